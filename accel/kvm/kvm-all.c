@@ -64,9 +64,14 @@
 
 #define KVM_MSI_HASHTAB_SIZE    256
 
+/* How often the dirty ring reaper collects the rings of idle vCPUs */
+#define KVM_DIRTY_RING_REAP_INTERVAL_MS 1000
+
 struct KVMParkedVcpu {
     unsigned long vcpu_id;
     int kvm_fd;
+    /* the kernel keeps the dirty ring position of parked vCPUs */
+    uint32_t kvm_fetch_index;
     QLIST_ENTRY(KVMParkedVcpu) node;
 };
 
@@ -105,6 +110,20 @@ struct KVMState
 #endif
     KVMMemoryListener memory_listener;
     QLIST_HEAD(, KVMParkedVcpu) kvm_parked_vcpus;
+    /* memory listener of each address space, indexed by as_id */
+    KVMMemoryListener **as_listeners;
+    int nr_as;
+
+    /* number of entries of each vCPU dirty ring, 0 if not in use */
+    uint32_t kvm_dirty_ring_size;
+    /* size in bytes of each vCPU dirty ring */
+    uint32_t kvm_dirty_ring_bytes;
+    QemuThread kvm_dirty_ring_reaper;
+    /* kicks the reaper when dirty logging starts or stops, or on exit */
+    QemuSemaphore kvm_dirty_ring_reaper_sem;
+    bool kvm_dirty_ring_reaper_active;
+    bool kvm_dirty_ring_reaper_quit;
+    Notifier kvm_dirty_ring_reaper_exit;
 
     /* memory encryption */
     void *memcrypt_handle;
@@ -153,6 +172,11 @@ bool kvm_memcrypt_enabled(void)
     return false;
 }
 
+bool kvm_dirty_ring_enabled(void)
+{
+    return kvm_state && kvm_state->kvm_dirty_ring_size;
+}
+
 int kvm_memcrypt_encrypt_data(uint8_t *ptr, uint64_t len)
 {
     if (kvm_state->memcrypt_handle &&
@@ -282,6 +306,179 @@ static int kvm_set_user_memory_region(KVMMemoryListener *kml, KVMSlot *slot, boo
     return ret;
 }
 
+/*
+ * Dirty ring collection.
+ *
+ * With the dirty ring, KVM pushes the guest frame of every page written
+ * by a vCPU to a ring shared with that vCPU, so collecting dirty pages
+ * costs time proportional to their number instead of to the size of
+ * the memory slots.  Rings are harvested with the BQL held, which also
+ * keeps the memory slots stable while entries are translated.
+ */
+
+static bool dirty_gfn_is_dirtied(struct kvm_dirty_gfn *gfn)
+{
+    return atomic_load_acquire(&gfn->flags) == KVM_DIRTY_GFN_F_DIRTY;
+}
+
+static void dirty_gfn_set_collected(struct kvm_dirty_gfn *gfn)
+{
+    atomic_store_release(&gfn->flags, KVM_DIRTY_GFN_F_RESET);
+}
+
+static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
+                                     uint32_t slot_id, uint64_t offset)
+{
+    KVMMemoryListener *kml;
+    KVMSlot *mem;
+
+    if (as_id >= s->nr_as || slot_id >= s->nr_slots) {
+        return;
+    }
+
+    kml = s->as_listeners[as_id];
+    if (!kml) {
+        return;
+    }
+
+    mem = &kml->slots[slot_id];
+    if (!mem->memory_size ||
+        offset >= (mem->memory_size / qemu_real_host_page_size)) {
+        return;
+    }
+
+    cpu_physical_memory_set_dirty_range(mem->ram_start_offset +
+                                        offset * qemu_real_host_page_size,
+                                        qemu_real_host_page_size,
+                                        DIRTY_CLIENTS_NOCODE);
+}
+
+static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
+{
+    struct kvm_dirty_gfn *dirty_gfns = cpu->kvm_dirty_gfns, *cur;
+    uint32_t ring_size = s->kvm_dirty_ring_size;
+    uint32_t count = 0, fetch = cpu->kvm_fetch_index;
+
+    while (true) {
+        cur = &dirty_gfns[fetch & (ring_size - 1)];
+        if (!dirty_gfn_is_dirtied(cur)) {
+            break;
+        }
+        kvm_dirty_ring_mark_page(s, cur->slot >> 16, cur->slot & 0xffff,
+                                 cur->offset);
+        dirty_gfn_set_collected(cur);
+        fetch++;
+        count++;
+    }
+    cpu->kvm_fetch_index = fetch;
+    cpu->dirty_pages += count;
+
+    return count;
+}
+
+/* Must be called with the BQL held */
+static uint64_t kvm_dirty_ring_reap(KVMState *s)
+{
+    CPUState *cpu;
+    uint64_t total = 0;
+    int64_t stamp = get_clock();
+    int ret;
+
+    CPU_FOREACH(cpu) {
+        if (cpu->kvm_dirty_gfns) {
+            total += kvm_dirty_ring_reap_one(s, cpu);
+        }
+    }
+
+    if (total) {
+        /* Let the kernel write protect the collected pages again */
+        ret = kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS);
+        assert(ret == total);
+    }
+
+    trace_kvm_dirty_ring_reap(total, get_clock() - stamp);
+
+    return total;
+}
+
+static void do_kvm_cpu_synchronize_kick(CPUState *cpu, run_on_cpu_data arg)
+{
+    /* Nothing to do, the exit already flushed the hardware dirty buffer */
+}
+
+/*
+ * Pages dirtied by a running vCPU can sit in a hardware buffer (e.g.
+ * Intel PML) until the vCPU exits.  Force an exit on every vCPU so that
+ * the rings hold everything dirtied before this call.
+ */
+static void kvm_cpu_synchronize_kick_all(void)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        run_on_cpu(cpu, do_kvm_cpu_synchronize_kick, RUN_ON_CPU_NULL);
+    }
+}
+
+static void *kvm_dirty_ring_reaper_thread(void *data)
+{
+    KVMState *s = data;
+
+    rcu_register_thread();
+
+    /*
+     * Keep the rings of vCPUs that rarely exit from filling up between
+     * two dirty log syncs.  Full rings are also reaped from the vCPU
+     * thread on KVM_EXIT_DIRTY_RING_FULL.  Nothing needs collecting
+     * while dirty logging is off, so sleep until it is turned on.
+     */
+    while (!atomic_read(&s->kvm_dirty_ring_reaper_quit)) {
+        if (!atomic_read(&s->kvm_dirty_ring_reaper_active)) {
+            qemu_sem_wait(&s->kvm_dirty_ring_reaper_sem);
+            continue;
+        }
+
+        if (qemu_sem_timedwait(&s->kvm_dirty_ring_reaper_sem,
+                               KVM_DIRTY_RING_REAP_INTERVAL_MS) == 0) {
+            /* dirty logging was stopped or we are quitting, recheck */
+            continue;
+        }
+
+        qemu_mutex_lock_iothread();
+        kvm_dirty_ring_reap(s);
+        qemu_mutex_unlock_iothread();
+    }
+
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+static void kvm_dirty_ring_reaper_kick(KVMState *s, bool active)
+{
+    atomic_set(&s->kvm_dirty_ring_reaper_active, active);
+    qemu_sem_post(&s->kvm_dirty_ring_reaper_sem);
+}
+
+static void kvm_dirty_ring_reaper_exit(Notifier *n, void *data)
+{
+    KVMState *s = container_of(n, KVMState, kvm_dirty_ring_reaper_exit);
+    bool locked = qemu_mutex_iothread_locked();
+
+    atomic_set(&s->kvm_dirty_ring_reaper_quit, true);
+    qemu_sem_post(&s->kvm_dirty_ring_reaper_sem);
+
+    /* the reaper may be waiting for the BQL */
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    qemu_thread_join(&s->kvm_dirty_ring_reaper);
+    if (locked) {
+        qemu_mutex_lock_iothread();
+    }
+    qemu_sem_destroy(&s->kvm_dirty_ring_reaper_sem);
+}
+
 int kvm_destroy_vcpu(CPUState *cpu)
 {
     KVMState *s = kvm_state;
@@ -303,15 +500,27 @@ int kvm_destroy_vcpu(CPUState *cpu)
         goto err;
     }
 
+    if (cpu->kvm_dirty_gfns) {
+        /* Don't lose the pages this vCPU dirtied since the last reap */
+        kvm_dirty_ring_reap(s);
+        ret = munmap(cpu->kvm_dirty_gfns, s->kvm_dirty_ring_bytes);
+        if (ret < 0) {
+            goto err;
+        }
+        cpu->kvm_dirty_gfns = NULL;
+    }
+
     vcpu = g_malloc0(sizeof(*vcpu));
     vcpu->vcpu_id = kvm_arch_vcpu_id(cpu);
     vcpu->kvm_fd = cpu->kvm_fd;
+    vcpu->kvm_fetch_index = cpu->kvm_fetch_index;
     QLIST_INSERT_HEAD(&kvm_state->kvm_parked_vcpus, vcpu, node);
 err:
     return ret;
 }
 
-static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
+static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id,
+                        uint32_t *fetch_index)
 {
     struct KVMParkedVcpu *cpu;
 
@@ -321,6 +530,7 @@ static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
 
             QLIST_REMOVE(cpu, node);
             kvm_fd = cpu->kvm_fd;
+            *fetch_index = cpu->kvm_fetch_index;
             g_free(cpu);
             return kvm_fd;
         }
@@ -337,7 +547,7 @@ int kvm_init_vcpu(CPUState *cpu)
 
     DPRINTF("kvm_init_vcpu\n");
 
-    ret = kvm_get_vcpu(s, kvm_arch_vcpu_id(cpu));
+    ret = kvm_get_vcpu(s, kvm_arch_vcpu_id(cpu), &cpu->kvm_fetch_index);
     if (ret < 0) {
         DPRINTF("kvm_create_vcpu failed\n");
         goto err;
@@ -367,6 +577,19 @@ int kvm_init_vcpu(CPUState *cpu)
             (void *)cpu->kvm_run + s->coalesced_mmio * PAGE_SIZE;
     }
 
+    if (s->kvm_dirty_ring_size) {
+        cpu->kvm_dirty_gfns = mmap(NULL, s->kvm_dirty_ring_bytes,
+                                   PROT_READ | PROT_WRITE, MAP_SHARED,
+                                   cpu->kvm_fd,
+                                   PAGE_SIZE * KVM_DIRTY_LOG_PAGE_OFFSET);
+        if (cpu->kvm_dirty_gfns == MAP_FAILED) {
+            ret = -errno;
+            cpu->kvm_dirty_gfns = NULL;
+            DPRINTF("mmap'ing vcpu dirty ring failed\n");
+            goto err;
+        }
+    }
+
     ret = kvm_arch_init_vcpu(cpu);
 err:
     return ret;
@@ -764,6 +987,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     MemoryRegion *mr = section->mr;
     bool writeable = !mr->readonly && !mr->rom_device;
     hwaddr start_addr, size;
+    ram_addr_t ram_start_offset;
     void *ram;
 
     if (!memory_region_is_ram(mr)) {
@@ -784,6 +1008,9 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     /* use aligned delta to align the ram address */
     ram = memory_region_get_ram_ptr(mr) + section->offset_within_region +
           (start_addr - section->offset_within_address_space);
+    ram_start_offset = memory_region_get_ram_addr(mr) +
+                       section->offset_within_region +
+                       (start_addr - section->offset_within_address_space);
 
     if (!add) {
         mem = kvm_lookup_matching_slot(kml, start_addr, size);
@@ -791,7 +1018,12 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
             return;
         }
         if (mem->flags & KVM_MEM_LOG_DIRTY_PAGES) {
-            kvm_physical_sync_dirty_bitmap(kml, section);
+            if (kvm_state->kvm_dirty_ring_size) {
+                /* ring entries refer to the slot id, collect them now */
+                kvm_dirty_ring_reap(kvm_state);
+            } else {
+                kvm_physical_sync_dirty_bitmap(kml, section);
+            }
         }
 
         /* unregister the slot */
@@ -811,6 +1043,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     mem->memory_size = size;
     mem->start_addr = start_addr;
     mem->ram = ram;
+    mem->ram_start_offset = ram_start_offset;
     mem->flags = kvm_mem_flags(mr);
 
     err = kvm_set_user_memory_region(kml, mem, true);
@@ -851,6 +1084,22 @@ static void kvm_log_sync(MemoryListener *listener,
     }
 }
 
+static void kvm_log_sync_global(MemoryListener *listener)
+{
+    kvm_cpu_synchronize_kick_all();
+    kvm_dirty_ring_reap(kvm_state);
+}
+
+static void kvm_log_global_start(MemoryListener *listener)
+{
+    kvm_dirty_ring_reaper_kick(kvm_state, true);
+}
+
+static void kvm_log_global_stop(MemoryListener *listener)
+{
+    kvm_dirty_ring_reaper_kick(kvm_state, false);
+}
+
 static void kvm_mem_ioeventfd_add(MemoryListener *listener,
                                   MemoryRegionSection *section,
                                   bool match_data, uint64_t data,
@@ -928,6 +1177,9 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
     kml->slots = g_malloc0(s->nr_slots * sizeof(KVMSlot));
     kml->as_id = as_id;
 
+    assert(as_id < s->nr_as);
+    s->as_listeners[as_id] = kml;
+
     for (i = 0; i < s->nr_slots; i++) {
         kml->slots[i].slot = i;
     }
@@ -936,7 +1188,14 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
     kml->listener.region_del = kvm_region_del;
     kml->listener.log_start = kvm_log_start;
     kml->listener.log_stop = kvm_log_stop;
-    kml->listener.log_sync = kvm_log_sync;
+    if (!s->kvm_dirty_ring_size) {
+        kml->listener.log_sync = kvm_log_sync;
+    } else if (as_id == 0) {
+        /* one global sync reaps the rings for every address space */
+        kml->listener.log_sync_global = kvm_log_sync_global;
+        kml->listener.log_global_start = kvm_log_global_start;
+        kml->listener.log_global_stop = kvm_log_global_stop;
+    }
     kml->listener.priority = 10;
 
     memory_listener_register(&kml->listener, as);
@@ -1590,6 +1849,12 @@ static int kvm_init(MachineState *ms)
         s->nr_slots = 32;
     }
 
+    s->nr_as = kvm_check_extension(s, KVM_CAP_MULTI_ADDRESS_SPACE);
+    if (s->nr_as <= 1) {
+        s->nr_as = 1;
+    }
+    s->as_listeners = g_new0(KVMMemoryListener *, s->nr_as);
+
     kvm_type = qemu_opt_get(qemu_get_machine_opts(), "kvm-type");
     if (mc->kvm_type) {
         type = mc->kvm_type(ms, kvm_type);
@@ -1661,6 +1926,39 @@ static int kvm_init(MachineState *ms)
     s->coalesced_pio = s->coalesced_mmio &&
                        kvm_check_extension(s, KVM_CAP_COALESCED_PIO);
 
+    /*
+     * The dirty ring must be enabled before any vCPU is created, and
+     * replaces KVM_GET_DIRTY_LOG for the whole VM.
+     */
+    if (ms->kvm_dirty_ring_size) {
+        uint32_t ring_bytes = ms->kvm_dirty_ring_size *
+                              sizeof(struct kvm_dirty_gfn);
+        int max_bytes = kvm_vm_check_extension(s, KVM_CAP_DIRTY_LOG_RING);
+
+        if (max_bytes <= 0) {
+            ret = -EINVAL;
+            error_report("KVM dirty ring not supported by the host kernel");
+            goto err;
+        }
+        if (ring_bytes > (uint32_t)max_bytes) {
+            ret = -EINVAL;
+            error_report("KVM dirty ring size %" PRIu32 " too big "
+                         "(maximum is %zu)", ms->kvm_dirty_ring_size,
+                         max_bytes / sizeof(struct kvm_dirty_gfn));
+            goto err;
+        }
+
+        ret = kvm_vm_enable_cap(s, KVM_CAP_DIRTY_LOG_RING, 0, ring_bytes);
+        if (ret) {
+            error_report("Enabling of KVM dirty ring failed: %s",
+                         strerror(-ret));
+            goto err;
+        }
+
+        s->kvm_dirty_ring_size = ms->kvm_dirty_ring_size;
+        s->kvm_dirty_ring_bytes = ring_bytes;
+    }
+
 #ifdef KVM_CAP_VCPU_EVENTS
     s->vcpu_events = kvm_check_extension(s, KVM_CAP_VCPU_EVENTS);
 #endif
@@ -1733,6 +2031,10 @@ static int kvm_init(MachineState *ms)
     s->memory_listener.listener.coalesced_io_add = kvm_coalesce_mmio_region;
     s->memory_listener.listener.coalesced_io_del = kvm_uncoalesce_mmio_region;
 
+    if (s->kvm_dirty_ring_size) {
+        /* log_global_start kicks the reaper through this semaphore */
+        qemu_sem_init(&s->kvm_dirty_ring_reaper_sem, 0);
+    }
     kvm_memory_listener_register(s, &s->memory_listener,
                                  &address_space_memory, 0);
     memory_listener_register(&kvm_io_listener,
@@ -1747,6 +2049,14 @@ static int kvm_init(MachineState *ms)
         qemu_balloon_inhibit(true);
     }
 
+    if (s->kvm_dirty_ring_size) {
+        qemu_thread_create(&s->kvm_dirty_ring_reaper, "kvm-reaper",
+                           kvm_dirty_ring_reaper_thread, s,
+                           QEMU_THREAD_JOINABLE);
+        s->kvm_dirty_ring_reaper_exit.notify = kvm_dirty_ring_reaper_exit;
+        qemu_add_exit_notifier(&s->kvm_dirty_ring_reaper_exit);
+    }
+
     return 0;
 
 err:
@@ -1758,6 +2068,7 @@ err:
         close(s->fd);
     }
     g_free(s->memory_listener.slots);
+    g_free(s->as_listeners);
 
     return ret;
 }
@@ -2041,6 +2352,17 @@ int kvm_cpu_exec(CPUState *cpu)
             DPRINTF("irq_window_open\n");
             ret = EXCP_INTERRUPT;
             break;
+        case KVM_EXIT_DIRTY_RING_FULL:
+            /*
+             * The vCPU can't run again until its ring has room, which
+             * KVM_RESET_DIRTY_RINGS in the reap gives back.
+             */
+            trace_kvm_dirty_ring_full(cpu->cpu_index);
+            qemu_mutex_lock_iothread();
+            kvm_dirty_ring_reap(kvm_state);
+            qemu_mutex_unlock_iothread();
+            ret = 0;
+            break;
         case KVM_EXIT_SHUTDOWN:
             DPRINTF("shutdown\n");
             qemu_system_reset_request(SHUTDOWN_CAUSE_GUEST_RESET);
@@ -893,6 +893,28 @@ int bdrv_parse_cache_mode(const char *mode, int *flags, bool *writethrough)
     return 0;
 }
 
+/**
+ * Set open flags for a given AIO engine
+ *
+ * Return 0 on success, -1 if the engine was invalid.
+ */
+int bdrv_parse_aio(const char *mode, int *flags)
+{
+    if (!strcmp(mode, "threads")) {
+        /* this is the default */
+    } else if (!strcmp(mode, "native")) {
+        *flags |= BDRV_O_NATIVE_AIO;
+#ifdef CONFIG_LINUX_IO_URING
+    } else if (!strcmp(mode, "io_uring")) {
+        *flags |= BDRV_O_IO_URING;
+#endif
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
 static char *bdrv_child_get_parent_desc(BdrvChild *c)
 {
     BlockDriverState *parent = c->opaque;
@@ -2155,6 +2177,23 @@ void bdrv_format_default_perms(BlockDriverState *bs, BdrvChild *c,
     *nshared = shared;
 }
 
+/*
+ * Queue contexts are attached to a whole subtree, so it must not change
+ * while any is attached: new nodes would get requests from contexts that
+ * were never attached to them, and removed nodes would keep theirs.
+ * Returns -EBUSY and sets @errp if @bs is part of such a subtree.
+ */
+static int bdrv_check_queue_contexts(BlockDriverState *bs, Error **errp)
+{
+    if (!QLIST_EMPTY(&bs->queue_contexts)) {
+        error_setg(errp, "Cannot change the graph at node '%s' while it is "
+                   "used by multiple queues",
+                   bdrv_get_device_or_node_name(bs));
+        return -EBUSY;
+    }
+    return 0;
+}
+
 static void bdrv_replace_child_noperm(BdrvChild *child,
                                       BlockDriverState *new_bs)
 {
@@ -2435,6 +2474,9 @@ void bdrv_set_backing_hd(BlockDriverState *bs, BlockDriverState *backing_hd,
     if (bdrv_is_backing_chain_frozen(bs, backing_bs(bs), errp)) {
         return;
     }
+    if (bdrv_check_queue_contexts(bs, errp) < 0) {
+        return;
+    }
 
     if (backing_hd) {
         bdrv_ref(backing_hd);
@@ -3562,6 +3604,9 @@ static int bdrv_reopen_parse_backing(BDRVReopenState *reopen_state,
                                          errp)) {
             return -EPERM;
         }
+        if (bdrv_check_queue_contexts(overlay_bs, errp) < 0) {
+            return -EBUSY;
+        }
         reopen_state->replace_backing_bs = true;
         if (new_backing_bs) {
             bdrv_ref(new_backing_bs);
@@ -4053,6 +4098,10 @@ void bdrv_replace_node(BlockDriverState *from, BlockDriverState *to,
     uint64_t perm = 0, shared = BLK_PERM_ALL;
     int ret;
 
+    if (bdrv_check_queue_contexts(from, errp) < 0) {
+        return;
+    }
+
     /* Make sure that @from doesn't go away until we have successfully attached
      * all of its parents to @to. */
     bdrv_ref(from);
@@ -4403,6 +4452,9 @@ int bdrv_drop_intermediate(BlockDriverState *top, BlockDriverState *base,
             goto exit;
         }
     }
+    if (bdrv_check_queue_contexts(top, NULL) < 0) {
+        goto exit;
+    }
 
     /* If 'base' recursively inherits from 'top' then we should set
      * base->inherits_from to top->inherits_from after 'top' and all
@@ -5923,6 +5975,115 @@ int bdrv_try_set_aio_context(BlockDriverState *bs, AioContext *ctx,
     return bdrv_child_try_set_aio_context(bs, ctx, NULL, errp);
 }
 
+/*
+ * Let @ctx submit requests to @bs and all its children and process them in
+ * @ctx, in addition to bdrv_get_aio_context(bs).  Calls for the same @ctx
+ * nest and must be balanced by bdrv_detach_queue_context().  Until then,
+ * the children of the nodes in the subtree cannot be replaced, added or
+ * removed, and the nodes cannot be replaced.
+ *
+ * The caller must drain the subtree of @bs.
+ */
+int bdrv_attach_queue_context(BlockDriverState *bs, AioContext *ctx,
+                              Error **errp)
+{
+    BdrvQueueContext *qc;
+    BdrvChild *child, *c;
+    int ret;
+
+    assert(bs->quiesce_counter > 0);
+
+    if (!bs->drv || !bs->drv->supports_multiqueue) {
+        error_setg(errp, "Node '%s' does not support multiple queues",
+                   bdrv_get_device_or_node_name(bs));
+        return -ENOTSUP;
+    }
+
+    QLIST_FOREACH(child, &bs->children, next) {
+        ret = bdrv_attach_queue_context(child->bs, ctx, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    QLIST_FOREACH(qc, &bs->queue_contexts, next) {
+        if (qc->ctx == ctx) {
+            qc->refcnt++;
+            return 0;
+        }
+    }
+
+    if (bs->drv->bdrv_attach_queue_context) {
+        ret = bs->drv->bdrv_attach_queue_context(bs, ctx, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    qc = g_new(BdrvQueueContext, 1);
+    *qc = (BdrvQueueContext) {
+        .ctx    = ctx,
+        .refcnt = 1,
+    };
+    QLIST_INSERT_HEAD(&bs->queue_contexts, qc, next);
+    return 0;
+
+fail:
+    QLIST_FOREACH(c, &bs->children, next) {
+        if (c == child) {
+            break;
+        }
+        bdrv_detach_queue_context(c->bs, ctx);
+    }
+    return ret;
+}
+
+/*
+ * Undo bdrv_attach_queue_context().  The caller must drain the subtree of @bs.
+ */
+void bdrv_detach_queue_context(BlockDriverState *bs, AioContext *ctx)
+{
+    BdrvQueueContext *qc;
+    BdrvChild *child;
+
+    assert(bs->quiesce_counter > 0);
+
+    QLIST_FOREACH(qc, &bs->queue_contexts, next) {
+        if (qc->ctx == ctx) {
+            break;
+        }
+    }
+    assert(qc);
+
+    if (--qc->refcnt == 0) {
+        QLIST_REMOVE(qc, next);
+        g_free(qc);
+        if (bs->drv->bdrv_detach_queue_context) {
+            bs->drv->bdrv_detach_queue_context(bs, ctx);
+        }
+    }
+
+    QLIST_FOREACH(child, &bs->children, next) {
+        bdrv_detach_queue_context(child->bs, ctx);
+    }
+}
+
+/*
+ * Returns true if @ctx was attached to @bs with bdrv_attach_queue_context().
+ * Drivers use this to pick the per-AioContext state of the current thread.
+ */
+bool bdrv_is_queue_context(BlockDriverState *bs, AioContext *ctx)
+{
+    BdrvQueueContext *qc;
+
+    QLIST_FOREACH(qc, &bs->queue_contexts, next) {
+        if (qc->ctx == ctx) {
+            return true;
+        }
+    }
+    return false;
+}
+
 void bdrv_add_aio_context_notifier(BlockDriverState *bs,
         void (*attached_aio_context)(AioContext *new_context, void *opaque),
         void (*detach_aio_context)(void *opaque), void *opaque)
@@ -6351,6 +6512,10 @@ void bdrv_add_child(BlockDriverState *parent_bs, BlockDriverState *child_bs,
         return;
     }
 
+    if (bdrv_check_queue_contexts(parent_bs, errp) < 0) {
+        return;
+    }
+
     parent_bs->drv->bdrv_add_child(parent_bs, child_bs, errp);
 }
 
@@ -6377,6 +6542,10 @@ void bdrv_del_child(BlockDriverState *parent_bs, BdrvChild *child, Error **errp)
         return;
     }
 
+    if (bdrv_check_queue_contexts(parent_bs, errp) < 0) {
+        return;
+    }
+
     parent_bs->drv->bdrv_del_child(parent_bs, child, errp);
 }
 
@@ -30,6 +30,7 @@
 #define NOT_DONE 0x7fffffff /* used while emulated sync operation in progress */
 
 static AioContext *blk_aiocb_get_aio_context(BlockAIOCB *acb);
+static AioContext *blk_get_request_aio_context(BlockBackend *blk);
 
 typedef struct BlockBackendAioNotifier {
     void (*attached_aio_context)(AioContext *new_context, void *opaque);
@@ -80,6 +81,13 @@ struct BlockBackend {
 
     int quiesce_counter;
     VMChangeStateEntry *vmsh;
+
+    /* AioContexts attached with blk_attach_queue_context() */
+    GSList *queue_contexts;
+    /* the node they were attached to, and the blocker of its subtree */
+    BlockDriverState *queue_bs;
+    Error *queue_blocker;
+
     bool force_allow_inactivate;
 
     /* Number of in-flight aio requests.  BlockDriverState also counts
@@ -777,6 +785,9 @@ void blk_remove_bs(BlockBackend *blk)
     BlockDriverState *bs;
 
     notifier_list_notify(&blk->remove_bs_notifiers, blk);
+    while (blk->queue_contexts) {
+        blk_detach_queue_context(blk, blk->queue_contexts->data);
+    }
     if (tgm->throttle_state) {
         bs = blk_bs(blk);
         bdrv_drained_begin(bs);
@@ -1300,7 +1311,8 @@ BlockAIOCB *blk_abort_aio_request(BlockBackend *blk,
     acb->blk = blk;
     acb->ret = ret;
 
-    aio_bh_schedule_oneshot(blk_get_aio_context(blk), error_callback_bh, acb);
+    aio_bh_schedule_oneshot(blk_get_request_aio_context(blk),
+                            error_callback_bh, acb);
     return &acb->common;
 }
 
@@ -1336,6 +1348,7 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
                                 BdrvRequestFlags flags,
                                 BlockCompletionFunc *cb, void *opaque)
 {
+    AioContext *ctx = blk_get_request_aio_context(blk);
     BlkAioEmAIOCB *acb;
     Coroutine *co;
 
@@ -1352,12 +1365,11 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
     acb->has_returned = false;
 
     co = qemu_coroutine_create(co_entry, acb);
-    bdrv_coroutine_enter(blk_bs(blk), co);
+    aio_co_enter(ctx, co);
 
     acb->has_returned = true;
     if (acb->rwco.ret != NOT_DONE) {
-        aio_bh_schedule_oneshot(blk_get_aio_context(blk),
-                                blk_aio_complete_bh, acb);
+        aio_bh_schedule_oneshot(ctx, blk_aio_complete_bh, acb);
     }
 
     return &acb->common;
@@ -1869,6 +1881,144 @@ AioContext *blk_get_aio_context(BlockBackend *blk)
     return blk->ctx;
 }
 
+/*
+ * The AioContext where requests submitted from the current thread run: the
+ * current AioContext if it was attached with blk_attach_queue_context(),
+ * otherwise the AioContext of @blk.
+ */
+static AioContext *blk_get_request_aio_context(BlockBackend *blk)
+{
+    AioContext *ctx;
+
+    if (!blk->queue_contexts) {
+        return blk_get_aio_context(blk);
+    }
+
+    ctx = qemu_get_current_aio_context();
+    if (g_slist_find(blk->queue_contexts, ctx)) {
+        return ctx;
+    }
+    return blk_get_aio_context(blk);
+}
+
+/*
+ * Block or unblock the operations on the nodes that bdrv_attach_queue_context()
+ * attaches the queue contexts to.
+ */
+static void blk_queue_op_block_subtree(BlockDriverState *bs, Error *reason,
+                                       bool block)
+{
+    BdrvChild *child;
+
+    if (block) {
+        bdrv_op_block_all(bs, reason);
+    } else {
+        bdrv_op_unblock_all(bs, reason);
+    }
+    QLIST_FOREACH(child, &bs->children, next) {
+        blk_queue_op_block_subtree(child->bs, reason, block);
+    }
+}
+
+/**
+ * blk_attach_queue_context:
+ * @ctx: AioContext that submits requests in addition to the one of @blk
+ *
+ * Asynchronous requests submitted from @ctx are then processed in @ctx and
+ * complete there, instead of being moved to blk_get_aio_context(blk).  This
+ * lets several threads submit requests to the same node in parallel, for
+ * example one per virtqueue.
+ *
+ * All nodes below @blk must support this (BlockDriver.supports_multiqueue),
+ * and I/O throttling cannot be used at the same time.  Block jobs and other
+ * operations on all these nodes are blocked, and the graph below @blk
+ * cannot change, until the last queue context is detached.  @ctx must not
+ * submit requests to @blk while this runs.
+ *
+ * Context: QEMU global mutex held, AioContext of @blk acquired.
+ */
+int blk_attach_queue_context(BlockBackend *blk, AioContext *ctx, Error **errp)
+{
+    /* Further contexts go to the same subtree as the first one */
+    BlockDriverState *bs = blk->queue_bs ?: blk_bs(blk);
+    int ret;
+
+    if (!bs) {
+        error_setg(errp, "No medium inserted");
+        return -ENOMEDIUM;
+    }
+    if (blk->public.throttle_group_member.throttle_state) {
+        error_setg(errp, "I/O throttling cannot be used with multiple queues");
+        return -ENOTSUP;
+    }
+    if (ctx == blk->ctx || g_slist_find(blk->queue_contexts, ctx)) {
+        return 0;
+    }
+
+    bdrv_subtree_drained_begin(bs);
+    ret = bdrv_attach_queue_context(bs, ctx, errp);
+    if (ret == 0) {
+        if (!blk->queue_contexts) {
+            error_setg(&blk->queue_blocker,
+                       "Node '%s' is used by multiple queues",
+                       bdrv_get_device_or_node_name(bs));
+            blk_queue_op_block_subtree(bs, blk->queue_blocker, true);
+            bdrv_ref(bs);
+            blk->queue_bs = bs;
+        }
+        blk->queue_contexts = g_slist_prepend(blk->queue_contexts, ctx);
+
+        /* Balance the aio_enable_external() of the drained_end below */
+        aio_disable_external(ctx);
+    }
+    bdrv_subtree_drained_end(bs);
+
+    return ret;
+}
+
+/**
+ * blk_detach_queue_context:
+ *
+ * Undo blk_attach_queue_context().  Requests submitted from @ctx are moved
+ * to the AioContext of @blk again.  @ctx must not submit requests to @blk
+ * while this runs.
+ *
+ * Context: QEMU global mutex held, AioContext of @blk acquired.
+ */
+void blk_detach_queue_context(BlockBackend *blk, AioContext *ctx)
+{
+    /* Undo it on the node the contexts were attached to */
+    BlockDriverState *bs = blk->queue_bs;
+
+    if (!g_slist_find(blk->queue_contexts, ctx)) {
+        return;
+    }
+
+    bdrv_subtree_drained_begin(bs);
+    blk->queue_contexts = g_slist_remove(blk->queue_contexts, ctx);
+    bdrv_detach_queue_context(bs, ctx);
+
+    /* drained_end below does not see @ctx anymore */
+    aio_enable_external(ctx);
+
+    if (!blk->queue_contexts) {
+        blk_queue_op_block_subtree(bs, blk->queue_blocker, false);
+        error_free(blk->queue_blocker);
+        blk->queue_blocker = NULL;
+        blk->queue_bs = NULL;
+    }
+    bdrv_subtree_drained_end(bs);
+
+    if (!blk->queue_bs) {
+        bdrv_unref(bs);
+    }
+}
+
+bool blk_has_queue_contexts(BlockBackend *blk)
+{
+    return blk->queue_contexts != NULL;
+}
+
 static AioContext *blk_aiocb_get_aio_context(BlockAIOCB *acb)
 {
     BlockBackendAIOCB *blk_acb = DO_UPCAST(BlockBackendAIOCB, common, acb);
@@ -2220,9 +2370,16 @@ static void blk_root_drained_begin(BdrvChild *child)
     BlockBackend *blk = child->opaque;
 
     if (++blk->quiesce_counter == 1) {
+        GSList *l;
+
         if (blk->dev_ops && blk->dev_ops->drained_begin) {
             blk->dev_ops->drained_begin(blk->dev_opaque);
         }
+
+        /* bdrv_drained_begin() only stops new requests in blk->ctx */
+        for (l = blk->queue_contexts; l; l = l->next) {
+            aio_disable_external(l->data);
+        }
     }
 
     /* Note that blk->root may not be accessible here yet if we are just
@@ -2249,6 +2406,12 @@ static void blk_root_drained_end(BdrvChild *child)
     atomic_dec(&blk->public.throttle_group_member.io_limits_disabled);
 
     if (--blk->quiesce_counter == 0) {
+        GSList *l;
+
+        for (l = blk->queue_contexts; l; l = l->next) {
+            aio_enable_external(l->data);
+        }
+
         if (blk->dev_ops && blk->dev_ops->drained_end) {
             blk->dev_ops->drained_end(blk->dev_opaque);
         }
@@ -155,6 +155,8 @@ typedef struct BDRVRawState {
     bool has_write_zeroes:1;
     bool discard_zeroes:1;
     bool use_linux_aio:1;
+    bool use_linux_io_uring:1;
+    bool io_uring_sqpoll:1;
     bool page_cache_inconsistent:1;
     bool has_fallocate;
     bool needs_alignment;
@@ -424,7 +426,13 @@ static QemuOptsList raw_runtime_opts = {
         {
             .name = "aio",
             .type = QEMU_OPT_STRING,
-            .help = "host AIO implementation (threads, native)",
+            .help = "host AIO implementation (threads, native, io_uring)",
+        },
+        {
+            .name = "io-uring-sqpoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "poll the io_uring submission queue from a kernel thread "
+                    "(default: off)",
         },
         {
             .name = "locking",
@@ -483,9 +491,15 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         goto fail;
     }
 
-    aio_default = (bdrv_flags & BDRV_O_NATIVE_AIO)
-                  ? BLOCKDEV_AIO_OPTIONS_NATIVE
-                  : BLOCKDEV_AIO_OPTIONS_THREADS;
+    if (bdrv_flags & BDRV_O_NATIVE_AIO) {
+        aio_default = BLOCKDEV_AIO_OPTIONS_NATIVE;
+#ifdef CONFIG_LINUX_IO_URING
+    } else if (bdrv_flags & BDRV_O_IO_URING) {
+        aio_default = BLOCKDEV_AIO_OPTIONS_IO_URING;
+#endif
+    } else {
+        aio_default = BLOCKDEV_AIO_OPTIONS_THREADS;
+    }
     aio = qapi_enum_parse(&BlockdevAioOptions_lookup,
                           qemu_opt_get(opts, "aio"),
                           aio_default, &local_err);
@@ -495,6 +509,10 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         goto fail;
     }
     s->use_linux_aio = (aio == BLOCKDEV_AIO_OPTIONS_NATIVE);
+#ifdef CONFIG_LINUX_IO_URING
+    s->use_linux_io_uring = (aio == BLOCKDEV_AIO_OPTIONS_IO_URING);
+#endif
+    s->io_uring_sqpoll = qemu_opt_get_bool(opts, "io-uring-sqpoll", false);
 
     locking = qapi_enum_parse(&OnOffAuto_lookup,
                               qemu_opt_get(opts, "locking"),
@@ -580,6 +598,23 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif /* !defined(CONFIG_LINUX_AIO) */
 
+    if (s->io_uring_sqpoll && !s->use_linux_io_uring) {
+        error_setg(errp, "io-uring-sqpoll requires aio=io_uring");
+        ret = -EINVAL;
+        goto fail;
+    }
+#ifdef CONFIG_LINUX_IO_URING
+    /* Unlike aio=native, this works with and without O_DIRECT */
+    if (s->use_linux_io_uring) {
+        if (!aio_setup_linux_io_uring(bdrv_get_aio_context(bs),
+                                      s->io_uring_sqpoll, errp)) {
+            error_prepend(errp, "Unable to use io_uring: ");
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+#endif
+
     s->has_discard = true;
     s->has_write_zeroes = true;
     if ((bs->open_flags & BDRV_O_NOCACHE) != 0) {
@@ -1853,11 +1888,28 @@ out:
     return result;
 }
 
+/*
+ * The AioContext whose linux-aio, io_uring and thread pool state serves
+ * requests from the current thread.  This is the current AioContext when it
+ * submits requests as a queue context (see bdrv_attach_queue_context()),
+ * and the AioContext of @bs otherwise.
+ */
+static AioContext *raw_get_aio_context(BlockDriverState *bs)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    if (bs && ctx != bdrv_get_aio_context(bs) &&
+        bdrv_is_queue_context(bs, ctx)) {
+        return ctx;
+    }
+    /* @bs can be NULL, bdrv_get_aio_context() returns the main context then */
+    return bdrv_get_aio_context(bs);
+}
+
 static int coroutine_fn raw_thread_pool_submit(BlockDriverState *bs,
                                                ThreadPoolFunc func, void *arg)
 {
-    /* @bs can be NULL, bdrv_get_aio_context() returns the main context then */
-    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    ThreadPool *pool = aio_get_thread_pool(raw_get_aio_context(bs));
     return thread_pool_submit_co(pool, func, arg);
 }
 
@@ -1876,16 +1928,20 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
      * If this is the case tell the low-level driver that it needs
      * to copy the buffer.
      */
-    if (s->needs_alignment) {
-        if (!bdrv_qiov_is_aligned(bs, qiov)) {
-            type |= QEMU_AIO_MISALIGNED;
+    if (s->needs_alignment && !bdrv_qiov_is_aligned(bs, qiov)) {
+        type |= QEMU_AIO_MISALIGNED;
+#ifdef CONFIG_LINUX_IO_URING
+    } else if (s->use_linux_io_uring) {
+        LuringState *aio = aio_get_linux_io_uring(raw_get_aio_context(bs));
+        assert(qiov->size == bytes);
+        return luring_co_submit(bs, aio, s->fd, offset, qiov, type);
+#endif
 #ifdef CONFIG_LINUX_AIO
-        } else if (s->use_linux_aio) {
-            LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
-            assert(qiov->size == bytes);
-            return laio_co_submit(bs, aio, s->fd, offset, qiov, type);
+    } else if (s->needs_alignment && s->use_linux_aio) {
+        LinuxAioState *aio = aio_get_linux_aio(raw_get_aio_context(bs));
+        assert(qiov->size == bytes);
+        return laio_co_submit(bs, aio, s->fd, offset, qiov, type);
 #endif
-        }
     }
 
     acb = (RawPosixAIOData) {
@@ -1921,24 +1977,62 @@ static int coroutine_fn raw_co_pwritev(BlockDriverState *bs, uint64_t offset,
 
 static void raw_aio_plug(BlockDriverState *bs)
 {
+    BDRVRawState *s G_GNUC_UNUSED = bs->opaque;
 #ifdef CONFIG_LINUX_AIO
-    BDRVRawState *s = bs->opaque;
     if (s->use_linux_aio) {
-        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
+        LinuxAioState *aio = aio_get_linux_aio(raw_get_aio_context(bs));
         laio_io_plug(bs, aio);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        LuringState *aio = aio_get_linux_io_uring(raw_get_aio_context(bs));
+        luring_io_plug(bs, aio);
+    }
+#endif
 }
 
 static void raw_aio_unplug(BlockDriverState *bs)
 {
+    BDRVRawState *s G_GNUC_UNUSED = bs->opaque;
 #ifdef CONFIG_LINUX_AIO
-    BDRVRawState *s = bs->opaque;
     if (s->use_linux_aio) {
-        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
+        LinuxAioState *aio = aio_get_linux_aio(raw_get_aio_context(bs));
         laio_io_unplug(bs, aio);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        LuringState *aio = aio_get_linux_io_uring(raw_get_aio_context(bs));
+        luring_io_unplug(bs, aio);
+    }
+#endif
+}
+
+/*
+ * Buffers are registered with the ring of the node's own AioContext only,
+ * requests from queue contexts simply don't use them.
+ */
+static void raw_register_buf(BlockDriverState *bs, void *host, size_t size)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+    if (s->use_linux_io_uring) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        luring_register_buf(aio, host, size);
+    }
+#endif
+}
+
+static void raw_unregister_buf(BlockDriverState *bs, void *host)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+    if (s->use_linux_io_uring) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        luring_unregister_buf(aio, host);
+    }
+#endif
 }
 
 static int raw_co_flush_to_disk(BlockDriverState *bs)
@@ -1952,6 +2046,22 @@ static int raw_co_flush_to_disk(BlockDriverState *bs)
         return ret;
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        LuringState *aio = aio_get_linux_io_uring(raw_get_aio_context(bs));
+
+        /* Same semantics as handle_aiocb_flush() */
+        if (s->page_cache_inconsistent) {
+            return -EIO;
+        }
+        ret = luring_co_submit(bs, aio, s->fd, 0, NULL, QEMU_AIO_FLUSH);
+        if (ret < 0 && (s->open_flags & O_DIRECT) == 0) {
+            s->page_cache_inconsistent = true;
+        }
+        return ret;
+    }
+#endif
+
     acb = (RawPosixAIOData) {
         .bs             = bs,
         .aio_fildes     = s->fd,
@@ -1975,6 +2085,36 @@ static void raw_aio_attach_aio_context(BlockDriverState *bs,
         }
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        Error *local_err = NULL;
+        if (!aio_setup_linux_io_uring(new_context, s->io_uring_sqpoll,
+                                      &local_err)) {
+            error_reportf_err(local_err, "Unable to use io_uring, "
+                                         "falling back to thread pool: ");
+            s->use_linux_io_uring = false;
+        }
+    }
+#endif
+}
+
+static int raw_attach_queue_context(BlockDriverState *bs, AioContext *ctx,
+                                    Error **errp)
+{
+    BDRVRawState *s G_GNUC_UNUSED = bs->opaque;
+
+#ifdef CONFIG_LINUX_AIO
+    if (s->use_linux_aio && !aio_setup_linux_aio(ctx, errp)) {
+        return -EIO;
+    }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring &&
+        !aio_setup_linux_io_uring(ctx, s->io_uring_sqpoll, errp)) {
+        return -EIO;
+    }
+#endif
+    return 0;
 }
 
 static void raw_close(BlockDriverState *bs)
@@ -2660,12 +2800,53 @@ static void coroutine_fn raw_co_invalidate_cache(BlockDriverState *bs,
 #endif /* !__linux__ */
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+/*
+ * Run fallocate() on a regular file through io_uring, without a hop to the
+ * thread pool.
+ *
+ * Returns: -ENOTSUP if the request has to go through the thread pool
+ * handlers, which know about the other ways to do it, 0 or -errno otherwise
+ */
+static int coroutine_fn
+raw_co_io_uring_fallocate(BlockDriverState *bs, int mode, int64_t offset,
+                          int bytes)
+{
+    BDRVRawState *s = bs->opaque;
+    LuringState *aio;
+
+    if (!s->use_linux_io_uring) {
+        return -ENOTSUP;
+    }
+#ifdef CONFIG_XFS
+    if (s->is_xfs) {
+        return -ENOTSUP;
+    }
+#endif
+
+    aio = aio_get_linux_io_uring(raw_get_aio_context(bs));
+    return translate_err(luring_co_fallocate(bs, aio, s->fd, mode, offset,
+                                             bytes));
+}
+#endif
+
 static coroutine_fn int
 raw_do_pdiscard(BlockDriverState *bs, int64_t offset, int bytes, bool blkdev)
 {
     BDRVRawState *s = bs->opaque;
     RawPosixAIOData acb;
 
+#if defined(CONFIG_LINUX_IO_URING) && defined(CONFIG_FALLOCATE_PUNCH_HOLE)
+    if (!blkdev && s->has_discard) {
+        int ret = raw_co_io_uring_fallocate(bs, FALLOC_FL_PUNCH_HOLE |
+                                            FALLOC_FL_KEEP_SIZE,
+                                            offset, bytes);
+        if (ret != -ENOTSUP) {
+            return ret;
+        }
+    }
+#endif
+
     acb = (RawPosixAIOData) {
         .bs             = bs,
         .aio_fildes     = s->fd,
@@ -2695,6 +2876,29 @@ raw_do_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int bytes,
     RawPosixAIOData acb;
     ThreadPoolFunc *handler;
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (!blkdev) {
+        int ret = -ENOTSUP;
+
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+        if (flags & BDRV_REQ_MAY_UNMAP) {
+            ret = raw_co_io_uring_fallocate(bs, FALLOC_FL_PUNCH_HOLE |
+                                            FALLOC_FL_KEEP_SIZE,
+                                            offset, bytes);
+        }
+#endif
+#ifdef CONFIG_FALLOCATE_ZERO_RANGE
+        if (ret == -ENOTSUP && s->has_write_zeroes) {
+            ret = raw_co_io_uring_fallocate(bs, FALLOC_FL_ZERO_RANGE,
+                                            offset, bytes);
+        }
+#endif
+        if (ret != -ENOTSUP) {
+            return ret;
+        }
+    }
+#endif
+
     acb = (RawPosixAIOData) {
         .bs             = bs,
         .aio_fildes     = s->fd,
@@ -2907,6 +3111,7 @@ BlockDriver bdrv_file = {
     .format_name = "file",
     .protocol_name = "file",
     .instance_size = sizeof(BDRVRawState),
+    .supports_multiqueue = true,
     .bdrv_needs_filename = true,
     .bdrv_probe = NULL, /* no probe for protocols */
     .bdrv_parse_filename = raw_parse_filename,
@@ -2931,7 +3136,10 @@ BlockDriver bdrv_file = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_attach_queue_context = raw_attach_queue_context,
 
     .bdrv_co_truncate = raw_co_truncate,
     .bdrv_getlength = raw_getlength,
@@ -3384,6 +3592,7 @@ static BlockDriver bdrv_host_device = {
     .format_name        = "host_device",
     .protocol_name        = "host_device",
     .instance_size      = sizeof(BDRVRawState),
+    .supports_multiqueue = true,
     .bdrv_needs_filename = true,
     .bdrv_probe_device  = hdev_probe_device,
     .bdrv_parse_filename = hdev_parse_filename,
@@ -3407,7 +3616,10 @@ static BlockDriver bdrv_host_device = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_attach_queue_context = raw_attach_queue_context,
 
     .bdrv_co_truncate       = raw_co_truncate,
     .bdrv_getlength	= raw_getlength,
@@ -3531,6 +3743,8 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
@@ -3663,6 +3877,8 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
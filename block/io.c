@@ -2876,7 +2876,12 @@ void bdrv_io_plug(BlockDriverState *bs)
         bdrv_io_plug(child->bs);
     }
 
-    if (atomic_fetch_inc(&bs->io_plugged) == 0) {
+    /*
+     * Multiqueue drivers plug the queue of the current AioContext, so they
+     * see every call and count the nesting themselves
+     */
+    if (atomic_fetch_inc(&bs->io_plugged) == 0 ||
+        (bs->drv && bs->drv->supports_multiqueue)) {
         BlockDriver *drv = bs->drv;
         if (drv && drv->bdrv_io_plug) {
             drv->bdrv_io_plug(bs);
@@ -2889,7 +2894,8 @@ void bdrv_io_unplug(BlockDriverState *bs)
     BdrvChild *child;
 
     assert(bs->io_plugged);
-    if (atomic_fetch_dec(&bs->io_plugged) == 1) {
+    if (atomic_fetch_dec(&bs->io_plugged) == 1 ||
+        (bs->drv && bs->drv->supports_multiqueue)) {
         BlockDriver *drv = bs->drv;
         if (drv && drv->bdrv_io_unplug) {
             drv->bdrv_io_unplug(bs);
@@ -0,0 +1,577 @@
+/*
+ * Linux io_uring support.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <liburing.h>
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "qemu/units.h"
+#include "block/block.h"
+#include "block/raw-aio.h"
+#include "qemu/coroutine.h"
+#include "qapi/error.h"
+#include "trace.h"
+
+/* io_uring ring size */
+#define MAX_ENTRIES 128
+
+/* Buffers registered through bdrv_register_buf() */
+#define MAX_BUFFERS 64
+
+/* Larger buffers are refused by the kernel */
+#define MAX_BUFFER_SIZE (1 * GiB)
+
+/* Idle time after which the submission queue polling thread sleeps */
+#define SQ_THREAD_IDLE_MS 1000
+
+typedef struct LuringAIOCB {
+    Coroutine *co;
+    struct io_uring_sqe sqeq;
+    ssize_t ret;
+    QEMUIOVector *qiov;
+    bool is_read;
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+
+    /*
+     * Buffered reads may require resubmission, see
+     * luring_resubmit_short_read().
+     */
+    int total_read;
+    QEMUIOVector resubmit_qiov;
+} LuringAIOCB;
+
+typedef struct LuringQueue {
+    int plugged;
+    unsigned int in_queue;
+    unsigned int in_flight;
+    bool blocked;
+    QSIMPLEQ_HEAD(, LuringAIOCB) submit_queue;
+} LuringQueue;
+
+struct LuringState {
+    AioContext *aio_context;
+
+    struct io_uring ring;
+    bool sqpoll;
+
+    /* IORING_OP_FALLOCATE is supported by the kernel */
+    bool has_fallocate;
+
+    /* Buffers registered with the ring, in registration order */
+    struct iovec buffers[MAX_BUFFERS];
+    int nb_buffers;
+
+    /* io queue for submit at batch.  Protected by AioContext lock. */
+    LuringQueue io_q;
+
+    /* I/O completion processing.  Only runs in I/O thread.  */
+    QEMUBH *completion_bh;
+};
+
+/**
+ * luring_resubmit:
+ *
+ * Resubmit a request by appending it to submit_queue.  The caller must ensure
+ * that ioq_submit() is called later so that submit_queue requests are started.
+ */
+static void luring_resubmit(LuringState *s, LuringAIOCB *luringcb)
+{
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+}
+
+/**
+ * luring_resubmit_short_read:
+ *
+ * A buffered read with the start of the range in the page cache can come
+ * back short on older kernels, while the rest of the range is still to be
+ * read from disk.  Resubmit the remaining part of the request.
+ */
+static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
+                                       int nread)
+{
+    QEMUIOVector *resubmit_qiov;
+    size_t remaining;
+
+    trace_luring_resubmit_short_read(s, luringcb, nread);
+
+    /* Update read position */
+    luringcb->total_read += nread;
+    remaining = luringcb->qiov->size - luringcb->total_read;
+
+    /* Shorten qiov */
+    resubmit_qiov = &luringcb->resubmit_qiov;
+    if (resubmit_qiov->iov == NULL) {
+        qemu_iovec_init(resubmit_qiov, luringcb->qiov->niov);
+    } else {
+        qemu_iovec_reset(resubmit_qiov);
+    }
+    qemu_iovec_concat(resubmit_qiov, luringcb->qiov, luringcb->total_read,
+                      remaining);
+
+    /* Update sqe */
+    luringcb->sqeq.off += nread;
+    luringcb->sqeq.addr = (__u64)(uintptr_t)luringcb->resubmit_qiov.iov;
+    luringcb->sqeq.len = luringcb->resubmit_qiov.niov;
+
+    luring_resubmit(s, luringcb);
+}
+
+/**
+ * luring_process_completions:
+ * @s: AIO state
+ *
+ * Fetches completed I/O requests, consumes cqes and invokes their callbacks.
+ *
+ * The function is somewhat tricky because it supports nested event loops, for
+ * example when a request callback invokes aio_poll().  It schedules the
+ * completion BH so that it can be called again in a nested event loop: the
+ * ring file descriptor is only readable when new completions are added, so
+ * a nested event loop would not see the ones that are already there.  When
+ * there are no completions left the BH is canceled.
+ */
+static void luring_process_completions(LuringState *s)
+{
+    struct io_uring_cqe *cqe;
+
+    /* Reschedule so nested event loops see currently pending completions */
+    qemu_bh_schedule(s->completion_bh);
+
+    while (io_uring_peek_cqe(&s->ring, &cqe) == 0 && cqe) {
+        LuringAIOCB *luringcb = io_uring_cqe_get_data(cqe);
+        int ret = cqe->res;
+        int total_bytes;
+
+        io_uring_cqe_seen(&s->ring, cqe);
+
+        /* Change counters one-by-one because we can be nested. */
+        s->io_q.in_flight--;
+        trace_luring_process_completion(s, luringcb, ret);
+
+        /* total_read is non-zero only for resubmitted read requests */
+        total_bytes = ret + luringcb->total_read;
+
+        if (ret < 0) {
+            if (ret == -EINTR) {
+                luring_resubmit(s, luringcb);
+                continue;
+            }
+        } else if (!luringcb->qiov) {
+            /* fsync and fallocate return 0 on success */
+        } else if (total_bytes == luringcb->qiov->size) {
+            ret = 0;
+        } else if (luringcb->is_read) {
+            if (ret > 0) {
+                luring_resubmit_short_read(s, luringcb, ret);
+                continue;
+            }
+            /* Short reads mean EOF, pad with zeros. */
+            qemu_iovec_memset(luringcb->qiov, total_bytes, 0,
+                              luringcb->qiov->size - total_bytes);
+            ret = 0;
+        } else {
+            ret = -ENOSPC;
+        }
+
+        luringcb->ret = ret;
+        if (luringcb->resubmit_qiov.iov) {
+            qemu_iovec_destroy(&luringcb->resubmit_qiov);
+        }
+
+        /*
+         * If the coroutine is already entered it must be in ioq_submit()
+         * and will notice luringcb->ret has been filled in when it
+         * eventually runs later.  Coroutines cannot be entered recursively
+         * so avoid doing that!
+         */
+        if (!qemu_coroutine_entered(luringcb->co)) {
+            aio_co_wake(luringcb->co);
+        }
+    }
+
+    /* Resubmitted requests are started by the BH if nobody else does */
+    if (!s->io_q.in_queue) {
+        qemu_bh_cancel(s->completion_bh);
+    }
+}
+
+/*
+ * Turn a single buffer read or write into a fixed buffer one if the buffer
+ * lies in a registered buffer, so that the kernel doesn't have to map the
+ * pages for each request.  This is done when the sqe is copied to the ring
+ * and not when the request is prepared, so that queued requests don't refer
+ * to a buffer index that luring_unregister_buf() has invalidated.
+ */
+static void luring_prep_fixed_buf(LuringState *s, struct io_uring_sqe *sqe)
+{
+    struct iovec *iov = (struct iovec *)(uintptr_t)sqe->addr;
+    int i;
+
+    if ((sqe->opcode != IORING_OP_READV && sqe->opcode != IORING_OP_WRITEV) ||
+        sqe->len != 1) {
+        return;
+    }
+
+    for (i = 0; i < s->nb_buffers; i++) {
+        uint8_t *start = s->buffers[i].iov_base;
+        uint8_t *end = start + s->buffers[i].iov_len;
+
+        if ((uint8_t *)iov->iov_base >= start &&
+            (uint8_t *)iov->iov_base + iov->iov_len <= end) {
+            sqe->opcode = sqe->opcode == IORING_OP_READV ?
+                          IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+            sqe->addr = (__u64)(uintptr_t)iov->iov_base;
+            sqe->len = iov->iov_len;
+            sqe->buf_index = i;
+            return;
+        }
+    }
+}
+
+static void ioq_submit(LuringState *s)
+{
+    int ret = 0;
+    LuringAIOCB *luringcb, *luringcb_next;
+
+    while (s->io_q.in_queue > 0) {
+        /*
+         * Try to fetch sqes from the ring for requests waiting in
+         * the overflow queue
+         */
+        QSIMPLEQ_FOREACH_SAFE(luringcb, &s->io_q.submit_queue, next,
+                              luringcb_next) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&s->ring);
+            if (!sqe) {
+                break;
+            }
+            /* Prep sqe for submission */
+            *sqe = luringcb->sqeq;
+            luring_prep_fixed_buf(s, sqe);
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.submit_queue, next);
+        }
+        ret = io_uring_submit(&s->ring);
+        trace_luring_io_uring_submit(s, ret);
+        /* Prevent infinite loop if submission is refused */
+        if (ret <= 0) {
+            if (ret == -EAGAIN || ret == -EINTR) {
+                continue;
+            }
+            break;
+        }
+        s->io_q.in_flight += ret;
+        s->io_q.in_queue  -= ret;
+    }
+    s->io_q.blocked = (s->io_q.in_queue > 0);
+
+    if (s->io_q.in_flight) {
+        /*
+         * We can try to complete something just right away if there are
+         * still requests in-flight.
+         */
+        luring_process_completions(s);
+    }
+}
+
+static void luring_process_completions_and_submit(LuringState *s)
+{
+    aio_context_acquire(s->aio_context);
+    luring_process_completions(s);
+
+    if (!s->io_q.plugged && s->io_q.in_queue > 0) {
+        ioq_submit(s);
+    }
+    aio_context_release(s->aio_context);
+}
+
+static void qemu_luring_completion_bh(void *opaque)
+{
+    LuringState *s = opaque;
+
+    luring_process_completions_and_submit(s);
+}
+
+static void qemu_luring_completion_cb(void *opaque)
+{
+    LuringState *s = opaque;
+
+    luring_process_completions_and_submit(s);
+}
+
+static bool qemu_luring_poll_cb(void *opaque)
+{
+    LuringState *s = opaque;
+
+    if (!io_uring_cq_ready(&s->ring)) {
+        return false;
+    }
+
+    luring_process_completions_and_submit(s);
+    return true;
+}
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->submit_queue);
+    io_q->plugged = 0;
+    io_q->in_queue = 0;
+    io_q->in_flight = 0;
+    io_q->blocked = false;
+}
+
+void luring_io_plug(BlockDriverState *bs, LuringState *s)
+{
+    trace_luring_io_plug(s);
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, LuringState *s)
+{
+    assert(s->io_q.plugged);
+    trace_luring_io_unplug(s, s->io_q.blocked, s->io_q.plugged,
+                           s->io_q.in_queue, s->io_q.in_flight);
+    if (--s->io_q.plugged == 0 &&
+        !s->io_q.blocked && s->io_q.in_queue > 0) {
+        ioq_submit(s);
+    }
+}
+
+/**
+ * luring_do_submit:
+ * @luringcb: AIO control block, with its sqe prepared
+ * @s: AIO state
+ *
+ * Adds the request to the pending queue, and submits the queue unless it
+ * is plugged and not full.
+ */
+static void luring_do_submit(LuringAIOCB *luringcb, LuringState *s)
+{
+    io_uring_sqe_set_data(&luringcb->sqeq, luringcb);
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+    trace_luring_do_submit(s, s->io_q.blocked, s->io_q.plugged,
+                           s->io_q.in_queue, s->io_q.in_flight);
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged ||
+         s->io_q.in_flight + s->io_q.in_queue >= MAX_ENTRIES)) {
+        ioq_submit(s);
+    }
+}
+
+static int coroutine_fn luring_co_wait(LuringAIOCB *luringcb)
+{
+    if (luringcb->ret == -EINPROGRESS) {
+        qemu_coroutine_yield();
+    }
+    return luringcb->ret;
+}
+
+/**
+ * luring_co_submit:
+ * @fd: file descriptor for I/O
+ * @offset: offset for request
+ * @qiov: request buffer, NULL for QEMU_AIO_FLUSH
+ * @type: QEMU_AIO_READ, QEMU_AIO_WRITE or QEMU_AIO_FLUSH
+ *
+ * Reads and writes work with and without O_DIRECT.  Flush is a
+ * fdatasync().
+ *
+ * Returns: 0 on success, -errno on failure
+ */
+int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
+                                  uint64_t offset, QEMUIOVector *qiov, int type)
+{
+    LuringAIOCB luringcb = {
+        .co         = qemu_coroutine_self(),
+        .ret        = -EINPROGRESS,
+        .qiov       = qiov,
+        .is_read    = (type == QEMU_AIO_READ),
+    };
+    struct io_uring_sqe *sqe = &luringcb.sqeq;
+
+    trace_luring_co_submit(bs, s, &luringcb, fd, offset, qiov ? qiov->size : 0,
+                           type);
+
+    switch (type) {
+    case QEMU_AIO_WRITE:
+        io_uring_prep_writev(sqe, fd, qiov->iov, qiov->niov, offset);
+        break;
+    case QEMU_AIO_READ:
+        io_uring_prep_readv(sqe, fd, qiov->iov, qiov->niov, offset);
+        break;
+    case QEMU_AIO_FLUSH:
+        io_uring_prep_fsync(sqe, fd, IORING_FSYNC_DATASYNC);
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, type);
+        return -EIO;
+    }
+
+    luring_do_submit(&luringcb, s);
+    return luring_co_wait(&luringcb);
+}
+
+/**
+ * luring_co_fallocate:
+ * @fd: file descriptor for the request
+ * @mode: fallocate() mode
+ *
+ * Returns: 0 on success, -ENOTSUP if the kernel cannot fallocate() through
+ * io_uring, -errno returned by fallocate() otherwise
+ */
+int coroutine_fn luring_co_fallocate(BlockDriverState *bs, LuringState *s,
+                                     int fd, int mode, uint64_t offset,
+                                     uint64_t bytes)
+{
+    LuringAIOCB luringcb = {
+        .co         = qemu_coroutine_self(),
+        .ret        = -EINPROGRESS,
+    };
+
+    if (!s->has_fallocate) {
+        return -ENOTSUP;
+    }
+
+    trace_luring_co_fallocate(bs, s, &luringcb, fd, mode, offset, bytes);
+    io_uring_prep_fallocate(&luringcb.sqeq, fd, mode, offset, bytes);
+
+    luring_do_submit(&luringcb, s);
+    return luring_co_wait(&luringcb);
+}
+
+/*
+ * Register the table of buffers with the ring.  The kernel waits for the
+ * requests in flight before it replaces the table.
+ */
+static int luring_update_buffers(LuringState *s)
+{
+    int ret;
+
+    ret = io_uring_unregister_buffers(&s->ring);
+    if (ret < 0 && ret != -ENXIO) {
+        return ret;
+    }
+    if (!s->nb_buffers) {
+        return 0;
+    }
+    return io_uring_register_buffers(&s->ring, s->buffers, s->nb_buffers);
+}
+
+/**
+ * luring_register_buf:
+ *
+ * Reads and writes of a single buffer inside @host are done as fixed
+ * buffer requests.  This is only an optimization, so failures are ignored.
+ */
+void luring_register_buf(LuringState *s, void *host, size_t size)
+{
+    int ret;
+
+    if (s->nb_buffers == MAX_BUFFERS || size > MAX_BUFFER_SIZE) {
+        trace_luring_register_buf(s, host, size, -ENOSPC);
+        return;
+    }
+
+    s->buffers[s->nb_buffers++] = (struct iovec) {
+        .iov_base = host,
+        .iov_len = size,
+    };
+    ret = luring_update_buffers(s);
+    trace_luring_register_buf(s, host, size, ret);
+    if (ret < 0) {
+        /* e.g. RLIMIT_MEMLOCK is too low, go on without it */
+        s->nb_buffers--;
+        luring_update_buffers(s);
+    }
+}
+
+void luring_unregister_buf(LuringState *s, void *host)
+{
+    int i;
+
+    for (i = 0; i < s->nb_buffers; i++) {
+        if (s->buffers[i].iov_base == host) {
+            break;
+        }
+    }
+    if (i == s->nb_buffers) {
+        return;
+    }
+
+    memmove(&s->buffers[i], &s->buffers[i + 1],
+            (s->nb_buffers - i - 1) * sizeof(s->buffers[0]));
+    s->nb_buffers--;
+    luring_update_buffers(s);
+    trace_luring_unregister_buf(s, host);
+}
+
+void luring_detach_aio_context(LuringState *s, AioContext *old_context)
+{
+    aio_set_fd_handler(old_context, s->ring.ring_fd, false, NULL, NULL, NULL,
+                       s);
+    qemu_bh_delete(s->completion_bh);
+    s->aio_context = NULL;
+}
+
+void luring_attach_aio_context(LuringState *s, AioContext *new_context)
+{
+    s->aio_context = new_context;
+    s->completion_bh = aio_bh_new(new_context, qemu_luring_completion_bh, s);
+    aio_set_fd_handler(s->aio_context, s->ring.ring_fd, false,
+                       qemu_luring_completion_cb, NULL, qemu_luring_poll_cb, s);
+}
+
+bool luring_uses_sqpoll(LuringState *s)
+{
+    return s->sqpoll;
+}
+
+/**
+ * luring_init:
+ * @sqpoll: let a kernel thread poll the submission queue, so that
+ *          submitting requests doesn't need a system call
+ */
+LuringState *luring_init(bool sqpoll, Error **errp)
+{
+    int rc;
+    LuringState *s = g_new0(LuringState, 1);
+    struct io_uring_params params = { 0 };
+    struct io_uring_probe *probe;
+
+    if (sqpoll) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = SQ_THREAD_IDLE_MS;
+    }
+
+    rc = io_uring_queue_init_params(MAX_ENTRIES, &s->ring, &params);
+    if (rc < 0) {
+        error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
+        g_free(s);
+        return NULL;
+    }
+    s->sqpoll = sqpoll;
+
+    /* Kernels before 5.6 can't probe, and have no IORING_OP_FALLOCATE */
+    probe = io_uring_get_probe_ring(&s->ring);
+    if (probe) {
+        s->has_fallocate = io_uring_opcode_supported(probe,
+                                                     IORING_OP_FALLOCATE);
+        io_uring_free_probe(probe);
+    }
+
+    ioq_init(&s->io_q);
+    trace_luring_init_state(s, sqpoll, s->has_fallocate);
+    return s;
+}
+
+void luring_cleanup(LuringState *s)
+{
+    io_uring_queue_exit(&s->ring);
+    trace_luring_cleanup_state(s);
+    g_free(s);
+}
@@ -30,6 +30,8 @@
 #define NVME_CQ_ENTRY_BYTES 16
 #define NVME_QUEUE_SIZE 128
 #define NVME_BAR_SIZE 8192
+/* I/O queue pairs requested from the controller, one per AioContext */
+#define NVME_MAX_IO_QUEUES 64
 
 typedef struct {
     int32_t  head, tail;
@@ -53,8 +55,16 @@ typedef struct {
     QemuMutex   lock;
 
     /* Fields protected by BQL */
+    BlockDriverState *bs;
     int         index;
     uint8_t     *prp_list_pages;
+    /* AioContext that uses the queue pair, NULL if it is unused */
+    AioContext  *aio_context;
+    /*
+     * Set by nvme_handle_event() for queue pairs of other AioContexts than
+     * the node's one, because all of them share the interrupt
+     */
+    EventNotifier notifier;
 
     /* Fields protected by @lock */
     NVMeQueue   sq, cq;
@@ -63,6 +73,7 @@ typedef struct {
     bool        busy;
     int         need_kick;
     int         inflight;
+    int         plugged;
 } NVMeQueuePair;
 
 /* Memory mapped registers */
@@ -93,7 +104,10 @@ typedef struct {
     NVMeRegs *regs;
     /* The submission/completion queue pairs.
      * [0]: admin queue.
-     * [1..]: io queues.
+     * [1]: io queue of aio_context.
+     * [2..]: io queues of the queue contexts, see bdrv_attach_queue_context().
+     * The array has room for NVME_MAX_IO_QUEUES io queues, so that it can be
+     * read without locks.
      */
     NVMeQueuePair **queues;
     int nr_queues;
@@ -105,7 +119,6 @@ typedef struct {
     uint64_t nsze; /* Namespace size reported by identify command */
     int nsid;      /* The namespace id to read/write data. */
     uint64_t max_transfer;
-    bool plugged;
 
     CoMutex dma_map_lock;
     CoQueue dma_flush_queue;
@@ -164,6 +177,7 @@ static void nvme_free_queue_pair(BlockDriverState *bs, NVMeQueuePair *q)
     qemu_vfree(q->prp_list_pages);
     qemu_vfree(q->sq.queue);
     qemu_vfree(q->cq.queue);
+    event_notifier_cleanup(&q->notifier);
     qemu_mutex_destroy(&q->lock);
     g_free(q);
 }
@@ -190,8 +204,16 @@ static NVMeQueuePair *nvme_create_queue_pair(BlockDriverState *bs,
     uint64_t prp_list_iova;
 
     qemu_mutex_init(&q->lock);
+    q->bs = bs;
     q->index = idx;
+    q->aio_context = s->aio_context;
     qemu_co_queue_init(&q->free_req_queue);
+    if (event_notifier_init(&q->notifier, 0)) {
+        error_setg(errp, "Failed to init event notifier");
+        qemu_mutex_destroy(&q->lock);
+        g_free(q);
+        return NULL;
+    }
     q->prp_list_pages = qemu_blockalign0(bs, s->page_size * NVME_QUEUE_SIZE);
     r = qemu_vfio_dma_map(s->vfio, q->prp_list_pages,
                           s->page_size * NVME_QUEUE_SIZE,
@@ -228,7 +250,7 @@ fail:
 /* With q->lock */
 static void nvme_kick(BDRVNVMeState *s, NVMeQueuePair *q)
 {
-    if (s->plugged || !q->need_kick) {
+    if (q->plugged || !q->need_kick) {
         return;
     }
     trace_nvme_kick(s, q->index);
@@ -306,7 +328,7 @@ static bool nvme_process_completion(BDRVNVMeState *s, NVMeQueuePair *q)
     NvmeCqe *c;
 
     trace_nvme_process_completion(s, q->index, q->inflight);
-    if (q->busy || s->plugged) {
+    if (q->busy || q->plugged) {
         trace_nvme_process_completion_queue_busy(s, q->index);
         return false;
     }
@@ -350,7 +372,7 @@ static bool nvme_process_completion(BDRVNVMeState *s, NVMeQueuePair *q)
         smp_mb_release();
         *q->cq.doorbell = cpu_to_le32(q->cq.head);
         if (!qemu_co_queue_empty(&q->free_req_queue)) {
-            aio_bh_schedule_oneshot(s->aio_context, nvme_free_req_queue_cb, q);
+            aio_bh_schedule_oneshot(q->aio_context, nvme_free_req_queue_cb, q);
         }
     }
     q->busy = false;
@@ -472,6 +494,20 @@ out:
     qemu_vfree(resp);
 }
 
+static bool nvme_poll_queue(BDRVNVMeState *s, NVMeQueuePair *q)
+{
+    bool progress = false;
+
+    qemu_mutex_lock(&q->lock);
+    while (nvme_process_completion(s, q)) {
+        /* Keep polling */
+        progress = true;
+    }
+    qemu_mutex_unlock(&q->lock);
+    return progress;
+}
+
+/* Poll the queue pairs of the node's AioContext */
 static bool nvme_poll_queues(BDRVNVMeState *s)
 {
     bool progress = false;
@@ -479,12 +515,10 @@ static bool nvme_poll_queues(BDRVNVMeState *s)
 
     for (i = 0; i < s->nr_queues; i++) {
         NVMeQueuePair *q = s->queues[i];
-        qemu_mutex_lock(&q->lock);
-        while (nvme_process_completion(s, q)) {
-            /* Keep polling */
-            progress = true;
+
+        if (q->aio_context == s->aio_context) {
+            progress |= nvme_poll_queue(s, q);
         }
-        qemu_mutex_unlock(&q->lock);
     }
     return progress;
 }
@@ -492,10 +526,53 @@ static bool nvme_poll_queues(BDRVNVMeState *s)
 static void nvme_handle_event(EventNotifier *n)
 {
     BDRVNVMeState *s = container_of(n, BDRVNVMeState, irq_notifier);
+    int i;
 
     trace_nvme_handle_event(s);
     event_notifier_test_and_clear(n);
     nvme_poll_queues(s);
+
+    /* The interrupt may be for a queue pair of another AioContext */
+    for (i = 2; i < atomic_read(&s->nr_queues); i++) {
+        NVMeQueuePair *q = s->queues[i];
+        AioContext *ctx = atomic_read(&q->aio_context);
+
+        if (ctx && ctx != s->aio_context && atomic_read(&q->inflight)) {
+            event_notifier_set(&q->notifier);
+        }
+    }
+}
+
+static void nvme_handle_queue_event(EventNotifier *n)
+{
+    NVMeQueuePair *q = container_of(n, NVMeQueuePair, notifier);
+    BDRVNVMeState *s = q->bs->opaque;
+
+    trace_nvme_handle_queue_event(s, q->index);
+    event_notifier_test_and_clear(n);
+    nvme_poll_queue(s, q);
+}
+
+static bool nvme_queue_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    NVMeQueuePair *q = container_of(e, NVMeQueuePair, notifier);
+
+    return nvme_poll_queue(q->bs->opaque, q);
+}
+
+/* The io queue pair of the current AioContext */
+static NVMeQueuePair *nvme_get_io_queue(BDRVNVMeState *s)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+    int i;
+
+    for (i = 2; i < s->nr_queues; i++) {
+        if (s->queues[i]->aio_context == ctx) {
+            return s->queues[i];
+        }
+    }
+    return s->queues[1];
 }
 
 static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
@@ -506,6 +583,11 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
     NvmeCmd cmd;
     int queue_size = NVME_QUEUE_SIZE;
 
+    if (n > NVME_MAX_IO_QUEUES) {
+        error_setg(errp, "Cannot create more than %d io queues",
+                   NVME_MAX_IO_QUEUES);
+        return false;
+    }
     q = nvme_create_queue_pair(bs, n, queue_size, errp);
     if (!q) {
         return false;
@@ -532,12 +614,25 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
         nvme_free_queue_pair(bs, q);
         return false;
     }
-    s->queues = g_renew(NVMeQueuePair *, s->queues, n + 1);
     s->queues[n] = q;
-    s->nr_queues++;
+    /* nvme_handle_event() can look at the new queue pair from now on */
+    atomic_mb_set(&s->nr_queues, n + 1);
     return true;
 }
 
+static int nvme_set_num_queues(BlockDriverState *bs, int nr_io_queues)
+{
+    BDRVNVMeState *s = bs->opaque;
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_SET_FEATURES,
+        .cdw10 = cpu_to_le32(0x07),
+        .cdw11 = cpu_to_le32(((nr_io_queues - 1) << 16) |
+                             (nr_io_queues - 1)),
+    };
+
+    return nvme_cmd_sync(bs, s->queues[0], &cmd);
+}
+
 static bool nvme_poll_cb(void *opaque)
 {
     EventNotifier *e = opaque;
@@ -612,7 +707,7 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     }
 
     /* Set up admin queue. */
-    s->queues = g_new(NVMeQueuePair *, 1);
+    s->queues = g_new0(NVMeQueuePair *, NVME_MAX_IO_QUEUES + 1);
     s->nr_queues = 1;
     s->queues[0] = nvme_create_queue_pair(bs, 0, NVME_QUEUE_SIZE, errp);
     if (!s->queues[0]) {
@@ -656,6 +751,14 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
         goto out;
     }
 
+    /*
+     * Ask for one io queue pair per AioContext that may use the device.  The
+     * controller can allocate fewer, creating the queues then fails.
+     */
+    if (nvme_set_num_queues(bs, NVME_MAX_IO_QUEUES)) {
+        trace_nvme_set_num_queues_failed(s, NVME_MAX_IO_QUEUES);
+    }
+
     /* Set up command queues. */
     if (!nvme_add_io_queue(bs, errp)) {
         ret = -EIO;
@@ -726,7 +829,13 @@ static void nvme_close(BlockDriverState *bs)
     BDRVNVMeState *s = bs->opaque;
 
     for (i = 0; i < s->nr_queues; ++i) {
-        nvme_free_queue_pair(bs, s->queues[i]);
+        NVMeQueuePair *q = s->queues[i];
+
+        if (q->aio_context && q->aio_context != s->aio_context) {
+            aio_set_event_notifier(q->aio_context, &q->notifier,
+                                   false, NULL, NULL);
+        }
+        nvme_free_queue_pair(bs, q);
     }
     g_free(s->queues);
     aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irq_notifier,
@@ -915,7 +1024,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
     uint32_t cdw12 = (((bytes >> BDRV_SECTOR_BITS) - 1) & 0xFFFF) |
                        (flags & BDRV_REQ_FUA ? 1 << 30 : 0);
@@ -927,7 +1036,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         .cdw12 = cpu_to_le32(cdw12),
     };
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1029,14 +1138,14 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
 static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
         .nsid = cpu_to_le32(s->nsid),
     };
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1091,30 +1200,91 @@ static void nvme_attach_aio_context(BlockDriverState *bs,
     BDRVNVMeState *s = bs->opaque;
 
     s->aio_context = new_context;
+    s->queues[0]->aio_context = new_context;
+    s->queues[1]->aio_context = new_context;
     aio_set_event_notifier(new_context, &s->irq_notifier,
                            false, nvme_handle_event, nvme_poll_cb);
 }
 
+/*
+ * Give @ctx an io queue pair of its own.  Queue pairs are not deleted from
+ * the controller when @ctx is detached, the next AioContext reuses them.
+ */
+static int nvme_attach_queue_context(BlockDriverState *bs, AioContext *ctx,
+                                     Error **errp)
+{
+    BDRVNVMeState *s = bs->opaque;
+    NVMeQueuePair *q = NULL;
+    int i;
+
+    if (ctx == s->aio_context) {
+        return 0;
+    }
+
+    for (i = 2; i < s->nr_queues; i++) {
+        if (!s->queues[i]->aio_context) {
+            q = s->queues[i];
+            break;
+        }
+    }
+    if (!q) {
+        if (!nvme_add_io_queue(bs, errp)) {
+            return -EIO;
+        }
+        q = s->queues[s->nr_queues - 1];
+    }
+
+    trace_nvme_attach_queue_context(s, ctx, q->index);
+    atomic_set(&q->aio_context, ctx);
+    aio_set_event_notifier(ctx, &q->notifier, false,
+                           nvme_handle_queue_event, nvme_queue_poll_cb);
+    return 0;
+}
+
+static void nvme_detach_queue_context(BlockDriverState *bs, AioContext *ctx)
+{
+    BDRVNVMeState *s = bs->opaque;
+    int i;
+
+    if (ctx == s->aio_context) {
+        return;
+    }
+
+    for (i = 2; i < s->nr_queues; i++) {
+        NVMeQueuePair *q = s->queues[i];
+
+        if (q->aio_context == ctx) {
+            trace_nvme_detach_queue_context(s, ctx, q->index);
+            assert(!q->inflight);
+            aio_set_event_notifier(ctx, &q->notifier, false, NULL, NULL);
+            atomic_set(&q->aio_context, NULL);
+            return;
+        }
+    }
+}
+
 static void nvme_aio_plug(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    assert(!s->plugged);
-    s->plugged = true;
+    NVMeQueuePair *q = nvme_get_io_queue(s);
+
+    qemu_mutex_lock(&q->lock);
+    q->plugged++;
+    qemu_mutex_unlock(&q->lock);
 }
 
 static void nvme_aio_unplug(BlockDriverState *bs)
 {
-    int i;
     BDRVNVMeState *s = bs->opaque;
-    assert(s->plugged);
-    s->plugged = false;
-    for (i = 1; i < s->nr_queues; i++) {
-        NVMeQueuePair *q = s->queues[i];
-        qemu_mutex_lock(&q->lock);
+    NVMeQueuePair *q = nvme_get_io_queue(s);
+
+    qemu_mutex_lock(&q->lock);
+    assert(q->plugged);
+    if (--q->plugged == 0) {
         nvme_kick(s, q);
         nvme_process_completion(s, q);
-        qemu_mutex_unlock(&q->lock);
     }
+    qemu_mutex_unlock(&q->lock);
 }
 
 static void nvme_register_buf(BlockDriverState *bs, void *host, size_t size)
@@ -1149,6 +1319,7 @@ static BlockDriver bdrv_nvme = {
     .format_name              = "nvme",
     .protocol_name            = "nvme",
     .instance_size            = sizeof(BDRVNVMeState),
+    .supports_multiqueue      = true,
 
     .bdrv_parse_filename      = nvme_parse_filename,
     .bdrv_file_open           = nvme_file_open,
@@ -1166,6 +1337,8 @@ static BlockDriver bdrv_nvme = {
 
     .bdrv_detach_aio_context  = nvme_detach_aio_context,
     .bdrv_attach_aio_context  = nvme_attach_aio_context,
+    .bdrv_attach_queue_context = nvme_attach_queue_context,
+    .bdrv_detach_queue_context = nvme_detach_queue_context,
 
     .bdrv_io_plug             = nvme_aio_plug,
     .bdrv_io_unplug           = nvme_aio_unplug,
@@ -31,29 +31,136 @@
 #include "qcow2.h"
 #include "block/thread-pool.h"
 #include "crypto.h"
+#include "trace.h"
 
-static int coroutine_fn
-qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
+/*
+ * Each image has its own pool, created on first use in the AioContext of
+ * the image, so that compressing or encrypting an image doesn't starve the
+ * other users of the AioContext pool.  The pool runs at most
+ * s->thread_pool_size work items at once, which is also the number of
+ * ciphers of s->crypto.
+ */
+static ThreadPool *qcow2_get_thread_pool(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (!s->thread_pool) {
+        s->thread_pool = thread_pool_new(bdrv_get_aio_context(bs));
+        thread_pool_set_max_threads(s->thread_pool, s->thread_pool_size);
+    }
+    return s->thread_pool;
+}
+
+void qcow2_free_thread_pool(BlockDriverState *bs)
 {
+    BDRVQcow2State *s = bs->opaque;
+
+    assert(!s->nb_threads);
+    thread_pool_free(s->thread_pool);
+    s->thread_pool = NULL;
+}
+
+void qcow2_set_thread_pool_size(BlockDriverState *bs, int size)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    s->thread_pool_size = size;
+    if (s->thread_pool) {
+        thread_pool_set_max_threads(s->thread_pool, size);
+    }
+}
+
+Qcow2ThreadPoolInfo *qcow2_get_thread_pool_info(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2ThreadPoolInfo *info;
+
+    if (!s->thread_pool) {
+        return NULL;
+    }
+
+    info = g_new0(Qcow2ThreadPoolInfo, 1);
+    info->size = s->thread_pool_size;
+    info->queue_depth = s->nb_threads;
+    info->max_queue_depth = s->thread_pool_max_queue_depth;
+    info->work_items = s->thread_pool_work_items;
+    info->clusters = s->thread_pool_clusters;
+    return info;
+}
+
+typedef struct Qcow2ProcessBatch {
+    Coroutine *co;
+    int pending;
     int ret;
+} Qcow2ProcessBatch;
+
+static void qcow2_process_cb(void *opaque, int ret)
+{
+    Qcow2ProcessBatch *batch = opaque;
+
+    if (ret < 0 && !batch->ret) {
+        batch->ret = ret;
+    }
+    if (--batch->pending == 0) {
+        aio_co_wake(batch->co);
+    }
+}
+
+/*
+ * qcow2_co_process()
+ *
+ * Run @func on the @nb_items work items of @args in the pool of @bs, and
+ * wait for all of them.
+ *
+ * @args - array of @nb_items arguments for @func, @arg_size bytes each
+ * @nb_clusters - number of clusters covered by the work items, for the
+ *                statistics
+ *
+ * Returns: 0 on success, the first error returned by @func otherwise
+ */
+static int coroutine_fn
+qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *args,
+                 size_t arg_size, int nb_items, int nb_clusters)
+{
     BDRVQcow2State *s = bs->opaque;
-    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    ThreadPool *pool = qcow2_get_thread_pool(bs);
+    Qcow2ProcessBatch batch = {
+        .co = qemu_coroutine_self(),
+        .pending = nb_items,
+    };
+    int i;
+
+    assert(nb_items > 0);
 
-    qemu_co_mutex_lock(&s->lock);
-    while (s->nb_threads >= QCOW2_MAX_THREADS) {
-        qemu_co_queue_wait(&s->thread_task_queue, &s->lock);
+    s->nb_threads += nb_items;
+    s->thread_pool_max_queue_depth = MAX(s->thread_pool_max_queue_depth,
+                                         s->nb_threads);
+    trace_qcow2_process(bs, nb_items, nb_clusters, s->nb_threads);
+
+    /* The completions run in this AioContext, not before we yield */
+    for (i = 0; i < nb_items; i++) {
+        thread_pool_submit_aio(pool, func, (uint8_t *)args + i * arg_size,
+                               qcow2_process_cb, &batch);
     }
-    s->nb_threads++;
-    qemu_co_mutex_unlock(&s->lock);
+    qemu_coroutine_yield();
 
-    ret = thread_pool_submit_co(pool, func, arg);
+    s->nb_threads -= nb_items;
+    s->thread_pool_work_items += nb_items;
+    s->thread_pool_clusters += nb_clusters;
 
-    qemu_co_mutex_lock(&s->lock);
-    s->nb_threads--;
-    qemu_co_queue_next(&s->thread_task_queue);
-    qemu_co_mutex_unlock(&s->lock);
+    return batch.ret;
+}
 
-    return ret;
+/*
+ * qcow2_batch_size()
+ *
+ * Returns: how many clusters each work item takes so that @nb_clusters
+ * consecutive clusters keep the whole pool busy with as few work items as
+ * possible
+ */
+static int qcow2_batch_size(BDRVQcow2State *s, int nb_clusters)
+{
+    return DIV_ROUND_UP(nb_clusters, MIN(nb_clusters, s->thread_pool_size));
 }
 
 
@@ -68,7 +175,11 @@ typedef struct Qcow2CompressData {
     size_t dest_size;
     const void *src;
     size_t src_size;
-    ssize_t ret;
+    /* the clusters of a batch are @stride bytes apart in @dest and @src */
+    int nb_clusters;
+    size_t stride;
+    /* one result per cluster */
+    ssize_t *ret;
 
     Qcow2CompressFunc func;
 } Qcow2CompressData;
@@ -165,9 +276,14 @@ static ssize_t qcow2_decompress(void *dest, size_t dest_size,
 static int qcow2_compress_pool_func(void *opaque)
 {
     Qcow2CompressData *data = opaque;
+    int i;
 
-    data->ret = data->func(data->dest, data->dest_size,
-                           data->src, data->src_size);
+    for (i = 0; i < data->nb_clusters; i++) {
+        data->ret[i] = data->func((uint8_t *)data->dest + i * data->stride,
+                                  data->dest_size,
+                                  (const uint8_t *)data->src + i * data->stride,
+                                  data->src_size);
+    }
 
     return 0;
 }
@@ -176,17 +292,20 @@ static ssize_t coroutine_fn
 qcow2_co_do_compress(BlockDriverState *bs, void *dest, size_t dest_size,
                      const void *src, size_t src_size, Qcow2CompressFunc func)
 {
+    ssize_t ret;
     Qcow2CompressData arg = {
         .dest = dest,
         .dest_size = dest_size,
         .src = src,
         .src_size = src_size,
+        .nb_clusters = 1,
+        .ret = &ret,
         .func = func,
     };
 
-    qcow2_co_process(bs, qcow2_compress_pool_func, &arg);
+    qcow2_co_process(bs, qcow2_compress_pool_func, &arg, sizeof(arg), 1, 1);
 
-    return arg.ret;
+    return ret;
 }
 
 ssize_t coroutine_fn
@@ -197,6 +316,47 @@ qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
                                 qcow2_compress);
 }
 
+/*
+ * qcow2_co_compress_clusters()
+ *
+ * Compress @nb_clusters consecutive clusters in parallel.  Cluster i of
+ * @src is compressed to at most cluster_size - 1 bytes at
+ * @dest + i * cluster_size.
+ *
+ * @dest - destination buffer, @nb_clusters clusters
+ * @src - source buffer, @nb_clusters clusters
+ * @ret - compressed size of each cluster, or the error of qcow2_compress()
+ */
+void coroutine_fn
+qcow2_co_compress_clusters(BlockDriverState *bs, void *dest, const void *src,
+                           int nb_clusters, ssize_t *ret)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int batch = qcow2_batch_size(s, nb_clusters);
+    int nb_items = DIV_ROUND_UP(nb_clusters, batch);
+    Qcow2CompressData *args = g_new(Qcow2CompressData, nb_items);
+    int i;
+
+    for (i = 0; i < nb_items; i++) {
+        size_t start = (size_t)i * batch * s->cluster_size;
+
+        args[i] = (Qcow2CompressData) {
+            .dest = (uint8_t *)dest + start,
+            .dest_size = s->cluster_size - 1,
+            .src = (const uint8_t *)src + start,
+            .src_size = s->cluster_size,
+            .nb_clusters = MIN(batch, nb_clusters - i * batch),
+            .stride = s->cluster_size,
+            .ret = ret + i * batch,
+            .func = qcow2_compress,
+        };
+    }
+
+    qcow2_co_process(bs, qcow2_compress_pool_func, args, sizeof(*args),
+                     nb_items, nb_clusters);
+    g_free(args);
+}
+
 ssize_t coroutine_fn
 qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
                     const void *src, size_t src_size)
@@ -233,22 +393,50 @@ static int qcow2_encdec_pool_func(void *opaque)
     return data->func(data->block, data->offset, data->buf, data->len, NULL);
 }
 
+/*
+ * qcow2_co_encdec()
+ *
+ * The run of clusters is split at cluster boundaries into one work item
+ * per batch of clusters, see qcow2_batch_size().  @offset and @len are
+ * sector aligned, and so are the cluster boundaries.
+ */
 static int coroutine_fn
 qcow2_co_encdec(BlockDriverState *bs, uint64_t file_cluster_offset,
                   uint64_t offset, void *buf, size_t len, Qcow2EncDecFunc func)
 {
     BDRVQcow2State *s = bs->opaque;
-    Qcow2EncDecData arg = {
-        .block = s->crypto,
-        .offset = s->crypt_physical_offset ?
-                      file_cluster_offset + offset_into_cluster(s, offset) :
-                      offset,
-        .buf = buf,
-        .len = len,
-        .func = func,
-    };
+    uint64_t crypt_offset = s->crypt_physical_offset ?
+                                file_cluster_offset +
+                                offset_into_cluster(s, offset) :
+                                offset;
+    int nb_clusters = size_to_clusters(s, offset_into_cluster(s, offset) +
+                                          len);
+    int batch = qcow2_batch_size(s, nb_clusters);
+    int nb_items = DIV_ROUND_UP(nb_clusters, batch);
+    Qcow2EncDecData *args = g_new(Qcow2EncDecData, nb_items);
+    size_t done = 0;
+    int i, ret;
+
+    for (i = 0; i < nb_items; i++) {
+        /* end of this batch, relative to the start of the first cluster */
+        size_t end = (size_t)(i + 1) * batch * s->cluster_size;
+        size_t cur_len = MIN(end - offset_into_cluster(s, offset), len) - done;
+
+        args[i] = (Qcow2EncDecData) {
+            .block = s->crypto,
+            .offset = crypt_offset + done,
+            .buf = (uint8_t *)buf + done,
+            .len = cur_len,
+            .func = func,
+        };
+        done += cur_len;
+    }
+    assert(done == len);
 
-    return qcow2_co_process(bs, qcow2_encdec_pool_func, &arg);
+    ret = qcow2_co_process(bs, qcow2_encdec_pool_func, args, sizeof(*args),
+                           nb_items, nb_clusters);
+    g_free(args);
+    return ret;
 }
 
 int coroutine_fn
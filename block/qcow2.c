@@ -297,7 +297,8 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             s->crypto = qcrypto_block_open(s->crypto_opts, "encrypt.",
                                            qcow2_crypto_hdr_read_func,
-                                           bs, cflags, QCOW2_MAX_THREADS, errp);
+                                           bs, cflags, s->thread_pool_size,
+                                           errp);
             if (!s->crypto) {
                 return -EINVAL;
             }
@@ -643,6 +644,7 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_THREAD_POOL_SIZE,
     NULL
 };
 
@@ -754,6 +756,11 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_THREAD_POOL_SIZE,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of threads compressing and encrypting clusters",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -807,6 +814,8 @@ static void cache_clean_timer_del(BlockDriverState *bs)
 static void qcow2_detach_aio_context(BlockDriverState *bs)
 {
     cache_clean_timer_del(bs);
+    /* Created again in the new AioContext on first use */
+    qcow2_free_thread_pool(bs);
 }
 
 static void qcow2_attach_aio_context(BlockDriverState *bs,
@@ -826,7 +835,8 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
     bool l2_cache_entry_size_set;
     int min_refcount_cache = MIN_REFCOUNT_CACHE_SIZE * s->cluster_size;
     uint64_t virtual_disk_size = bs->total_sectors * BDRV_SECTOR_SIZE;
-    uint64_t max_l2_cache = virtual_disk_size / (s->cluster_size / 8);
+    uint64_t max_l2_cache =
+        virtual_disk_size / (s->cluster_size / l2_entry_size(s));
 
     combined_cache_size_set = qemu_opt_get(opts, QCOW2_OPT_CACHE_SIZE);
     l2_cache_size_set = qemu_opt_get(opts, QCOW2_OPT_L2_CACHE_SIZE);
@@ -909,6 +919,7 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    int thread_pool_size;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -922,6 +933,7 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
     uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
+    uint64_t thread_pool_size;
     int i;
     const char *encryptfmt;
     QDict *encryptopts = NULL;
@@ -986,7 +998,7 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         }
     }
 
-    r->l2_slice_size = l2_cache_entry_size / sizeof(uint64_t);
+    r->l2_slice_size = l2_cache_entry_size / l2_entry_size(s);
     r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
                                            l2_cache_entry_size);
     r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
@@ -1015,6 +1027,24 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    thread_pool_size = qemu_opt_get_number(opts, QCOW2_OPT_THREAD_POOL_SIZE,
+                                           MIN(g_get_num_processors(),
+                                               QCOW2_MAX_THREADS));
+    if (thread_pool_size < 1 || thread_pool_size > QCOW2_MAX_THREADS) {
+        error_setg(errp, QCOW2_OPT_THREAD_POOL_SIZE " must be between 1 "
+                   "and %d", QCOW2_MAX_THREADS);
+        ret = -EINVAL;
+        goto fail;
+    }
+    /* There is one cipher per thread */
+    if (s->crypto && thread_pool_size != s->thread_pool_size) {
+        error_setg(errp, "Cannot change " QCOW2_OPT_THREAD_POOL_SIZE
+                   " of an encrypted image");
+        ret = -EINVAL;
+        goto fail;
+    }
+    r->thread_pool_size = thread_pool_size;
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1165,6 +1195,10 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
         cache_clean_timer_init(bs, bdrv_get_aio_context(bs));
     }
 
+    if (s->thread_pool_size != r->thread_pool_size) {
+        qcow2_set_thread_pool_size(bs, r->thread_pool_size);
+    }
+
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     s->crypto_opts = r->crypto_opts;
 }
@@ -1335,6 +1369,17 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         }
     }
 
+    s->subclusters_per_cluster =
+        has_subclusters(s) ? QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER : 1;
+    s->subcluster_size = s->cluster_size / s->subclusters_per_cluster;
+    s->subcluster_bits = ctz32(s->subcluster_size);
+
+    if (s->subcluster_size < (1 << MIN_CLUSTER_BITS)) {
+        error_setg(errp, "Unsupported subcluster size: %d", s->subcluster_size);
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* Check support for various header values */
     if (header.refcount_order > 6) {
         error_setg(errp, "Reference count entry width too large; may not "
@@ -1375,7 +1420,8 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         bs->encrypted = true;
     }
 
-    s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
+    /* L2 is always one cluster */
+    s->l2_bits = s->cluster_bits - ctz32(l2_entry_size(s));
     s->l2_size = 1 << s->l2_bits;
     /* 2^(s->refcount_order - 3) is the refcount width in bytes */
     s->refcount_block_bits = s->cluster_bits - (s->refcount_order - 3);
@@ -1539,7 +1585,7 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
             }
             s->crypto = qcrypto_block_open(s->crypto_opts, "encrypt.",
                                            NULL, NULL, cflags,
-                                           QCOW2_MAX_THREADS, errp);
+                                           s->thread_pool_size, errp);
             if (!s->crypto) {
                 ret = -EINVAL;
                 goto fail;
@@ -1694,8 +1740,6 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
     }
 #endif
 
-    qemu_co_queue_init(&s->thread_task_queue);
-
     return ret;
 
  fail:
@@ -1911,16 +1955,18 @@ static int coroutine_fn qcow2_co_block_status(BlockDriverState *bs,
 
     *pnum = bytes;
 
-    if ((ret == QCOW2_CLUSTER_NORMAL || ret == QCOW2_CLUSTER_ZERO_ALLOC) &&
-        !s->crypto) {
+    if ((ret == QCOW2_SUBCLUSTER_NORMAL ||
+         ret == QCOW2_SUBCLUSTER_ZERO_ALLOC) && !s->crypto) {
         index_in_cluster = offset & (s->cluster_size - 1);
         *map = cluster_offset | index_in_cluster;
         *file = s->data_file->bs;
         status |= BDRV_BLOCK_OFFSET_VALID;
     }
-    if (ret == QCOW2_CLUSTER_ZERO_PLAIN || ret == QCOW2_CLUSTER_ZERO_ALLOC) {
+    if (ret == QCOW2_SUBCLUSTER_ZERO_PLAIN ||
+        ret == QCOW2_SUBCLUSTER_ZERO_ALLOC) {
         status |= BDRV_BLOCK_ZERO;
-    } else if (ret != QCOW2_CLUSTER_UNALLOCATED) {
+    } else if (ret != QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN &&
+               ret != QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC) {
         status |= BDRV_BLOCK_DATA;
     }
     if (s->metadata_preallocation && (status & BDRV_BLOCK_DATA) &&
@@ -1990,9 +2036,15 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
                             QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
         }
 
-        qemu_co_mutex_lock(&s->lock);
-        ret = qcow2_get_cluster_offset(bs, offset, &cur_bytes, &cluster_offset);
-        qemu_co_mutex_unlock(&s->lock);
+        /* Only take s->lock if the L2 slice needs to be loaded */
+        ret = qcow2_get_cached_cluster_offset(bs, offset, &cur_bytes,
+                                              &cluster_offset);
+        if (ret == -EAGAIN) {
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_get_cluster_offset(bs, offset, &cur_bytes,
+                                           &cluster_offset);
+            qemu_co_mutex_unlock(&s->lock);
+        }
         if (ret < 0) {
             goto fail;
         }
@@ -2003,7 +2055,8 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
         qemu_iovec_concat(&hd_qiov, qiov, bytes_done, cur_bytes);
 
         switch (ret) {
-        case QCOW2_CLUSTER_UNALLOCATED:
+        case QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN:
+        case QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC:
 
             if (bs->backing) {
                 BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
@@ -2018,12 +2071,12 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
             }
             break;
 
-        case QCOW2_CLUSTER_ZERO_PLAIN:
-        case QCOW2_CLUSTER_ZERO_ALLOC:
+        case QCOW2_SUBCLUSTER_ZERO_PLAIN:
+        case QCOW2_SUBCLUSTER_ZERO_ALLOC:
             qemu_iovec_memset(&hd_qiov, 0, 0, cur_bytes);
             break;
 
-        case QCOW2_CLUSTER_COMPRESSED:
+        case QCOW2_SUBCLUSTER_COMPRESSED:
             ret = qcow2_co_preadv_compressed(bs, cluster_offset,
                                              offset, cur_bytes,
                                              &hd_qiov);
@@ -2033,7 +2086,7 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
 
             break;
 
-        case QCOW2_CLUSTER_NORMAL:
+        case QCOW2_SUBCLUSTER_NORMAL:
             if ((cluster_offset & 511) != 0) {
                 ret = -EIO;
                 goto fail;
@@ -2185,6 +2238,11 @@ static int handle_alloc_space(BlockDriverState *bs, QCowL2Meta *l2meta)
             continue;
         }
 
+        /* Reused clusters may have data outside of the COW regions */
+        if (m->keep_old_clusters) {
+            continue;
+        }
+
         if (!is_zero_cow(bs, m)) {
             continue;
         }
@@ -2236,8 +2294,6 @@ static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    qemu_co_mutex_lock(&s->lock);
-
     while (bytes != 0) {
 
         l2meta = NULL;
@@ -2251,22 +2307,30 @@ static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
                             - offset_in_cluster);
         }
 
-        ret = qcow2_alloc_cluster_offset(bs, offset, &cur_bytes,
-                                         &cluster_offset, &l2meta);
-        if (ret < 0) {
-            goto out_locked;
-        }
+        /* Overwriting allocated data doesn't need s->lock */
+        ret = qcow2_get_cached_write_offset(bs, offset, &cur_bytes,
+                                            &cluster_offset);
+        if (ret == -EAGAIN) {
+            qemu_co_mutex_lock(&s->lock);
 
-        assert((cluster_offset & 511) == 0);
+            ret = qcow2_alloc_cluster_offset(bs, offset, &cur_bytes,
+                                             &cluster_offset, &l2meta);
+            if (ret < 0) {
+                goto out_locked;
+            }
 
-        ret = qcow2_pre_write_overlap_check(bs, 0,
-                                            cluster_offset + offset_in_cluster,
-                                            cur_bytes, true);
-        if (ret < 0) {
-            goto out_locked;
-        }
+            assert((cluster_offset & 511) == 0);
 
-        qemu_co_mutex_unlock(&s->lock);
+            ret = qcow2_pre_write_overlap_check(bs, 0,
+                                                cluster_offset +
+                                                offset_in_cluster,
+                                                cur_bytes, true);
+            if (ret < 0) {
+                goto out_locked;
+            }
+
+            qemu_co_mutex_unlock(&s->lock);
+        }
 
         qemu_iovec_reset(&hd_qiov);
         qemu_iovec_concat(&hd_qiov, qiov, bytes_done, cur_bytes);
@@ -2319,11 +2383,13 @@ static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
             }
         }
 
-        qemu_co_mutex_lock(&s->lock);
-
-        ret = qcow2_handle_l2meta(bs, &l2meta, true);
-        if (ret) {
-            goto out_locked;
+        if (l2meta) {
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_handle_l2meta(bs, &l2meta, true);
+            if (ret) {
+                goto out_locked;
+            }
+            qemu_co_mutex_unlock(&s->lock);
         }
 
         bytes -= cur_bytes;
@@ -2332,7 +2398,7 @@ static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
         trace_qcow2_writev_done_part(qemu_coroutine_self(), cur_bytes);
     }
     ret = 0;
-    goto out_locked;
+    goto out;
 
 out_unlocked:
     qemu_co_mutex_lock(&s->lock);
@@ -2342,6 +2408,7 @@ out_locked:
 
     qemu_co_mutex_unlock(&s->lock);
 
+out:
     qemu_iovec_destroy(&hd_qiov);
     qemu_vfree(cluster_data);
     trace_qcow2_writev_done_req(qemu_coroutine_self(), ret);
@@ -2399,6 +2466,7 @@ static void qcow2_close(BlockDriverState *bs)
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
 
+    qcow2_free_thread_pool(bs);
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
 
@@ -2629,6 +2697,11 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_INCOMPAT_DATA_FILE_BITNR,
                 .name = "external data file",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
+                .name = "extended L2 entries",
+            },
             {
                 .type = QCOW2_FEAT_TYPE_COMPATIBLE,
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
@@ -2827,12 +2900,12 @@ static int coroutine_fn preallocate_co(BlockDriverState *bs, uint64_t offset,
 
         while (meta) {
             QCowL2Meta *next = meta->next;
+            meta->prealloc = true;
 
             ret = qcow2_alloc_cluster_link_l2(bs, meta);
             if (ret < 0) {
                 error_setg_errno(errp, -ret, "Mapping clusters failed");
-                qcow2_free_any_clusters(bs, meta->alloc_offset,
-                                        meta->nb_clusters, QCOW2_DISCARD_NEVER);
+                qcow2_alloc_cluster_abort(bs, meta);
                 return ret;
             }
 
@@ -2929,28 +3002,31 @@ int64_t qcow2_refcount_metadata_size(int64_t clusters, size_t cluster_size,
  * @total_size: virtual disk size in bytes
  * @cluster_size: cluster size in bytes
  * @refcount_order: refcount bits power-of-2 exponent
+ * @extended_l2: true if the image has extended L2 entries
  *
  * Returns: Total number of bytes required for the fully allocated image
  * (including metadata).
  */
 static int64_t qcow2_calc_prealloc_size(int64_t total_size,
                                         size_t cluster_size,
-                                        int refcount_order)
+                                        int refcount_order,
+                                        bool extended_l2)
 {
     int64_t meta_size = 0;
     uint64_t nl1e, nl2e;
     int64_t aligned_total_size = ROUND_UP(total_size, cluster_size);
+    size_t l2e_size = extended_l2 ? L2E_SIZE_EXTENDED : L2E_SIZE_NORMAL;
 
     /* header: 1 cluster */
     meta_size += cluster_size;
 
     /* total size of L2 tables */
     nl2e = aligned_total_size / cluster_size;
-    nl2e = ROUND_UP(nl2e, cluster_size / sizeof(uint64_t));
-    meta_size += nl2e * sizeof(uint64_t);
+    nl2e = ROUND_UP(nl2e, cluster_size / l2e_size);
+    meta_size += nl2e * l2e_size;
 
     /* total size of L1 tables */
-    nl1e = nl2e * sizeof(uint64_t) / cluster_size;
+    nl1e = nl2e * l2e_size / cluster_size;
     nl1e = ROUND_UP(nl1e, cluster_size / sizeof(uint64_t));
     meta_size += nl1e * sizeof(uint64_t);
 
@@ -3146,6 +3222,26 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
     }
     refcount_order = ctz32(qcow2_opts->refcount_bits);
 
+    if (!qcow2_opts->has_extended_l2) {
+        qcow2_opts->extended_l2 = false;
+    }
+    if (qcow2_opts->extended_l2) {
+        if (version < 3) {
+            error_setg(errp, "Extended L2 entries are only supported with "
+                       "compatibility level 1.1 and above (use version=v3 or "
+                       "greater)");
+            ret = -EINVAL;
+            goto out;
+        }
+        if (cluster_size < (1 << QCOW2_EXTL2_MIN_CLUSTER_BITS)) {
+            error_setg(errp, "Extended L2 entries are only supported with "
+                       "cluster sizes of at least %d bytes",
+                       1 << QCOW2_EXTL2_MIN_CLUSTER_BITS);
+            ret = -EINVAL;
+            goto out;
+        }
+    }
+
     if (qcow2_opts->data_file_raw && !qcow2_opts->data_file) {
         error_setg(errp, "data-file-raw requires data-file");
         ret = -EINVAL;
@@ -3215,6 +3311,10 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         header->incompatible_features |=
             cpu_to_be64(QCOW2_INCOMPAT_DATA_FILE);
     }
+    if (qcow2_opts->extended_l2) {
+        header->incompatible_features |=
+            cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
+    }
     if (qcow2_opts->data_file_raw) {
         header->autoclear_features |=
             cpu_to_be64(QCOW2_AUTOCLEAR_DATA_FILE_RAW);
@@ -3401,6 +3501,7 @@ static int coroutine_fn qcow2_co_create_opts(const char *filename, QemuOpts *opt
         { BLOCK_OPT_ENCRYPT,            BLOCK_OPT_ENCRYPT_FORMAT },
         { BLOCK_OPT_COMPAT_LEVEL,       "version" },
         { BLOCK_OPT_DATA_FILE_RAW,      "data-file-raw" },
+        { BLOCK_OPT_EXTL2,              "extended-l2" },
         { NULL, NULL },
     };
 
@@ -3532,9 +3633,12 @@ static coroutine_fn int qcow2_co_pwrite_zeroes(BlockDriverState *bs,
         bytes = s->cluster_size;
         nr = s->cluster_size;
         ret = qcow2_get_cluster_offset(bs, offset, &nr, &off);
-        if (ret != QCOW2_CLUSTER_UNALLOCATED &&
-            ret != QCOW2_CLUSTER_ZERO_PLAIN &&
-            ret != QCOW2_CLUSTER_ZERO_ALLOC) {
+        /* Zero clusters are created for whole clusters only */
+        if ((ret != QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN &&
+             ret != QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC &&
+             ret != QCOW2_SUBCLUSTER_ZERO_PLAIN &&
+             ret != QCOW2_SUBCLUSTER_ZERO_ALLOC) ||
+            nr != s->cluster_size) {
             qemu_co_mutex_unlock(&s->lock);
             return -ENOTSUP;
         }
@@ -3602,7 +3706,8 @@ qcow2_co_copy_range_from(BlockDriverState *bs,
         }
 
         switch (ret) {
-        case QCOW2_CLUSTER_UNALLOCATED:
+        case QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN:
+        case QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC:
             if (bs->backing && bs->backing->bs) {
                 int64_t backing_length = bdrv_getlength(bs->backing->bs);
                 if (src_offset >= backing_length) {
@@ -3617,16 +3722,16 @@ qcow2_co_copy_range_from(BlockDriverState *bs,
             }
             break;
 
-        case QCOW2_CLUSTER_ZERO_PLAIN:
-        case QCOW2_CLUSTER_ZERO_ALLOC:
+        case QCOW2_SUBCLUSTER_ZERO_PLAIN:
+        case QCOW2_SUBCLUSTER_ZERO_ALLOC:
             cur_write_flags |= BDRV_REQ_ZERO_WRITE;
             break;
 
-        case QCOW2_CLUSTER_COMPRESSED:
+        case QCOW2_SUBCLUSTER_COMPRESSED:
             ret = -ENOTSUP;
             goto out;
 
-        case QCOW2_CLUSTER_NORMAL:
+        case QCOW2_SUBCLUSTER_NORMAL:
             child = s->data_file;
             copy_offset += offset_into_cluster(s, src_offset);
             if ((copy_offset & 511) != 0) {
@@ -3895,7 +4000,7 @@ static int coroutine_fn qcow2_co_truncate(BlockDriverState *bs, int64_t offset,
          *  preallocation. All that matters is that we will not have to allocate
          *  new refcount structures for them.) */
         nb_new_l2_tables = DIV_ROUND_UP(nb_new_data_clusters,
-                                        s->cluster_size / sizeof(uint64_t));
+                                        s->cluster_size / l2_entry_size(s));
         /* The cluster range may not be aligned to L2 boundaries, so add one L2
          * table for a potential head/tail */
         nb_new_l2_tables++;
@@ -3945,6 +4050,7 @@ static int coroutine_fn qcow2_co_truncate(BlockDriverState *bs, int64_t offset,
                 .offset       = guest_offset,
                 .alloc_offset = host_offset,
                 .nb_clusters  = nb_clusters,
+                .prealloc     = true,
             };
             qemu_co_queue_init(&allocation.dependent_requests);
 
@@ -4012,7 +4118,8 @@ qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
 {
     BDRVQcow2State *s = bs->opaque;
     int ret;
-    ssize_t out_len;
+    int i, nb_clusters;
+    ssize_t *out_len;
     uint8_t *buf, *out_buf;
     uint64_t cluster_offset;
 
@@ -4034,56 +4141,78 @@ qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
         return -EINVAL;
     }
 
-    buf = qemu_blockalign(bs, s->cluster_size);
-    if (bytes != s->cluster_size) {
-        if (bytes > s->cluster_size ||
-            offset + bytes != bs->total_sectors << BDRV_SECTOR_BITS)
-        {
-            qemu_vfree(buf);
-            return -EINVAL;
-        }
-        /* Zero-pad last write if image size is not cluster aligned */
-        memset(buf + bytes, 0, s->cluster_size - bytes);
+    /* Only the last cluster of the image may be written partially */
+    if (offset_into_cluster(s, bytes) &&
+        offset + bytes != bs->total_sectors << BDRV_SECTOR_BITS) {
+        return -EINVAL;
     }
+
+    nb_clusters = size_to_clusters(s, bytes);
+    buf = qemu_try_blockalign(bs, (uint64_t)nb_clusters << s->cluster_bits);
+    out_buf = g_try_malloc((uint64_t)nb_clusters << s->cluster_bits);
+    if (!buf || !out_buf) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+    out_len = g_new(ssize_t, nb_clusters);
+
+    /* Zero-pad last write if image size is not cluster aligned */
+    memset(buf + bytes, 0, ((uint64_t)nb_clusters << s->cluster_bits) - bytes);
     qemu_iovec_to_buf(qiov, 0, buf, bytes);
 
-    out_buf = g_malloc(s->cluster_size);
+    /* The clusters are compressed in parallel by the image thread pool */
+    qcow2_co_compress_clusters(bs, out_buf, buf, nb_clusters, out_len);
+
+    for (i = 0; i < nb_clusters; i++) {
+        uint64_t cluster_start = offset + ((uint64_t)i << s->cluster_bits);
+        uint8_t *cluster_out = out_buf + ((uint64_t)i << s->cluster_bits);
+
+        if (out_len[i] == -ENOMEM) {
+            /* could not compress: write normal cluster */
+            uint64_t cluster_bytes = MIN(s->cluster_size,
+                                         offset + bytes - cluster_start);
+            QEMUIOVector local_qiov;
+
+            qemu_iovec_init_buf(&local_qiov,
+                                buf + ((uint64_t)i << s->cluster_bits),
+                                cluster_bytes);
+            ret = qcow2_co_pwritev(bs, cluster_start, cluster_bytes,
+                                   &local_qiov, 0);
+            if (ret < 0) {
+                goto fail_len;
+            }
+            continue;
+        } else if (out_len[i] < 0) {
+            ret = -EINVAL;
+            goto fail_len;
+        }
 
-    out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
-                                buf, s->cluster_size);
-    if (out_len == -ENOMEM) {
-        /* could not compress: write normal cluster */
-        ret = qcow2_co_pwritev(bs, offset, bytes, qiov, 0);
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_alloc_compressed_cluster_offset(bs, cluster_start,
+                                                    out_len[i],
+                                                    &cluster_offset);
         if (ret < 0) {
-            goto fail;
+            qemu_co_mutex_unlock(&s->lock);
+            goto fail_len;
         }
-        goto success;
-    } else if (out_len < 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
 
-    qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_alloc_compressed_cluster_offset(bs, offset, out_len,
-                                                &cluster_offset);
-    if (ret < 0) {
+        ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len[i],
+                                            true);
         qemu_co_mutex_unlock(&s->lock);
-        goto fail;
-    }
-
-    ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len, true);
-    qemu_co_mutex_unlock(&s->lock);
-    if (ret < 0) {
-        goto fail;
-    }
+        if (ret < 0) {
+            goto fail_len;
+        }
 
-    BLKDBG_EVENT(s->data_file, BLKDBG_WRITE_COMPRESSED);
-    ret = bdrv_co_pwrite(s->data_file, cluster_offset, out_len, out_buf, 0);
-    if (ret < 0) {
-        goto fail;
+        BLKDBG_EVENT(s->data_file, BLKDBG_WRITE_COMPRESSED);
+        ret = bdrv_co_pwrite(s->data_file, cluster_offset, out_len[i],
+                             cluster_out, 0);
+        if (ret < 0) {
+            goto fail_len;
+        }
     }
-success:
     ret = 0;
+fail_len:
+    g_free(out_len);
 fail:
     qemu_vfree(buf);
     g_free(out_buf);
@@ -4412,6 +4541,8 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     PreallocMode prealloc;
     bool has_backing_file;
     bool has_luks;
+    bool extended_l2;
+    size_t l2e_size;
 
     /* Parse image creation options */
     cluster_size = qcow2_opt_get_cluster_size_del(opts, &local_err);
@@ -4429,6 +4560,9 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
         goto err;
     }
 
+    extended_l2 = qemu_opt_get_bool_del(opts, BLOCK_OPT_EXTL2, false);
+    l2e_size = extended_l2 ? L2E_SIZE_EXTENDED : L2E_SIZE_NORMAL;
+
     optstr = qemu_opt_get_del(opts, BLOCK_OPT_PREALLOC);
     prealloc = qapi_enum_parse(&PreallocMode_lookup, optstr,
                                PREALLOC_MODE_OFF, &local_err);
@@ -4460,7 +4594,7 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
 
     /* Check that virtual disk size is valid */
     l2_tables = DIV_ROUND_UP(virtual_size / cluster_size,
-                             cluster_size / sizeof(uint64_t));
+                             cluster_size / l2e_size);
     if (l2_tables * sizeof(uint64_t) > QCOW_MAX_L1_SIZE) {
         error_setg(&local_err, "The image size is too large "
                                "(try using a larger cluster size)");
@@ -4525,7 +4659,8 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     info = g_new(BlockMeasureInfo, 1);
     info->fully_allocated =
         qcow2_calc_prealloc_size(virtual_size, cluster_size,
-                                 ctz32(refcount_bits)) + luks_payload_size;
+                                 ctz32(refcount_bits), extended_l2) +
+        luks_payload_size;
 
     /* Remove data clusters that are not required.  This overestimates the
      * required size because metadata needed for the fully allocated file is
@@ -4597,6 +4732,8 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs,
             .data_file          = g_strdup(s->image_data_file),
             .has_data_file_raw  = has_data_file(bs),
             .data_file_raw      = data_file_is_raw(bs),
+            .has_extended_l2    = has_subclusters(s),
+            .extended_l2        = has_subclusters(s),
         };
     } else {
         /* if this assertion fails, this probably means a new version was
@@ -4627,6 +4764,10 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs,
         spec_info->u.qcow2.data->encrypt = qencrypt;
     }
 
+    spec_info->u.qcow2.data->thread_pool = qcow2_get_thread_pool_info(bs);
+    spec_info->u.qcow2.data->has_thread_pool =
+        !!spec_info->u.qcow2.data->thread_pool;
+
     return spec_info;
 }
 
@@ -4897,6 +5038,12 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                                  "images");
                 return -EINVAL;
             }
+        } else if (!strcmp(desc->name, BLOCK_OPT_EXTL2)) {
+            if (qemu_opt_get_bool(opts, BLOCK_OPT_EXTL2, has_subclusters(s)) !=
+                has_subclusters(s)) {
+                error_setg(errp, "Changing extended_l2 is not supported");
+                return -ENOTSUP;
+            }
         } else {
             /* if this point is reached, this probably means a new option was
              * added without having it covered here */
@@ -4906,6 +5053,12 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
         desc++;
     }
 
+    if (new_version < 3 && has_subclusters(s)) {
+        error_setg(errp, "Images with extended L2 entries require "
+                   "compatibility level 1.1");
+        return -ENOTSUP;
+    }
+
     helper_cb_info = (Qcow2AmendHelperCBInfo){
         .original_status_cb = status_cb,
         .original_cb_opaque = cb_opaque,
@@ -5162,6 +5315,12 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Width of a reference count entry in bits",
             .def_value_str = "16"
         },
+        {
+            .name = BLOCK_OPT_EXTL2,
+            .type = QEMU_OPT_BOOL,
+            .help = "Extended L2 tables (divide clusters into 32 subclusters "
+                    "for allocation)",
+        },
         { /* end of list */ }
     }
 };
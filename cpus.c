@@ -775,19 +775,30 @@ static const VMStateDescription vmstate_timers = {
     }
 };
 
+/* The global throttle applies to every vcpu, on top of its own one */
+static int cpu_throttle_vcpu_effective(CPUState *cpu)
+{
+    return MAX(cpu_throttle_get_percentage(),
+               cpu_throttle_get_vcpu_percentage(cpu));
+}
+
+/*
+ * Every tick lasts long enough for the most throttled vcpu to run for a
+ * whole CPU_THROTTLE_TIMESLICE_NS; each vcpu sleeps for its own
+ * percentage of the tick, which is passed in @opaque.
+ */
 static void cpu_throttle_thread(CPUState *cpu, run_on_cpu_data opaque)
 {
     double pct;
-    double throttle_ratio;
     long sleeptime_ns;
 
-    if (!cpu_throttle_get_percentage()) {
+    pct = (double)cpu_throttle_vcpu_effective(cpu) / 100;
+    if (!pct) {
+        atomic_set(&cpu->throttle_thread_scheduled, 0);
         return;
     }
 
-    pct = (double)cpu_throttle_get_percentage()/100;
-    throttle_ratio = pct / (1 - pct);
-    sleeptime_ns = (long)(throttle_ratio * CPU_THROTTLE_TIMESLICE_NS);
+    sleeptime_ns = (long)(pct * opaque.host_ulong);
 
     qemu_mutex_unlock_iothread();
     g_usleep(sleeptime_ns / 1000); /* Convert ns to us for usleep call */
@@ -798,22 +809,29 @@ static void cpu_throttle_thread(CPUState *cpu, run_on_cpu_data opaque)
 static void cpu_throttle_timer_tick(void *opaque)
 {
     CPUState *cpu;
-    double pct;
+    int pct_max = 0;
+    unsigned long period_ns;
+
+    CPU_FOREACH(cpu) {
+        pct_max = MAX(pct_max, cpu_throttle_vcpu_effective(cpu));
+    }
 
     /* Stop the timer if needed */
-    if (!cpu_throttle_get_percentage()) {
+    if (!pct_max) {
         return;
     }
+
+    period_ns = CPU_THROTTLE_TIMESLICE_NS / (1 - (double)pct_max / 100);
     CPU_FOREACH(cpu) {
-        if (!atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
+        if (cpu_throttle_vcpu_effective(cpu) &&
+            !atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
             async_run_on_cpu(cpu, cpu_throttle_thread,
-                             RUN_ON_CPU_NULL);
+                             RUN_ON_CPU_HOST_ULONG(period_ns));
         }
     }
 
-    pct = (double)cpu_throttle_get_percentage()/100;
     timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
-                                   CPU_THROTTLE_TIMESLICE_NS / (1-pct));
+                                   period_ns);
 }
 
 void cpu_throttle_set(int new_throttle_pct)
@@ -828,9 +846,37 @@ void cpu_throttle_set(int new_throttle_pct)
                                        CPU_THROTTLE_TIMESLICE_NS);
 }
 
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct)
+{
+    if (new_throttle_pct) {
+        new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+        new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
+    }
+
+    atomic_set(&cpu->throttle_percentage, new_throttle_pct);
+
+    if (new_throttle_pct) {
+        timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
+                                           CPU_THROTTLE_TIMESLICE_NS);
+    }
+}
+
+int cpu_throttle_get_vcpu_percentage(CPUState *cpu)
+{
+    return atomic_read(&cpu->throttle_percentage);
+}
+
 void cpu_throttle_stop(void)
 {
+    CPUState *cpu;
+
     atomic_set(&throttle_percentage, 0);
+
+    rcu_read_lock();
+    CPU_FOREACH(cpu) {
+        atomic_set(&cpu->throttle_percentage, 0);
+    }
+    rcu_read_unlock();
 }
 
 bool cpu_throttle_active(void)
@@ -2544,6 +2544,59 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
         }
     }
 }
+
+/*
+ * Back a shared file RAMBlock with @fd instead of its own file, e.g. the
+ * memfd of another QEMU process, at the same host address.  On success
+ * the RAMBlock owns @fd and its previous file is closed.
+ */
+int qemu_ram_remap_fd(RAMBlock *rb, int fd, Error **errp)
+{
+    struct stat st;
+    void *area;
+
+    if (rb->fd < 0 || !(rb->flags & RAM_SHARED) ||
+        (rb->flags & RAM_PREALLOC)) {
+        error_setg(errp, "RAM block %s is not backed by a shared file",
+                   rb->idstr);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) {
+        error_setg_errno(errp, errno, "cannot stat the file of RAM block %s",
+                         rb->idstr);
+        return -1;
+    }
+    if (st.st_size < rb->max_length) {
+        error_setg(errp, "file of RAM block %s is too small: %" PRId64
+                   " < " RAM_ADDR_FMT, rb->idstr, (int64_t)st.st_size,
+                   rb->max_length);
+        return -1;
+    }
+    if (qemu_fd_getpagesize(fd) != rb->page_size) {
+        error_setg(errp, "mismatched page size for RAM block %s: %zu != %zu",
+                   rb->idstr, qemu_fd_getpagesize(fd), rb->page_size);
+        return -1;
+    }
+
+    area = mmap(rb->host, rb->max_length, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, 0);
+    if (area != rb->host) {
+        error_setg_errno(errp, errno, "cannot map the file of RAM block %s",
+                         rb->idstr);
+        return -1;
+    }
+    qemu_ram_setup_dump(rb->host, rb->max_length);
+
+    close(rb->fd);
+    rb->fd = fd;
+    return 0;
+}
+#else
+int qemu_ram_remap_fd(RAMBlock *rb, int fd, Error **errp)
+{
+    error_setg(errp, "RAM blocks cannot be remapped on this host");
+    return -1;
+}
 #endif /* !_WIN32 */
 
 /* Return a host pointer to ram allocated with qemu_ram_alloc.
@@ -608,6 +608,20 @@ STEXI
 @item info migrate_cache_size
 @findex info migrate_cache_size
 Show current migration xbzrle cache size.
+ETEXI
+
+    {
+        .name       = "dirty_rate",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show dirty page rate information",
+        .cmd        = hmp_info_dirty_rate,
+    },
+
+STEXI
+@item info dirty_rate
+@findex info dirty_rate
+Show the result of the last dirty page rate measurement.
 ETEXI
 
     {
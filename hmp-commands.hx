@@ -1059,6 +1059,26 @@ STEXI
 @item migrate_pause
 @findex migrate_pause
 Pause an ongoing migration.  Currently it only supports postcopy.
+ETEXI
+
+    {
+        .name       = "calc_dirty_rate",
+        .args_type  = "dirty_bitmap:-b,second:l,sample_pages:l?",
+        .params     = "[-b] second [sample_pages]",
+        .help       = "start measuring the guest dirty page rate over "
+                      "'second' seconds (use -b to count dirty pages with "
+                      "dirty logging instead of sampling)",
+        .cmd        = hmp_calc_dirty_rate,
+    },
+
+STEXI
+@item calc_dirty_rate [-b] @var{second} [@var{sample_pages}]
+@findex calc_dirty_rate
+Start measuring the guest dirty page rate over @var{second} seconds, by
+hashing @var{sample_pages} random pages per GiB of guest memory.  With
+@option{-b}, enable dirty logging for the duration of the measurement and
+count the dirtied pages instead.  Use @code{info dirty_rate} to see the
+result.
 ETEXI
 
     {
@@ -38,6 +38,7 @@
 #include "qapi/qapi-commands-run-state.h"
 #include "qapi/qapi-commands-tpm.h"
 #include "qapi/qapi-commands-ui.h"
+#include "qapi/qapi-visit-migration.h"
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/string-input-visitor.h"
@@ -225,6 +226,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "expected downtime: %" PRIu64 " milliseconds\n",
                            info->expected_downtime);
         }
+        if (info->has_expected_converge_time) {
+            monitor_printf(mon, "expected converge time: %" PRIu64
+                           " milliseconds\n", info->expected_converge_time);
+        }
         if (info->has_downtime) {
             monitor_printf(mon, "downtime: %" PRIu64 " milliseconds\n",
                            info->downtime);
@@ -260,6 +265,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->multifd_bytes >> 10);
         monitor_printf(mon, "pages-per-second: %" PRIu64 "\n",
                        info->ram->pages_per_second);
+        monitor_printf(mon, "dirty sync BQL time: %" PRIu64 " us"
+                       " (max %" PRIu64 " us)\n",
+                       info->ram->dirty_sync_bql_time,
+                       info->ram->dirty_sync_bql_time_max);
 
         if (info->ram->dirty_pages_rate) {
             monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages\n",
@@ -293,6 +302,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss_rate);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
+        monitor_printf(mon, "xbzrle cache eviction: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_eviction);
     }
 
     if (info->has_compression) {
@@ -328,6 +341,16 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
         g_free(str);
         visit_free(v);
     }
+    if (info->has_vcpu_throttle_percentage) {
+        Visitor *v;
+        char *str;
+        v = string_output_visitor_new(false, &str);
+        visit_type_intList(v, NULL, &info->vcpu_throttle_percentage, NULL);
+        visit_complete(v, &str);
+        monitor_printf(mon, "vcpu throttle percentage: %s\n", str);
+        g_free(str);
+        visit_free(v);
+    }
     if (info->has_socket_address) {
         SocketAddressList *addr;
 
@@ -435,6 +458,30 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %u\n",
             MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_CHANNELS),
             params->multifd_channels);
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_COMPRESSION),
+            MultiFDCompression_str(params->multifd_compression));
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_ZLIB_LEVEL),
+            params->multifd_zlib_level);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_ZSTD_LEVEL),
+            params->multifd_zstd_level);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_BITMAP_SYNC_THREADS),
+            params->bitmap_sync_threads);
+        monitor_printf(mon, "%s: %" PRIu64 " bytes\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_PACKET_SIZE),
+            params->multifd_packet_size);
+        monitor_printf(mon, "%s: %" PRIu64 " bytes\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_POSTCOPY_PREFETCH_SIZE),
+            params->postcopy_prefetch_size);
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_ZERO_PAGE_DETECTION),
+            ZeroPageDetection_str(params->zero_page_detection));
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_VMSTATE_THREADS),
+            params->vmstate_threads);
         monitor_printf(mon, "%s: %" PRIu64 "\n",
             MigrationParameter_str(MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE),
             params->xbzrle_cache_size);
@@ -455,6 +502,43 @@ void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    DirtyRateInfo *info;
+    DirtyRateBlockList *block;
+    DirtyRateVcpuList *vcpu;
+    Error *err = NULL;
+
+    info = qmp_query_dirty_rate(&err);
+    if (err) {
+        hmp_handle_error(mon, &err);
+        return;
+    }
+
+    monitor_printf(mon, "Status: %s\n", DirtyRateStatus_str(info->status));
+    monitor_printf(mon, "Mode: %s\n", DirtyRateMeasureMode_str(info->mode));
+    monitor_printf(mon, "Start time: %" PRId64 " s\n", info->start_time);
+    monitor_printf(mon, "Period: %" PRId64 " s\n", info->calc_time);
+    if (info->has_sample_pages) {
+        monitor_printf(mon, "Sample pages: %" PRIu64 " per GiB\n",
+                       info->sample_pages);
+    }
+    if (info->has_dirty_rate) {
+        monitor_printf(mon, "Dirty rate: %" PRId64 " MB/s\n",
+                       info->dirty_rate);
+    }
+    for (block = info->blocks; block; block = block->next) {
+        monitor_printf(mon, "  block %s: %" PRId64 " MB/s\n",
+                       block->value->id, block->value->dirty_rate);
+    }
+    for (vcpu = info->vcpus; vcpu; vcpu = vcpu->next) {
+        monitor_printf(mon, "  vcpu %" PRId64 ": %" PRId64 " MB/s\n",
+                       vcpu->value->id, vcpu->value->dirty_rate);
+    }
+
+    qapi_free_DirtyRateInfo(info);
+}
+
 void hmp_info_cpus(Monitor *mon, const QDict *qdict)
 {
     CpuInfoFastList *cpu_list, *cpu;
@@ -1681,6 +1765,28 @@ void hmp_migrate_pause(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, &err);
 }
 
+void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    bool dirty_bitmap = qdict_get_try_bool(qdict, "dirty_bitmap", false);
+    int64_t sec = qdict_get_int(qdict, "second");
+    bool has_sample_pages = qdict_haskey(qdict, "sample_pages");
+    int64_t sample_pages = qdict_get_try_int(qdict, "sample_pages", 0);
+    Error *err = NULL;
+
+    qmp_calc_dirty_rate(sec, has_sample_pages, sample_pages, true,
+                        dirty_bitmap ? DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP :
+                                       DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING,
+                        &err);
+    if (err) {
+        hmp_handle_error(mon, &err);
+        return;
+    }
+
+    monitor_printf(mon, "Started measuring the dirty page rate for %" PRId64
+                   " seconds, use \"info dirty_rate\" to see the result\n",
+                   sec);
+}
+
 /* Kept for backwards compatibility */
 void hmp_migrate_set_downtime(Monitor *mon, const QDict *qdict)
 {
@@ -1821,6 +1927,39 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_multifd_channels = true;
         visit_type_int(v, param, &p->multifd_channels, &err);
         break;
+    case MIGRATION_PARAMETER_MULTIFD_COMPRESSION:
+        p->has_multifd_compression = true;
+        visit_type_MultiFDCompression(v, param, &p->multifd_compression,
+                                      &err);
+        break;
+    case MIGRATION_PARAMETER_MULTIFD_ZLIB_LEVEL:
+        p->has_multifd_zlib_level = true;
+        visit_type_uint8(v, param, &p->multifd_zlib_level, &err);
+        break;
+    case MIGRATION_PARAMETER_MULTIFD_ZSTD_LEVEL:
+        p->has_multifd_zstd_level = true;
+        visit_type_uint8(v, param, &p->multifd_zstd_level, &err);
+        break;
+    case MIGRATION_PARAMETER_BITMAP_SYNC_THREADS:
+        p->has_bitmap_sync_threads = true;
+        visit_type_uint8(v, param, &p->bitmap_sync_threads, &err);
+        break;
+    case MIGRATION_PARAMETER_MULTIFD_PACKET_SIZE:
+        p->has_multifd_packet_size = true;
+        visit_type_size(v, param, &p->multifd_packet_size, &err);
+        break;
+    case MIGRATION_PARAMETER_POSTCOPY_PREFETCH_SIZE:
+        p->has_postcopy_prefetch_size = true;
+        visit_type_size(v, param, &p->postcopy_prefetch_size, &err);
+        break;
+    case MIGRATION_PARAMETER_ZERO_PAGE_DETECTION:
+        p->has_zero_page_detection = true;
+        visit_type_ZeroPageDetection(v, param, &p->zero_page_detection, &err);
+        break;
+    case MIGRATION_PARAMETER_VMSTATE_THREADS:
+        p->has_vmstate_threads = true;
+        visit_type_uint8(v, param, &p->vmstate_threads, &err);
+        break;
     case MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE:
         p->has_xbzrle_cache_size = true;
         visit_type_size(v, param, &cache_size, &err);
@@ -25,14 +25,21 @@
 #include "hw/virtio/virtio-bus.h"
 #include "qom/object_interfaces.h"
 
+/* An AioContext that processes some of the virtqueues */
+typedef struct VirtIOBlockDataPlaneThread {
+    VirtIOBlockDataPlane *s;
+    IOThread *iothread;             /* NULL for the main loop */
+    AioContext *ctx;
+    QEMUBH *bh;                     /* bh for guest notification */
+    unsigned long *batch_notify_vqs;
+} VirtIOBlockDataPlaneThread;
+
 struct VirtIOBlockDataPlane {
     bool starting;
     bool stopping;
 
     VirtIOBlkConf *conf;
     VirtIODevice *vdev;
-    QEMUBH *bh;                     /* bh for guest notification */
-    unsigned long *batch_notify_vqs;
     bool batch_notifications;
 
     /* Note that these EventNotifiers are assigned by value.  This is
@@ -40,16 +47,37 @@ struct VirtIOBlockDataPlane {
      * (because you don't own the file descriptor or handle; you just
      * use it).
      */
-    IOThread *iothread;
+
+    /* Virtqueue i is processed by threads[i % nr_vq_threads] */
+    VirtIOBlockDataPlaneThread *threads;
+    unsigned nr_threads;
+    unsigned nr_vq_threads;
+
+    /* AioContext of the BlockBackend, the one of threads[0] */
     AioContext *ctx;
 };
 
+static VirtIOBlockDataPlaneThread *vq_thread(VirtIOBlockDataPlane *s,
+                                             VirtQueue *vq)
+{
+    return &s->threads[virtio_get_queue_index(vq) % s->nr_vq_threads];
+}
+
+/* The AioContext that processes @vq, its lock protects the virtqueue */
+AioContext *virtio_blk_data_plane_get_aio_context(VirtIOBlockDataPlane *s,
+                                                  VirtQueue *vq)
+{
+    return vq_thread(s, vq)->ctx;
+}
+
 /* Raise an interrupt to signal guest, if necessary */
 void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq)
 {
     if (s->batch_notifications) {
-        set_bit(virtio_get_queue_index(vq), s->batch_notify_vqs);
-        qemu_bh_schedule(s->bh);
+        VirtIOBlockDataPlaneThread *t = vq_thread(s, vq);
+
+        set_bit(virtio_get_queue_index(vq), t->batch_notify_vqs);
+        qemu_bh_schedule(t->bh);
     } else {
         virtio_notify_irqfd(s->vdev, vq);
     }
@@ -57,13 +85,17 @@ void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq)
 
 static void notify_guest_bh(void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockDataPlaneThread *t = opaque;
+    VirtIOBlockDataPlane *s = t->s;
     unsigned nvqs = s->conf->num_queues;
     unsigned long bitmap[BITS_TO_LONGS(nvqs)];
     unsigned j;
 
-    memcpy(bitmap, s->batch_notify_vqs, sizeof(bitmap));
-    memset(s->batch_notify_vqs, 0, sizeof(bitmap));
+    /* Requests restarted after an error can complete in another thread */
+    aio_context_acquire(t->ctx);
+    memcpy(bitmap, t->batch_notify_vqs, sizeof(bitmap));
+    memset(t->batch_notify_vqs, 0, sizeof(bitmap));
+    aio_context_release(t->ctx);
 
     for (j = 0; j < nvqs; j += BITS_PER_LONG) {
         unsigned long bits = bitmap[j];
@@ -79,6 +111,51 @@ static void notify_guest_bh(void *opaque)
     }
 }
 
+/*
+ * Look up the IOThreads of the iothreads property, a colon separated list
+ * of ids.  Returns the number of IOThreads, or -1 on error.
+ */
+static int virtio_blk_parse_iothreads(VirtIOBlkConf *conf,
+                                      IOThread ***iothreads, Error **errp)
+{
+    gchar **ids;
+    int i, n;
+
+    if (conf->iothread) {
+        error_setg(errp, "iothread and iothreads are mutually exclusive");
+        return -1;
+    }
+
+    ids = g_strsplit(conf->iothreads, ":", 0);
+    n = g_strv_length(ids);
+    if (n == 0) {
+        error_setg(errp, "iothreads must list at least one iothread");
+        goto fail;
+    }
+    if (n > conf->num_queues) {
+        error_setg(errp, "iothreads lists %d iothreads but there are only "
+                   "%" PRIu16 " queues", n, conf->num_queues);
+        goto fail;
+    }
+
+    *iothreads = g_new(IOThread *, n);
+    for (i = 0; i < n; i++) {
+        (*iothreads)[i] = iothread_by_id(ids[i]);
+        if (!(*iothreads)[i]) {
+            error_setg(errp, "iothread '%s' not found", ids[i]);
+            g_free(*iothreads);
+            goto fail;
+        }
+    }
+
+    g_strfreev(ids);
+    return n;
+
+fail:
+    g_strfreev(ids);
+    return -1;
+}
+
 /* Context: QEMU global mutex held */
 bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
                                   VirtIOBlockDataPlane **dataplane,
@@ -87,19 +164,33 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     VirtIOBlockDataPlane *s;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    IOThread **iothreads = NULL;
+    int nr_iothreads = 0;
+    unsigned i;
 
     *dataplane = NULL;
 
-    if (conf->iothread) {
+    if (conf->iothreads) {
+        nr_iothreads = virtio_blk_parse_iothreads(conf, &iothreads, errp);
+        if (nr_iothreads < 0) {
+            return false;
+        }
+    } else if (conf->iothread) {
+        nr_iothreads = 1;
+        iothreads = g_new(IOThread *, 1);
+        iothreads[0] = conf->iothread;
+    }
+
+    if (nr_iothreads) {
         if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
             error_setg(errp,
                        "device is incompatible with iothread "
                        "(transport does not support notifiers)");
-            return false;
+            goto fail;
         }
         if (!virtio_device_ioeventfd_enabled(vdev)) {
             error_setg(errp, "ioeventfd is required for iothread");
-            return false;
+            goto fail;
         }
 
         /* If dataplane is (re-)enabled while the guest is running there could
@@ -107,11 +198,12 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
          */
         if (blk_op_is_blocked(conf->conf.blk, BLOCK_OP_TYPE_DATAPLANE, errp)) {
             error_prepend(errp, "cannot start virtio-blk dataplane: ");
-            return false;
+            goto fail;
         }
     }
     /* Don't try if transport does not support notifiers. */
     if (!virtio_device_ioeventfd_enabled(vdev)) {
+        g_free(iothreads);
         return false;
     }
 
@@ -119,25 +211,40 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     s->vdev = vdev;
     s->conf = conf;
 
-    if (conf->iothread) {
-        s->iothread = conf->iothread;
-        object_ref(OBJECT(s->iothread));
-        s->ctx = iothread_get_aio_context(s->iothread);
-    } else {
-        s->ctx = qemu_get_aio_context();
+    s->nr_threads = MAX(nr_iothreads, 1);
+    s->nr_vq_threads = s->nr_threads;
+    s->threads = g_new0(VirtIOBlockDataPlaneThread, s->nr_threads);
+    for (i = 0; i < s->nr_threads; i++) {
+        VirtIOBlockDataPlaneThread *t = &s->threads[i];
+
+        t->s = s;
+        if (nr_iothreads) {
+            t->iothread = iothreads[i];
+            object_ref(OBJECT(t->iothread));
+            t->ctx = iothread_get_aio_context(t->iothread);
+        } else {
+            t->ctx = qemu_get_aio_context();
+        }
+        t->bh = aio_bh_new(t->ctx, notify_guest_bh, t);
+        t->batch_notify_vqs = bitmap_new(conf->num_queues);
     }
-    s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
-    s->batch_notify_vqs = bitmap_new(conf->num_queues);
+    s->ctx = s->threads[0].ctx;
+    g_free(iothreads);
 
     *dataplane = s;
 
     return true;
+
+fail:
+    g_free(iothreads);
+    return false;
 }
 
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
     VirtIOBlock *vblk;
+    unsigned i;
 
     if (!s) {
         return;
@@ -145,11 +252,16 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 
     vblk = VIRTIO_BLK(s->vdev);
     assert(!vblk->dataplane_started);
-    g_free(s->batch_notify_vqs);
-    qemu_bh_delete(s->bh);
-    if (s->iothread) {
-        object_unref(OBJECT(s->iothread));
+    for (i = 0; i < s->nr_threads; i++) {
+        VirtIOBlockDataPlaneThread *t = &s->threads[i];
+
+        g_free(t->batch_notify_vqs);
+        qemu_bh_delete(t->bh);
+        if (t->iothread) {
+            object_unref(OBJECT(t->iothread));
+        }
     }
+    g_free(s->threads);
     g_free(s);
 }
 
@@ -219,6 +331,25 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
         goto fail_guest_notifiers;
     }
 
+    /* The other iothreads submit requests to the BlockBackend directly */
+    s->nr_vq_threads = s->nr_threads;
+    aio_context_acquire(s->ctx);
+    for (i = 1; i < s->nr_threads; i++) {
+        if (blk_attach_queue_context(s->conf->conf.blk, s->threads[i].ctx,
+                                     &local_err) < 0) {
+            warn_reportf_err(local_err, "virtio-blk processes all queues in "
+                             "the first iothread: ");
+            local_err = NULL;
+            while (--i > 0) {
+                blk_detach_queue_context(s->conf->conf.blk,
+                                         s->threads[i].ctx);
+            }
+            s->nr_vq_threads = 1;
+            break;
+        }
+    }
+    aio_context_release(s->ctx);
+
     /* Kick right away to begin processing requests already in vring */
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
@@ -227,14 +358,15 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        AioContext *ctx = vq_thread(s, vq)->ctx;
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx,
+        aio_context_acquire(ctx);
+        virtio_queue_aio_set_host_notifier_handler(vq, ctx,
                 virtio_blk_data_plane_handle_output);
+        aio_context_release(ctx);
     }
-    aio_context_release(s->ctx);
     return 0;
 
   fail_guest_notifiers:
@@ -250,13 +382,16 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
  */
 static void virtio_blk_data_plane_stop_bh(void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockDataPlaneThread *t = opaque;
+    VirtIOBlockDataPlane *s = t->s;
     unsigned i;
 
     for (i = 0; i < s->conf->num_queues; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
+        if (vq_thread(s, vq) == t) {
+            virtio_queue_aio_set_host_notifier_handler(vq, t->ctx, NULL);
+        }
     }
 }
 
@@ -283,8 +418,18 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
+    for (i = 0; i < s->nr_vq_threads; i++) {
+        VirtIOBlockDataPlaneThread *t = &s->threads[i];
+
+        aio_context_acquire(t->ctx);
+        aio_wait_bh_oneshot(t->ctx, virtio_blk_data_plane_stop_bh, t);
+        aio_context_release(t->ctx);
+    }
+
     aio_context_acquire(s->ctx);
-    aio_wait_bh_oneshot(s->ctx, virtio_blk_data_plane_stop_bh, s);
+    for (i = 1; i < s->nr_vq_threads; i++) {
+        blk_detach_queue_context(s->conf->conf.blk, s->threads[i].ctx);
+    }
 
     /* Drain and try to switch bs back to the QEMU main loop. If other users
      * keep the BlockBackend in the iothread, that's ok */
@@ -67,6 +67,19 @@ static void virtio_blk_free_request(VirtIOBlockReq *req)
     g_free(req);
 }
 
+/*
+ * The AioContext that processes @vq.  Its lock protects the virtqueue, it
+ * is the AioContext of the BlockBackend unless the dataplane spreads the
+ * virtqueues over several iothreads.
+ */
+static AioContext *virtio_blk_vq_aio_context(VirtIOBlock *s, VirtQueue *vq)
+{
+    if (s->dataplane_started && !s->dataplane_disabled) {
+        return virtio_blk_data_plane_get_aio_context(s->dataplane, vq);
+    }
+    return blk_get_aio_context(s->blk);
+}
+
 static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
 {
     VirtIOBlock *s = req->dev;
@@ -93,8 +106,10 @@ static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
         /* Break the link as the next request is going to be parsed from the
          * ring again. Otherwise we may end up doing a double completion! */
         req->mr_next = NULL;
+        qemu_mutex_lock(&s->rq_lock);
         req->next = s->rq;
         s->rq = req;
+        qemu_mutex_unlock(&s->rq_lock);
     } else if (action == BLOCK_ERROR_ACTION_REPORT) {
         virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
         if (acct_failed) {
@@ -113,12 +128,16 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
     VirtIOBlock *s = next->dev;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
 
-    aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
     while (next) {
         VirtIOBlockReq *req = next;
+        AioContext *ctx = virtio_blk_vq_aio_context(s, req->vq);
+
         next = req->mr_next;
         trace_virtio_blk_rw_complete(vdev, req, ret);
 
+        /* Restarted requests of different virtqueues can be merged */
+        aio_context_acquire(ctx);
+
         if (req->qiov.nalloc != -1) {
             /* If nalloc is != -1 req->qiov is a local copy of the original
              * external iovec. It was allocated in submit_requests to be
@@ -138,6 +157,7 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
              * happen on the other side of the migration).
              */
             if (virtio_blk_handle_rw_error(req, -ret, is_read, true)) {
+                aio_context_release(ctx);
                 continue;
             }
         }
@@ -145,16 +165,17 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
         virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
         block_acct_done(blk_get_stats(s->blk), &req->acct);
         virtio_blk_free_request(req);
+        aio_context_release(ctx);
     }
-    aio_context_release(blk_get_aio_context(s->conf.conf.blk));
 }
 
 static void virtio_blk_flush_complete(void *opaque, int ret)
 {
     VirtIOBlockReq *req = opaque;
     VirtIOBlock *s = req->dev;
+    AioContext *ctx = virtio_blk_vq_aio_context(s, req->vq);
 
-    aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
+    aio_context_acquire(ctx);
     if (ret) {
         if (virtio_blk_handle_rw_error(req, -ret, 0, true)) {
             goto out;
@@ -166,17 +187,18 @@ static void virtio_blk_flush_complete(void *opaque, int ret)
     virtio_blk_free_request(req);
 
 out:
-    aio_context_release(blk_get_aio_context(s->conf.conf.blk));
+    aio_context_release(ctx);
 }
 
 static void virtio_blk_discard_write_zeroes_complete(void *opaque, int ret)
 {
     VirtIOBlockReq *req = opaque;
     VirtIOBlock *s = req->dev;
+    AioContext *ctx = virtio_blk_vq_aio_context(s, req->vq);
     bool is_write_zeroes = (virtio_ldl_p(VIRTIO_DEVICE(s), &req->out.type) &
                             ~VIRTIO_BLK_T_BARRIER) == VIRTIO_BLK_T_WRITE_ZEROES;
 
-    aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
+    aio_context_acquire(ctx);
     if (ret) {
         if (virtio_blk_handle_rw_error(req, -ret, false, is_write_zeroes)) {
             goto out;
@@ -190,7 +212,7 @@ static void virtio_blk_discard_write_zeroes_complete(void *opaque, int ret)
     virtio_blk_free_request(req);
 
 out:
-    aio_context_release(blk_get_aio_context(s->conf.conf.blk));
+    aio_context_release(ctx);
 }
 
 #ifdef __linux__
@@ -208,6 +230,7 @@ static void virtio_blk_ioctl_complete(void *opaque, int status)
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
     struct virtio_scsi_inhdr *scsi;
     struct sg_io_hdr *hdr;
+    AioContext *ctx;
 
     scsi = (void *)req->elem.in_sg[req->elem.in_num - 2].iov_base;
 
@@ -237,10 +260,11 @@ static void virtio_blk_ioctl_complete(void *opaque, int status)
     virtio_stl_p(vdev, &scsi->data_len, hdr->dxfer_len);
 
 out:
-    aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
+    ctx = virtio_blk_vq_aio_context(s, req->vq);
+    aio_context_acquire(ctx);
     virtio_blk_req_complete(req, status);
     virtio_blk_free_request(req);
-    aio_context_release(blk_get_aio_context(s->conf.conf.blk));
+    aio_context_release(ctx);
     g_free(ioctl_req);
 }
 
@@ -760,8 +784,9 @@ bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
     VirtIOBlockReq *req;
     MultiReqBuffer mrb = {};
     bool progress = false;
+    AioContext *ctx = virtio_blk_vq_aio_context(s, vq);
 
-    aio_context_acquire(blk_get_aio_context(s->blk));
+    aio_context_acquire(ctx);
     blk_io_plug(s->blk);
 
     do {
@@ -784,7 +809,7 @@ bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
     }
 
     blk_io_unplug(s->blk);
-    aio_context_release(blk_get_aio_context(s->blk));
+    aio_context_release(ctx);
     return progress;
 }
 
@@ -812,18 +837,30 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 static void virtio_blk_dma_restart_bh(void *opaque)
 {
     VirtIOBlock *s = opaque;
-    VirtIOBlockReq *req = s->rq;
+    VirtIOBlockReq *req;
     MultiReqBuffer mrb = {};
 
     qemu_bh_delete(s->bh);
     s->bh = NULL;
 
+    qemu_mutex_lock(&s->rq_lock);
+    req = s->rq;
     s->rq = NULL;
+    qemu_mutex_unlock(&s->rq_lock);
 
     aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
     while (req) {
         VirtIOBlockReq *next = req->next;
-        if (virtio_blk_handle_request(req, &mrb)) {
+        AioContext *vq_ctx = virtio_blk_vq_aio_context(s, req->vq);
+        int ret;
+
+        /*
+         * The virtqueue may belong to another iothread, see
+         * virtio_blk_data_plane_get_aio_context()
+         */
+        aio_context_acquire(vq_ctx);
+        ret = virtio_blk_handle_request(req, &mrb);
+        if (ret) {
             /* Device is now broken and won't do any processing until it gets
              * reset. Already queued requests will be lost: let's purge them.
              */
@@ -833,6 +870,9 @@ static void virtio_blk_dma_restart_bh(void *opaque)
                 virtio_blk_free_request(req);
                 req = next;
             }
+        }
+        aio_context_release(vq_ctx);
+        if (ret) {
             break;
         }
         req = next;
@@ -1164,6 +1204,7 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     virtio_init(vdev, "virtio-blk", VIRTIO_ID_BLOCK, s->config_size);
 
     s->blk = conf->conf.blk;
+    qemu_mutex_init(&s->rq_lock);
     s->rq = NULL;
     s->sector_mask = (s->conf.conf.logical_block_size / BDRV_SECTOR_SIZE) - 1;
 
@@ -1173,6 +1214,7 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     virtio_blk_data_plane_create(vdev, conf, &s->dataplane, &err);
     if (err != NULL) {
         error_propagate(errp, err);
+        qemu_mutex_destroy(&s->rq_lock);
         virtio_cleanup(vdev);
         return;
     }
@@ -1193,6 +1235,7 @@ static void virtio_blk_device_unrealize(DeviceState *dev, Error **errp)
     s->dataplane = NULL;
     qemu_del_vm_change_state_handler(s->change);
     blockdev_mark_auto_del(s->blk);
+    qemu_mutex_destroy(&s->rq_lock);
     virtio_cleanup(vdev);
 }
 
@@ -1232,6 +1275,7 @@ static Property virtio_blk_properties[] = {
     DEFINE_PROP_UINT16("queue-size", VirtIOBlock, conf.queue_size, 128),
     DEFINE_PROP_LINK("iothread", VirtIOBlock, conf.iothread, TYPE_IOTHREAD,
                      IOThread *),
+    DEFINE_PROP_STRING("iothreads", VirtIOBlock, conf.iothreads),
     DEFINE_PROP_BIT64("discard", VirtIOBlock, host_features,
                       VIRTIO_BLK_F_DISCARD, true),
     DEFINE_PROP_BIT64("write-zeroes", VirtIOBlock, host_features,
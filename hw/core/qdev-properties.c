@@ -11,6 +11,7 @@
 #include "qapi/visitor.h"
 #include "chardev/char.h"
 #include "qemu/uuid.h"
+#include "qapi/qapi-types-migration.h"
 
 void qdev_prop_set_after_realize(DeviceState *dev, const char *name,
                                   Error **errp)
@@ -606,6 +607,34 @@ const PropertyInfo qdev_prop_losttickpolicy = {
     .set_default_value = set_default_value_enum,
 };
 
+/* --- multifd compression method --- */
+
+QEMU_BUILD_BUG_ON(sizeof(MultiFDCompression) != sizeof(int));
+
+const PropertyInfo qdev_prop_multifd_compression = {
+    .name = "MultiFDCompression",
+    .description = "multifd_compression values, "
+                   "none/zlib/zstd",
+    .enum_table = &MultiFDCompression_lookup,
+    .get = get_enum,
+    .set = set_enum,
+    .set_default_value = set_default_value_enum,
+};
+
+/* --- zero page detection --- */
+
+QEMU_BUILD_BUG_ON(sizeof(ZeroPageDetection) != sizeof(int));
+
+const PropertyInfo qdev_prop_zero_page_detection = {
+    .name = "ZeroPageDetection",
+    .description = "zero_page_detection values, "
+                   "none/legacy/multifd",
+    .enum_table = &ZeroPageDetection_lookup,
+    .get = get_enum,
+    .set = set_enum,
+    .set_default_value = set_default_value_enum,
+};
+
 /* --- Block device error handling policy --- */
 
 QEMU_BUILD_BUG_ON(sizeof(BlockdevOnError) != sizeof(int));
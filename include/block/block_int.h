@@ -58,6 +58,7 @@
 #define BLOCK_OPT_REFCOUNT_BITS     "refcount_bits"
 #define BLOCK_OPT_DATA_FILE         "data_file"
 #define BLOCK_OPT_DATA_FILE_RAW     "data_file_raw"
+#define BLOCK_OPT_EXTL2             "extended_l2"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
@@ -120,6 +121,14 @@ struct BlockDriver {
     /* Set if a driver can support backing files */
     bool supports_backing;
 
+    /*
+     * Set if requests can be submitted from several AioContexts at once,
+     * see bdrv_attach_queue_context().  Everything the driver does for a
+     * request must then be thread-safe or kept in the AioContext that the
+     * request runs in.
+     */
+    bool supports_multiqueue;
+
     /* For handling image reopen for split or non-split files */
     int (*bdrv_reopen_prepare)(BDRVReopenState *reopen_state,
                                BlockReopenQueue *queue, Error **errp);
@@ -436,6 +445,17 @@ struct BlockDriver {
     void (*bdrv_attach_aio_context)(BlockDriverState *bs,
                                     AioContext *new_context);
 
+    /*
+     * Prepare for requests submitted from @ctx in addition to the AioContext
+     * of @bs, e.g. by setting up per-AioContext submission queues.  Only
+     * called for drivers that set supports_multiqueue, with @bs drained,
+     * when @ctx is attached the first time.  bdrv_detach_queue_context is
+     * called when its last user is gone.
+     */
+    int (*bdrv_attach_queue_context)(BlockDriverState *bs, AioContext *ctx,
+                                     Error **errp);
+    void (*bdrv_detach_queue_context)(BlockDriverState *bs, AioContext *ctx);
+
     /* io queue for linux-aio */
     void (*bdrv_io_plug)(BlockDriverState *bs);
     void (*bdrv_io_unplug)(BlockDriverState *bs);
@@ -618,6 +638,13 @@ typedef struct BlockLimits {
 
 typedef struct BdrvOpBlocker BdrvOpBlocker;
 
+typedef struct BdrvQueueContext {
+    AioContext *ctx;
+    /* number of bdrv_attach_queue_context() calls for @ctx */
+    unsigned int refcnt;
+    QLIST_ENTRY(BdrvQueueContext) next;
+} BdrvQueueContext;
+
 typedef struct BdrvAioNotifier {
     void (*attached_aio_context)(AioContext *new_context, void *opaque);
     void (*detach_aio_context)(void *opaque);
@@ -760,6 +787,11 @@ struct BlockDriverState {
      * regarding this BDS's context */
     QLIST_HEAD(, BdrvAioNotifier) aio_notifiers;
     bool walking_aio_notifiers; /* to make removal during iteration safe */
+    /*
+     * AioContexts other than aio_context that submit requests, only changed
+     * while the node is drained
+     */
+    QLIST_HEAD(, BdrvQueueContext) queue_contexts;
 
     char filename[PATH_MAX];
     char backing_file[PATH_MAX]; /* if non zero, the image is a diff of
@@ -51,6 +51,14 @@ struct RAMBlock {
     unsigned long *unsentmap;
     /* bitmap of already received pages in postcopy */
     unsigned long *receivedmap;
+    /*
+     * mapped-ram: where the bitmap of the pages present in the file and
+     * the pages themselves start in the migration file, and that bitmap
+     * while saving
+     */
+    uint64_t bitmap_offset;
+    uint64_t pages_offset;
+    unsigned long *file_bmap;
 };
 
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
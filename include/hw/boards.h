@@ -246,6 +246,7 @@ struct MachineState {
     bool kernel_irqchip_required;
     bool kernel_irqchip_split;
     int kvm_shadow_mem;
+    uint32_t kvm_dirty_ring_size;
     char *dtb;
     char *dumpdtb;
     int phandle_start;
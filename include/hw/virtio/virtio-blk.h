@@ -34,6 +34,7 @@ struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    char *iothreads;
     char *serial;
     uint32_t request_merging;
     uint16_t num_queues;
@@ -48,6 +49,7 @@ struct VirtIOBlockReq;
 typedef struct VirtIOBlock {
     VirtIODevice parent_obj;
     BlockBackend *blk;
+    QemuMutex rq_lock;              /* protects rq */
     void *rq;
     QEMUBH *bh;
     VirtIOBlkConf conf;
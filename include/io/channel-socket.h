@@ -48,6 +48,10 @@ struct QIOChannelSocket {
     socklen_t localAddrLen;
     struct sockaddr_storage remoteAddr;
     socklen_t remoteAddrLen;
+    /* number of sendmsg() calls issued with MSG_ZEROCOPY */
+    ssize_t zero_copy_queued;
+    /* number of those the kernel has reported as completed */
+    ssize_t zero_copy_sent;
 };
 
 
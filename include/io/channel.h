@@ -38,12 +38,16 @@ typedef struct QIOChannelClass QIOChannelClass;
 
 #define QIO_CHANNEL_ERR_BLOCK -2
 
+#define QIO_CHANNEL_WRITE_FLAG_ZERO_COPY 0x1
+
 typedef enum QIOChannelFeature QIOChannelFeature;
 
 enum QIOChannelFeature {
     QIO_CHANNEL_FEATURE_FD_PASS,
     QIO_CHANNEL_FEATURE_SHUTDOWN,
     QIO_CHANNEL_FEATURE_LISTEN,
+    QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY,
+    QIO_CHANNEL_FEATURE_SEEKABLE,
 };
 
 
@@ -109,6 +113,7 @@ struct QIOChannelClass {
                          size_t niov,
                          int *fds,
                          size_t nfds,
+                         int flags,
                          Error **errp);
     ssize_t (*io_readv)(QIOChannel *ioc,
                         const struct iovec *iov,
@@ -141,6 +146,18 @@ struct QIOChannelClass {
                                   IOHandler *io_read,
                                   IOHandler *io_write,
                                   void *opaque);
+    int (*io_flush)(QIOChannel *ioc,
+                    Error **errp);
+    ssize_t (*io_pwritev)(QIOChannel *ioc,
+                          const struct iovec *iov,
+                          size_t niov,
+                          off_t offset,
+                          Error **errp);
+    ssize_t (*io_preadv)(QIOChannel *ioc,
+                         const struct iovec *iov,
+                         size_t niov,
+                         off_t offset,
+                         Error **errp);
 };
 
 /* General I/O handling functions */
@@ -233,6 +250,7 @@ ssize_t qio_channel_readv_full(QIOChannel *ioc,
  * @niov: the length of the @iov array
  * @fds: an array of file handles to send
  * @nfds: number of file handles in @fds
+ * @flags: write flags (QIO_CHANNEL_WRITE_FLAG_*)
  * @errp: pointer to a NULL-initialized error object
  *
  * Write data to the IO channel, reading it from the
@@ -256,6 +274,14 @@ ssize_t qio_channel_readv_full(QIOChannel *ioc,
  * unless qio_channel_has_feature() returns a true
  * value for the QIO_CHANNEL_FEATURE_FD_PASS constant.
  *
+ * If @flags contains QIO_CHANNEL_WRITE_FLAG_ZERO_COPY, the
+ * kernel may keep referencing the memory in @iov after this
+ * call returns, so the caller must not modify or free it
+ * until qio_channel_flush() has completed. It is an error
+ * to pass this flag unless qio_channel_has_feature() returns
+ * a true value for the QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY
+ * constant.
+ *
  * Returns: the number of bytes sent, or -1 on error,
  * or QIO_CHANNEL_ERR_BLOCK if no data is can be sent
  * and the channel is non-blocking
@@ -265,6 +291,7 @@ ssize_t qio_channel_writev_full(QIOChannel *ioc,
                                 size_t niov,
                                 int *fds,
                                 size_t nfds,
+                                int flags,
                                 Error **errp);
 
 /**
@@ -349,6 +376,33 @@ int qio_channel_writev_all(QIOChannel *ioc,
                            size_t niov,
                            Error **erp);
 
+/**
+ * qio_channel_writev_full_all:
+ * @ioc: the channel object
+ * @iov: the array of memory regions to write data from
+ * @niov: the length of the @iov array
+ * @fds: an array of file handles to send
+ * @nfds: number of file handles in @fds
+ * @flags: write flags (QIO_CHANNEL_WRITE_FLAG_*)
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Behaves like qio_channel_writev_all(), but allows
+ * sending file handles and passing write @flags, as
+ * described for qio_channel_writev_full().
+ *
+ * File handles are only sent along with the first
+ * chunk of data that gets written.
+ *
+ * Returns: 0 if all bytes were written, or -1 on error
+ */
+int qio_channel_writev_full_all(QIOChannel *ioc,
+                                const struct iovec *iov,
+                                size_t niov,
+                                int *fds,
+                                size_t nfds,
+                                int flags,
+                                Error **errp);
+
 /**
  * qio_channel_readv:
  * @ioc: the channel object
@@ -780,4 +834,73 @@ void qio_channel_set_aio_fd_handler(QIOChannel *ioc,
                                     IOHandler *io_write,
                                     void *opaque);
 
+/**
+ * qio_channel_flush:
+ * @ioc: the channel object
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Block until every write previously issued with
+ * QIO_CHANNEL_WRITE_FLAG_ZERO_COPY has been completed by
+ * the kernel, after which the memory that was passed to
+ * those writes may be modified or released again.
+ *
+ * Channels that do not implement zero copy writes have
+ * nothing to wait for and return immediately.
+ *
+ * Returns: -1 on error, 1 if at least one write fell back
+ * to copying the data, 0 otherwise
+ */
+int qio_channel_flush(QIOChannel *ioc,
+                      Error **errp);
+
+/**
+ * qio_channel_pwritev:
+ * @ioc: the channel object
+ * @iov: the array of memory regions to write data from
+ * @niov: the length of the @iov array
+ * @offset: the position in the channel to write at
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Write data from the memory regions referenced by @iov to
+ * the channel, starting at @offset.  The current I/O position
+ * of the channel is not changed, so multiple threads can write
+ * to different parts of the channel at the same time.
+ *
+ * Not all implementations will support this facility, it is
+ * only available if qio_channel_has_feature() returns a true
+ * value for the QIO_CHANNEL_FEATURE_SEEKABLE constant.
+ *
+ * Returns: the number of bytes written, or -1 on error
+ */
+ssize_t qio_channel_pwritev(QIOChannel *ioc,
+                            const struct iovec *iov,
+                            size_t niov,
+                            off_t offset,
+                            Error **errp);
+
+/**
+ * qio_channel_preadv:
+ * @ioc: the channel object
+ * @iov: the array of memory regions to read data into
+ * @niov: the length of the @iov array
+ * @offset: the position in the channel to read from
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Read data from the channel, starting at @offset, into the
+ * memory regions referenced by @iov.  The current I/O position
+ * of the channel is not changed.
+ *
+ * Not all implementations will support this facility, it is
+ * only available if qio_channel_has_feature() returns a true
+ * value for the QIO_CHANNEL_FEATURE_SEEKABLE constant.
+ *
+ * Returns: the number of bytes read, 0 at end of file, or -1
+ * on error
+ */
+ssize_t qio_channel_preadv(QIOChannel *ioc,
+                           const struct iovec *iov,
+                           size_t niov,
+                           off_t offset,
+                           Error **errp);
+
 #endif /* QIO_CHANNEL_H */
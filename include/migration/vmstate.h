@@ -187,6 +187,13 @@ struct VMStateDescription {
     int (*pre_save)(void *opaque);
     int (*post_save)(void *opaque);
     bool (*needed)(void *opaque);
+    /*
+     * The hooks only touch the device itself and don't need the BQL,
+     * so the state can be saved and loaded by a vmstate thread,
+     * concurrently with other devices.  Descriptions without hooks
+     * don't need to set it.
+     */
+    bool parallel;
     const VMStateField *fields;
     const VMStateDescription **subsections;
 };
@@ -1069,6 +1076,7 @@ int vmstate_save_state_v(QEMUFile *f, const VMStateDescription *vmsd,
                          void *opaque, QJSON *vmdesc, int version_id);
 
 bool vmstate_save_needed(const VMStateDescription *vmsd, void *opaque);
+bool vmstate_is_parallel(const VMStateDescription *vmsd);
 
 /* Returns: 0 on success, -1 on failure */
 int vmstate_register_with_alias_id(DeviceState *dev, int instance_id,
@@ -0,0 +1,95 @@
+/*
+ * Linux userfaultfd helpers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_USERFAULTFD_H
+#define QEMU_USERFAULTFD_H
+
+#ifdef CONFIG_LINUX
+
+#include <linux/userfaultfd.h>
+
+/**
+ * uffd_query_features: query the userfaultfd features of the kernel
+ *
+ * Returns 0 on success, -1 if userfaultfd is not available
+ *
+ * @features: set to the UFFD_FEATURE_* bits supported by the kernel
+ * @errp: set *errp on failure
+ */
+int uffd_query_features(uint64_t *features, Error **errp);
+
+/**
+ * uffd_create_fd: create a userfault file descriptor
+ *
+ * Returns the file descriptor or -1 on failure
+ *
+ * @features: UFFD_FEATURE_* bits to enable, all of them must be supported
+ * @non_blocking: read() returns EAGAIN instead of waiting for an event
+ * @errp: set *errp on failure
+ */
+int uffd_create_fd(uint64_t features, bool non_blocking, Error **errp);
+
+/**
+ * uffd_register_memory: register a memory range with a userfault fd
+ *
+ * Returns 0 on success or -1 on failure
+ *
+ * @uffd: userfault file descriptor
+ * @addr: page aligned start of the range
+ * @length: page aligned length of the range
+ * @mode: UFFDIO_REGISTER_MODE_* tracking mode
+ * @ioctls: if not NULL, set to the _UFFDIO_* bits usable on the range
+ * @errp: set *errp on failure
+ */
+int uffd_register_memory(int uffd, void *addr, uint64_t length,
+                         uint64_t mode, uint64_t *ioctls, Error **errp);
+
+/**
+ * uffd_unregister_memory: undo uffd_register_memory()
+ *
+ * Returns 0 on success or -1 on failure
+ *
+ * @uffd: userfault file descriptor
+ * @addr: start of the range
+ * @length: length of the range
+ * @errp: set *errp on failure
+ */
+int uffd_unregister_memory(int uffd, void *addr, uint64_t length,
+                           Error **errp);
+
+/**
+ * uffd_change_protection: write protect or unprotect a memory range
+ *
+ * Unprotecting a range wakes the threads that fault on it, unless
+ * @dont_wake is set.
+ *
+ * Returns 0 on success or -errno on failure
+ *
+ * @uffd: userfault file descriptor
+ * @addr: start of the range, registered with UFFDIO_REGISTER_MODE_WP
+ * @length: length of the range
+ * @wp: true to write protect the range, false to unprotect it
+ * @dont_wake: don't wake the faulting threads when unprotecting
+ */
+int uffd_change_protection(int uffd, void *addr, uint64_t length,
+                           bool wp, bool dont_wake);
+
+/**
+ * uffd_read_events: read pending events of a non-blocking userfault fd
+ *
+ * Returns the number of events read, 0 if there is none pending, or
+ * -errno on failure
+ *
+ * @uffd: userfault file descriptor
+ * @msgs: buffer for the events
+ * @count: number of entries in @msgs
+ */
+int uffd_read_events(int uffd, struct uffd_msg *msgs, int count);
+
+#endif /* CONFIG_LINUX */
+
+#endif /* QEMU_USERFAULTFD_H */
@@ -269,6 +269,7 @@ struct CPUWatchpoint {
 
 struct KVMState;
 struct kvm_run;
+struct kvm_dirty_gfn;
 
 struct hax_vcpu_state;
 
@@ -340,6 +341,10 @@ struct qemu_work_item;
  * @mem_io_pc: Host Program Counter at which the memory was accessed.
  * @mem_io_vaddr: Target virtual address at which the memory was accessed.
  * @kvm_fd: vCPU file descriptor for KVM.
+ * @kvm_dirty_gfns: mapping of the vCPU dirty ring, when the KVM dirty
+ *                  ring is in use.
+ * @kvm_fetch_index: index of the next dirty ring entry to harvest.
+ * @dirty_pages: number of pages harvested from the vCPU dirty ring.
  * @work_mutex: Lock to prevent multiple access to queued_work_*.
  * @queued_work_first: First asynchronous work pending.
  * @trace_dstate_delayed: Delayed changes to trace_dstate (includes all changes
@@ -424,6 +429,9 @@ struct CPUState {
     int kvm_fd;
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
+    struct kvm_dirty_gfn *kvm_dirty_gfns;
+    uint32_t kvm_fetch_index;
+    uint64_t dirty_pages;
 
     /* Used for events with 'vcpu' and *without* the 'disabled' properties */
     DECLARE_BITMAP(trace_dstate_delayed, CPU_TRACE_DSTATE_MAX_EVENTS);
@@ -443,6 +451,8 @@ struct CPUState {
      * autoconverge
      */
     bool throttle_thread_scheduled;
+    /* Throttle percentage of this vcpu alone, see cpu_throttle_set_vcpu */
+    int throttle_percentage;
 
     bool ignore_memory_transaction_failures;
 
@@ -832,10 +842,30 @@ void cpu_throttle_set(int new_throttle_pct);
 /**
  * cpu_throttle_stop:
  *
- * Stops the vcpu throttling started by cpu_throttle_set.
+ * Stops the vcpu throttling started by cpu_throttle_set and
+ * cpu_throttle_set_vcpu.
  */
 void cpu_throttle_stop(void);
 
+/**
+ * cpu_throttle_set_vcpu:
+ * @cpu: The vcpu to throttle.
+ * @new_throttle_pct: Percent of sleep time. Valid range is 1 to 99, or 0
+ * to stop throttling @cpu alone.
+ *
+ * Like cpu_throttle_set, but only for @cpu.  When both are in use, the
+ * larger of the two percentages applies to @cpu.
+ */
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct);
+
+/**
+ * cpu_throttle_get_vcpu_percentage:
+ * @cpu: The vcpu to query.
+ *
+ * Returns: The percentage set by cpu_throttle_set_vcpu, or 0.
+ */
+int cpu_throttle_get_vcpu_percentage(CPUState *cpu);
+
 /**
  * cpu_throttle_active:
  *
@@ -210,6 +210,9 @@ void blk_op_unblock_all(BlockBackend *blk, Error *reason);
 AioContext *blk_get_aio_context(BlockBackend *blk);
 int blk_set_aio_context(BlockBackend *blk, AioContext *new_context,
                         Error **errp);
+int blk_attach_queue_context(BlockBackend *blk, AioContext *ctx, Error **errp);
+void blk_detach_queue_context(BlockBackend *blk, AioContext *ctx);
+bool blk_has_queue_contexts(BlockBackend *blk);
 void blk_add_aio_context_notifier(BlockBackend *blk,
         void (*attached_aio_context)(AioContext *new_context, void *opaque),
         void (*detach_aio_context)(void *opaque), void *opaque);
@@ -238,6 +238,14 @@ bool kvm_arm_supports_user_irq(void);
  */
 bool kvm_memcrypt_enabled(void);
 
+/**
+ * kvm_dirty_ring_enabled - return boolean indicating whether dirty pages
+ *                          are collected with the per-vCPU dirty ring
+ *
+ * When it is, CPUState::dirty_pages counts the pages dirtied by each vCPU.
+ */
+bool kvm_dirty_ring_enabled(void);
+
 /**
  * kvm_memcrypt_encrypt_data: encrypt the memory range
  *
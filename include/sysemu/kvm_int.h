@@ -18,6 +18,8 @@ typedef struct KVMSlot
     hwaddr start_addr;
     ram_addr_t memory_size;
     void *ram;
+    /* ram_addr_t of the first page of the slot */
+    ram_addr_t ram_start_offset;
     int slot;
     int flags;
     int old_flags;
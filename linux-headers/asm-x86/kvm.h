@@ -51,6 +51,7 @@
 
 /* Architectural interrupt line count. */
 #define KVM_NR_INTERRUPTS 256
+#define KVM_DIRTY_LOG_PAGE_OFFSET 64
 
 struct kvm_memory_alias {
 	__u32 slot;  /* this has a different namespace than memory slots */
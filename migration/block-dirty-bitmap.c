@@ -56,6 +56,27 @@
  * The last chunk in stream should contain flags & EOS. The chunk may skip
  * device and/or bitmap names, assuming them to be the same with the previous
  * chunk.
+ *
+ * With the dirty-bitmaps-multifd capability, the data chunks are sent
+ * through the multifd channels instead, one per packet, and every chunk
+ * names its bitmap:
+ *
+ * # Data chunk of bitmap migration through multifd
+ * be32: flags (BITS, with ZEROES or RLE)
+ * 1 byte: node name size
+ * n bytes: node name
+ * 1 byte: bitmap name size
+ * n bytes: bitmap name
+ * be64: start sector
+ * be64: number of sectors
+ * [ be64: buffer size  ] \ ! (flags & ZEROES)
+ * [ n bytes: buffer    ] /
+ *
+ * With flags & RLE, the buffer holds the lengths of the alternating runs
+ * of clear and set bits of the serialized bitmap, starting with a run of
+ * clear bits, as unsigned LEB128 numbers.  The channels are synchronized
+ * before the first COMPLETE chunk, so that every data chunk is loaded by
+ * the time the bitmaps are completed.
  */
 
 #include "qemu/osdep.h"
@@ -67,11 +88,14 @@
 #include "migration/misc.h"
 #include "migration/migration.h"
 #include "qemu-file.h"
+#include "ram.h"
+#include "multifd.h"
 #include "migration/vmstate.h"
 #include "migration/register.h"
 #include "qemu/hbitmap.h"
 #include "sysemu/sysemu.h"
 #include "qemu/cutils.h"
+#include "qemu/bswap.h"
 #include "qapi/error.h"
 #include "trace.h"
 
@@ -95,6 +119,9 @@
 
 #define DIRTY_BITMAP_MIG_EXTRA_FLAGS        0x80
 
+/* Only in the chunks sent through multifd */
+#define DIRTY_BITMAP_MIG_FLAG_RLE           0x0100
+
 #define DIRTY_BITMAP_MIG_START_FLAG_ENABLED          0x01
 #define DIRTY_BITMAP_MIG_START_FLAG_PERSISTENT       0x02
 /* 0x04 was "AUTOLOAD" flags on elder versions, no it is ignored */
@@ -132,6 +159,8 @@ typedef struct DirtyBitmapLoadState {
     char bitmap_name[256];
     BlockDriverState *bs;
     BdrvDirtyBitmap *bitmap;
+    /* the multifd channels were synced before the first COMPLETE chunk */
+    bool multifd_synced;
 } DirtyBitmapLoadState;
 
 static DirtyBitmapMigState dirty_bitmap_mig_state;
@@ -254,6 +283,184 @@ static void send_bitmap_bits(QEMUFile *f, DirtyBitmapMigBitmapState *dbms,
     g_free(buf);
 }
 
+/* An unsigned LEB128 number takes at most 10 bytes */
+#define RLE_RUN_MAX_SIZE 10
+
+/**
+ * dirty_bitmap_rle_encode: run-length encode a serialized bitmap
+ *
+ * Returns the size of the encoding, or 0 if it is larger than @out_size
+ *
+ * @buf: serialized bitmap, bit 0 of the first byte first
+ * @size: size of @buf
+ * @out: where to write the encoding
+ * @out_size: size of @out
+ */
+static size_t dirty_bitmap_rle_encode(const uint8_t *buf, size_t size,
+                                      uint8_t *out, size_t out_size)
+{
+    uint64_t nbits = (uint64_t)size * 8;
+    uint64_t i = 0;
+    size_t len = 0;
+    bool set = false;
+
+    while (i < nbits) {
+        uint8_t same = set ? 0xff : 0;
+        uint64_t run = i;
+
+        while (i < nbits) {
+            if (!(i & 7) && buf[i >> 3] == same) {
+                i += 8;
+            } else if (!!(buf[i >> 3] & (1 << (i & 7))) == set) {
+                i++;
+            } else {
+                break;
+            }
+        }
+        run = i - run;
+
+        if (out_size - len < RLE_RUN_MAX_SIZE) {
+            return 0;
+        }
+        do {
+            out[len++] = (run & 0x7f) | (run > 0x7f ? 0x80 : 0);
+            run >>= 7;
+        } while (run);
+        set = !set;
+    }
+
+    return len;
+}
+
+/**
+ * dirty_bitmap_rle_decode: rebuild a serialized bitmap from its encoding
+ *
+ * Returns 0 for success, -1 if the encoding doesn't describe exactly
+ * @size bytes
+ *
+ * @in: the encoding, see dirty_bitmap_rle_encode()
+ * @in_size: size of @in
+ * @buf: where to write the serialized bitmap
+ * @size: size of @buf
+ */
+static int dirty_bitmap_rle_decode(const uint8_t *in, size_t in_size,
+                                   uint8_t *buf, size_t size)
+{
+    uint64_t nbits = (uint64_t)size * 8;
+    uint64_t i = 0;
+    size_t pos = 0;
+    bool set = false;
+
+    memset(buf, 0, size);
+    while (pos < in_size) {
+        uint64_t run = 0;
+        int shift = 0;
+
+        do {
+            if (pos == in_size || shift >= 64) {
+                return -1;
+            }
+            run |= (uint64_t)(in[pos] & 0x7f) << shift;
+            shift += 7;
+        } while (in[pos++] & 0x80);
+
+        if (run > nbits - i) {
+            return -1;
+        }
+        if (set) {
+            uint64_t end = i + run;
+
+            for (; i < end && (i & 7); i++) {
+                buf[i >> 3] |= 1 << (i & 7);
+            }
+            if (end - i >= 8) {
+                memset(buf + (i >> 3), 0xff, (end - i) >> 3);
+                i += (end - i) & ~7ULL;
+            }
+            for (; i < end; i++) {
+                buf[i >> 3] |= 1 << (i & 7);
+            }
+        } else {
+            i += run;
+        }
+        set = !set;
+    }
+
+    return i == nbits ? 0 : -1;
+}
+
+/**
+ * send_bitmap_bits_multifd: send a data chunk through a multifd channel
+ *
+ * The chunk is run-length encoded unless that makes it larger.
+ *
+ * @dbms: bitmap to send
+ * @start_sector: first sector of the chunk
+ * @nr_sectors: number of sectors of the chunk
+ */
+static void send_bitmap_bits_multifd(DirtyBitmapMigBitmapState *dbms,
+                                     uint64_t start_sector,
+                                     uint64_t nr_sectors)
+{
+    const char *bitmap_name = bdrv_dirty_bitmap_name(dbms->bitmap);
+    size_t node_len = strlen(dbms->node_name);
+    size_t bitmap_len = strlen(bitmap_name);
+    /* align for buffer_is_zero() */
+    uint64_t align = 4 * sizeof(long);
+    uint64_t bits_size =
+        bdrv_dirty_bitmap_serialization_size(
+            dbms->bitmap, start_sector << BDRV_SECTOR_BITS,
+            nr_sectors << BDRV_SECTOR_BITS);
+    uint8_t *bits = g_malloc0(QEMU_ALIGN_UP(bits_size, align));
+    size_t header_size = 4 + 1 + node_len + 1 + bitmap_len + 3 * 8;
+    uint8_t *buf = g_malloc(header_size + bits_size);
+    uint8_t *p = buf;
+    uint32_t flags = DIRTY_BITMAP_MIG_FLAG_BITS;
+    uint64_t buf_size = 0;
+
+    assert(node_len < 256 && bitmap_len < 256);
+
+    bdrv_dirty_bitmap_serialize_part(
+        dbms->bitmap, bits, start_sector << BDRV_SECTOR_BITS,
+        nr_sectors << BDRV_SECTOR_BITS);
+
+    if (buffer_is_zero(bits, QEMU_ALIGN_UP(bits_size, align))) {
+        flags |= DIRTY_BITMAP_MIG_FLAG_ZEROES;
+        header_size -= 8;
+    } else {
+        buf_size = dirty_bitmap_rle_encode(bits, bits_size, buf + header_size,
+                                           bits_size);
+        if (buf_size) {
+            flags |= DIRTY_BITMAP_MIG_FLAG_RLE;
+        } else {
+            memcpy(buf + header_size, bits, bits_size);
+            buf_size = bits_size;
+        }
+    }
+    g_free(bits);
+
+    trace_send_bitmap_bits_multifd(flags, start_sector, nr_sectors,
+                                   bits_size, buf_size);
+
+    stl_be_p(p, flags);
+    p += 4;
+    *p++ = node_len;
+    memcpy(p, dbms->node_name, node_len);
+    p += node_len;
+    *p++ = bitmap_len;
+    memcpy(p, bitmap_name, bitmap_len);
+    p += bitmap_len;
+    stq_be_p(p, start_sector);
+    p += 8;
+    stq_be_p(p, nr_sectors);
+    p += 8;
+    if (!(flags & DIRTY_BITMAP_MIG_FLAG_ZEROES)) {
+        stq_be_p(p, buf_size);
+    }
+
+    multifd_send_dirty_bitmap(buf, header_size + buf_size);
+}
+
 /* Called with iothread lock taken.  */
 static void dirty_bitmap_mig_cleanup(void)
 {
@@ -310,7 +517,10 @@ static int init_dirty_bitmap_migration(void)
             dbms->node_name = name;
             dbms->bitmap = bitmap;
             dbms->total_sectors = bdrv_nb_sectors(bs);
-            dbms->sectors_per_chunk = CHUNK_SIZE * 8 *
+            /* A multifd chunk fills a packet, the packet header is large */
+            dbms->sectors_per_chunk = (migrate_dirty_bitmaps_multifd() ?
+                                       migrate_multifd_packet_size() :
+                                       CHUNK_SIZE) * 8 *
                 bdrv_dirty_bitmap_granularity(bitmap) >> BDRV_SECTOR_BITS;
             if (bdrv_dirty_bitmap_enabled(bitmap)) {
                 dbms->flags |= DIRTY_BITMAP_MIG_START_FLAG_ENABLED;
@@ -344,10 +554,14 @@ fail:
 /* Called with no lock taken.  */
 static void bulk_phase_send_chunk(QEMUFile *f, DirtyBitmapMigBitmapState *dbms)
 {
-    uint32_t nr_sectors = MIN(dbms->total_sectors - dbms->cur_sector,
-                             dbms->sectors_per_chunk);
+    uint64_t nr_sectors = MIN(dbms->total_sectors - dbms->cur_sector,
+                              dbms->sectors_per_chunk);
 
-    send_bitmap_bits(f, dbms, dbms->cur_sector, nr_sectors);
+    if (migrate_dirty_bitmaps_multifd()) {
+        send_bitmap_bits_multifd(dbms, dbms->cur_sector, nr_sectors);
+    } else {
+        send_bitmap_bits(f, dbms, dbms->cur_sector, nr_sectors);
+    }
 
     dbms->cur_sector += nr_sectors;
     if (dbms->cur_sector >= dbms->total_sectors) {
@@ -402,6 +616,11 @@ static int dirty_bitmap_save_complete(QEMUFile *f, void *opaque)
         bulk_phase(f, false);
     }
 
+    if (migrate_dirty_bitmaps_multifd()) {
+        /* The destination syncs on the first COMPLETE chunk */
+        multifd_send_sync_main();
+    }
+
     QSIMPLEQ_FOREACH(dbms, &dirty_bitmap_mig_state.dbms_list, entry) {
         send_bitmap_complete(f, dbms);
     }
@@ -601,6 +820,130 @@ static int dirty_bitmap_load_bits(QEMUFile *f, DirtyBitmapLoadState *s)
     return 0;
 }
 
+/**
+ * dirty_bitmap_load_multifd: load a data chunk received by a multifd channel
+ *
+ * Called from the channel threads, each chunk covers its own part of the
+ * bitmap.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @buf: the chunk
+ * @size: size of @buf
+ * @errp: pointer to an error
+ */
+int dirty_bitmap_load_multifd(uint8_t *buf, size_t size, Error **errp)
+{
+    uint8_t *end = buf + size;
+    char node_name[256], bitmap_name[256];
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+    uint64_t first_byte, nr_bytes, buf_size, needed_size;
+    uint32_t flags;
+    uint8_t len;
+
+    if (end - buf < 5) {
+        goto truncated;
+    }
+    flags = ldl_be_p(buf);
+    buf += 4;
+    len = *buf++;
+    if (end - buf < len + 1) {
+        goto truncated;
+    }
+    memcpy(node_name, buf, len);
+    node_name[len] = 0;
+    buf += len;
+    len = *buf++;
+    if (end - buf < len + 16) {
+        goto truncated;
+    }
+    memcpy(bitmap_name, buf, len);
+    bitmap_name[len] = 0;
+    buf += len;
+    first_byte = ldq_be_p(buf) << BDRV_SECTOR_BITS;
+    nr_bytes = ldq_be_p(buf + 8) << BDRV_SECTOR_BITS;
+    buf += 16;
+    trace_dirty_bitmap_load_multifd(flags, first_byte >> BDRV_SECTOR_BITS,
+                                    nr_bytes >> BDRV_SECTOR_BITS);
+
+    if ((flags & ~(DIRTY_BITMAP_MIG_FLAG_ZEROES | DIRTY_BITMAP_MIG_FLAG_RLE)) !=
+        DIRTY_BITMAP_MIG_FLAG_BITS) {
+        error_setg(errp, "Unknown flags in migrated dirty bitmap chunk: %x",
+                   flags);
+        return -1;
+    }
+
+    bs = bdrv_lookup_bs(node_name, node_name, errp);
+    if (!bs) {
+        return -1;
+    }
+    bitmap = bdrv_find_dirty_bitmap(bs, bitmap_name);
+    if (!bitmap) {
+        error_setg(errp, "Unknown dirty bitmap '%s' for block device '%s'",
+                   bitmap_name, node_name);
+        return -1;
+    }
+    if (first_byte > bdrv_dirty_bitmap_size(bitmap) ||
+        nr_bytes > bdrv_dirty_bitmap_size(bitmap) - first_byte) {
+        error_setg(errp, "Dirty bitmap chunk out of the bitmap '%s'",
+                   bitmap_name);
+        return -1;
+    }
+
+    if (flags & DIRTY_BITMAP_MIG_FLAG_ZEROES) {
+        bdrv_dirty_bitmap_deserialize_zeroes(bitmap, first_byte, nr_bytes,
+                                             false);
+        return 0;
+    }
+
+    if (end - buf < 8) {
+        goto truncated;
+    }
+    buf_size = ldq_be_p(buf);
+    buf += 8;
+    if (end - buf != buf_size) {
+        goto truncated;
+    }
+    needed_size = bdrv_dirty_bitmap_serialization_size(bitmap, first_byte,
+                                                       nr_bytes);
+    if (flags & DIRTY_BITMAP_MIG_FLAG_RLE) {
+        uint8_t *bits;
+        int ret;
+
+        if (needed_size > MULTIFD_PACKET_SIZE_MAX) {
+            goto granularity;
+        }
+        bits = g_malloc(needed_size);
+        ret = dirty_bitmap_rle_decode(buf, buf_size, bits, needed_size);
+        if (ret) {
+            error_setg(errp, "Invalid run-length encoding of the dirty "
+                       "bitmap '%s'", bitmap_name);
+        } else {
+            bdrv_dirty_bitmap_deserialize_part(bitmap, bits, first_byte,
+                                               nr_bytes, false);
+        }
+        g_free(bits);
+        return ret;
+    }
+
+    if (buf_size != needed_size) {
+        goto granularity;
+    }
+    bdrv_dirty_bitmap_deserialize_part(bitmap, buf, first_byte, nr_bytes,
+                                       false);
+    return 0;
+
+truncated:
+    error_setg(errp, "Truncated dirty bitmap chunk");
+    return -1;
+
+granularity:
+    error_setg(errp, "Migrated bitmap granularity doesn't match the "
+               "destination bitmap '%s' granularity", bitmap_name);
+    return -1;
+}
+
 static int dirty_bitmap_load_header(QEMUFile *f, DirtyBitmapLoadState *s)
 {
     Error *local_err = NULL;
@@ -668,6 +1011,11 @@ static int dirty_bitmap_load(QEMUFile *f, void *opaque, int version_id)
         if (s.flags & DIRTY_BITMAP_MIG_FLAG_START) {
             ret = dirty_bitmap_load_start(f, &s);
         } else if (s.flags & DIRTY_BITMAP_MIG_FLAG_COMPLETE) {
+            if (migrate_dirty_bitmaps_multifd() && !s.multifd_synced) {
+                /* Wait for the data chunks still in the channels */
+                multifd_recv_sync_main();
+                s.multifd_synced = true;
+            }
             dirty_bitmap_load_complete(f, &s);
         } else if (s.flags & DIRTY_BITMAP_MIG_FLAG_BITS) {
             ret = dirty_bitmap_load_bits(f, &s);
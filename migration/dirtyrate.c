@@ -0,0 +1,443 @@
+/*
+ * Dirty page rate measurement
+ *
+ * Estimate how fast the guest dirties its memory without starting a
+ * migration, either by hashing a random sample of the guest pages or
+ * with the same dirty logging that RAM migration uses.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/crc32c.h"
+#include "qemu/cutils.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "qemu/units.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-migration.h"
+#include "qapi/qmp/qerror.h"
+#include "exec/ram_addr.h"
+#include "exec/memory.h"
+#include "qom/cpu.h"
+#include "sysemu/kvm.h"
+#include "migration/misc.h"
+#include "dirtyrate.h"
+#include "trace.h"
+
+#define DIRTYRATE_MIN_CALC_TIME         1
+#define DIRTYRATE_MAX_CALC_TIME         60
+#define DIRTYRATE_MIN_SAMPLE_PAGES      128
+#define DIRTYRATE_MAX_SAMPLE_PAGES      4096
+#define DIRTYRATE_DEFAULT_SAMPLE_PAGES  512
+
+typedef struct DirtyRateBlockStat {
+    char idstr[256];
+    /* used to detect a RAMBlock that was resized during the window */
+    ram_addr_t used_length;
+    /* page-sampling mode: sampled offsets and the hash of their content */
+    uint64_t nr_samples;
+    ram_addr_t *sample_offset;
+    uint32_t *sample_hash;
+    /* (estimated) number of bytes dirtied during the window */
+    uint64_t dirty_bytes;
+} DirtyRateBlockStat;
+
+typedef struct DirtyRateVcpuStat {
+    int index;
+    uint64_t start_pages;
+    uint64_t dirty_pages;
+} DirtyRateVcpuStat;
+
+typedef struct DirtyRateStat {
+    int64_t calc_time;
+    uint64_t sample_pages;
+    DirtyRateMeasureMode mode;
+    /* realtime clock, in milliseconds */
+    int64_t start_time;
+    /* actual start and length of the window, only used by the thread */
+    int64_t window_start;
+    int64_t elapsed;
+    int nr_blocks;
+    DirtyRateBlockStat *blocks;
+    int nr_vcpus;
+    DirtyRateVcpuStat *vcpus;
+} DirtyRateStat;
+
+/*
+ * The measurement thread only writes to dirtyrate_stat while the status
+ * is "measuring"; the monitor only reads the results once the status
+ * has been switched to "measured".
+ */
+static DirtyRateStatus dirtyrate_status = DIRTY_RATE_STATUS_UNSTARTED;
+static DirtyRateStat dirtyrate_stat;
+
+bool dirtyrate_bitmap_measuring(void)
+{
+    return atomic_load_acquire(&dirtyrate_status) ==
+               DIRTY_RATE_STATUS_MEASURING &&
+           dirtyrate_stat.mode == DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP;
+}
+
+static void dirtyrate_stat_reset(DirtyRateStat *stat)
+{
+    int i;
+
+    for (i = 0; i < stat->nr_blocks; i++) {
+        g_free(stat->blocks[i].sample_offset);
+        g_free(stat->blocks[i].sample_hash);
+    }
+    g_free(stat->blocks);
+    g_free(stat->vcpus);
+    memset(stat, 0, sizeof(*stat));
+}
+
+static uint32_t dirtyrate_hash_page(RAMBlock *block, ram_addr_t offset)
+{
+    return crc32c(0xffffffff, block->host + offset, TARGET_PAGE_SIZE);
+}
+
+/**
+ * dirtyrate_sample_block: pick the pages of a RAMBlock to be sampled
+ *
+ * The number of samples is proportional to the size of the RAMBlock,
+ * with at least one page per RAMBlock.
+ *
+ * @stat: measurement state
+ * @b: statistics of the RAMBlock
+ * @block: RAMBlock to sample
+ */
+static void dirtyrate_sample_block(DirtyRateStat *stat,
+                                   DirtyRateBlockStat *b, RAMBlock *block)
+{
+    uint64_t pages = block->used_length >> TARGET_PAGE_BITS;
+    uint64_t i;
+
+    b->nr_samples = DIV_ROUND_UP(stat->sample_pages *
+                                 (block->used_length >> 20), 1024);
+    b->nr_samples = MIN(MAX(b->nr_samples, 1), pages);
+    b->sample_offset = g_new(ram_addr_t, b->nr_samples);
+    b->sample_hash = g_new(uint32_t, b->nr_samples);
+
+    for (i = 0; i < b->nr_samples; i++) {
+        uint64_t page = (((uint64_t)g_random_int() << 32) |
+                         g_random_int()) % pages;
+
+        b->sample_offset[i] = page << TARGET_PAGE_BITS;
+        b->sample_hash[i] = dirtyrate_hash_page(block, b->sample_offset[i]);
+    }
+}
+
+/**
+ * dirtyrate_count_and_clear: count and clear the dirty pages of a RAMBlock
+ *
+ * Returns the number of pages marked dirty for migration in @block since
+ * the last call
+ *
+ * @block: RAMBlock to look at
+ */
+static uint64_t dirtyrate_count_and_clear(RAMBlock *block)
+{
+    unsigned long page = block->offset >> TARGET_PAGE_BITS;
+    unsigned long end = page + (block->used_length >> TARGET_PAGE_BITS);
+    DirtyMemoryBlocks *blocks;
+    uint64_t count = 0;
+
+    blocks = atomic_rcu_read(&ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION]);
+
+    while (page < end) {
+        unsigned long *map = blocks->blocks[page / DIRTY_MEMORY_BLOCK_SIZE];
+        unsigned long offset = page % DIRTY_MEMORY_BLOCK_SIZE;
+
+        /* DIRTY_MEMORY_BLOCK_SIZE is a multiple of BITS_PER_LONG */
+        if (!(offset % BITS_PER_LONG) && end - page >= BITS_PER_LONG) {
+            count += ctpopl(atomic_xchg(&map[BIT_WORD(offset)], 0));
+            page += BITS_PER_LONG;
+        } else {
+            count += bitmap_test_and_clear_atomic(map, offset, 1);
+            page++;
+        }
+    }
+
+    return count;
+}
+
+/* Must be called with the RCU read lock held */
+static void dirtyrate_init_blocks(DirtyRateStat *stat)
+{
+    RAMBlock *block;
+    int n = 0;
+
+    RAMBLOCK_FOREACH(block) {
+        if (qemu_ram_is_migratable(block)) {
+            n++;
+        }
+    }
+
+    stat->blocks = g_new0(DirtyRateBlockStat, n);
+    RAMBLOCK_FOREACH(block) {
+        DirtyRateBlockStat *b;
+
+        if (!qemu_ram_is_migratable(block) || stat->nr_blocks == n) {
+            continue;
+        }
+        b = &stat->blocks[stat->nr_blocks++];
+        pstrcpy(b->idstr, sizeof(b->idstr), block->idstr);
+        b->used_length = block->used_length;
+        if (stat->mode == DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING) {
+            dirtyrate_sample_block(stat, b, block);
+        } else {
+            dirtyrate_count_and_clear(block);
+        }
+    }
+}
+
+/**
+ * dirtyrate_find_block: look up a RAMBlock again at the end of the window
+ *
+ * Returns the RAMBlock, or NULL if it went away or was resized
+ *
+ * Must be called with the RCU read lock held.
+ *
+ * @b: statistics of the RAMBlock
+ */
+static RAMBlock *dirtyrate_find_block(DirtyRateBlockStat *b)
+{
+    RAMBlock *block = qemu_ram_block_by_name(b->idstr);
+
+    if (!block || block->used_length != b->used_length) {
+        return NULL;
+    }
+    return block;
+}
+
+static void dirtyrate_wait(DirtyRateStat *stat)
+{
+    g_usleep(stat->calc_time * G_USEC_PER_SEC);
+    stat->elapsed = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                    stat->window_start;
+}
+
+static void dirtyrate_measure_sampling(DirtyRateStat *stat)
+{
+    int i;
+
+    rcu_read_lock();
+    stat->window_start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    dirtyrate_init_blocks(stat);
+    rcu_read_unlock();
+
+    dirtyrate_wait(stat);
+
+    rcu_read_lock();
+    for (i = 0; i < stat->nr_blocks; i++) {
+        DirtyRateBlockStat *b = &stat->blocks[i];
+        RAMBlock *block = dirtyrate_find_block(b);
+        uint64_t j, dirty = 0;
+
+        if (!block) {
+            continue;
+        }
+        for (j = 0; j < b->nr_samples; j++) {
+            if (dirtyrate_hash_page(block, b->sample_offset[j]) !=
+                b->sample_hash[j]) {
+                dirty++;
+            }
+        }
+        b->dirty_bytes = dirty * b->used_length / b->nr_samples;
+    }
+    rcu_read_unlock();
+}
+
+static void dirtyrate_measure_bitmap(DirtyRateStat *stat)
+{
+    CPUState *cpu;
+    int i;
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_start();
+    /* Throw away whatever was dirty before the window */
+    memory_global_dirty_log_sync();
+    rcu_read_lock();
+    stat->window_start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    dirtyrate_init_blocks(stat);
+    rcu_read_unlock();
+
+    if (kvm_enabled() && kvm_dirty_ring_enabled()) {
+        CPU_FOREACH(cpu) {
+            stat->nr_vcpus++;
+        }
+        stat->vcpus = g_new0(DirtyRateVcpuStat, stat->nr_vcpus);
+        i = 0;
+        CPU_FOREACH(cpu) {
+            stat->vcpus[i].index = cpu->cpu_index;
+            stat->vcpus[i].start_pages = cpu->dirty_pages;
+            i++;
+        }
+    }
+    qemu_mutex_unlock_iothread();
+
+    dirtyrate_wait(stat);
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_sync();
+    rcu_read_lock();
+    for (i = 0; i < stat->nr_blocks; i++) {
+        DirtyRateBlockStat *b = &stat->blocks[i];
+        RAMBlock *block = dirtyrate_find_block(b);
+
+        if (block) {
+            b->dirty_bytes = dirtyrate_count_and_clear(block) <<
+                             TARGET_PAGE_BITS;
+        }
+    }
+    rcu_read_unlock();
+
+    for (i = 0; i < stat->nr_vcpus; i++) {
+        cpu = qemu_get_cpu(stat->vcpus[i].index);
+        if (cpu) {
+            stat->vcpus[i].dirty_pages = cpu->dirty_pages -
+                                         stat->vcpus[i].start_pages;
+        }
+    }
+    memory_global_dirty_log_stop();
+    qemu_mutex_unlock_iothread();
+}
+
+static void *dirtyrate_thread(void *opaque)
+{
+    DirtyRateStat *stat = opaque;
+
+    rcu_register_thread();
+
+    trace_dirtyrate_start(DirtyRateMeasureMode_str(stat->mode),
+                          stat->calc_time);
+    if (stat->mode == DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP) {
+        dirtyrate_measure_bitmap(stat);
+    } else {
+        dirtyrate_measure_sampling(stat);
+    }
+    trace_dirtyrate_end(stat->elapsed);
+
+    atomic_store_release(&dirtyrate_status, DIRTY_RATE_STATUS_MEASURED);
+
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+/* Convert bytes dirtied during the window to MB/s */
+static int64_t dirtyrate_mbps(DirtyRateStat *stat, uint64_t bytes)
+{
+    return bytes * 1000 / MAX(stat->elapsed, 1) / MiB;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
+                         int64_t sample_pages, bool has_mode,
+                         DirtyRateMeasureMode mode, Error **errp)
+{
+    DirtyRateStat *stat = &dirtyrate_stat;
+    QemuThread thread;
+
+    if (atomic_load_acquire(&dirtyrate_status) ==
+        DIRTY_RATE_STATUS_MEASURING) {
+        error_setg(errp, "the dirty page rate is already being measured");
+        return;
+    }
+
+    if (calc_time < DIRTYRATE_MIN_CALC_TIME ||
+        calc_time > DIRTYRATE_MAX_CALC_TIME) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "calc-time",
+                   "a value between 1 and 60");
+        return;
+    }
+
+    if (!has_sample_pages) {
+        sample_pages = DIRTYRATE_DEFAULT_SAMPLE_PAGES;
+    } else if (sample_pages < DIRTYRATE_MIN_SAMPLE_PAGES ||
+               sample_pages > DIRTYRATE_MAX_SAMPLE_PAGES) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "sample-pages",
+                   "a value between 128 and 4096");
+        return;
+    }
+
+    if (!has_mode) {
+        mode = DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING;
+    }
+    if (mode == DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP) {
+        if (has_sample_pages) {
+            error_setg(errp, "sample-pages is only valid in "
+                       "page-sampling mode");
+            return;
+        }
+        if (!migration_is_idle()) {
+            error_setg(errp, "the dirty-bitmap mode cannot be used while "
+                       "a migration is running");
+            return;
+        }
+    }
+
+    dirtyrate_stat_reset(stat);
+    stat->calc_time = calc_time;
+    stat->sample_pages = sample_pages;
+    stat->mode = mode;
+    stat->start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    atomic_store_release(&dirtyrate_status, DIRTY_RATE_STATUS_MEASURING);
+
+    qemu_thread_create(&thread, "dirtyrate", dirtyrate_thread, stat,
+                       QEMU_THREAD_DETACHED);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateStat *stat = &dirtyrate_stat;
+    DirtyRateInfo *info = g_new0(DirtyRateInfo, 1);
+    uint64_t total = 0;
+    int i;
+
+    info->status = atomic_load_acquire(&dirtyrate_status);
+    info->start_time = stat->start_time / 1000;
+    info->calc_time = stat->calc_time;
+    info->mode = stat->mode;
+    if (stat->mode == DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING) {
+        info->has_sample_pages = true;
+        info->sample_pages = stat->sample_pages;
+    }
+
+    if (info->status != DIRTY_RATE_STATUS_MEASURED) {
+        return info;
+    }
+
+    info->has_blocks = true;
+    for (i = stat->nr_blocks - 1; i >= 0; i--) {
+        DirtyRateBlockList *entry = g_new0(DirtyRateBlockList, 1);
+
+        entry->value = g_new0(DirtyRateBlock, 1);
+        entry->value->id = g_strdup(stat->blocks[i].idstr);
+        entry->value->dirty_rate = dirtyrate_mbps(stat,
+                                                  stat->blocks[i].dirty_bytes);
+        entry->next = info->blocks;
+        info->blocks = entry;
+        total += stat->blocks[i].dirty_bytes;
+    }
+    info->has_dirty_rate = true;
+    info->dirty_rate = dirtyrate_mbps(stat, total);
+
+    if (stat->nr_vcpus) {
+        info->has_vcpus = true;
+    }
+    for (i = stat->nr_vcpus - 1; i >= 0; i--) {
+        DirtyRateVcpuList *entry = g_new0(DirtyRateVcpuList, 1);
+
+        entry->value = g_new0(DirtyRateVcpu, 1);
+        entry->value->id = stat->vcpus[i].index;
+        entry->value->dirty_rate = dirtyrate_mbps(stat,
+            stat->vcpus[i].dirty_pages * qemu_real_host_page_size);
+        entry->next = info->vcpus;
+        info->vcpus = entry;
+    }
+
+    return info;
+}
@@ -0,0 +1,17 @@
+/*
+ * Dirty page rate measurement
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_DIRTYRATE_H
+#define QEMU_MIGRATION_DIRTYRATE_H
+
+/*
+ * A dirty-bitmap measurement owns the global dirty log and the migration
+ * dirty memory client, so no migration may start while it is running.
+ */
+bool dirtyrate_bitmap_measuring(void);
+
+#endif
@@ -15,10 +15,12 @@
 
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "qemu/error-report.h"
 #include "migration/blocker.h"
 #include "exec.h"
 #include "fd.h"
+#include "file.h"
 #include "socket.h"
 #include "rdma.h"
 #include "ram.h"
@@ -40,12 +42,17 @@
 #include "qemu/rcu.h"
 #include "block.h"
 #include "postcopy-ram.h"
+#include "dirtyrate.h"
+#include "multifd.h"
 #include "qemu/thread.h"
 #include "trace.h"
 #include "exec/target_page.h"
 #include "io/channel-buffer.h"
 #include "migration/colo.h"
 #include "hw/boards.h"
+#include "qom/cpu.h"
+#include "sysemu/kvm.h"
+#include "sysemu/cpus.h"
 #include "monitor/monitor.h"
 #include "net/announce.h"
 
@@ -82,6 +89,18 @@
 /* The delay time (in ms) between two COLO checkpoints */
 #define DEFAULT_MIGRATE_X_CHECKPOINT_DELAY (200 * 100)
 #define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+#define DEFAULT_MIGRATE_MULTIFD_COMPRESSION MULTIFD_COMPRESSION_NONE
+/* 0: means nocompress, 1: best speed, ... 9: best compress ratio */
+#define DEFAULT_MIGRATE_MULTIFD_ZLIB_LEVEL 1
+/* 0: means nocompress, 1: best speed, ... 20: best compress ratio */
+#define DEFAULT_MIGRATE_MULTIFD_ZSTD_LEVEL 1
+/* Only the migration thread synchronizes the dirty bitmap */
+#define DEFAULT_MIGRATE_BITMAP_SYNC_THREADS 1
+#define DEFAULT_MIGRATE_MULTIFD_PACKET_SIZE MULTIFD_PACKET_SIZE
+#define DEFAULT_MIGRATE_POSTCOPY_PREFETCH_SIZE 0
+#define DEFAULT_MIGRATE_ZERO_PAGE_DETECTION ZERO_PAGE_DETECTION_MULTIFD
+/* Only the migration thread saves and loads the device state */
+#define DEFAULT_MIGRATE_VMSTATE_THREADS 1
 
 /* Background transfer rate for postcopy, 0 means unlimited, note
  * that page requests can still exceed this limit.
@@ -149,6 +168,7 @@ void migration_object_init(void)
         g_array_new(FALSE, TRUE, sizeof(struct PostCopyFD));
     qemu_mutex_init(&current_incoming->rp_mutex);
     qemu_event_init(&current_incoming->main_thread_load_event, false);
+    qemu_event_init(&current_incoming->postcopy_ram_ready_event, false);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_dst, 0);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_fault, 0);
 
@@ -208,12 +228,17 @@ void migration_incoming_state_destroy(void)
         qemu_fclose(mis->from_src_file);
         mis->from_src_file = NULL;
     }
+    if (mis->postcopy_qemufile_dst) {
+        qemu_fclose(mis->postcopy_qemufile_dst);
+        mis->postcopy_qemufile_dst = NULL;
+    }
     if (mis->postcopy_remote_fds) {
         g_array_free(mis->postcopy_remote_fds, TRUE);
         mis->postcopy_remote_fds = NULL;
     }
 
     qemu_event_reset(&mis->main_thread_load_event);
+    qemu_event_reset(&mis->postcopy_ram_ready_event);
 
     if (mis->socket_address_list) {
         qapi_free_SocketAddressList(mis->socket_address_list);
@@ -364,6 +389,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
@@ -516,10 +543,12 @@ fail:
 static void migration_incoming_setup(QEMUFile *f)
 {
     MigrationIncomingState *mis = migration_incoming_get_current();
+    Error *local_err = NULL;
 
-    if (multifd_load_setup() != 0) {
+    if (multifd_load_setup(&local_err) != 0) {
         /* We haven't been able to create multifd threads
            nothing better to do */
+        error_report_err(local_err);
         exit(EXIT_FAILURE);
     }
 
@@ -574,7 +603,14 @@ void migration_fd_process_incoming(QEMUFile *f)
     }
 
     migration_incoming_setup(f);
-    migration_incoming_process();
+
+    /*
+     * The multifd channels of RDMA connect after the main channel, the
+     * last one starts the migration in migration_ioc_process_incoming().
+     */
+    if (multifd_recv_all_channels_created()) {
+        migration_incoming_process();
+    }
 }
 
 void migration_ioc_process_incoming(QIOChannel *ioc, Error **errp)
@@ -595,9 +631,18 @@ void migration_ioc_process_incoming(QIOChannel *ioc, Error **errp)
 
         /*
          * Common migration only needs one channel, so we can start
-         * right now.  Multifd needs more than one channel, we wait.
+         * right now.  Multifd and postcopy-preempt need more than one
+         * channel, we wait, except when multifd reads a mapped-ram file.
          */
-        start_migration = !migrate_use_multifd();
+        start_migration = (!migrate_use_multifd() || migrate_mapped_ram()) &&
+                          !migrate_postcopy_preempt();
+    } else if (migrate_postcopy_preempt()) {
+        if (mis->postcopy_qemufile_dst) {
+            error_setg(errp, "postcopy-preempt channel already connected");
+            return;
+        }
+        postcopy_preempt_new_channel(mis, qemu_fopen_channel_input(ioc));
+        start_migration = true;
     } else {
         Error *local_err = NULL;
         /* Multiple connections */
@@ -626,6 +671,9 @@ bool migration_has_all_channels(void)
     bool all_channels;
 
     all_channels = multifd_recv_all_channels_created();
+    if (migrate_postcopy_preempt()) {
+        all_channels = all_channels && mis->postcopy_qemufile_dst != NULL;
+    }
 
     return all_channels && mis->from_src_file != NULL;
 }
@@ -769,6 +817,22 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->block_incremental = s->parameters.block_incremental;
     params->has_multifd_channels = true;
     params->multifd_channels = s->parameters.multifd_channels;
+    params->has_multifd_compression = true;
+    params->multifd_compression = s->parameters.multifd_compression;
+    params->has_multifd_zlib_level = true;
+    params->multifd_zlib_level = s->parameters.multifd_zlib_level;
+    params->has_multifd_zstd_level = true;
+    params->multifd_zstd_level = s->parameters.multifd_zstd_level;
+    params->has_bitmap_sync_threads = true;
+    params->bitmap_sync_threads = s->parameters.bitmap_sync_threads;
+    params->has_multifd_packet_size = true;
+    params->multifd_packet_size = s->parameters.multifd_packet_size;
+    params->has_postcopy_prefetch_size = true;
+    params->postcopy_prefetch_size = s->parameters.postcopy_prefetch_size;
+    params->has_zero_page_detection = true;
+    params->zero_page_detection = s->parameters.zero_page_detection;
+    params->has_vmstate_threads = true;
+    params->vmstate_threads = s->parameters.vmstate_threads;
     params->has_xbzrle_cache_size = true;
     params->xbzrle_cache_size = s->parameters.xbzrle_cache_size;
     params->has_max_postcopy_bandwidth = true;
@@ -841,6 +905,8 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->page_size = qemu_target_page_size();
     info->ram->multifd_bytes = ram_counters.multifd_bytes;
     info->ram->pages_per_second = s->pages_per_second;
+    info->ram->dirty_sync_bql_time = ram_counters.dirty_sync_bql_time;
+    info->ram->dirty_sync_bql_time_max = ram_counters.dirty_sync_bql_time_max;
 
     if (migrate_use_xbzrle()) {
         info->has_xbzrle_cache = true;
@@ -851,6 +917,8 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         info->xbzrle_cache->cache_miss = xbzrle_counters.cache_miss;
         info->xbzrle_cache->cache_miss_rate = xbzrle_counters.cache_miss_rate;
         info->xbzrle_cache->overflow = xbzrle_counters.overflow;
+        info->xbzrle_cache->cache_hit = xbzrle_counters.cache_hit;
+        info->xbzrle_cache->cache_eviction = xbzrle_counters.cache_eviction;
     }
 
     if (migrate_use_compression()) {
@@ -870,6 +938,18 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         info->cpu_throttle_percentage = cpu_throttle_get_percentage();
     }
 
+    if (migrate_vcpu_throttle()) {
+        intList **tail = &info->vcpu_throttle_percentage;
+        CPUState *cpu;
+
+        info->has_vcpu_throttle_percentage = true;
+        CPU_FOREACH(cpu) {
+            *tail = g_new0(intList, 1);
+            (*tail)->value = cpu_throttle_get_vcpu_percentage(cpu);
+            tail = &(*tail)->next;
+        }
+    }
+
     if (s->state != MIGRATION_STATUS_COMPLETED) {
         info->ram->remaining = ram_bytes_remaining();
         info->ram->dirty_pages_rate = ram_counters.dirty_pages_rate;
@@ -915,6 +995,8 @@ static void fill_source_migration_info(MigrationInfo *info)
             - s->start_time;
         info->has_expected_downtime = true;
         info->expected_downtime = s->expected_downtime;
+        info->has_expected_converge_time = s->expected_converge_time >= 0;
+        info->expected_converge_time = s->expected_converge_time;
         info->has_setup_time = true;
         info->setup_time = s->setup_time;
 
@@ -933,6 +1015,8 @@ static void fill_source_migration_info(MigrationInfo *info)
         info->downtime = s->downtime;
         info->has_setup_time = true;
         info->setup_time = s->setup_time;
+        info->vmstate_times = qemu_savevm_vmstate_times();
+        info->has_vmstate_times = !!info->vmstate_times;
 
         populate_ram_info(info, s);
         break;
@@ -1022,6 +1106,165 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+#ifdef CONFIG_LINUX
+    if (cap_list[MIGRATION_CAPABILITY_ZERO_COPY_SEND] &&
+        (!cap_list[MIGRATION_CAPABILITY_MULTIFD] ||
+         migrate_multifd_compression() != MULTIFD_COMPRESSION_NONE)) {
+        error_setg(errp, "Zero copy only available for non-compressed "
+                   "multifd migration");
+        return false;
+    }
+#endif
+
+    if (cap_list[MIGRATION_CAPABILITY_VCPU_THROTTLE]) {
+        if (!cap_list[MIGRATION_CAPABILITY_AUTO_CONVERGE]) {
+            error_setg(errp, "vcpu-throttle requires auto-converge");
+            return false;
+        }
+        if (!kvm_enabled() || !kvm_dirty_ring_enabled()) {
+            error_setg(errp, "vcpu-throttle requires the KVM dirty ring");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT]) {
+        if (!cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "postcopy-preempt requires postcopy-ram");
+            return false;
+        }
+        /*
+         * The destination tells the preempt channel apart from the main
+         * one by the order of the connections, which multifd breaks.
+         */
+        if (cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+            error_setg(errp, "postcopy-preempt is not compatible with "
+                       "multifd");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT]) {
+        /*
+         * Pages are saved in the order of the write faults and released
+         * as soon as they are sent, anything that sends the same page
+         * twice or needs the VM stopped at the end is out.
+         */
+        static const MigrationCapability incompatible[] = {
+            MIGRATION_CAPABILITY_POSTCOPY_RAM,
+            MIGRATION_CAPABILITY_DIRTY_BITMAPS,
+            MIGRATION_CAPABILITY_POSTCOPY_BLOCKTIME,
+            MIGRATION_CAPABILITY_LATE_BLOCK_ACTIVATE,
+            MIGRATION_CAPABILITY_RETURN_PATH,
+            MIGRATION_CAPABILITY_MULTIFD,
+            MIGRATION_CAPABILITY_PAUSE_BEFORE_SWITCHOVER,
+            MIGRATION_CAPABILITY_AUTO_CONVERGE,
+            MIGRATION_CAPABILITY_RELEASE_RAM,
+            MIGRATION_CAPABILITY_RDMA_PIN_ALL,
+            MIGRATION_CAPABILITY_COMPRESS,
+            MIGRATION_CAPABILITY_XBZRLE,
+            MIGRATION_CAPABILITY_X_COLO,
+            MIGRATION_CAPABILITY_BLOCK,
+            MIGRATION_CAPABILITY_VCPU_THROTTLE,
+            MIGRATION_CAPABILITY_POSTCOPY_PREEMPT,
+            MIGRATION_CAPABILITY_MAPPED_RAM,
+        };
+        int i;
+
+        for (i = 0; i < ARRAY_SIZE(incompatible); i++) {
+            if (cap_list[incompatible[i]]) {
+                error_setg(errp, "background-snapshot is not compatible "
+                           "with %s",
+                           MigrationCapability_str(incompatible[i]));
+                return false;
+            }
+        }
+        if (!ram_write_tracking_available()) {
+            error_setg(errp, "background-snapshot requires userfaultfd "
+                       "write protection support from the host kernel");
+            return false;
+        }
+        if (!ram_write_tracking_compatible()) {
+            error_setg(errp, "background-snapshot is not supported by the "
+                       "guest memory backends");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+        /*
+         * Each page has a single slot in the file, anything that sends
+         * something else than the page contents, or needs the destination
+         * to answer, is out.
+         */
+        static const MigrationCapability incompatible[] = {
+            MIGRATION_CAPABILITY_POSTCOPY_RAM,
+            MIGRATION_CAPABILITY_POSTCOPY_BLOCKTIME,
+            MIGRATION_CAPABILITY_POSTCOPY_PREEMPT,
+            MIGRATION_CAPABILITY_RETURN_PATH,
+            MIGRATION_CAPABILITY_XBZRLE,
+            MIGRATION_CAPABILITY_COMPRESS,
+            MIGRATION_CAPABILITY_RDMA_PIN_ALL,
+            MIGRATION_CAPABILITY_X_COLO,
+            MIGRATION_CAPABILITY_ZERO_COPY_SEND,
+        };
+        int i;
+
+        for (i = 0; i < ARRAY_SIZE(incompatible); i++) {
+            if (cap_list[incompatible[i]]) {
+                error_setg(errp, "mapped-ram is not compatible with %s",
+                           MigrationCapability_str(incompatible[i]));
+                return false;
+            }
+        }
+        if (cap_list[MIGRATION_CAPABILITY_MULTIFD] &&
+            migrate_multifd_compression() != MULTIFD_COMPRESSION_NONE) {
+            error_setg(errp, "mapped-ram is not compatible with multifd "
+                       "compression");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_LOCAL_RAM]) {
+        /*
+         * Both sides use the same memory, anything that discards it or
+         * keeps the source running after the switchover is out.
+         */
+        static const MigrationCapability incompatible[] = {
+            MIGRATION_CAPABILITY_POSTCOPY_RAM,
+            MIGRATION_CAPABILITY_RELEASE_RAM,
+            MIGRATION_CAPABILITY_X_COLO,
+            MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT,
+            MIGRATION_CAPABILITY_MAPPED_RAM,
+            MIGRATION_CAPABILITY_RDMA_PIN_ALL,
+        };
+        int i;
+
+        for (i = 0; i < ARRAY_SIZE(incompatible); i++) {
+            if (cap_list[incompatible[i]]) {
+                error_setg(errp, "local-ram is not compatible with %s",
+                           MigrationCapability_str(incompatible[i]));
+                return false;
+            }
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_DIRTY_BITMAPS_MULTIFD]) {
+        if (!cap_list[MIGRATION_CAPABILITY_DIRTY_BITMAPS]) {
+            error_setg(errp, "dirty-bitmaps-multifd requires dirty-bitmaps");
+            return false;
+        }
+        if (!cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+            error_setg(errp, "dirty-bitmaps-multifd requires multifd");
+            return false;
+        }
+        /* The chunks need a packet stream next to the pages */
+        if (cap_list[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+            error_setg(errp, "dirty-bitmaps-multifd is not compatible with "
+                       "mapped-ram");
+            return false;
+        }
+    }
+
     return true;
 }
 
@@ -1158,6 +1401,56 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (params->has_multifd_zlib_level &&
+        (params->multifd_zlib_level > 9)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "multifd_zlib_level",
+                   "is invalid, it should be in the range of 0 to 9");
+        return false;
+    }
+
+    if (params->has_multifd_zstd_level &&
+        (params->multifd_zstd_level > 20)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "multifd_zstd_level",
+                   "is invalid, it should be in the range of 0 to 20");
+        return false;
+    }
+
+    if (params->has_bitmap_sync_threads &&
+        (params->bitmap_sync_threads < 1)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "bitmap_sync_threads",
+                   "is invalid, it should be in the range of 1 to 255");
+        return false;
+    }
+
+    if (params->has_multifd_packet_size &&
+        (params->multifd_packet_size < qemu_target_page_size() ||
+         params->multifd_packet_size > MULTIFD_PACKET_SIZE_MAX ||
+         params->multifd_packet_size % qemu_target_page_size())) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "multifd_packet_size",
+                   "a multiple of the target page size up to 64 MiB");
+        return false;
+    }
+
+    if (params->has_postcopy_prefetch_size &&
+        (params->postcopy_prefetch_size > POSTCOPY_PREFETCH_SIZE_MAX ||
+         params->postcopy_prefetch_size % qemu_target_page_size())) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "postcopy_prefetch_size",
+                   "a multiple of the target page size up to 64 MiB");
+        return false;
+    }
+
+#ifdef CONFIG_LINUX
+    if (migrate_use_zero_copy_send() &&
+        params->has_multifd_compression &&
+        params->multifd_compression != MULTIFD_COMPRESSION_NONE) {
+        error_setg(errp, "Zero copy only available for non-compressed "
+                   "multifd migration");
+        return false;
+    }
+#endif
+
     if (params->has_xbzrle_cache_size &&
         (params->xbzrle_cache_size < qemu_target_page_size() ||
          !is_power_of_2(params->xbzrle_cache_size))) {
@@ -1206,6 +1499,12 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
                    "is invalid, it must be in the range of 1 to 10000 ms");
        return false;
     }
+
+    if (params->has_vmstate_threads && (params->vmstate_threads < 1)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "vmstate_threads",
+                   "is invalid, it should be in the range of 1 to 255");
+        return false;
+    }
     return true;
 }
 
@@ -1268,6 +1567,30 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_multifd_channels) {
         dest->multifd_channels = params->multifd_channels;
     }
+    if (params->has_multifd_compression) {
+        dest->multifd_compression = params->multifd_compression;
+    }
+    if (params->has_multifd_zlib_level) {
+        dest->multifd_zlib_level = params->multifd_zlib_level;
+    }
+    if (params->has_multifd_zstd_level) {
+        dest->multifd_zstd_level = params->multifd_zstd_level;
+    }
+    if (params->has_bitmap_sync_threads) {
+        dest->bitmap_sync_threads = params->bitmap_sync_threads;
+    }
+    if (params->has_multifd_packet_size) {
+        dest->multifd_packet_size = params->multifd_packet_size;
+    }
+    if (params->has_postcopy_prefetch_size) {
+        dest->postcopy_prefetch_size = params->postcopy_prefetch_size;
+    }
+    if (params->has_zero_page_detection) {
+        dest->zero_page_detection = params->zero_page_detection;
+    }
+    if (params->has_vmstate_threads) {
+        dest->vmstate_threads = params->vmstate_threads;
+    }
     if (params->has_xbzrle_cache_size) {
         dest->xbzrle_cache_size = params->xbzrle_cache_size;
     }
@@ -1364,6 +1687,30 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_multifd_channels) {
         s->parameters.multifd_channels = params->multifd_channels;
     }
+    if (params->has_multifd_compression) {
+        s->parameters.multifd_compression = params->multifd_compression;
+    }
+    if (params->has_multifd_zlib_level) {
+        s->parameters.multifd_zlib_level = params->multifd_zlib_level;
+    }
+    if (params->has_multifd_zstd_level) {
+        s->parameters.multifd_zstd_level = params->multifd_zstd_level;
+    }
+    if (params->has_bitmap_sync_threads) {
+        s->parameters.bitmap_sync_threads = params->bitmap_sync_threads;
+    }
+    if (params->has_multifd_packet_size) {
+        s->parameters.multifd_packet_size = params->multifd_packet_size;
+    }
+    if (params->has_postcopy_prefetch_size) {
+        s->parameters.postcopy_prefetch_size = params->postcopy_prefetch_size;
+    }
+    if (params->has_zero_page_detection) {
+        s->parameters.zero_page_detection = params->zero_page_detection;
+    }
+    if (params->has_vmstate_threads) {
+        s->parameters.vmstate_threads = params->vmstate_threads;
+    }
     if (params->has_xbzrle_cache_size) {
         s->parameters.xbzrle_cache_size = params->xbzrle_cache_size;
         xbzrle_cache_resize(params->xbzrle_cache_size, errp);
@@ -1514,6 +1861,10 @@ static void migrate_fd_cleanup(MigrationState *s)
         qemu_mutex_lock_iothread();
 
         multifd_save_cleanup();
+        if (s->postcopy_qemufile_src) {
+            qemu_fclose(s->postcopy_qemufile_src);
+            s->postcopy_qemufile_src = NULL;
+        }
         qemu_mutex_lock(&s->qemu_file_lock);
         tmp = s->to_dst_file;
         s->to_dst_file = NULL;
@@ -1609,6 +1960,9 @@ static void migrate_fd_cancel(MigrationState *s)
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
     }
+    if (s->state == MIGRATION_STATUS_CANCELLING && s->postcopy_qemufile_src) {
+        qemu_file_shutdown(s->postcopy_qemufile_src);
+    }
     if (s->state == MIGRATION_STATUS_CANCELLING && s->block_inactive) {
         Error *local_err = NULL;
 
@@ -1705,10 +2059,14 @@ void migrate_init(MigrationState *s)
     s->pages_per_second = 0.0;
     s->downtime = 0;
     s->expected_downtime = 0;
+    s->expected_converge_time = -1;
     s->setup_time = 0;
     s->start_postcopy = false;
     s->postcopy_after_devices = false;
     s->migration_thread_running = false;
+    s->postcopy_qemufile_src = NULL;
+    qemu_sem_destroy(&s->postcopy_qemufile_src_sem);
+    qemu_sem_init(&s->postcopy_qemufile_src_sem, 0);
     error_free(s->error);
     s->error = NULL;
 
@@ -1719,6 +2077,8 @@ void migrate_init(MigrationState *s)
     s->vm_was_running = false;
     s->iteration_initial_bytes = 0;
     s->threshold_size = 0;
+    s->bandwidth = 0;
+    s->downtime_overhead = 0;
 }
 
 static GSList *migration_blockers;
@@ -1889,6 +2249,12 @@ static bool migrate_prepare(MigrationState *s, bool blk, bool blk_inc,
         return false;
     }
 
+    if (dirtyrate_bitmap_measuring()) {
+        error_setg(errp, "A dirty page rate measurement is using the dirty "
+                   "log, try again later");
+        return false;
+    }
+
     if (blk || blk_inc) {
         if (migrate_use_block() || migrate_use_block_incremental()) {
             error_setg(errp, "Command options are incompatible with "
@@ -1926,6 +2292,27 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    /* The preempt channel is a plain socket connected to the same address */
+    if (migrate_postcopy_preempt() &&
+        ((!strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) ||
+         (s->parameters.tls_creds && *s->parameters.tls_creds))) {
+        error_setg(errp, "postcopy-preempt requires a tcp or unix "
+                   "migration without TLS");
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        block_cleanup_parameters(s);
+        return;
+    }
+
+    /* The file descriptors are passed over a unix socket */
+    if (migrate_local_ram() && !strstart(uri, "unix:", NULL)) {
+        error_setg(errp, "local-ram requires a unix migration");
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        block_cleanup_parameters(s);
+        return;
+    }
+
     if (strstart(uri, "tcp:", &p)) {
         tcp_start_outgoing_migration(s, p, &local_err);
 #ifdef CONFIG_RDMA
@@ -1938,6 +2325,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
     } else {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
                    "a valid migration protocol");
@@ -2033,6 +2422,60 @@ bool migrate_postcopy_ram(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM];
 }
 
+bool migrate_postcopy_preempt(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
+}
+
+bool migrate_background_snapshot(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT];
+}
+
+bool migrate_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MAPPED_RAM];
+}
+
+bool migrate_switchover_prediction(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_SWITCHOVER_PREDICTION];
+}
+
+bool migrate_local_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_LOCAL_RAM];
+}
+
+bool migrate_dirty_bitmaps_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_DIRTY_BITMAPS_MULTIFD];
+}
+
 bool migrate_postcopy(void)
 {
     return migrate_postcopy_ram() || migrate_dirty_bitmaps();
@@ -2137,6 +2580,15 @@ bool migrate_use_events(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_EVENTS];
 }
 
+bool migrate_vcpu_throttle(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_VCPU_THROTTLE];
+}
+
 bool migrate_use_multifd(void)
 {
     MigrationState *s;
@@ -2146,6 +2598,17 @@ bool migrate_use_multifd(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD];
 }
 
+#ifdef CONFIG_LINUX
+bool migrate_use_zero_copy_send(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_COPY_SEND];
+}
+#endif
+
 bool migrate_pause_before_switchover(void)
 {
     MigrationState *s;
@@ -2165,6 +2628,78 @@ int migrate_multifd_channels(void)
     return s->parameters.multifd_channels;
 }
 
+MultiFDCompression migrate_multifd_compression(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.multifd_compression;
+}
+
+int migrate_multifd_zlib_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.multifd_zlib_level;
+}
+
+int migrate_multifd_zstd_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.multifd_zstd_level;
+}
+
+int migrate_bitmap_sync_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.bitmap_sync_threads;
+}
+
+uint64_t migrate_multifd_packet_size(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.multifd_packet_size;
+}
+
+uint64_t migrate_postcopy_prefetch_size(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.postcopy_prefetch_size;
+}
+
+ZeroPageDetection migrate_zero_page_detection(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.zero_page_detection;
+}
+
+int migrate_vmstate_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.vmstate_threads;
+}
+
 int migrate_use_xbzrle(void)
 {
     MigrationState *s;
@@ -2539,6 +3074,11 @@ static int postcopy_start(MigrationState *ms)
     int64_t bandwidth = migrate_max_postcopy_bandwidth();
     bool restart_block = false;
     int cur_state = MIGRATION_STATUS_ACTIVE;
+
+    if (migrate_postcopy_preempt() && postcopy_preempt_wait_channel(ms)) {
+        return -1;
+    }
+
     if (!migrate_pause_before_switchover()) {
         migrate_set_state(&ms->state, MIGRATION_STATUS_ACTIVE,
                           MIGRATION_STATUS_POSTCOPY_ACTIVE);
@@ -2759,6 +3299,8 @@ static void migration_completion(MigrationState *s)
         if (!ret) {
             bool inactivate = !migrate_colo_enabled();
             ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+            s->vm_stop_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                              s->downtime_start;
             if (ret >= 0) {
                 ret = migration_maybe_pause(s, &current_active_state,
                                             MIGRATION_STATUS_DEVICE);
@@ -3025,6 +3567,51 @@ static void migration_calculate_complete(MigrationState *s)
     }
 }
 
+/*
+ * migration_predict: predict the downtime if we switched over now
+ *
+ * On top of sending the pending data, the downtime includes stopping
+ * the VM, synchronizing the dirty bitmap one last time and saving the
+ * device state.  Those can only be measured during the downtime, so
+ * they come from the last time they were measured.
+ *
+ * Also predict how long it takes until the downtime is within the
+ * limit, from the rate at which the guest dirties its memory.
+ *
+ * @s: Current migration state
+ * @pending_size: data that must still be sent
+ */
+static void migration_predict(MigrationState *s, uint64_t pending_size)
+{
+    double dirty_rate, target;
+
+    if (!s->bandwidth) {
+        return;
+    }
+
+    s->expected_downtime = s->downtime_overhead + pending_size / s->bandwidth;
+
+    /* bytes dirtied per ms, known once a whole pass was done */
+    dirty_rate = (double)ram_counters.dirty_pages_rate *
+                 qemu_target_page_size() / 1000;
+    /* the overhead can exceed the limit, don't let it wrap around */
+    target = (double)MAX((int64_t)s->parameters.downtime_limit -
+                         s->downtime_overhead, 0) * s->bandwidth;
+    if (s->expected_downtime <= s->parameters.downtime_limit) {
+        s->expected_converge_time = 0;
+    } else if (ram_counters.dirty_sync_count > 1 && target > 0 &&
+               s->bandwidth > dirty_rate) {
+        s->expected_converge_time = (pending_size - target) /
+                                    (s->bandwidth - dirty_rate);
+    } else {
+        s->expected_converge_time = -1;
+    }
+
+    trace_migration_predict(pending_size, s->bandwidth, dirty_rate,
+                            s->downtime_overhead, s->expected_downtime,
+                            s->expected_converge_time);
+}
+
 static void migration_update_counters(MigrationState *s,
                                       int64_t current_time)
 {
@@ -3040,7 +3627,20 @@ static void migration_update_counters(MigrationState *s,
     transferred = current_bytes - s->iteration_initial_bytes;
     time_spent = current_time - s->iteration_start_time;
     bandwidth = (double)transferred / time_spent;
-    s->threshold_size = bandwidth * s->parameters.downtime_limit;
+
+    /* A single period is too noisy for the prediction */
+    s->bandwidth = s->bandwidth ? (s->bandwidth * 3 + bandwidth) / 4 :
+                                  bandwidth;
+    s->downtime_overhead = s->vm_stop_time +
+                           ram_counters.dirty_sync_bql_time / 1000 +
+                           s->vmstate_cost / 1000;
+    if (migrate_switchover_prediction()) {
+        /* Leave room for the overhead as well */
+        s->threshold_size = MAX((int64_t)s->parameters.downtime_limit -
+                                s->downtime_overhead, 0) * s->bandwidth;
+    } else {
+        s->threshold_size = bandwidth * s->parameters.downtime_limit;
+    }
 
     s->mbps = (((double) transferred * 8.0) /
                ((double) time_spent / 1000.0)) / 1000.0 / 1000.0;
@@ -3050,14 +3650,6 @@ static void migration_update_counters(MigrationState *s,
     s->pages_per_second = (double) transferred_pages /
                              (((double) time_spent / 1000.0));
 
-    /*
-     * if we haven't sent anything, we don't want to
-     * recalculate. 10000 is a small enough number for our purposes
-     */
-    if (ram_counters.dirty_pages_rate && transferred > 10000) {
-        s->expected_downtime = ram_counters.remaining / bandwidth;
-    }
-
     qemu_file_reset_rate_limit(s->to_dst_file);
 
     s->iteration_start_time = current_time;
@@ -3090,6 +3682,7 @@ static MigIterateState migration_iteration_run(MigrationState *s)
 
     trace_migrate_pending(pending_size, s->threshold_size,
                           pend_pre, pend_compat, pend_post);
+    migration_predict(s, pending_size);
 
     if (pending_size && pending_size >= s->threshold_size) {
         /* Still a significant amount to transfer */
@@ -3287,12 +3880,173 @@ static void *migration_thread(void *opaque)
     return NULL;
 }
 
+static void bg_migration_completion(MigrationState *s, QEMUFile *fb,
+                                    QIOChannelBuffer *bioc)
+{
+    /* The device state goes after the RAM, so that it is loaded last */
+    qemu_fflush(fb);
+    qemu_put_buffer(s->to_dst_file, bioc->data, bioc->usage);
+    qemu_fflush(s->to_dst_file);
+
+    if (qemu_file_get_error(fb) || qemu_file_get_error(s->to_dst_file)) {
+        trace_migration_completion_file_err();
+        migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                          MIGRATION_STATUS_FAILED);
+        return;
+    }
+
+    migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                      MIGRATION_STATUS_COMPLETED);
+}
+
+static void bg_migration_iteration_finish(MigrationState *s)
+{
+    qemu_mutex_lock_iothread();
+    switch (s->state) {
+    case MIGRATION_STATUS_COMPLETED:
+        migration_calculate_complete(s);
+        break;
+
+    case MIGRATION_STATUS_ACTIVE:
+    case MIGRATION_STATUS_FAILED:
+    case MIGRATION_STATUS_CANCELLED:
+    case MIGRATION_STATUS_CANCELLING:
+        break;
+
+    default:
+        /* Should not reach here, but if so, forgive the VM. */
+        error_report("%s: Unknown ending state %d", __func__, s->state);
+        break;
+    }
+    migrate_fd_cleanup_schedule(s);
+    qemu_mutex_unlock_iothread();
+}
+
+/*
+ * Background snapshot thread on the source VM.
+ * The VM is only stopped to save the device state and write protect its
+ * RAM, then the RAM is written out as it was at that point while the guest
+ * keeps running; pages are saved out of order when the guest writes to
+ * them.  The stream has the migration format, with the device state after
+ * the RAM.
+ */
+static void *bg_migration_thread(void *opaque)
+{
+    MigrationState *s = opaque;
+    int64_t setup_start = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    MigThrError thr_error;
+    QIOChannelBuffer *bioc;
+    QEMUFile *fb;
+    bool urgent = false;
+    bool done = false;
+
+    rcu_register_thread();
+
+    object_ref(OBJECT(s));
+    s->iteration_start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    qemu_savevm_state_header(s->to_dst_file);
+    qemu_savevm_state_setup(s->to_dst_file);
+
+    s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
+    migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                      MIGRATION_STATUS_ACTIVE);
+
+    trace_migration_thread_setup_complete();
+
+    bioc = qio_channel_buffer_new(512 * KiB);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "vmstate-buffer");
+    fb = qemu_fopen_channel_output(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    ram_write_tracking_prepare();
+
+    qemu_mutex_lock_iothread();
+    s->downtime_start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER, NULL);
+    s->vm_was_running = runstate_is_running();
+
+    if (global_state_store() ||
+        vm_stop_force_state(RUN_STATE_PAUSED) < 0) {
+        goto fail;
+    }
+
+    cpu_synchronize_all_states();
+    if (qemu_savevm_state_complete_precopy_non_iterable(fb, false, false) ||
+        ram_write_tracking_start()) {
+        goto fail;
+    }
+
+    if (s->vm_was_running) {
+        vm_start();
+    }
+    s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - s->downtime_start;
+    qemu_mutex_unlock_iothread();
+
+    while (s->state == MIGRATION_STATUS_ACTIVE) {
+        int64_t current_time;
+
+        if (urgent || !qemu_file_rate_limit(s->to_dst_file)) {
+            if (qemu_savevm_state_iterate(s->to_dst_file, false) > 0) {
+                done = true;
+                break;
+            }
+        }
+
+        thr_error = migration_detect_error(s);
+        if (thr_error == MIG_THR_ERR_FATAL) {
+            break;
+        }
+
+        current_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+        migration_update_counters(s, current_time);
+
+        urgent = false;
+        if (qemu_file_rate_limit(s->to_dst_file)) {
+            /*
+             * Wait for a delay to do rate limiting, unless a vCPU is
+             * blocked on a page that still has to be saved.
+             */
+            int ms = s->iteration_start_time + BUFFER_DELAY - current_time;
+            trace_migration_thread_ratelimit_pre(ms);
+            urgent = ram_write_tracking_wait(ms);
+            trace_migration_thread_ratelimit_post(urgent);
+        }
+    }
+
+    /* Don't keep the vCPUs waiting while the device state is written */
+    ram_write_tracking_stop();
+    if (done) {
+        bg_migration_completion(s, fb, bioc);
+    }
+    goto out;
+
+fail:
+    migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                      MIGRATION_STATUS_FAILED);
+    if (s->vm_was_running) {
+        vm_start();
+    }
+    qemu_mutex_unlock_iothread();
+
+out:
+    trace_migration_thread_after_loop();
+    qemu_fclose(fb);
+    bg_migration_iteration_finish(s);
+    object_unref(OBJECT(s));
+    rcu_unregister_thread();
+    return NULL;
+}
+
 void migrate_fd_connect(MigrationState *s, Error *error_in)
 {
+    Error *local_err = NULL;
     int64_t rate_limit;
     bool resume = s->state == MIGRATION_STATUS_POSTCOPY_PAUSED;
 
     s->expected_downtime = s->parameters.downtime_limit;
+    s->vmstate_cost = qemu_savevm_vmstate_cost();
     s->cleanup_bh = qemu_bh_new(migrate_fd_cleanup_bh, s);
     if (error_in) {
         migrate_fd_error(s, error_in);
@@ -3336,14 +4090,23 @@ void migrate_fd_connect(MigrationState *s, Error *error_in)
         return;
     }
 
-    if (multifd_save_setup() != 0) {
+    if (multifd_save_setup(&local_err) != 0) {
+        error_report_err(local_err);
         migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
                           MIGRATION_STATUS_FAILED);
         migrate_fd_cleanup(s);
         return;
     }
-    qemu_thread_create(&s->thread, "live_migration", migration_thread, s,
-                       QEMU_THREAD_JOINABLE);
+    if (migrate_postcopy_preempt()) {
+        postcopy_preempt_setup(s);
+    }
+    if (migrate_background_snapshot()) {
+        qemu_thread_create(&s->thread, "bg_snapshot", bg_migration_thread, s,
+                           QEMU_THREAD_JOINABLE);
+    } else {
+        qemu_thread_create(&s->thread, "live_migration", migration_thread, s,
+                           QEMU_THREAD_JOINABLE);
+    }
     s->migration_thread_running = true;
 }
 
@@ -3406,6 +4169,30 @@ static Property migration_properties[] = {
     DEFINE_PROP_UINT8("multifd-channels", MigrationState,
                       parameters.multifd_channels,
                       DEFAULT_MIGRATE_MULTIFD_CHANNELS),
+    DEFINE_PROP_MULTIFD_COMPRESSION("multifd-compression", MigrationState,
+                      parameters.multifd_compression,
+                      DEFAULT_MIGRATE_MULTIFD_COMPRESSION),
+    DEFINE_PROP_UINT8("multifd-zlib-level", MigrationState,
+                      parameters.multifd_zlib_level,
+                      DEFAULT_MIGRATE_MULTIFD_ZLIB_LEVEL),
+    DEFINE_PROP_UINT8("multifd-zstd-level", MigrationState,
+                      parameters.multifd_zstd_level,
+                      DEFAULT_MIGRATE_MULTIFD_ZSTD_LEVEL),
+    DEFINE_PROP_UINT8("bitmap-sync-threads", MigrationState,
+                      parameters.bitmap_sync_threads,
+                      DEFAULT_MIGRATE_BITMAP_SYNC_THREADS),
+    DEFINE_PROP_SIZE("multifd-packet-size", MigrationState,
+                      parameters.multifd_packet_size,
+                      DEFAULT_MIGRATE_MULTIFD_PACKET_SIZE),
+    DEFINE_PROP_SIZE("postcopy-prefetch-size", MigrationState,
+                      parameters.postcopy_prefetch_size,
+                      DEFAULT_MIGRATE_POSTCOPY_PREFETCH_SIZE),
+    DEFINE_PROP_ZERO_PAGE_DETECTION("zero-page-detection", MigrationState,
+                      parameters.zero_page_detection,
+                      DEFAULT_MIGRATE_ZERO_PAGE_DETECTION),
+    DEFINE_PROP_UINT8("vmstate-threads", MigrationState,
+                      parameters.vmstate_threads,
+                      DEFAULT_MIGRATE_VMSTATE_THREADS),
     DEFINE_PROP_SIZE("xbzrle-cache-size", MigrationState,
                       parameters.xbzrle_cache_size,
                       DEFAULT_MIGRATE_XBZRLE_CACHE_SIZE),
@@ -3441,6 +4228,21 @@ static Property migration_properties[] = {
     DEFINE_PROP_MIG_CAP("x-block", MIGRATION_CAPABILITY_BLOCK),
     DEFINE_PROP_MIG_CAP("x-return-path", MIGRATION_CAPABILITY_RETURN_PATH),
     DEFINE_PROP_MIG_CAP("x-multifd", MIGRATION_CAPABILITY_MULTIFD),
+#ifdef CONFIG_LINUX
+    DEFINE_PROP_MIG_CAP("x-zero-copy-send",
+            MIGRATION_CAPABILITY_ZERO_COPY_SEND),
+#endif
+    DEFINE_PROP_MIG_CAP("x-vcpu-throttle", MIGRATION_CAPABILITY_VCPU_THROTTLE),
+    DEFINE_PROP_MIG_CAP("x-postcopy-preempt",
+                        MIGRATION_CAPABILITY_POSTCOPY_PREEMPT),
+    DEFINE_PROP_MIG_CAP("x-background-snapshot",
+                        MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT),
+    DEFINE_PROP_MIG_CAP("x-mapped-ram", MIGRATION_CAPABILITY_MAPPED_RAM),
+    DEFINE_PROP_MIG_CAP("x-switchover-prediction",
+                        MIGRATION_CAPABILITY_SWITCHOVER_PREDICTION),
+    DEFINE_PROP_MIG_CAP("x-local-ram", MIGRATION_CAPABILITY_LOCAL_RAM),
+    DEFINE_PROP_MIG_CAP("x-dirty-bitmaps-multifd",
+                        MIGRATION_CAPABILITY_DIRTY_BITMAPS_MULTIFD),
 
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -3466,6 +4268,7 @@ static void migration_instance_finalize(Object *obj)
     qemu_sem_destroy(&ms->pause_sem);
     qemu_sem_destroy(&ms->postcopy_pause_sem);
     qemu_sem_destroy(&ms->postcopy_pause_rp_sem);
+    qemu_sem_destroy(&ms->postcopy_qemufile_src_sem);
     qemu_sem_destroy(&ms->rp_state.rp_sem);
     error_free(ms->error);
 }
@@ -3495,6 +4298,14 @@ static void migration_instance_init(Object *obj)
     params->has_x_checkpoint_delay = true;
     params->has_block_incremental = true;
     params->has_multifd_channels = true;
+    params->has_multifd_compression = true;
+    params->has_multifd_zlib_level = true;
+    params->has_multifd_zstd_level = true;
+    params->has_bitmap_sync_threads = true;
+    params->has_multifd_packet_size = true;
+    params->has_postcopy_prefetch_size = true;
+    params->has_zero_page_detection = true;
+    params->has_vmstate_threads = true;
     params->has_xbzrle_cache_size = true;
     params->has_max_postcopy_bandwidth = true;
     params->has_max_cpu_throttle = true;
@@ -3505,6 +4316,7 @@ static void migration_instance_init(Object *obj)
 
     qemu_sem_init(&ms->postcopy_pause_sem, 0);
     qemu_sem_init(&ms->postcopy_pause_rp_sem, 0);
+    qemu_sem_init(&ms->postcopy_qemufile_src_sem, 0);
     qemu_sem_init(&ms->rp_state.rp_sem, 0);
     qemu_sem_init(&ms->rate_limit_sem, 0);
     qemu_mutex_init(&ms->qemu_file_lock);
@@ -26,6 +26,13 @@ struct PostcopyBlocktimeContext;
 
 #define  MIGRATION_RESUME_ACK_VALUE  (1)
 
+/* Streams carrying RAM pages; the postcopy one needs postcopy-preempt */
+typedef enum {
+    RAM_CHANNEL_PRECOPY = 0,
+    RAM_CHANNEL_POSTCOPY = 1,
+    RAM_CHANNEL_MAX,
+} RamChannel;
+
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *from_src_file;
@@ -49,6 +56,11 @@ struct MigrationIncomingState {
     bool           have_listen_thread;
     QemuThread     listen_thread;
     QemuSemaphore  listen_thread_sem;
+    /*
+     * Set once the RAM is registered with userfault, the multifd channels
+     * wait for it before placing the postcopy pages they receive
+     */
+    QemuEvent      postcopy_ram_ready_event;
 
     /* For the kernel to send us notifications */
     int       userfault_fd;
@@ -58,11 +70,19 @@ struct MigrationIncomingState {
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     /* RAMBlock of last request sent to source */
     RAMBlock *last_rb;
-    void     *postcopy_tmp_page;
+    /* RAMBlock of the last page received on each channel */
+    RAMBlock *last_recv_block[RAM_CHANNEL_MAX];
+    /* One temporary host page for each channel loading postcopy pages */
+    void     *postcopy_tmp_pages[RAM_CHANNEL_MAX];
     void     *postcopy_tmp_zero_page;
     /* PostCopyFD's for external userfaultfds & handlers of shared memory */
     GArray   *postcopy_remote_fds;
 
+    /* postcopy-preempt: channel with the pages requested by the fault thread */
+    QEMUFile  *postcopy_qemufile_dst;
+    bool       have_preempt_thread;
+    QemuThread preempt_thread;
+
     QEMUBH *bh;
 
     int state;
@@ -147,6 +167,13 @@ struct MigrationState
      * measured bandwidth
      */
     int64_t threshold_size;
+    /* bandwidth in bytes per ms, smoothed over the last periods */
+    double bandwidth;
+    /*
+     * Downtime on top of sending the pending data, in ms: stopping the
+     * VM, the last dirty bitmap sync and saving the device state
+     */
+    int64_t downtime_overhead;
 
     /* params from 'migrate-set-parameters' */
     MigrationParameters parameters;
@@ -170,6 +197,12 @@ struct MigrationState
     int64_t downtime_start;
     int64_t downtime;
     int64_t expected_downtime;
+    /* expected time until the switchover (ms), -1 if unknown */
+    int64_t expected_converge_time;
+    /* time it took to stop the VM at the last completion (ms) */
+    int64_t vm_stop_time;
+    /* expected time to save the device state (us), when migration started */
+    int64_t vmstate_cost;
     bool enabled_capabilities[MIGRATION_CAPABILITY__MAX];
     int64_t setup_time;
     /*
@@ -225,6 +258,14 @@ struct MigrationState
     /* Needed by postcopy-pause state */
     QemuSemaphore postcopy_pause_sem;
     QemuSemaphore postcopy_pause_rp_sem;
+
+    /*
+     * postcopy-preempt: channel for the pages requested by the
+     * destination.  postcopy_qemufile_src_sem is posted once the
+     * connection attempt finished, whether it succeeded or not.
+     */
+    QEMUFile *postcopy_qemufile_src;
+    QemuSemaphore postcopy_qemufile_src_sem;
     /*
      * Whether we abort the migration if decompression errors are
      * detected at the destination. It is left at false for qemu
@@ -261,14 +302,34 @@ bool migrate_postcopy(void);
 
 bool migrate_release_ram(void);
 bool migrate_postcopy_ram(void);
+bool migrate_postcopy_preempt(void);
+bool migrate_background_snapshot(void);
+bool migrate_mapped_ram(void);
+bool migrate_switchover_prediction(void);
+bool migrate_local_ram(void);
+bool migrate_dirty_bitmaps_multifd(void);
 bool migrate_zero_blocks(void);
 bool migrate_dirty_bitmaps(void);
 bool migrate_ignore_shared(void);
 
 bool migrate_auto_converge(void);
+bool migrate_vcpu_throttle(void);
 bool migrate_use_multifd(void);
+#ifdef CONFIG_LINUX
+bool migrate_use_zero_copy_send(void);
+#else
+#define migrate_use_zero_copy_send() (false)
+#endif
 bool migrate_pause_before_switchover(void);
 int migrate_multifd_channels(void);
+MultiFDCompression migrate_multifd_compression(void);
+int migrate_multifd_zlib_level(void);
+int migrate_multifd_zstd_level(void);
+int migrate_bitmap_sync_threads(void);
+uint64_t migrate_multifd_packet_size(void);
+uint64_t migrate_postcopy_prefetch_size(void);
+ZeroPageDetection migrate_zero_page_detection(void);
+int migrate_vmstate_threads(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
@@ -302,6 +363,7 @@ void migrate_send_rp_resume_ack(MigrationIncomingState *mis, uint32_t value);
 
 void dirty_bitmap_mig_before_vm_start(void);
 void init_dirty_bitmap_incoming_migration(void);
+int dirty_bitmap_load_multifd(uint8_t *buf, size_t size, Error **errp);
 void migrate_add_address(SocketAddress *address);
 
 int foreach_not_ignored_block(RAMBlockIterFunc func, void *opaque);
@@ -0,0 +1,223 @@
+/*
+ * Multifd common functions
+ *
+ * Copyright (c) 2019 Red Hat Inc
+ *
+ * Authors:
+ *  Juan Quintela <quintela@redhat.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_MULTIFD_H
+#define QEMU_MIGRATION_MULTIFD_H
+
+#include "qapi/qapi-types-migration.h"
+#include "exec/cpu-common.h"
+#include "qemu/thread.h"
+#include "io/channel.h"
+
+#define MULTIFD_FLAG_SYNC (1 << 0)
+
+/* We reserve 3 bits for compression methods */
+#define MULTIFD_FLAG_COMPRESSION_MASK (7 << 1)
+/* we need to be compatible. Before compression value was 0 */
+#define MULTIFD_FLAG_NOCOMP (0 << 1)
+#define MULTIFD_FLAG_ZLIB (1 << 1)
+#define MULTIFD_FLAG_ZSTD (2 << 1)
+/* The pages are placed with userfault, see multifd_recv_place_pages() */
+#define MULTIFD_FLAG_POSTCOPY (1 << 4)
+/* The payload is a dirty bitmap chunk, see dirty_bitmap_load_multifd() */
+#define MULTIFD_FLAG_DIRTY_BITMAP (1 << 5)
+
+/*
+ * Default and maximum for the multifd-packet-size parameter.  They need
+ * to be a multiple of qemu_target_page_size()
+ */
+#define MULTIFD_PACKET_SIZE (512 * 1024)
+#define MULTIFD_PACKET_SIZE_MAX (64 * 1024 * 1024)
+/* A dirty bitmap chunk is at most one packet of bits plus its header */
+#define MULTIFD_DIRTY_BITMAP_MAX (MULTIFD_PACKET_SIZE_MAX + 1024)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    unsigned char uuid[16]; /* QemuUUID */
+    uint8_t id;
+    uint8_t unused1[7];     /* Reserved for future use */
+    uint64_t unused2[4];    /* Reserved for future use */
+} __attribute__((packed)) MultiFDInit_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    /* maximum number of allocated pages */
+    uint32_t pages_alloc;
+    /* non zero pages */
+    uint32_t normal_pages;
+    /* size of the next packet that contains pages */
+    uint32_t next_packet_size;
+    uint64_t packet_num;
+    /* zero pages, listed in @offset after the normal ones */
+    uint32_t zero_pages;
+    uint32_t unused32[1];    /* Reserved for future use */
+    uint64_t unused64[3];    /* Reserved for future use */
+    char ramblock[256];
+    uint64_t offset[];
+} __attribute__((packed)) MultiFDPacket_t;
+
+typedef struct {
+    /* number of used pages */
+    uint32_t used;
+    /* number of non zero pages, they come first in @offset */
+    uint32_t normal;
+    /* number of allocated pages */
+    uint32_t allocated;
+    /* global number of generated multifd packets */
+    uint64_t packet_num;
+    /* offset of each page */
+    ram_addr_t *offset;
+    /* pointer to the pages, a run of contiguous pages shares one entry */
+    struct iovec *iov;
+    /* number of used iov entries */
+    uint32_t num_iov;
+    RAMBlock *block;
+} MultiFDPages_t;
+
+typedef struct {
+    /* this fields are not changed once the thread is created */
+    /* channel number */
+    uint8_t id;
+    /* channel thread name */
+    char *name;
+    /* channel thread id */
+    QemuThread thread;
+    /* communication channel, NULL with mapped-ram */
+    QIOChannel *c;
+    /* sem where to wait for more work */
+    QemuSemaphore sem;
+    /* this mutex protects the following parameters */
+    QemuMutex mutex;
+    /* is this channel thread running */
+    bool running;
+    /* should this thread finish */
+    bool quit;
+    /* thread has work to do */
+    int pending_job;
+    /* array of pages to sent */
+    MultiFDPages_t *pages;
+    /* packet allocated len */
+    uint32_t packet_len;
+    /* pointer to the packet */
+    MultiFDPacket_t *packet;
+    /* multifd flags for each packet */
+    uint32_t flags;
+    /* size of the next packet that contains pages */
+    uint32_t next_packet_size;
+    /* global number of generated multifd packets */
+    uint64_t packet_num;
+    /* flags used for the page writes (QIO_CHANNEL_WRITE_FLAG_*) */
+    int write_flags;
+    /* zero pages found and not accounted yet by the migration thread */
+    uint64_t zero_pages;
+    /* dirty bitmap chunk to send instead of pages, owned by the channel */
+    uint8_t *bitmap_chunk;
+    /* size of @bitmap_chunk */
+    uint32_t bitmap_chunk_size;
+    /* thread local variables */
+    /* scratch array where the zero pages are collected */
+    ram_addr_t *zero_offset;
+    /* packets sent through this channel */
+    uint64_t num_packets;
+    /* pages sent through this channel */
+    uint64_t num_pages;
+    /* iov entries sent through this channel */
+    uint64_t num_iovs;
+    /* zero pages found by this channel */
+    uint64_t num_zero_pages;
+    /* used for compression methods */
+    void *data;
+}  MultiFDSendParams;
+
+typedef struct {
+    /* this fields are not changed once the thread is created */
+    /* channel number */
+    uint8_t id;
+    /* channel thread name */
+    char *name;
+    /* channel thread id */
+    QemuThread thread;
+    /* communication channel, NULL with mapped-ram */
+    QIOChannel *c;
+    /* mapped-ram: sem where to wait for more work */
+    QemuSemaphore sem;
+    /* this mutex protects the following parameters */
+    QemuMutex mutex;
+    /* is this channel thread running */
+    bool running;
+    /* mapped-ram: should this thread finish */
+    bool quit;
+    /* mapped-ram: thread has work to do */
+    int pending_job;
+    /* array of pages to receive */
+    MultiFDPages_t *pages;
+    /* packet allocated len */
+    uint32_t packet_len;
+    /* pointer to the packet */
+    MultiFDPacket_t *packet;
+    /* multifd flags for each packet */
+    uint32_t flags;
+    /* global number of generated multifd packets */
+    uint64_t packet_num;
+    /* thread local variables */
+    /* size of the next packet that contains pages */
+    uint32_t next_packet_size;
+    /* packets sent through this channel */
+    uint64_t num_packets;
+    /* pages sent through this channel */
+    uint64_t num_pages;
+    /* iov entries received through this channel */
+    uint64_t num_iovs;
+    /* zero pages received through this channel */
+    uint64_t num_zero_pages;
+    /* syncs main thread and channels */
+    QemuSemaphore sem_sync;
+    /* postcopy: buffer where the pages are received before being placed */
+    uint8_t *postcopy_buf;
+    /* postcopy: host page assembled from its target pages */
+    uint8_t *postcopy_host_page;
+    /* used for de-compression methods */
+    void *data;
+} MultiFDRecvParams;
+
+/*
+ * Per compression method hooks.  The send hooks are called from the
+ * channel thread with the channel pages owned by that thread, so no
+ * locking is needed inside them.
+ */
+typedef struct {
+    /* Setup for sending side */
+    int (*send_setup)(MultiFDSendParams *p, Error **errp);
+    /* Cleanup for sending side */
+    void (*send_cleanup)(MultiFDSendParams *p, Error **errp);
+    /*
+     * Prepare the send packet: set p->next_packet_size and add the
+     * method flag to @flags
+     */
+    int (*send_prepare)(MultiFDSendParams *p, uint32_t used,
+                        uint32_t *flags, Error **errp);
+    /* Write the pages payload that follows the packet header */
+    int (*send_write)(MultiFDSendParams *p, uint32_t used, Error **errp);
+    /* Setup for receiving side */
+    int (*recv_setup)(MultiFDRecvParams *p, Error **errp);
+    /* Cleanup for receiving side */
+    void (*recv_cleanup)(MultiFDRecvParams *p);
+    /* Read all pages */
+    int (*recv_pages)(MultiFDRecvParams *p, uint32_t used, Error **errp);
+} MultiFDMethods;
+
+void multifd_register_ops(int method, MultiFDMethods *ops);
+
+#endif
@@ -1,6 +1,7 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set associative cache indexed by a hash of the page
+ * address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -30,26 +31,52 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/* number of pages in one set */
+#define CACHE_WAYS 8
+
+/* sets of the previous table moved over on each cache access */
+#define CACHE_DRAIN_SETS 4
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
+    /* bitmap generation of the last use */
     uint64_t it_age;
+    /* cache clock of the last use, orders the pages of a generation */
+    uint64_t it_lru;
     uint8_t *it_data;
 };
 
+typedef struct CacheTable {
+    /* set i is items[i * ways] ... items[i * ways + ways - 1] */
+    CacheItem *items;
+    size_t num_sets;
+    unsigned int ways;
+    unsigned int set_bits;
+} CacheTable;
+
 struct PageCache {
-    CacheItem *page_cache;
+    CacheTable *table;
+    /*
+     * Table in use before the last resize.  Its pages are moved to @table
+     * when they are looked up, and a few sets at a time on every access,
+     * so that resizing does not have to go through the whole cache.
+     */
+    CacheTable *old_table;
+    /* next set of @old_table to move */
+    size_t old_pos;
     size_t page_size;
     size_t max_num_items;
     size_t num_items;
+    uint64_t lru_clock;
 };
 
-PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
+static CacheTable *cache_table_new(int64_t new_size, size_t page_size,
+                                   Error **errp)
 {
-    int64_t i;
     size_t num_pages = new_size / page_size;
-    PageCache *cache;
+    CacheTable *table;
 
     if (new_size < page_size) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
@@ -65,87 +92,237 @@ PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
     }
 
     /* We prefer not to abort if there is no memory */
-    cache = g_try_malloc(sizeof(*cache));
-    if (!cache) {
+    table = g_try_new0(CacheTable, 1);
+    if (!table) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
                    "Failed to allocate cache");
         return NULL;
     }
-    cache->page_size = page_size;
-    cache->num_items = 0;
-    cache->max_num_items = num_pages;
+    table->ways = MIN(num_pages, CACHE_WAYS);
+    table->num_sets = num_pages / table->ways;
+    table->set_bits = ctz64(table->num_sets);
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache sets to %zu, %u ways\n", table->num_sets,
+            table->ways);
 
-    /* We prefer not to abort if there is no memory */
-    cache->page_cache = g_try_malloc((cache->max_num_items) *
-                                     sizeof(*cache->page_cache));
-    if (!cache->page_cache) {
+    /* Free entries have no data, it_addr and it_age don't matter */
+    table->items = g_try_new0(CacheItem, num_pages);
+    if (!table->items) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
                    "Failed to allocate page cache");
-        g_free(cache);
+        g_free(table);
+        return NULL;
+    }
+
+    return table;
+}
+
+static void cache_table_free(PageCache *cache, CacheTable *table)
+{
+    size_t i;
+
+    for (i = 0; i < table->num_sets * table->ways; i++) {
+        cache->num_items -= !!table->items[i].it_data;
+        g_free(table->items[i].it_data);
+    }
+    g_free(table->items);
+    g_free(table);
+}
+
+PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
+{
+    PageCache *cache;
+
+    /* We prefer not to abort if there is no memory */
+    cache = g_try_new0(PageCache, 1);
+    if (!cache) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
+                   "Failed to allocate cache");
         return NULL;
     }
+    cache->page_size = page_size;
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        cache->page_cache[i].it_data = NULL;
-        cache->page_cache[i].it_age = 0;
-        cache->page_cache[i].it_addr = -1;
+    cache->table = cache_table_new(new_size, page_size, errp);
+    if (!cache->table) {
+        g_free(cache);
+        return NULL;
     }
+    cache->max_num_items = new_size / page_size;
 
     return cache;
 }
 
 void cache_fini(PageCache *cache)
 {
-    int64_t i;
-
     g_assert(cache);
-    g_assert(cache->page_cache);
+    g_assert(cache->table);
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        g_free(cache->page_cache[i].it_data);
+    if (cache->old_table) {
+        cache_table_free(cache, cache->old_table);
     }
-
-    g_free(cache->page_cache);
-    cache->page_cache = NULL;
+    cache_table_free(cache, cache->table);
+    g_assert(!cache->num_items);
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+int cache_resize(PageCache *cache, int64_t new_size, Error **errp)
 {
-    g_assert(cache->max_num_items);
-    return (address / cache->page_size) & (cache->max_num_items - 1);
+    CacheTable *table;
+
+    table = cache_table_new(new_size, cache->page_size, errp);
+    if (!table) {
+        return -1;
+    }
+
+    /* Only one table is drained at a time, drop what is left of it */
+    if (cache->old_table) {
+        cache_table_free(cache, cache->old_table);
+    }
+    cache->old_table = cache->table;
+    cache->old_pos = 0;
+    cache->table = table;
+    cache->max_num_items = new_size / cache->page_size;
+
+    return 0;
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+static CacheItem *cache_get_set(const CacheTable *table, size_t page_size,
+                                uint64_t addr)
 {
-    size_t pos;
+    uint64_t pfn = addr / page_size;
+    size_t set;
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    /*
+     * RAMBlocks start at aligned offsets, fold the high bits in so that
+     * the same page of two blocks does not always land in the same set.
+     */
+    set = (pfn ^ (pfn >> table->set_bits)) & (table->num_sets - 1);
 
-    pos = cache_get_cache_pos(cache, addr);
+    return &table->items[set * table->ways];
+}
 
-    return &cache->page_cache[pos];
+static CacheItem *cache_find_in_set(CacheItem *set, unsigned int ways,
+                                    uint64_t addr)
+{
+    unsigned int i;
+
+    for (i = 0; i < ways; i++) {
+        if (set[i].it_data && set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
 }
 
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+/*
+ * Pick the entry of @set that a new page can use: a free one if there
+ * is any, otherwise the least recently used page of the oldest
+ * generation.
+ */
+static CacheItem *cache_find_victim(CacheItem *set, unsigned int ways)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *victim = &set[0];
+    unsigned int i;
+
+    for (i = 0; i < ways; i++) {
+        if (!set[i].it_data) {
+            return &set[i];
+        }
+        if (set[i].it_age < victim->it_age ||
+            (set[i].it_age == victim->it_age &&
+             set[i].it_lru < victim->it_lru)) {
+            victim = &set[i];
+        }
+    }
+    return victim;
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
-                     uint64_t current_age)
+/*
+ * Move @it from the old table to a free entry of the current one.  The
+ * page is dropped if its set is full: the pages that are already there
+ * were used since the resize.
+ */
+static CacheItem *cache_move_item(PageCache *cache, CacheItem *it)
 {
+    CacheItem *set = cache_get_set(cache->table, cache->page_size,
+                                   it->it_addr);
+    CacheItem *dst = cache_find_victim(set, cache->table->ways);
+
+    if (dst->it_data) {
+        g_free(it->it_data);
+        it->it_data = NULL;
+        cache->num_items--;
+        return NULL;
+    }
+
+    *dst = *it;
+    it->it_data = NULL;
+    return dst;
+}
+
+static void cache_drain_old_table(PageCache *cache)
+{
+    CacheTable *old = cache->old_table;
+    size_t end = MIN(cache->old_pos + CACHE_DRAIN_SETS, old->num_sets);
+    size_t i;
+
+    for (i = cache->old_pos * old->ways; i < end * old->ways; i++) {
+        if (old->items[i].it_data) {
+            cache_move_item(cache, &old->items[i]);
+        }
+    }
+
+    cache->old_pos = end;
+    if (cache->old_pos == old->num_sets) {
+        DPRINTF("Done moving the pages of the previous table\n");
+        cache_table_free(cache, old);
+        cache->old_table = NULL;
+    }
+}
+
+static CacheItem *cache_get_by_addr(PageCache *cache, uint64_t addr)
+{
+    CacheTable *table;
     CacheItem *it;
 
-    it = cache_get_by_addr(cache, addr);
+    g_assert(cache);
+    table = cache->table;
+    g_assert(table);
+
+    it = cache_find_in_set(cache_get_set(table, cache->page_size, addr),
+                           table->ways, addr);
+    if (!it && cache->old_table) {
+        it = cache_find_in_set(cache_get_set(cache->old_table,
+                                             cache->page_size, addr),
+                               cache->old_table->ways, addr);
+        if (it) {
+            it = cache_move_item(cache, it);
+        }
+    }
+
+    return it;
+}
+
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr)
+{
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
+}
+
+bool cache_is_cached(PageCache *cache, uint64_t addr, uint64_t current_age)
+{
+    CacheItem *it;
 
-    if (it->it_addr == addr) {
+    if (cache->old_table) {
+        cache_drain_old_table(cache);
+    }
+
+    it = cache_get_by_addr(cache, addr);
+    if (it) {
         /* update the it_age when the cache hit */
         it->it_age = current_age;
+        it->it_lru = ++cache->lru_clock;
         return true;
     }
     return false;
@@ -154,17 +331,28 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age)
 {
-
     CacheItem *it;
+    int ret = 0;
+
+    if (cache->old_table) {
+        cache_drain_old_table(cache);
+    }
 
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
-
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+    if (!it) {
+        it = cache_find_victim(cache_get_set(cache->table, cache->page_size,
+                                             addr),
+                               cache->table->ways);
+        if (it->it_data) {
+            if (it->it_age + CACHED_PAGE_LIFETIME > current_age) {
+                /* every page of the set is fresh, don't replace any */
+                return -1;
+            }
+            ret = 1;
+        }
     }
+
     /* allocate page */
     if (!it->it_data) {
         it->it_data = g_try_malloc(cache->page_size);
@@ -178,7 +366,8 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
     memcpy(it->it_data, pdata, cache->page_size);
 
     it->it_age = current_age;
+    it->it_lru = ++cache->lru_clock;
     it->it_addr = addr;
 
-    return 0;
+    return ret;
 }
@@ -1,6 +1,7 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set associative cache indexed by a hash of the page
+ * address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -35,6 +36,22 @@ PageCache *cache_init(int64_t cache_size, size_t page_size, Error **errp);
  */
 void cache_fini(PageCache *cache);
 
+/**
+ * cache_resize: change the size of the cache
+ *
+ * The cached pages are kept.  They are moved to the new layout when they
+ * are used and in small batches on every cache access, so this does not
+ * walk the whole cache.
+ *
+ * Returns 0 on success or -1 on error, in which case the cache is left
+ * untouched
+ *
+ * @cache: pointer to the PageCache struct
+ * @new_size: new cache size in bytes
+ * @errp: set *errp if the check failed, with reason
+ */
+int cache_resize(PageCache *cache, int64_t new_size, Error **errp);
+
 /**
  * cache_is_cached: Checks to see if the page is cached
  *
@@ -44,8 +61,7 @@ void cache_fini(PageCache *cache);
  * @addr: page addr
  * @current_age: current bitmap generation
  */
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
-                     uint64_t current_age);
+bool cache_is_cached(PageCache *cache, uint64_t addr, uint64_t current_age);
 
 /**
  * get_cached_data: Get the data cached for an addr
@@ -55,13 +71,18 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
  * @cache pointer to the PageCache struct
  * @addr: page addr
  */
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr);
 
 /**
  * cache_insert: insert the page into the cache. the page cache
  * will dup the data on insert. the previous value will be overwritten
  *
- * Returns -1 when the page isn't inserted into cache
+ * When the set of the page is full, the least recently used page of the
+ * oldest generation is replaced, unless it was used in the last two
+ * generations.
+ *
+ * Returns -1 when the page isn't inserted into cache, 1 when another
+ * page was evicted to make room for it, 0 otherwise
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
@@ -28,6 +28,8 @@
 #include "sysemu/sysemu.h"
 #include "sysemu/balloon.h"
 #include "qemu/error-report.h"
+#include "qemu-file-channel.h"
+#include "socket.h"
 #include "trace.h"
 
 /* Arbitrary limit on size of each discard command,
@@ -534,8 +536,17 @@ static void postcopy_balloon_inhibit(bool state)
  */
 int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
+    int i;
+
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    if (mis->have_preempt_thread) {
+        /* The thread quits once it read the end of the preempt channel */
+        trace_postcopy_ram_incoming_cleanup_preempt_join();
+        qemu_thread_join(&mis->preempt_thread);
+        mis->have_preempt_thread = false;
+    }
+
     if (mis->have_fault_thread) {
         Error *local_err = NULL;
 
@@ -574,9 +585,11 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 
     postcopy_state_set(POSTCOPY_INCOMING_END);
 
-    if (mis->postcopy_tmp_page) {
-        munmap(mis->postcopy_tmp_page, mis->largest_page_size);
-        mis->postcopy_tmp_page = NULL;
+    for (i = 0; i < RAM_CHANNEL_MAX; i++) {
+        if (mis->postcopy_tmp_pages[i]) {
+            munmap(mis->postcopy_tmp_pages[i], mis->largest_page_size);
+            mis->postcopy_tmp_pages[i] = NULL;
+        }
     }
     if (mis->postcopy_tmp_zero_page) {
         munmap(mis->postcopy_tmp_zero_page, mis->largest_page_size);
@@ -865,6 +878,21 @@ static bool postcopy_pause_fault_thread(MigrationIncomingState *mis)
 /*
  * Handle faults detected by the USERFAULT markings
  */
+/*
+ * Length of the page request sent to the source for a fault at @offset:
+ * the faulting host page, followed by the postcopy-prefetch-size.  The
+ * source sends the host page through the preempt channel if there is one,
+ * and the rest through the main channel before the background pages.
+ */
+static size_t postcopy_request_len(RAMBlock *rb, ram_addr_t offset)
+{
+    size_t pagesize = qemu_ram_pagesize(rb);
+    uint64_t len;
+
+    len = pagesize + ROUND_UP(migrate_postcopy_prefetch_size(), pagesize);
+    return MIN(len, qemu_ram_get_used_length(rb) - offset);
+}
+
 static void *postcopy_ram_fault_thread(void *opaque)
 {
     MigrationIncomingState *mis = opaque;
@@ -899,6 +927,7 @@ static void *postcopy_ram_fault_thread(void *opaque)
 
     while (true) {
         ram_addr_t rb_offset;
+        size_t req_len;
         int poll_result;
 
         /*
@@ -983,6 +1012,7 @@ static void *postcopy_ram_fault_thread(void *opaque)
             }
 
             rb_offset &= ~(qemu_ram_pagesize(rb) - 1);
+            req_len = postcopy_request_len(rb, rb_offset);
             trace_postcopy_ram_fault_thread_request(msg.arg.pagefault.address,
                                                 qemu_ram_get_idstr(rb),
                                                 rb_offset,
@@ -994,20 +1024,21 @@ static void *postcopy_ram_fault_thread(void *opaque)
 retry:
             /*
              * Send the request to the source - we want to request one
-             * of our host page sizes (which is >= TPS)
+             * of our host page sizes (which is >= TPS), plus the prefetch
+             * window that follows it
              */
             if (rb != mis->last_rb) {
                 mis->last_rb = rb;
                 ret = migrate_send_rp_req_pages(mis,
                                                 qemu_ram_get_idstr(rb),
                                                 rb_offset,
-                                                qemu_ram_pagesize(rb));
+                                                req_len);
             } else {
                 /* Save some space */
                 ret = migrate_send_rp_req_pages(mis,
                                                 NULL,
                                                 rb_offset,
-                                                qemu_ram_pagesize(rb));
+                                                req_len);
             }
 
             if (ret) {
@@ -1087,6 +1118,57 @@ retry:
     return NULL;
 }
 
+/*
+ * Returns a zeroed page of the largest page size, used to place zero
+ * huge pages, or NULL on error
+ */
+static void *postcopy_get_tmp_zero_page(MigrationIncomingState *mis)
+{
+    if (!mis->postcopy_tmp_zero_page) {
+        void *page = mmap(NULL, mis->largest_page_size,
+                          PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (page == MAP_FAILED) {
+            error_report("%s: %s mapping large zero page",
+                         __func__, strerror(errno));
+            return NULL;
+        }
+        memset(page, '\0', mis->largest_page_size);
+        mis->postcopy_tmp_zero_page = page;
+    }
+
+    return mis->postcopy_tmp_zero_page;
+}
+
+/*
+ * Loads the pages that the source sends through the postcopy preempt
+ * channel, next to the listen thread that loads the main channel.
+ */
+static void *postcopy_preempt_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    int ret;
+
+    trace_postcopy_preempt_thread_entry();
+    rcu_register_thread();
+
+    ret = ram_load_postcopy_preempt(mis->postcopy_qemufile_dst);
+    if (ret) {
+        /*
+         * Nothing more can come through this channel; a network
+         * failure shows up on the main channel too, and the source
+         * falls back to it for the requested pages.
+         */
+        error_report("%s: failed to load the postcopy preempt channel: %d",
+                     __func__, ret);
+    }
+
+    rcu_unregister_thread();
+    trace_postcopy_preempt_thread_exit(ret);
+    return NULL;
+}
+
 int postcopy_ram_enable_notify(MigrationIncomingState *mis)
 {
     /* Open the fd for the kernel to give us userfaults */
@@ -1121,6 +1203,19 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
     qemu_sem_destroy(&mis->fault_thread_sem);
     mis->have_fault_thread = true;
 
+    if (mis->postcopy_qemufile_dst || migrate_use_multifd()) {
+        /* Allocate it now, several loading threads place zero pages */
+        if (!postcopy_get_tmp_zero_page(mis)) {
+            return -1;
+        }
+    }
+    if (mis->postcopy_qemufile_dst) {
+        qemu_thread_create(&mis->preempt_thread, "postcopy/preempt",
+                           postcopy_preempt_thread, mis,
+                           QEMU_THREAD_JOINABLE);
+        mis->have_preempt_thread = true;
+    }
+
     /* Mark so that we get notified of accesses to unwritten areas */
     if (foreach_not_ignored_block(ram_block_enable_notify, mis)) {
         error_report("ram_block_enable_notify failed");
@@ -1133,6 +1228,9 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
      */
     postcopy_balloon_inhibit(true);
 
+    /* The multifd channels can place pages from now on */
+    qemu_event_set(&mis->postcopy_ram_ready_event);
+
     trace_postcopy_ram_enable_notify();
 
     return 0;
@@ -1234,22 +1332,12 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
                                                                       host));
     } else {
         /* The kernel can't use UFFDIO_ZEROPAGE for hugepages */
-        if (!mis->postcopy_tmp_zero_page) {
-            mis->postcopy_tmp_zero_page = mmap(NULL, mis->largest_page_size,
-                                               PROT_READ | PROT_WRITE,
-                                               MAP_PRIVATE | MAP_ANONYMOUS,
-                                               -1, 0);
-            if (mis->postcopy_tmp_zero_page == MAP_FAILED) {
-                int e = errno;
-                mis->postcopy_tmp_zero_page = NULL;
-                error_report("%s: %s mapping large zero page",
-                             __func__, strerror(e));
-                return -e;
-            }
-            memset(mis->postcopy_tmp_zero_page, '\0', mis->largest_page_size);
+        void *zero_page = postcopy_get_tmp_zero_page(mis);
+
+        if (!zero_page) {
+            return -ENOMEM;
         }
-        return postcopy_place_page(mis, host, mis->postcopy_tmp_zero_page,
-                                   rb);
+        return postcopy_place_page(mis, host, zero_page, rb);
     }
 }
 
@@ -1261,20 +1349,21 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
  * Returns: Pointer to allocated page
  *
  */
-void *postcopy_get_tmp_page(MigrationIncomingState *mis)
+void *postcopy_get_tmp_page(MigrationIncomingState *mis, int channel)
 {
-    if (!mis->postcopy_tmp_page) {
-        mis->postcopy_tmp_page = mmap(NULL, mis->largest_page_size,
-                             PROT_READ | PROT_WRITE, MAP_PRIVATE |
-                             MAP_ANONYMOUS, -1, 0);
-        if (mis->postcopy_tmp_page == MAP_FAILED) {
-            mis->postcopy_tmp_page = NULL;
+    if (!mis->postcopy_tmp_pages[channel]) {
+        void *page = mmap(NULL, mis->largest_page_size,
+                          PROT_READ | PROT_WRITE, MAP_PRIVATE |
+                          MAP_ANONYMOUS, -1, 0);
+
+        if (page == MAP_FAILED) {
             error_report("%s: %s", __func__, strerror(errno));
             return NULL;
         }
+        mis->postcopy_tmp_pages[channel] = page;
     }
 
-    return mis->postcopy_tmp_page;
+    return mis->postcopy_tmp_pages[channel];
 }
 
 #else
@@ -1334,7 +1423,7 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
     return -1;
 }
 
-void *postcopy_get_tmp_page(MigrationIncomingState *mis)
+void *postcopy_get_tmp_page(MigrationIncomingState *mis, int channel)
 {
     assert(0);
     return NULL;
@@ -1492,3 +1581,68 @@ void postcopy_unregister_shared_ufd(struct PostCopyFD *pcfd)
         }
     }
 }
+
+/*
+ * postcopy-preempt: the source connects a second channel to the
+ * destination while precopy runs.  Once postcopy starts, the pages that
+ * the destination asks for go through it, so that they do not wait
+ * behind the background pages filling the main channel.
+ */
+static void postcopy_preempt_send_channel_new(QIOTask *task, gpointer opaque)
+{
+    MigrationState *s = opaque;
+    QIOChannel *ioc = QIO_CHANNEL(qio_task_get_source(task));
+    Error *local_err = NULL;
+
+    if (qio_task_propagate_error(task, &local_err)) {
+        /* The destination doesn't start loading without this channel */
+        migrate_set_error(s, local_err);
+        error_free(local_err);
+        if (s->state == MIGRATION_STATUS_SETUP ||
+            s->state == MIGRATION_STATUS_ACTIVE) {
+            migrate_set_state(&s->state, s->state, MIGRATION_STATUS_FAILED);
+        }
+        qemu_mutex_lock(&s->qemu_file_lock);
+        if (s->to_dst_file) {
+            qemu_file_shutdown(s->to_dst_file);
+        }
+        qemu_mutex_unlock(&s->qemu_file_lock);
+    } else {
+        qio_channel_set_name(ioc, "migration-postcopy-preempt");
+        /* Requested pages are latency bound */
+        qio_channel_set_delay(ioc, false);
+        s->postcopy_qemufile_src = qemu_fopen_channel_output(ioc);
+        qemu_file_set_blocking(s->postcopy_qemufile_src, true);
+        trace_postcopy_preempt_new_channel();
+    }
+
+    /* The waiter checks postcopy_qemufile_src to know how it went */
+    qemu_sem_post(&s->postcopy_qemufile_src_sem);
+    object_unref(OBJECT(ioc));
+}
+
+void postcopy_preempt_setup(MigrationState *s)
+{
+    socket_send_channel_create(postcopy_preempt_send_channel_new, s);
+}
+
+int postcopy_preempt_wait_channel(MigrationState *s)
+{
+    if (s->postcopy_qemufile_src) {
+        return 0;
+    }
+    qemu_sem_wait(&s->postcopy_qemufile_src_sem);
+    if (!s->postcopy_qemufile_src) {
+        error_report("postcopy-preempt channel is not connected");
+        return -1;
+    }
+    return 0;
+}
+
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file)
+{
+    /* Read by the preempt thread, outside of any coroutine */
+    qemu_file_set_blocking(file, true);
+    mis->postcopy_qemufile_dst = file;
+    trace_postcopy_preempt_new_channel();
+}
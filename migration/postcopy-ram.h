@@ -13,6 +13,9 @@
 #ifndef QEMU_POSTCOPY_RAM_H
 #define QEMU_POSTCOPY_RAM_H
 
+/* Upper limit of the postcopy-prefetch-size parameter */
+#define POSTCOPY_PREFETCH_SIZE_MAX (64 * 1024 * 1024)
+
 /* Return true if the host supports everything we need to do postcopy-ram */
 bool postcopy_ram_supported_by_host(MigrationIncomingState *mis);
 
@@ -105,10 +108,10 @@ typedef enum {
 
 /*
  * Allocate a page of memory that can be mapped at a later point in time
- * using postcopy_place_page
+ * using postcopy_place_page, one for each RamChannel
  * Returns: Pointer to allocated page
  */
-void *postcopy_get_tmp_page(MigrationIncomingState *mis);
+void *postcopy_get_tmp_page(MigrationIncomingState *mis, int channel);
 
 PostcopyState postcopy_state_get(void);
 /* Set the state and return the old state */
@@ -189,4 +192,14 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd, uint64_t client_addr,
 int postcopy_request_shared_page(struct PostCopyFD *pcfd, RAMBlock *rb,
                                  uint64_t client_addr, uint64_t offset);
 
+/*
+ * postcopy-preempt, source side: start connecting the channel for the
+ * pages requested by the destination
+ */
+void postcopy_preempt_setup(MigrationState *s);
+/* Wait for the connection, returns 0 if the channel can be used */
+int postcopy_preempt_wait_channel(MigrationState *s);
+/* postcopy-preempt, destination side: @file is the preempt channel */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file);
+
 #endif
@@ -72,16 +72,24 @@ static ssize_t channel_writev_buffer(void *opaque,
 }
 
 
-static ssize_t channel_get_buffer(void *opaque,
-                                  uint8_t *buf,
-                                  int64_t pos,
-                                  size_t size)
+static ssize_t channel_get_buffer_fds(void *opaque,
+                                      uint8_t *buf,
+                                      int64_t pos,
+                                      size_t size,
+                                      int **fds,
+                                      size_t *nfds)
 {
     QIOChannel *ioc = QIO_CHANNEL(opaque);
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
     ssize_t ret;
 
+    if (!qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_FD_PASS)) {
+        fds = NULL;
+        nfds = NULL;
+    }
+
     do {
-        ret = qio_channel_read(ioc, (char *)buf, size, NULL);
+        ret = qio_channel_readv_full(ioc, &iov, 1, fds, nfds, NULL);
         if (ret < 0) {
             if (ret == QIO_CHANNEL_ERR_BLOCK) {
                 if (qemu_in_coroutine()) {
@@ -100,6 +108,97 @@ static ssize_t channel_get_buffer(void *opaque,
 }
 
 
+static int channel_put_fd(void *opaque, int fd)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+    uint8_t byte = 0;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+
+    if (!qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_FD_PASS)) {
+        return -ENOTSUP;
+    }
+    if (qio_channel_writev_full_all(ioc, &iov, 1, &fd, 1, 0, NULL)) {
+        /* XXX handle Error * object */
+        return -EIO;
+    }
+    return 0;
+}
+
+
+static int64_t channel_seek(void *opaque, int64_t offset, int whence)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+    off_t ret;
+
+    if (!qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE)) {
+        return -ESPIPE;
+    }
+
+    ret = qio_channel_io_seek(ioc, offset, whence, NULL);
+    if (ret < 0) {
+        /* XXX handle Error * object */
+        return -EIO;
+    }
+    return ret;
+}
+
+
+static ssize_t channel_prwv(QIOChannel *ioc, const struct iovec *iov,
+                            int iovcnt, int64_t offset, bool is_write)
+{
+    ssize_t done = 0;
+    struct iovec *local_iov = g_new(struct iovec, iovcnt);
+    struct iovec *local_iov_head = local_iov;
+    unsigned int nlocal_iov = iovcnt;
+
+    nlocal_iov = iov_copy(local_iov, nlocal_iov,
+                          iov, iovcnt,
+                          0, iov_size(iov, iovcnt));
+
+    while (nlocal_iov > 0) {
+        ssize_t len;
+
+        if (is_write) {
+            len = qio_channel_pwritev(ioc, local_iov, nlocal_iov,
+                                      offset + done, NULL);
+        } else {
+            len = qio_channel_preadv(ioc, local_iov, nlocal_iov,
+                                     offset + done, NULL);
+        }
+        if (len < 0) {
+            /* XXX handle Error objects */
+            done = -EIO;
+            goto cleanup;
+        }
+        if (len == 0) {
+            /* end of file */
+            break;
+        }
+
+        iov_discard_front(&local_iov, &nlocal_iov, len);
+        done += len;
+    }
+
+ cleanup:
+    g_free(local_iov_head);
+    return done;
+}
+
+
+static ssize_t channel_pwritev(void *opaque, const struct iovec *iov,
+                               int iovcnt, int64_t offset)
+{
+    return channel_prwv(QIO_CHANNEL(opaque), iov, iovcnt, offset, true);
+}
+
+
+static ssize_t channel_preadv(void *opaque, const struct iovec *iov,
+                              int iovcnt, int64_t offset)
+{
+    return channel_prwv(QIO_CHANNEL(opaque), iov, iovcnt, offset, false);
+}
+
+
 static int channel_close(void *opaque)
 {
     QIOChannel *ioc = QIO_CHANNEL(opaque);
@@ -160,11 +259,13 @@ static QEMUFile *channel_get_output_return_path(void *opaque)
 }
 
 static const QEMUFileOps channel_input_ops = {
-    .get_buffer = channel_get_buffer,
+    .get_buffer_fds = channel_get_buffer_fds,
     .close = channel_close,
     .shut_down = channel_shutdown,
     .set_blocking = channel_set_blocking,
     .get_return_path = channel_get_input_return_path,
+    .seek = channel_seek,
+    .preadv = channel_preadv,
 };
 
 
@@ -174,6 +275,9 @@ static const QEMUFileOps channel_output_ops = {
     .shut_down = channel_shutdown,
     .set_blocking = channel_set_blocking,
     .get_return_path = channel_get_output_return_path,
+    .seek = channel_seek,
+    .pwritev = channel_pwritev,
+    .put_fd = channel_put_fd,
 };
 
 
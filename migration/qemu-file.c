@@ -50,6 +50,9 @@ struct QEMUFile {
     struct iovec iov[MAX_IOV_SIZE];
     unsigned int iovcnt;
 
+    /* file descriptors received and not taken by qemu_file_recv_fd() yet */
+    GArray *fds;
+
     int last_error;
 };
 
@@ -293,8 +296,23 @@ static ssize_t qemu_fill_buffer(QEMUFile *f)
     f->buf_index = 0;
     f->buf_size = pending;
 
-    len = f->ops->get_buffer(f->opaque, f->buf + pending, f->pos,
-                        IO_BUF_SIZE - pending);
+    if (f->ops->get_buffer_fds) {
+        int *fds = NULL;
+        size_t nfds = 0;
+
+        len = f->ops->get_buffer_fds(f->opaque, f->buf + pending, f->pos,
+                                     IO_BUF_SIZE - pending, &fds, &nfds);
+        if (nfds) {
+            if (!f->fds) {
+                f->fds = g_array_new(false, false, sizeof(int));
+            }
+            g_array_append_vals(f->fds, fds, nfds);
+        }
+        g_free(fds);
+    } else {
+        len = f->ops->get_buffer(f->opaque, f->buf + pending, f->pos,
+                                 IO_BUF_SIZE - pending);
+    }
     if (len > 0) {
         f->buf_size += len;
         f->pos += len;
@@ -312,6 +330,161 @@ void qemu_update_position(QEMUFile *f, size_t size)
     f->pos += size;
 }
 
+/*
+ * Random access to the backing file
+ *
+ * Some parts of the stream can be written at a fixed offset of a seekable
+ * backing file (see the mapped-ram capability), outside of the buffered
+ * sequential stream.  The stream itself can be moved past them.
+ */
+
+bool qemu_file_is_seekable(QEMUFile *f)
+{
+    return f->ops->seek && f->ops->seek(f->opaque, 0, SEEK_CUR) >= 0;
+}
+
+/*
+ * The offset in the backing file of the next byte written to or read from
+ * the stream, or a negative errno value
+ */
+int64_t qemu_file_get_offset(QEMUFile *f)
+{
+    int64_t ret;
+
+    if (!f->ops->seek) {
+        return -ESPIPE;
+    }
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    }
+
+    ret = f->ops->seek(f->opaque, 0, SEEK_CUR);
+    if (ret >= 0 && !qemu_file_is_writable(f)) {
+        /* The data left in the buffer was already read from the file */
+        ret -= f->buf_size - f->buf_index;
+    }
+    return ret;
+}
+
+/*
+ * Continue the stream at @offset of the backing file.  Buffered output is
+ * flushed first, buffered input is dropped.
+ */
+void qemu_file_set_offset(QEMUFile *f, int64_t offset)
+{
+    int64_t ret;
+
+    if (!f->ops->seek) {
+        qemu_file_set_error(f, -ESPIPE);
+        return;
+    }
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    } else {
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+
+    ret = f->ops->seek(f->opaque, offset, SEEK_SET);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+}
+
+/*
+ * Write @iov at @offset of the backing file.  This doesn't touch the
+ * stream, so it can be called from any thread; errors are returned as a
+ * negative errno value and not recorded in @f.
+ */
+int qemu_pwritev(QEMUFile *f, const struct iovec *iov, int iovcnt,
+                 int64_t offset)
+{
+    ssize_t ret;
+
+    if (!f->ops->pwritev) {
+        return -ESPIPE;
+    }
+    ret = f->ops->pwritev(f->opaque, iov, iovcnt, offset);
+    if (ret < 0) {
+        return ret;
+    }
+    return ret == iov_size(iov, iovcnt) ? 0 : -EIO;
+}
+
+/*
+ * Read @iov from @offset of the backing file, with the same rules as
+ * qemu_pwritev().  Reading past the end of file is an error.
+ */
+int qemu_preadv(QEMUFile *f, const struct iovec *iov, int iovcnt,
+                int64_t offset)
+{
+    ssize_t ret;
+
+    if (!f->ops->preadv) {
+        return -ESPIPE;
+    }
+    ret = f->ops->preadv(f->opaque, iov, iovcnt, offset);
+    if (ret < 0) {
+        return ret;
+    }
+    return ret == iov_size(iov, iovcnt) ? 0 : -EIO;
+}
+
+/*
+ * Passing file descriptors
+ *
+ * On a unix socket, a file descriptor travels along with a byte of the
+ * stream.  The receiver gets it once it has read that byte, so the
+ * descriptors are taken in the order they were sent.
+ */
+
+/*
+ * Send @fd, which stays owned by the caller.
+ * Returns 0 on success or a negative errno value.
+ */
+int qemu_file_send_fd(QEMUFile *f, int fd)
+{
+    int ret;
+
+    if (!f->ops->put_fd) {
+        return -ENOTSUP;
+    }
+    qemu_fflush(f);
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+    ret = f->ops->put_fd(f->opaque, fd);
+    if (ret) {
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+    f->pos++;
+    f->bytes_xfer++;
+    return 0;
+}
+
+/*
+ * Receive the next file descriptor sent with qemu_file_send_fd(), which
+ * belongs to the caller from now on.
+ * Returns the file descriptor or a negative errno value.
+ */
+int qemu_file_recv_fd(QEMUFile *f)
+{
+    int fd;
+
+    qemu_get_byte(f);
+    if (qemu_file_get_error(f)) {
+        return qemu_file_get_error(f);
+    }
+    if (!f->fds || !f->fds->len) {
+        return -EBADF;
+    }
+    fd = g_array_index(f->fds, int, 0);
+    g_array_remove_index(f->fds, 0);
+    return fd;
+}
+
 /** Closes the file
  *
  * Returns negative error value if any error happened on previous operations or
@@ -338,6 +511,14 @@ int qemu_fclose(QEMUFile *f)
     if (f->last_error) {
         ret = f->last_error;
     }
+    if (f->fds) {
+        guint i;
+
+        for (i = 0; i < f->fds->len; i++) {
+            close(g_array_index(f->fds, int, i));
+        }
+        g_array_free(f->fds, true);
+    }
     g_free(f);
     trace_qemu_file_fclose();
     return ret;
@@ -99,6 +99,38 @@ typedef QEMUFile *(QEMURetPathFunc)(void *opaque);
  */
 typedef int (QEMUFileShutdownFunc)(void *opaque, bool rd, bool wr);
 
+/*
+ * Move the I/O position of a seekable backing file, see lseek().
+ * Returns the new position or a negative errno value.
+ */
+typedef int64_t (QEMUFileSeekFunc)(void *opaque, int64_t offset, int whence);
+
+/*
+ * Write or read a whole iovec at a given offset of a seekable backing
+ * file, without moving its I/O position.  Returns the number of bytes
+ * transferred, which is only short at the end of file when reading, or a
+ * negative errno value.
+ */
+typedef ssize_t (QEMUFilePwritevFunc)(void *opaque, const struct iovec *iov,
+                                      int iovcnt, int64_t offset);
+typedef ssize_t (QEMUFilePreadvFunc)(void *opaque, const struct iovec *iov,
+                                     int iovcnt, int64_t offset);
+
+/*
+ * Read like QEMUFileGetBufferFunc, and also return the file descriptors
+ * passed along with the data in a newly allocated array, see
+ * qio_channel_readv_full().
+ */
+typedef ssize_t (QEMUFileGetBufferFDsFunc)(void *opaque, uint8_t *buf,
+                                           int64_t pos, size_t size,
+                                           int **fds, size_t *nfds);
+
+/*
+ * Write one byte of data carrying the file descriptor @fd.
+ * Returns 0 on success or a negative errno value.
+ */
+typedef int (QEMUFilePutFDFunc)(void *opaque, int fd);
+
 typedef struct QEMUFileOps {
     QEMUFileGetBufferFunc *get_buffer;
     QEMUFileCloseFunc *close;
@@ -106,6 +138,11 @@ typedef struct QEMUFileOps {
     QEMUFileWritevBufferFunc *writev_buffer;
     QEMURetPathFunc *get_return_path;
     QEMUFileShutdownFunc *shut_down;
+    QEMUFileSeekFunc *seek;
+    QEMUFilePwritevFunc *pwritev;
+    QEMUFilePreadvFunc *preadv;
+    QEMUFileGetBufferFDsFunc *get_buffer_fds;
+    QEMUFilePutFDFunc *put_fd;
 } QEMUFileOps;
 
 typedef struct QEMUFileHooks {
@@ -157,6 +194,16 @@ void qemu_file_set_blocking(QEMUFile *f, bool block);
 
 size_t qemu_get_counted_string(QEMUFile *f, char buf[256]);
 
+bool qemu_file_is_seekable(QEMUFile *f);
+int64_t qemu_file_get_offset(QEMUFile *f);
+void qemu_file_set_offset(QEMUFile *f, int64_t offset);
+int qemu_pwritev(QEMUFile *f, const struct iovec *iov, int iovcnt,
+                 int64_t offset);
+int qemu_preadv(QEMUFile *f, const struct iovec *iov, int iovcnt,
+                int64_t offset);
+int qemu_file_send_fd(QEMUFile *f, int fd);
+int qemu_file_recv_fd(QEMUFile *f);
+
 void ram_control_before_iterate(QEMUFile *f, uint64_t flags);
 void ram_control_after_iterate(QEMUFile *f, uint64_t flags);
 void ram_control_load_hook(QEMUFile *f, uint64_t flags, void *data);
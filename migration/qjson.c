@@ -88,6 +88,23 @@ void json_prop_str(QJSON *json, const char *name, const char *str)
     qstring_append_chr(json->str, '"');
 }
 
+/*
+ * Append the members that were written to @src, which must not be
+ * finished, to the current object of @json.
+ */
+void json_append_members(QJSON *json, QJSON *src)
+{
+    /* Skip the "{ " of qjson_new() */
+    const char *members = qstring_get_str(src->str) + 2;
+
+    if (!*members) {
+        return;
+    }
+    json_emit_element(json, NULL);
+    qstring_append(json->str, members);
+    json->omit_comma = false;
+}
+
 const char *qjson_get_str(QJSON *json)
 {
     return qstring_get_str(json->str);
@@ -33,11 +33,14 @@
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/main-loop.h"
+#include "qemu/units.h"
 #include "qemu/pmem.h"
 #include "xbzrle.h"
 #include "ram.h"
+#include "multifd.h"
 #include "migration.h"
 #include "socket.h"
+#include "rdma.h"
 #include "migration/register.h"
 #include "migration/misc.h"
 #include "qemu-file.h"
@@ -57,6 +60,7 @@
 #include "qemu/uuid.h"
 #include "savevm.h"
 #include "qemu/iov.h"
+#include "qemu/userfaultfd.h"
 
 /***********************************************************/
 /* ram save/restore */
@@ -77,6 +81,18 @@
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
 
+/*
+ * mapped-ram: each RAMBlock in the block list of the stream is followed
+ * by a header and a region of the file that holds the bitmap of the pages
+ * present in the file and a slot for every page.  The stream goes on past
+ * the region.
+ */
+#define MAPPED_RAM_VERSION 1
+/* Alignment of the pages in the file, suitable for O_DIRECT */
+#define MAPPED_RAM_ALIGN (1 * MiB)
+/* Maximum size of a run of pages written at once without multifd */
+#define MAPPED_RAM_BATCH (1 * MiB)
+
 static inline bool is_zero_range(uint8_t *p, uint64_t size)
 {
     return buffer_is_zero(p, size);
@@ -118,7 +134,9 @@ static void XBZRLE_cache_unlock(void)
  * This function is called from qmp_migrate_set_cache_size in main
  * thread, possibly while a migration is in progress.  A running
  * migration may be using the cache and might finish during this call,
- * hence changes to the cache are protected by XBZRLE.lock().
+ * hence changes to the cache are protected by XBZRLE.lock().  The cached
+ * pages are kept and moved over by the migration thread as it uses the
+ * cache, so the lock is only held to set up the new cache layout.
  *
  * Returns 0 for success or -1 for error
  *
@@ -127,7 +145,6 @@ static void XBZRLE_cache_unlock(void)
  */
 int xbzrle_cache_resize(int64_t new_size, Error **errp)
 {
-    PageCache *new_cache;
     int64_t ret = 0;
 
     /* Check for truncation */
@@ -145,24 +162,28 @@ int xbzrle_cache_resize(int64_t new_size, Error **errp)
     XBZRLE_cache_lock();
 
     if (XBZRLE.cache != NULL) {
-        new_cache = cache_init(new_size, TARGET_PAGE_SIZE, errp);
-        if (!new_cache) {
-            ret = -1;
-            goto out;
-        }
-
-        cache_fini(XBZRLE.cache);
-        XBZRLE.cache = new_cache;
+        ret = cache_resize(XBZRLE.cache, new_size, errp);
     }
-out:
+
     XBZRLE_cache_unlock();
     return ret;
 }
 
+/*
+ * With local-ram, the destination takes over the file of the shared
+ * RAMBlocks instead of receiving their pages
+ */
+static bool ramblock_is_local(RAMBlock *block)
+{
+    return migrate_local_ram() && block->fd >= 0 &&
+           qemu_ram_is_shared(block);
+}
+
 static bool ramblock_is_ignored(RAMBlock *block)
 {
     return !qemu_ram_is_migratable(block) ||
-           (migrate_ignore_shared() && qemu_ram_is_shared(block));
+           (migrate_ignore_shared() && qemu_ram_is_shared(block)) ||
+           ramblock_is_local(block);
 }
 
 /* Should be holding either ram_list.mutex, or the RCU lock. */
@@ -301,6 +322,7 @@ struct RAMSrcPageRequest {
 
     QSIMPLEQ_ENTRY(RAMSrcPageRequest) next_req;
 };
+typedef QSIMPLEQ_HEAD(, RAMSrcPageRequest) RAMSrcPageRequestQueue;
 
 /* State of RAM for migration */
 struct RAMState {
@@ -310,6 +332,8 @@ struct RAMState {
     RAMBlock *last_seen_block;
     /* Last block from where we have sent data */
     RAMBlock *last_sent_block;
+    /* Same as last_sent_block for the postcopy preempt channel */
+    RAMBlock *preempt_last_sent_block;
     /* Last dirty target page we have sent */
     ram_addr_t last_page;
     /* last ram version we have seen */
@@ -327,6 +351,8 @@ struct RAMState {
     uint64_t bytes_xfer_prev;
     /* number of dirty pages since start_time */
     uint64_t num_dirty_pages_period;
+    /* vcpu-throttle: CPUState::dirty_pages of each vcpu at start_time */
+    uint64_t *vcpu_dirty_pages_prev;
     /* xbzrle misses since the beginning of the period */
     uint64_t xbzrle_cache_miss_prev;
 
@@ -350,7 +376,29 @@ struct RAMState {
     RAMBlock *last_req_rb;
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
-    QSIMPLEQ_HEAD(, RAMSrcPageRequest) src_page_requests;
+    RAMSrcPageRequestQueue src_page_requests;
+    /*
+     * The part of the requests past the faulting host page, i.e. the
+     * destination's postcopy-prefetch-size; also protected by
+     * src_page_req_mutex, and served after src_page_requests
+     */
+    RAMSrcPageRequestQueue src_prefetch_requests;
+    /*
+     * background-snapshot: userfault fd write protecting the guest RAM,
+     * -1 when write tracking is off
+     */
+    int uffdio_fd;
+    /*
+     * The run of saved pages whose write protection is still to be
+     * dropped, see ram_wt_release()
+     */
+    RAMBlock *wp_release_block;
+    ram_addr_t wp_release_start;
+    ram_addr_t wp_release_len;
+    /* mapped-ram: the run of pages still to be written to the file */
+    RAMBlock *mapped_block;
+    ram_addr_t mapped_start;
+    ram_addr_t mapped_len;
 };
 typedef struct RAMState RAMState;
 
@@ -407,6 +455,10 @@ struct PageSearchStatus {
     unsigned long page;
     /* Set once we wrap around */
     bool         complete_round;
+    /* The page was requested by a faulting destination */
+    bool         urgent;
+    /* The host page goes through the multifd channels */
+    bool         multifd;
 };
 typedef struct PageSearchStatus PageSearchStatus;
 
@@ -581,123 +633,6 @@ exit:
 #define MULTIFD_MAGIC 0x11223344U
 #define MULTIFD_VERSION 1
 
-#define MULTIFD_FLAG_SYNC (1 << 0)
-
-/* This value needs to be a multiple of qemu_target_page_size() */
-#define MULTIFD_PACKET_SIZE (512 * 1024)
-
-typedef struct {
-    uint32_t magic;
-    uint32_t version;
-    unsigned char uuid[16]; /* QemuUUID */
-    uint8_t id;
-    uint8_t unused1[7];     /* Reserved for future use */
-    uint64_t unused2[4];    /* Reserved for future use */
-} __attribute__((packed)) MultiFDInit_t;
-
-typedef struct {
-    uint32_t magic;
-    uint32_t version;
-    uint32_t flags;
-    /* maximum number of allocated pages */
-    uint32_t pages_alloc;
-    uint32_t pages_used;
-    /* size of the next packet that contains pages */
-    uint32_t next_packet_size;
-    uint64_t packet_num;
-    uint64_t unused[4];    /* Reserved for future use */
-    char ramblock[256];
-    uint64_t offset[];
-} __attribute__((packed)) MultiFDPacket_t;
-
-typedef struct {
-    /* number of used pages */
-    uint32_t used;
-    /* number of allocated pages */
-    uint32_t allocated;
-    /* global number of generated multifd packets */
-    uint64_t packet_num;
-    /* offset of each page */
-    ram_addr_t *offset;
-    /* pointer to each page */
-    struct iovec *iov;
-    RAMBlock *block;
-} MultiFDPages_t;
-
-typedef struct {
-    /* this fields are not changed once the thread is created */
-    /* channel number */
-    uint8_t id;
-    /* channel thread name */
-    char *name;
-    /* channel thread id */
-    QemuThread thread;
-    /* communication channel */
-    QIOChannel *c;
-    /* sem where to wait for more work */
-    QemuSemaphore sem;
-    /* this mutex protects the following parameters */
-    QemuMutex mutex;
-    /* is this channel thread running */
-    bool running;
-    /* should this thread finish */
-    bool quit;
-    /* thread has work to do */
-    int pending_job;
-    /* array of pages to sent */
-    MultiFDPages_t *pages;
-    /* packet allocated len */
-    uint32_t packet_len;
-    /* pointer to the packet */
-    MultiFDPacket_t *packet;
-    /* multifd flags for each packet */
-    uint32_t flags;
-    /* size of the next packet that contains pages */
-    uint32_t next_packet_size;
-    /* global number of generated multifd packets */
-    uint64_t packet_num;
-    /* thread local variables */
-    /* packets sent through this channel */
-    uint64_t num_packets;
-    /* pages sent through this channel */
-    uint64_t num_pages;
-}  MultiFDSendParams;
-
-typedef struct {
-    /* this fields are not changed once the thread is created */
-    /* channel number */
-    uint8_t id;
-    /* channel thread name */
-    char *name;
-    /* channel thread id */
-    QemuThread thread;
-    /* communication channel */
-    QIOChannel *c;
-    /* this mutex protects the following parameters */
-    QemuMutex mutex;
-    /* is this channel thread running */
-    bool running;
-    /* array of pages to receive */
-    MultiFDPages_t *pages;
-    /* packet allocated len */
-    uint32_t packet_len;
-    /* pointer to the packet */
-    MultiFDPacket_t *packet;
-    /* multifd flags for each packet */
-    uint32_t flags;
-    /* global number of generated multifd packets */
-    uint64_t packet_num;
-    /* thread local variables */
-    /* size of the next packet that contains pages */
-    uint32_t next_packet_size;
-    /* packets sent through this channel */
-    uint64_t num_packets;
-    /* pages sent through this channel */
-    uint64_t num_pages;
-    /* syncs main thread and channels */
-    QemuSemaphore sem_sync;
-} MultiFDRecvParams;
-
 static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
 {
     MultiFDInit_t msg;
@@ -760,6 +695,265 @@ static int multifd_recv_initial_packet(QIOChannel *c, Error **errp)
     return msg.id;
 }
 
+/* Multifd without compression */
+
+/**
+ * nocomp_send_setup: setup send side
+ *
+ * For no compression this function does nothing.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int nocomp_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    return 0;
+}
+
+/**
+ * nocomp_send_cleanup: cleanup send side
+ *
+ * For no compression this function does nothing.
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static void nocomp_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    return;
+}
+
+/**
+ * nocomp_send_prepare: prepare date to be able to send
+ *
+ * For no compression we just have to calculate the size of the
+ * packet.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @flags: packet flags, the compression method is added here
+ * @errp: pointer to an error
+ */
+static int nocomp_send_prepare(MultiFDSendParams *p, uint32_t used,
+                               uint32_t *flags, Error **errp)
+{
+    p->next_packet_size = used * qemu_target_page_size();
+    *flags |= MULTIFD_FLAG_NOCOMP;
+    return 0;
+}
+
+/**
+ * nocomp_send_write: do the actual write of the data
+ *
+ * For no compression we just have to write the data.  With zero copy
+ * the kernel sends straight from guest memory, and the channel is
+ * flushed on the next sync packet.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int nocomp_send_write(MultiFDSendParams *p, uint32_t used,
+                             Error **errp)
+{
+    struct iovec *iov = p->pages->iov;
+    uint32_t left = p->pages->num_iov;
+
+    /* Big packets can have more than IOV_MAX entries */
+    while (left) {
+        uint32_t n = MIN(left, IOV_MAX);
+
+        if (qio_channel_writev_full_all(p->c, iov, n, NULL, 0,
+                                        p->write_flags, errp)) {
+            return -1;
+        }
+        iov += n;
+        left -= n;
+    }
+    return 0;
+}
+
+/**
+ * nocomp_recv_setup: setup receive side
+ *
+ * For no compression this function does nothing.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int nocomp_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    return 0;
+}
+
+/**
+ * nocomp_recv_cleanup: setup receive side
+ *
+ * For no compression this function does nothing.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void nocomp_recv_cleanup(MultiFDRecvParams *p)
+{
+}
+
+/**
+ * nocomp_recv_pages: read the data from the channel into actual pages
+ *
+ * For no compression we just need to read things into the correct place.
+ * Runs of contiguous pages are read straight into guest memory with a
+ * single iov entry.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int nocomp_recv_pages(MultiFDRecvParams *p, uint32_t used,
+                             Error **errp)
+{
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    struct iovec *iov = p->pages->iov;
+    uint32_t left = p->pages->num_iov;
+
+    if (flags != MULTIFD_FLAG_NOCOMP) {
+        error_setg(errp, "multifd %d: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_NOCOMP);
+        return -1;
+    }
+    if (p->next_packet_size != used * qemu_target_page_size()) {
+        error_setg(errp, "multifd %d: received packet size %u expected %zu",
+                   p->id, p->next_packet_size,
+                   used * qemu_target_page_size());
+        return -1;
+    }
+
+    /* Big packets can have more than IOV_MAX entries */
+    while (left) {
+        uint32_t n = MIN(left, IOV_MAX);
+
+        if (qio_channel_readv_all(p->c, iov, n, errp)) {
+            return -1;
+        }
+        iov += n;
+        left -= n;
+    }
+    return 0;
+}
+
+static MultiFDMethods multifd_nocomp_ops = {
+    .send_setup = nocomp_send_setup,
+    .send_cleanup = nocomp_send_cleanup,
+    .send_prepare = nocomp_send_prepare,
+    .send_write = nocomp_send_write,
+    .recv_setup = nocomp_recv_setup,
+    .recv_cleanup = nocomp_recv_cleanup,
+    .recv_pages = nocomp_recv_pages
+};
+
+/* Multifd over RDMA */
+
+/**
+ * rdma_send_prepare: prepare date to be able to send
+ *
+ * The pages don't follow the packet in the channel, they are written
+ * into the destination memory with RDMA WRITEs.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @flags: packet flags, the compression method is added here
+ * @errp: pointer to an error
+ */
+static int rdma_send_prepare(MultiFDSendParams *p, uint32_t used,
+                             uint32_t *flags, Error **errp)
+{
+    p->next_packet_size = 0;
+    *flags |= MULTIFD_FLAG_NOCOMP;
+    return 0;
+}
+
+/**
+ * rdma_send_write: write the pages into the destination memory
+ *
+ * The writes have completed when this returns, and the destination
+ * sees them before the next packet of the channel.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int rdma_send_write(MultiFDSendParams *p, uint32_t used,
+                           Error **errp)
+{
+    if (rdma_send_channel_write_pages(p->c, p->pages->block, p->pages->iov,
+                                      p->pages->num_iov, errp) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * rdma_recv_pages: check the packet
+ *
+ * The pages are already in place, nothing is read from the channel.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int rdma_recv_pages(MultiFDRecvParams *p, uint32_t used,
+                           Error **errp)
+{
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+
+    if (flags != MULTIFD_FLAG_NOCOMP) {
+        error_setg(errp, "multifd %d: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_NOCOMP);
+        return -1;
+    }
+    if (p->next_packet_size) {
+        error_setg(errp, "multifd %d: received packet size %u expected 0",
+                   p->id, p->next_packet_size);
+        return -1;
+    }
+    return 0;
+}
+
+static MultiFDMethods multifd_rdma_ops = {
+    .send_setup = nocomp_send_setup,
+    .send_cleanup = nocomp_send_cleanup,
+    .send_prepare = rdma_send_prepare,
+    .send_write = rdma_send_write,
+    .recv_setup = nocomp_recv_setup,
+    .recv_cleanup = nocomp_recv_cleanup,
+    .recv_pages = rdma_recv_pages
+};
+
+static MultiFDMethods *multifd_ops[MULTIFD_COMPRESSION__MAX] = {
+    [MULTIFD_COMPRESSION_NONE] = &multifd_nocomp_ops,
+};
+
+void multifd_register_ops(int method, MultiFDMethods *ops)
+{
+    assert(0 < method && method < MULTIFD_COMPRESSION__MAX);
+    multifd_ops[method] = ops;
+}
+
 static MultiFDPages_t *multifd_pages_init(size_t size)
 {
     MultiFDPages_t *pages = g_new0(MultiFDPages_t, 1);
@@ -774,6 +968,7 @@ static MultiFDPages_t *multifd_pages_init(size_t size)
 static void multifd_pages_clear(MultiFDPages_t *pages)
 {
     pages->used = 0;
+    pages->num_iov = 0;
     pages->allocated = 0;
     pages->packet_num = 0;
     pages->block = NULL;
@@ -784,19 +979,21 @@ static void multifd_pages_clear(MultiFDPages_t *pages)
     g_free(pages);
 }
 
-static void multifd_send_fill_packet(MultiFDSendParams *p)
+static void multifd_send_fill_packet(MultiFDSendParams *p, uint32_t flags,
+                                     uint64_t packet_num)
 {
     MultiFDPacket_t *packet = p->packet;
-    uint32_t page_max = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    uint32_t page_max = multifd_send_state->page_count;
     int i;
 
     packet->magic = cpu_to_be32(MULTIFD_MAGIC);
     packet->version = cpu_to_be32(MULTIFD_VERSION);
-    packet->flags = cpu_to_be32(p->flags);
+    packet->flags = cpu_to_be32(flags);
     packet->pages_alloc = cpu_to_be32(page_max);
-    packet->pages_used = cpu_to_be32(p->pages->used);
+    packet->normal_pages = cpu_to_be32(p->pages->normal);
     packet->next_packet_size = cpu_to_be32(p->next_packet_size);
-    packet->packet_num = cpu_to_be64(p->packet_num);
+    packet->packet_num = cpu_to_be64(packet_num);
+    packet->zero_pages = cpu_to_be32(p->pages->used - p->pages->normal);
 
     if (p->pages->block) {
         strncpy(packet->ramblock, p->pages->block->idstr, 256);
@@ -810,8 +1007,10 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
 static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
 {
     MultiFDPacket_t *packet = p->packet;
-    uint32_t pages_max = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    uint32_t pages_max = multifd_recv_state->page_count;
     RAMBlock *block;
+    struct iovec *iov = NULL;
+    uint32_t zero;
     int i;
 
     packet->magic = be32_to_cpu(packet->magic);
@@ -850,15 +1049,28 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     if (packet->pages_alloc > p->pages->allocated) {
         multifd_pages_clear(p->pages);
         p->pages = multifd_pages_init(packet->pages_alloc);
+        g_free(p->postcopy_buf);
+        p->postcopy_buf = NULL;
+        g_free(p->postcopy_host_page);
+        p->postcopy_host_page = NULL;
     }
+    if ((p->flags & MULTIFD_FLAG_POSTCOPY) && !p->postcopy_buf) {
+        size_t size = p->pages->allocated * TARGET_PAGE_SIZE;
 
-    p->pages->used = be32_to_cpu(packet->pages_used);
-    if (p->pages->used > packet->pages_alloc) {
+        p->postcopy_buf = g_malloc(size);
+        p->postcopy_host_page = g_malloc(size);
+    }
+
+    p->pages->normal = be32_to_cpu(packet->normal_pages);
+    zero = be32_to_cpu(packet->zero_pages);
+    if (p->pages->normal > packet->pages_alloc ||
+        zero > packet->pages_alloc - p->pages->normal) {
         error_setg(errp, "multifd: received packet "
-                   "with %d pages and expected maximum pages are %d",
-                   p->pages->used, packet->pages_alloc) ;
+                   "with %u pages and expected maximum pages are %d",
+                   p->pages->normal + zero, packet->pages_alloc) ;
         return -1;
     }
+    p->pages->used = p->pages->normal + zero;
 
     p->next_packet_size = be32_to_cpu(packet->next_packet_size);
     p->packet_num = be64_to_cpu(packet->packet_num);
@@ -872,10 +1084,13 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
                        packet->ramblock);
             return -1;
         }
+        p->pages->block = block;
     }
 
+    p->pages->num_iov = 0;
     for (i = 0; i < p->pages->used; i++) {
         ram_addr_t offset = be64_to_cpu(packet->offset[i]);
+        uint8_t *host;
 
         if (offset > (block->used_length - TARGET_PAGE_SIZE)) {
             error_setg(errp, "multifd: offset too long " RAM_ADDR_FMT
@@ -883,8 +1098,24 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
                        offset, block->max_length);
             return -1;
         }
-        p->pages->iov[i].iov_base = block->host + offset;
-        p->pages->iov[i].iov_len = TARGET_PAGE_SIZE;
+        p->pages->offset[i] = offset;
+        /* The zero pages are not in the payload */
+        if (i >= p->pages->normal) {
+            continue;
+        }
+        if (p->flags & MULTIFD_FLAG_POSTCOPY) {
+            /* The guest memory is only written by placing whole pages */
+            host = p->postcopy_buf + i * TARGET_PAGE_SIZE;
+        } else {
+            host = block->host + offset;
+        }
+        if (iov && (uint8_t *)iov->iov_base + iov->iov_len == host) {
+            iov->iov_len += TARGET_PAGE_SIZE;
+            continue;
+        }
+        iov = &p->pages->iov[p->pages->num_iov++];
+        iov->iov_base = host;
+        iov->iov_len = TARGET_PAGE_SIZE;
     }
 
     return 0;
@@ -898,8 +1129,16 @@ struct {
     QemuSemaphore sem_sync;
     /* global number of generated multifd packets */
     uint64_t packet_num;
+    /* maximum number of pages in a packet */
+    uint32_t page_count;
     /* send channels ready */
     QemuSemaphore channels_ready;
+    /* multifd ops */
+    MultiFDMethods *ops;
+    /* mapped-ram: the file where the channels write the pages */
+    QEMUFile *file;
+    /* the channels are RDMA connections */
+    bool rdma;
 } *multifd_send_state;
 
 /*
@@ -920,13 +1159,31 @@ struct {
  * false.
  */
 
-static void multifd_send_pages(void)
+/*
+ * The migration thread accounts the pages as normal ones when it queues
+ * them, fix it up for the zero pages that the channel found since.
+ * Called with the channel mutex held.
+ */
+static void multifd_send_account_zero_pages(MultiFDSendParams *p)
+{
+    uint64_t bytes = p->zero_pages * TARGET_PAGE_SIZE;
+
+    ram_counters.normal -= p->zero_pages;
+    ram_counters.duplicate += p->zero_pages;
+    ram_counters.multifd_bytes -= bytes;
+    ram_counters.transferred -= bytes;
+    p->zero_pages = 0;
+}
+
+/*
+ * Wait for a channel without pending job and give it one.  Returns with
+ * the channel mutex held.
+ */
+static MultiFDSendParams *multifd_send_get_channel(void)
 {
     int i;
     static int next_channel;
     MultiFDSendParams *p = NULL; /* make happy gcc */
-    MultiFDPages_t *pages = multifd_send_state->pages;
-    uint64_t transferred;
 
     qemu_sem_wait(&multifd_send_state->channels_ready);
     for (i = next_channel;; i = (i + 1) % migrate_multifd_channels()) {
@@ -940,13 +1197,30 @@ static void multifd_send_pages(void)
         }
         qemu_mutex_unlock(&p->mutex);
     }
+    multifd_send_account_zero_pages(p);
+    return p;
+}
+
+static void multifd_send_pages(void)
+{
+    MultiFDSendParams *p = multifd_send_get_channel();
+    MultiFDPages_t *pages = multifd_send_state->pages;
+    uint64_t transferred;
+
     p->pages->used = 0;
+    p->pages->num_iov = 0;
 
+    if (migration_in_postcopy()) {
+        p->flags |= MULTIFD_FLAG_POSTCOPY;
+    }
     p->packet_num = multifd_send_state->packet_num++;
     p->pages->block = NULL;
     multifd_send_state->pages = p->pages;
     p->pages = pages;
-    transferred = ((uint64_t) pages->used) * TARGET_PAGE_SIZE + p->packet_len;
+    transferred = ((uint64_t) pages->used) * TARGET_PAGE_SIZE;
+    if (!migrate_mapped_ram()) {
+        transferred += p->packet_len;
+    }
     ram_counters.multifd_bytes += transferred;
     ram_counters.transferred += transferred;;
     qemu_mutex_unlock(&p->mutex);
@@ -962,9 +1236,20 @@ static void multifd_queue_page(RAMBlock *block, ram_addr_t offset)
     }
 
     if (pages->block == block) {
+        struct iovec *iov = NULL;
+        uint8_t *host = block->host + offset;
+
+        if (pages->num_iov) {
+            iov = &pages->iov[pages->num_iov - 1];
+        }
         pages->offset[pages->used] = offset;
-        pages->iov[pages->used].iov_base = block->host + offset;
-        pages->iov[pages->used].iov_len = TARGET_PAGE_SIZE;
+        if (iov && (uint8_t *)iov->iov_base + iov->iov_len == host) {
+            iov->iov_len += TARGET_PAGE_SIZE;
+        } else {
+            iov = &pages->iov[pages->num_iov++];
+            iov->iov_base = host;
+            iov->iov_len = TARGET_PAGE_SIZE;
+        }
         pages->used++;
 
         if (pages->used < pages->allocated) {
@@ -979,6 +1264,46 @@ static void multifd_queue_page(RAMBlock *block, ram_addr_t offset)
     }
 }
 
+/**
+ * multifd_send_dirty_bitmap: send a dirty bitmap chunk through a channel
+ *
+ * The chunk goes through the next free channel, in parallel with the
+ * pages.  It is only known to be loaded on the destination once the
+ * destination went through the next sync, see multifd_send_sync_main().
+ *
+ * @buf: the chunk, freed by the channel once it has been written
+ * @size: size of @buf, at most MULTIFD_DIRTY_BITMAP_MAX
+ */
+void multifd_send_dirty_bitmap(uint8_t *buf, uint32_t size)
+{
+    MultiFDSendParams *p = multifd_send_get_channel();
+    uint64_t transferred = p->packet_len + size;
+
+    assert(size <= MULTIFD_DIRTY_BITMAP_MAX);
+    p->bitmap_chunk = buf;
+    p->bitmap_chunk_size = size;
+    p->flags |= MULTIFD_FLAG_DIRTY_BITMAP;
+    p->packet_num = multifd_send_state->packet_num++;
+    ram_counters.multifd_bytes += transferred;
+    ram_counters.transferred += transferred;
+    qemu_mutex_unlock(&p->mutex);
+    qemu_sem_post(&p->sem);
+}
+
+/*
+ * Make room for @count pages of @block in the pending packet, so that
+ * they are sent together
+ */
+static void multifd_queue_reserve(RAMBlock *block, uint32_t count)
+{
+    MultiFDPages_t *pages = multifd_send_state->pages;
+
+    if (pages->used &&
+        (pages->block != block || pages->allocated - pages->used < count)) {
+        multifd_send_pages();
+    }
+}
+
 static void multifd_send_terminate_threads(Error *err)
 {
     int i;
@@ -1007,6 +1332,7 @@ static void multifd_send_terminate_threads(Error *err)
 
 void multifd_save_cleanup(void)
 {
+    Error *local_err = NULL;
     int i;
 
     if (!migrate_use_multifd()) {
@@ -1019,7 +1345,11 @@ void multifd_save_cleanup(void)
         if (p->running) {
             qemu_thread_join(&p->thread);
         }
-        socket_send_channel_destroy(p->c);
+        if (multifd_send_state->rdma) {
+            rdma_send_channel_destroy(p->c);
+        } else {
+            socket_send_channel_destroy(p->c);
+        }
         p->c = NULL;
         qemu_mutex_destroy(&p->mutex);
         qemu_sem_destroy(&p->sem);
@@ -1027,9 +1357,19 @@ void multifd_save_cleanup(void)
         p->name = NULL;
         multifd_pages_clear(p->pages);
         p->pages = NULL;
+        g_free(p->zero_offset);
+        p->zero_offset = NULL;
+        g_free(p->bitmap_chunk);
+        p->bitmap_chunk = NULL;
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        multifd_send_state->ops->send_cleanup(p, &local_err);
+        if (local_err) {
+            migrate_set_error(migrate_get_current(), local_err);
+            error_free(local_err);
+            local_err = NULL;
+        }
     }
     qemu_sem_destroy(&multifd_send_state->channels_ready);
     qemu_sem_destroy(&multifd_send_state->sem_sync);
@@ -1041,7 +1381,7 @@ void multifd_save_cleanup(void)
     multifd_send_state = NULL;
 }
 
-static void multifd_send_sync_main(void)
+void multifd_send_sync_main(void)
 {
     int i;
 
@@ -1070,63 +1410,256 @@ static void multifd_send_sync_main(void)
         trace_multifd_send_sync_main_wait(p->id);
         qemu_sem_wait(&multifd_send_state->sem_sync);
     }
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        multifd_send_account_zero_pages(p);
+        qemu_mutex_unlock(&p->mutex);
+    }
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 }
 
-static void *multifd_send_thread(void *opaque)
+/**
+ * multifd_send_zero_page_detect: look for zero pages in the channel pages
+ *
+ * The zero pages are moved after the normal ones, which keep their
+ * order, and the iovs are rebuilt for the normal pages only.
+ *
+ * Returns the number of zero pages
+ *
+ * @p: Params for the channel that we are using
+ */
+static uint32_t multifd_send_zero_page_detect(MultiFDSendParams *p)
 {
-    MultiFDSendParams *p = opaque;
-    Error *local_err = NULL;
-    int ret;
+    MultiFDPages_t *pages = p->pages;
+    uint8_t *host_base = pages->block->host;
+    struct iovec *iov = NULL;
+    uint32_t i, zero = 0;
 
-    trace_multifd_send_thread_start(p->id);
-    rcu_register_thread();
+    pages->normal = 0;
+    pages->num_iov = 0;
+    for (i = 0; i < pages->used; i++) {
+        ram_addr_t offset = pages->offset[i];
+        uint8_t *host = host_base + offset;
 
-    if (multifd_send_initial_packet(p, &local_err) < 0) {
-        goto out;
+        if (buffer_is_zero(host, TARGET_PAGE_SIZE)) {
+            p->zero_offset[zero++] = offset;
+            continue;
+        }
+        pages->offset[pages->normal++] = offset;
+        if (iov && (uint8_t *)iov->iov_base + iov->iov_len == host) {
+            iov->iov_len += TARGET_PAGE_SIZE;
+        } else {
+            iov = &pages->iov[pages->num_iov++];
+            iov->iov_base = host;
+            iov->iov_len = TARGET_PAGE_SIZE;
+        }
     }
-    /* initial packet */
-    p->num_packets = 1;
-
-    while (true) {
-        qemu_sem_wait(&p->sem);
-        qemu_mutex_lock(&p->mutex);
+    memcpy(&pages->offset[pages->normal], p->zero_offset,
+           zero * sizeof(ram_addr_t));
 
-        if (p->pending_job) {
-            uint32_t used = p->pages->used;
-            uint64_t packet_num = p->packet_num;
-            uint32_t flags = p->flags;
+    return zero;
+}
 
-            p->next_packet_size = used * qemu_target_page_size();
-            multifd_send_fill_packet(p);
-            p->flags = 0;
-            p->num_packets++;
-            p->num_pages += used;
-            p->pages->used = 0;
-            qemu_mutex_unlock(&p->mutex);
+/**
+ * multifd_send_packet: send the channel pages as a packet
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @flags: packet flags
+ * @packet_num: packet number
+ * @errp: pointer to an error
+ */
+static int multifd_send_packet(MultiFDSendParams *p, uint32_t used,
+                               uint32_t flags, uint64_t packet_num,
+                               Error **errp)
+{
+    uint32_t zero = 0, normal;
+
+    /*
+     * The pages belong to this channel until pending_job is
+     * decremented, so zero page detection and compression happen
+     * without the lock and the migration thread can keep feeding the
+     * other channels.
+     */
+    if (used &&
+        migrate_zero_page_detection() == ZERO_PAGE_DETECTION_MULTIFD) {
+        zero = multifd_send_zero_page_detect(p);
+    }
+    normal = used - zero;
+    p->pages->normal = normal;
+
+    if (normal) {
+        if (multifd_send_state->ops->send_prepare(p, normal, &flags, errp)) {
+            return -1;
+        }
+    } else {
+        p->next_packet_size = 0;
+    }
+    multifd_send_fill_packet(p, flags, packet_num);
+    p->num_packets++;
+    p->num_pages += normal;
+    p->num_zero_pages += zero;
+    p->num_iovs += p->pages->num_iov;
+
+    trace_multifd_send(p->id, packet_num, normal, zero, flags,
+                       p->next_packet_size);
+
+    if (qio_channel_write_all(p->c, (void *)p->packet, p->packet_len,
+                              errp)) {
+        return -1;
+    }
+
+    if (normal) {
+        return multifd_send_state->ops->send_write(p, normal, errp);
+    }
+    return 0;
+}
+
+/**
+ * multifd_send_bitmap_chunk: send a dirty bitmap chunk
+ *
+ * The chunk follows a packet without pages.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @buf: the chunk
+ * @size: size of @buf
+ * @flags: packet flags
+ * @packet_num: packet number
+ * @errp: pointer to an error
+ */
+static int multifd_send_bitmap_chunk(MultiFDSendParams *p, uint8_t *buf,
+                                     uint32_t size, uint32_t flags,
+                                     uint64_t packet_num, Error **errp)
+{
+    p->pages->normal = 0;
+    p->next_packet_size = size;
+    multifd_send_fill_packet(p, flags, packet_num);
+    p->num_packets++;
+
+    trace_multifd_send(p->id, packet_num, 0, 0, flags, size);
+
+    if (qio_channel_write_all(p->c, (void *)p->packet, p->packet_len,
+                              errp)) {
+        return -1;
+    }
+    return qio_channel_write_all(p->c, (void *)buf, size, errp);
+}
+
+/**
+ * multifd_send_file_pages: write the channel pages to the mapped-ram file
+ *
+ * Each page has a fixed offset in the file, so no packet is needed and the
+ * channels write in parallel.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int multifd_send_file_pages(MultiFDSendParams *p, uint32_t used,
+                                   Error **errp)
+{
+    RAMBlock *block = p->pages->block;
+    uint32_t i;
+    int ret;
+
+    for (i = 0; i < p->pages->num_iov; i++) {
+        struct iovec *iov = &p->pages->iov[i];
+        ram_addr_t offset = (uint8_t *)iov->iov_base - block->host;
+
+        ret = qemu_pwritev(multifd_send_state->file, iov, 1,
+                           block->pages_offset + offset);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "multifd %d: failed to write pages "
+                             "of %s at " RAM_ADDR_FMT, p->id, block->idstr,
+                             offset);
+            return -1;
+        }
+    }
+    p->num_pages += used;
+    p->num_iovs += p->pages->num_iov;
+
+    trace_multifd_send_file(p->id, used, p->pages->num_iov);
+    return 0;
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+    Error *local_err = NULL;
+    int ret;
+
+    trace_multifd_send_thread_start(p->id);
+    rcu_register_thread();
+
+    if (!migrate_mapped_ram()) {
+        if (multifd_send_initial_packet(p, &local_err) < 0) {
+            goto out;
+        }
+        /* initial packet */
+        p->num_packets = 1;
+    }
+
+    while (true) {
+        qemu_sem_wait(&p->sem);
+        qemu_mutex_lock(&p->mutex);
+
+        if (p->pending_job) {
+            uint32_t used = p->pages->used;
+            uint64_t packet_num = p->packet_num;
+            uint32_t flags = p->flags;
+            uint8_t *chunk = p->bitmap_chunk;
+            uint32_t zero = 0;
 
-            trace_multifd_send(p->id, packet_num, used, flags,
-                               p->next_packet_size);
+            p->flags = 0;
+            p->bitmap_chunk = NULL;
+            qemu_mutex_unlock(&p->mutex);
 
-            ret = qio_channel_write_all(p->c, (void *)p->packet,
-                                        p->packet_len, &local_err);
+            if (chunk) {
+                ret = multifd_send_bitmap_chunk(p, chunk, p->bitmap_chunk_size,
+                                                flags, packet_num,
+                                                &local_err);
+                g_free(chunk);
+            } else if (!migrate_mapped_ram()) {
+                ret = multifd_send_packet(p, used, flags, packet_num,
+                                          &local_err);
+                zero = used - p->pages->normal;
+            } else if (used) {
+                ret = multifd_send_file_pages(p, used, &local_err);
+            } else {
+                ret = 0;
+            }
             if (ret != 0) {
                 break;
             }
 
-            if (used) {
-                ret = qio_channel_writev_all(p->c, p->pages->iov,
-                                             used, &local_err);
-                if (ret != 0) {
-                    break;
-                }
-            }
-
             qemu_mutex_lock(&p->mutex);
+            p->zero_pages += zero;
+            p->pages->used = 0;
+            p->pages->num_iov = 0;
             p->pending_job--;
             qemu_mutex_unlock(&p->mutex);
 
             if (flags & MULTIFD_FLAG_SYNC) {
+                /*
+                 * Everything queued before the sync must have left guest
+                 * memory before the main thread goes on, so that a page
+                 * dirtied again afterwards is never read by the kernel
+                 * for an older send.
+                 */
+                if (p->write_flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY) {
+                    ret = qio_channel_flush(p->c, &local_err);
+                    if (ret < 0) {
+                        break;
+                    }
+                }
                 qemu_sem_post(&multifd_send_state->sem_sync);
             }
             qemu_sem_post(&multifd_send_state->channels_ready);
@@ -1149,7 +1682,8 @@ out:
     qemu_mutex_unlock(&p->mutex);
 
     rcu_unregister_thread();
-    trace_multifd_send_thread_end(p->id, p->num_packets, p->num_pages);
+    trace_multifd_send_thread_end(p->id, p->num_packets, p->num_pages,
+                                  p->num_zero_pages, p->num_iovs);
 
     return NULL;
 }
@@ -1163,6 +1697,15 @@ static void multifd_new_send_channel_async(QIOTask *task, gpointer opaque)
     if (qio_task_propagate_error(task, &local_err)) {
         migrate_set_error(migrate_get_current(), local_err);
         multifd_save_cleanup();
+    } else if (migrate_use_zero_copy_send() &&
+               !qio_channel_has_feature(sioc,
+                                        QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+        error_setg(&local_err, "multifd %d: zero copy send feature not "
+                   "detected in host kernel", p->id);
+        migrate_set_error(migrate_get_current(), local_err);
+        error_free(local_err);
+        object_unref(OBJECT(sioc));
+        multifd_save_cleanup();
     } else {
         p->c = QIO_CHANNEL(sioc);
         qio_channel_set_delay(p->c, false);
@@ -1172,10 +1715,11 @@ static void multifd_new_send_channel_async(QIOTask *task, gpointer opaque)
     }
 }
 
-int multifd_save_setup(void)
+int multifd_save_setup(Error **errp)
 {
     int thread_count;
-    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    uint32_t page_count = migrate_multifd_packet_size() /
+                          qemu_target_page_size();
     uint8_t i;
 
     if (!migrate_use_multifd()) {
@@ -1185,8 +1729,17 @@ int multifd_save_setup(void)
     multifd_send_state = g_malloc0(sizeof(*multifd_send_state));
     multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
     multifd_send_state->pages = multifd_pages_init(page_count);
+    multifd_send_state->page_count = page_count;
     qemu_sem_init(&multifd_send_state->sem_sync, 0);
     qemu_sem_init(&multifd_send_state->channels_ready, 0);
+    multifd_send_state->ops = multifd_ops[migrate_multifd_compression()];
+    if (migrate_mapped_ram()) {
+        multifd_send_state->file = migrate_get_current()->to_dst_file;
+    }
+    if (rdma_multifd_outgoing()) {
+        multifd_send_state->rdma = true;
+        multifd_send_state->ops = &multifd_rdma_ops;
+    }
 
     for (i = 0; i < thread_count; i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
@@ -1197,11 +1750,52 @@ int multifd_save_setup(void)
         p->pending_job = 0;
         p->id = i;
         p->pages = multifd_pages_init(page_count);
+        p->zero_offset = g_new0(ram_addr_t, page_count);
         p->packet_len = sizeof(MultiFDPacket_t)
                       + sizeof(ram_addr_t) * page_count;
         p->packet = g_malloc0(p->packet_len);
         p->name = g_strdup_printf("multifdsend_%d", i);
-        socket_send_channel_create(multifd_new_send_channel_async, p);
+        if (migrate_use_zero_copy_send()) {
+            p->write_flags = QIO_CHANNEL_WRITE_FLAG_ZERO_COPY;
+        } else {
+            p->write_flags = 0;
+        }
+    }
+
+    /*
+     * Only connect once every channel is initialised: a failed connection
+     * leads to multifd_save_cleanup(), which goes through all of them.
+     */
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        if (migrate_mapped_ram()) {
+            /* The channels share the migration file */
+            p->running = true;
+            qemu_thread_create(&p->thread, p->name, multifd_send_thread, p,
+                               QEMU_THREAD_JOINABLE);
+        } else if (multifd_send_state->rdma) {
+            /* Each channel has its own RDMA connection */
+            p->c = rdma_send_channel_create(errp);
+            if (!p->c) {
+                return -1;
+            }
+            p->running = true;
+            qemu_thread_create(&p->thread, p->name, multifd_send_thread, p,
+                               QEMU_THREAD_JOINABLE);
+        } else {
+            socket_send_channel_create(multifd_new_send_channel_async, p);
+        }
+    }
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+        int ret;
+
+        ret = multifd_send_state->ops->send_setup(p, errp);
+        if (ret) {
+            return ret;
+        }
     }
     return 0;
 }
@@ -1214,6 +1808,18 @@ struct {
     QemuSemaphore sem_sync;
     /* global number of generated multifd packets */
     uint64_t packet_num;
+    /* maximum number of pages in a packet */
+    uint32_t page_count;
+    /* multifd ops */
+    MultiFDMethods *ops;
+    /* mapped-ram: pages to be read by the next free channel */
+    MultiFDPages_t *pages;
+    /* mapped-ram: recv channels ready */
+    QemuSemaphore channels_ready;
+    /* mapped-ram: the file where the channels read the pages */
+    QEMUFile *file;
+    /* mapped-ram: first error of the channels, a negative errno value */
+    int error;
 } *multifd_recv_state;
 
 static void multifd_recv_terminate_threads(Error *err)
@@ -1234,13 +1840,22 @@ static void multifd_recv_terminate_threads(Error *err)
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
 
         qemu_mutex_lock(&p->mutex);
+        if (migrate_mapped_ram()) {
+            p->quit = true;
+            qemu_sem_post(&p->sem);
+            qemu_mutex_unlock(&p->mutex);
+            continue;
+        }
         /* We could arrive here for two reasons:
            - normal quit, i.e. everything went fine, just finished
            - error quit: We close the channels so the channel threads
              finish the qio_channel_read_all_eof() */
+        p->quit = true;
         qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
         qemu_mutex_unlock(&p->mutex);
     }
+    /* Don't leave a channel waiting to place postcopy pages */
+    qemu_event_set(&migration_incoming_get_current()->postcopy_ram_ready_event);
 }
 
 int multifd_load_cleanup(Error **errp)
@@ -1261,6 +1876,7 @@ int multifd_load_cleanup(Error **errp)
         object_unref(OBJECT(p->c));
         p->c = NULL;
         qemu_mutex_destroy(&p->mutex);
+        qemu_sem_destroy(&p->sem);
         qemu_sem_destroy(&p->sem_sync);
         g_free(p->name);
         p->name = NULL;
@@ -1269,8 +1885,17 @@ int multifd_load_cleanup(Error **errp)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        g_free(p->postcopy_buf);
+        p->postcopy_buf = NULL;
+        g_free(p->postcopy_host_page);
+        p->postcopy_host_page = NULL;
+        multifd_recv_state->ops->recv_cleanup(p);
     }
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    qemu_sem_destroy(&multifd_recv_state->channels_ready);
+    if (multifd_recv_state->pages) {
+        multifd_pages_clear(multifd_recv_state->pages);
+    }
     g_free(multifd_recv_state->params);
     multifd_recv_state->params = NULL;
     g_free(multifd_recv_state);
@@ -1279,11 +1904,12 @@ int multifd_load_cleanup(Error **errp)
     return ret;
 }
 
-static void multifd_recv_sync_main(void)
+void multifd_recv_sync_main(void)
 {
     int i;
 
-    if (!migrate_use_multifd()) {
+    /* With mapped-ram the stream has no pages to sync with */
+    if (!migrate_use_multifd() || migrate_mapped_ram()) {
         return;
     }
     for (i = 0; i < migrate_multifd_channels(); i++) {
@@ -1306,6 +1932,148 @@ static void multifd_recv_sync_main(void)
     trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
 }
 
+/**
+ * multifd_recv_dirty_bitmap: read and load a dirty bitmap chunk
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int multifd_recv_dirty_bitmap(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t size = p->next_packet_size;
+    uint8_t *buf;
+    int ret;
+
+    if (size > MULTIFD_DIRTY_BITMAP_MAX) {
+        error_setg(errp, "multifd %d: received dirty bitmap chunk of %u "
+                   "bytes, the maximum is %u", p->id, size,
+                   MULTIFD_DIRTY_BITMAP_MAX);
+        return -1;
+    }
+    buf = g_malloc(size);
+    ret = qio_channel_read_all(p->c, (void *)buf, size, errp);
+    if (!ret) {
+        ret = dirty_bitmap_load_multifd(buf, size, errp);
+    }
+    g_free(buf);
+    return ret;
+}
+
+/*
+ * multifd_recv_zero_pages: clear the zero pages of the packet
+ *
+ * Pages that are already zero are left alone, so that memory that
+ * was never touched doesn't get allocated.
+ */
+static void multifd_recv_zero_pages(MultiFDRecvParams *p)
+{
+    MultiFDPages_t *pages = p->pages;
+    uint32_t i;
+
+    for (i = pages->normal; i < pages->used; i++) {
+        uint8_t *host = pages->block->host + pages->offset[i];
+
+        if (!buffer_is_zero(host, TARGET_PAGE_SIZE)) {
+            memset(host, 0, TARGET_PAGE_SIZE);
+        }
+    }
+}
+
+/**
+ * multifd_recv_place_pages: place the pages of a postcopy packet
+ *
+ * The guest memory is registered with userfault, so the pages are
+ * received in a buffer and each host page is placed atomically once all
+ * of its target pages are gathered.  The source sends whole host pages
+ * in a packet, the normal pages first and then the zero ones, both in
+ * ascending order.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int multifd_recv_place_pages(MultiFDRecvParams *p, Error **errp)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    MultiFDPages_t *pages = p->pages;
+    RAMBlock *block = pages->block;
+    size_t page_size = qemu_ram_pagesize(block);
+    uint32_t normal = 0, zero = pages->normal;
+    uint32_t placed = 0;
+
+    if (page_size > pages->allocated * TARGET_PAGE_SIZE) {
+        error_setg(errp, "multifd %d: host page of %s bigger than a packet",
+                   p->id, block->idstr);
+        return -1;
+    }
+
+    /* The packet can arrive before the main channel got to listen */
+    qemu_event_wait(&mis->postcopy_ram_ready_event);
+    if (atomic_read(&p->quit)) {
+        error_setg(errp, "multifd %d: quit before placing the pages", p->id);
+        return -1;
+    }
+
+    while (normal < pages->normal || zero < pages->used) {
+        uint8_t *from = p->postcopy_host_page;
+        bool all_zero = true;
+        size_t found = 0;
+        ram_addr_t start;
+        int ret;
+
+        /* The lowest page left starts the next host page */
+        if (zero == pages->used ||
+            (normal < pages->normal &&
+             pages->offset[normal] < pages->offset[zero])) {
+            start = QEMU_ALIGN_DOWN(pages->offset[normal], page_size);
+        } else {
+            start = QEMU_ALIGN_DOWN(pages->offset[zero], page_size);
+        }
+
+        for (; normal < pages->normal &&
+               pages->offset[normal] - start < page_size; normal++) {
+            uint8_t *page = p->postcopy_buf + normal * TARGET_PAGE_SIZE;
+
+            if (page_size == TARGET_PAGE_SIZE) {
+                from = page;
+            } else {
+                memcpy(from + pages->offset[normal] - start, page,
+                       TARGET_PAGE_SIZE);
+            }
+            all_zero = false;
+            found += TARGET_PAGE_SIZE;
+        }
+        for (; zero < pages->used &&
+               pages->offset[zero] - start < page_size; zero++) {
+            memset(from + pages->offset[zero] - start, 0, TARGET_PAGE_SIZE);
+            found += TARGET_PAGE_SIZE;
+        }
+
+        if (found != page_size) {
+            error_setg(errp, "multifd %d: incomplete host page %s:"
+                       RAM_ADDR_FMT, p->id, block->idstr, start);
+            return -1;
+        }
+        if (all_zero) {
+            ret = postcopy_place_page_zero(mis, block->host + start, block);
+        } else {
+            ret = postcopy_place_page(mis, block->host + start, from, block);
+        }
+        if (ret) {
+            error_setg_errno(errp, -ret, "multifd %d: failed to place page "
+                             "%s:" RAM_ADDR_FMT, p->id, block->idstr, start);
+            return -1;
+        }
+        placed++;
+    }
+    trace_multifd_recv_place_pages(p->id, block->idstr, placed);
+
+    return 0;
+}
+
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
@@ -1316,7 +2084,7 @@ static void *multifd_recv_thread(void *opaque)
     rcu_register_thread();
 
     while (true) {
-        uint32_t used;
+        uint32_t normal, zero;
         uint32_t flags;
 
         ret = qio_channel_read_all_eof(p->c, (void *)p->packet,
@@ -1335,21 +2103,34 @@ static void *multifd_recv_thread(void *opaque)
             break;
         }
 
-        used = p->pages->used;
+        normal = p->pages->normal;
+        zero = p->pages->used - normal;
         flags = p->flags;
-        trace_multifd_recv(p->id, p->packet_num, used, flags,
+        trace_multifd_recv(p->id, p->packet_num, normal, zero, flags,
                            p->next_packet_size);
         p->num_packets++;
-        p->num_pages += used;
+        p->num_pages += normal;
+        p->num_zero_pages += zero;
+        p->num_iovs += p->pages->num_iov;
         qemu_mutex_unlock(&p->mutex);
 
-        if (used) {
-            ret = qio_channel_readv_all(p->c, p->pages->iov,
-                                        used, &local_err);
+        if (normal) {
+            ret = multifd_recv_state->ops->recv_pages(p, normal, &local_err);
             if (ret != 0) {
                 break;
             }
         }
+        if (flags & MULTIFD_FLAG_DIRTY_BITMAP) {
+            if (multifd_recv_dirty_bitmap(p, &local_err)) {
+                break;
+            }
+        } else if ((flags & MULTIFD_FLAG_POSTCOPY) && normal + zero) {
+            if (multifd_recv_place_pages(p, &local_err)) {
+                break;
+            }
+        } else if (zero) {
+            multifd_recv_zero_pages(p);
+        }
 
         if (flags & MULTIFD_FLAG_SYNC) {
             qemu_sem_post(&multifd_recv_state->sem_sync);
@@ -1365,63 +2146,272 @@ static void *multifd_recv_thread(void *opaque)
     qemu_mutex_unlock(&p->mutex);
 
     rcu_unregister_thread();
-    trace_multifd_recv_thread_end(p->id, p->num_packets, p->num_pages);
+    trace_multifd_recv_thread_end(p->id, p->num_packets, p->num_pages,
+                                  p->num_zero_pages, p->num_iovs);
 
     return NULL;
 }
 
-int multifd_load_setup(void)
+/*
+ * mapped-ram: the channels don't read packets, the main thread hands them
+ * runs of pages to read from the file, the same way the send side does.
+ */
+static void *multifd_recv_file_thread(void *opaque)
 {
-    int thread_count;
-    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
-    uint8_t i;
-
-    if (!migrate_use_multifd()) {
-        return 0;
-    }
-    thread_count = migrate_multifd_channels();
-    multifd_recv_state = g_malloc0(sizeof(*multifd_recv_state));
-    multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
-    atomic_set(&multifd_recv_state->count, 0);
-    qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+    MultiFDRecvParams *p = opaque;
 
-    for (i = 0; i < thread_count; i++) {
-        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+    trace_multifd_recv_thread_start(p->id);
+    rcu_register_thread();
 
-        qemu_mutex_init(&p->mutex);
-        qemu_sem_init(&p->sem_sync, 0);
-        p->id = i;
-        p->pages = multifd_pages_init(page_count);
-        p->packet_len = sizeof(MultiFDPacket_t)
-                      + sizeof(ram_addr_t) * page_count;
-        p->packet = g_malloc0(p->packet_len);
-        p->name = g_strdup_printf("multifdrecv_%d", i);
-    }
-    return 0;
-}
+    while (true) {
+        qemu_sem_wait(&p->sem);
+        qemu_mutex_lock(&p->mutex);
 
-bool multifd_recv_all_channels_created(void)
-{
-    int thread_count = migrate_multifd_channels();
+        if (p->pending_job) {
+            RAMBlock *block = p->pages->block;
+            uint32_t used = p->pages->used;
+            uint32_t flags = p->flags;
+            uint32_t i;
 
-    if (!migrate_use_multifd()) {
-        return true;
-    }
+            p->flags = 0;
+            qemu_mutex_unlock(&p->mutex);
 
-    return thread_count == atomic_read(&multifd_recv_state->count);
-}
+            /* After an error the jobs are only completed */
+            for (i = 0; i < p->pages->num_iov &&
+                 !atomic_read(&multifd_recv_state->error); i++) {
+                struct iovec *iov = &p->pages->iov[i];
+                ram_addr_t offset = (uint8_t *)iov->iov_base - block->host;
+                int ret;
+
+                ret = qemu_preadv(multifd_recv_state->file, iov, 1,
+                                  block->pages_offset + offset);
+                if (ret < 0) {
+                    error_report("multifd %d: failed to read pages of %s at "
+                                 RAM_ADDR_FMT ": %s", p->id, block->idstr,
+                                 offset, strerror(-ret));
+                    atomic_cmpxchg(&multifd_recv_state->error, 0, ret);
+                }
+            }
+            p->num_pages += used;
+            p->num_iovs += p->pages->num_iov;
+            trace_multifd_recv_file(p->id, used, p->pages->num_iov);
 
-/*
- * Try to receive all multifd channels to get ready for the migration.
- * - Return true and do not set @errp when correctly receving all channels;
- * - Return false and do not set @errp when correctly receiving the current one;
- * - Return false and set @errp when failing to receive the current channel.
- */
-bool multifd_recv_new_channel(QIOChannel *ioc, Error **errp)
-{
-    MultiFDRecvParams *p;
-    Error *local_err = NULL;
-    int id;
+            qemu_mutex_lock(&p->mutex);
+            p->pages->used = 0;
+            p->pages->num_iov = 0;
+            p->pending_job--;
+            qemu_mutex_unlock(&p->mutex);
+
+            if (flags & MULTIFD_FLAG_SYNC) {
+                qemu_sem_post(&multifd_recv_state->sem_sync);
+            }
+            /* Sync requests don't take a channels_ready token */
+            if (used) {
+                qemu_sem_post(&multifd_recv_state->channels_ready);
+            }
+        } else if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            break;
+        } else {
+            qemu_mutex_unlock(&p->mutex);
+        }
+    }
+
+    qemu_mutex_lock(&p->mutex);
+    p->running = false;
+    qemu_mutex_unlock(&p->mutex);
+
+    rcu_unregister_thread();
+    trace_multifd_recv_thread_end(p->id, p->num_packets, p->num_pages,
+                                  p->num_zero_pages, p->num_iovs);
+
+    return NULL;
+}
+
+/*
+ * Hand the pending pages to a free channel, see multifd_send_pages()
+ * for how the pages are exchanged
+ */
+static void multifd_recv_file_pages(void)
+{
+    int i;
+    static int next_channel;
+    MultiFDRecvParams *p = NULL;
+    MultiFDPages_t *pages = multifd_recv_state->pages;
+
+    qemu_sem_wait(&multifd_recv_state->channels_ready);
+    for (i = next_channel;; i = (i + 1) % migrate_multifd_channels()) {
+        p = &multifd_recv_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        if (!p->pending_job) {
+            p->pending_job++;
+            next_channel = (i + 1) % migrate_multifd_channels();
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+    p->pages->used = 0;
+    p->pages->num_iov = 0;
+    p->pages->block = NULL;
+    multifd_recv_state->pages = p->pages;
+    p->pages = pages;
+    qemu_mutex_unlock(&p->mutex);
+    qemu_sem_post(&p->sem);
+}
+
+/**
+ * multifd_recv_file_queue: read a run of pages from the mapped-ram file
+ *
+ * The run is split in packet sized jobs for the channels.
+ *
+ * @f: QEMUFile of the migration stream
+ * @block: block that contains the pages
+ * @offset: offset inside the block of the first page
+ * @len: length of the run
+ */
+static void multifd_recv_file_queue(QEMUFile *f, RAMBlock *block,
+                                    ram_addr_t offset, ram_addr_t len)
+{
+    MultiFDPages_t *pages = multifd_recv_state->pages;
+
+    multifd_recv_state->file = f;
+    if (pages->block && pages->block != block) {
+        multifd_recv_file_pages();
+        pages = multifd_recv_state->pages;
+    }
+    pages->block = block;
+
+    while (len) {
+        uint32_t n = MIN(len / TARGET_PAGE_SIZE,
+                         pages->allocated - pages->used);
+        struct iovec *iov = &pages->iov[pages->num_iov++];
+
+        iov->iov_base = block->host + offset;
+        iov->iov_len = (ram_addr_t)n * TARGET_PAGE_SIZE;
+        pages->used += n;
+        offset += iov->iov_len;
+        len -= iov->iov_len;
+
+        if (pages->used == pages->allocated) {
+            multifd_recv_file_pages();
+            pages = multifd_recv_state->pages;
+            pages->block = block;
+        }
+    }
+}
+
+/**
+ * multifd_recv_file_sync: wait for the queued mapped-ram pages
+ *
+ * Returns 0 once every page queued with multifd_recv_file_queue() is in
+ * guest memory, or the first read error as a negative errno value
+ */
+static int multifd_recv_file_sync(void)
+{
+    int i;
+
+    if (multifd_recv_state->pages->used) {
+        multifd_recv_file_pages();
+    }
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->flags |= MULTIFD_FLAG_SYNC;
+        p->pending_job++;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        qemu_sem_wait(&multifd_recv_state->sem_sync);
+    }
+    return atomic_read(&multifd_recv_state->error);
+}
+
+int multifd_load_setup(Error **errp)
+{
+    int thread_count;
+    uint32_t page_count = migrate_multifd_packet_size() /
+                          qemu_target_page_size();
+    uint8_t i;
+
+    if (!migrate_use_multifd()) {
+        return 0;
+    }
+    thread_count = migrate_multifd_channels();
+    multifd_recv_state = g_malloc0(sizeof(*multifd_recv_state));
+    multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
+    atomic_set(&multifd_recv_state->count, 0);
+    multifd_recv_state->page_count = page_count;
+    qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+    qemu_sem_init(&multifd_recv_state->channels_ready, 0);
+    multifd_recv_state->ops = multifd_ops[migrate_multifd_compression()];
+    if (migrate_mapped_ram()) {
+        multifd_recv_state->pages = multifd_pages_init(page_count);
+    }
+    if (rdma_multifd_incoming()) {
+        multifd_recv_state->ops = &multifd_rdma_ops;
+    }
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        qemu_mutex_init(&p->mutex);
+        qemu_sem_init(&p->sem, 0);
+        qemu_sem_init(&p->sem_sync, 0);
+        p->quit = false;
+        p->pending_job = 0;
+        p->id = i;
+        p->pages = multifd_pages_init(page_count);
+        p->packet_len = sizeof(MultiFDPacket_t)
+                      + sizeof(ram_addr_t) * page_count;
+        p->packet = g_malloc0(p->packet_len);
+        p->name = g_strdup_printf("multifdrecv_%d", i);
+        if (migrate_mapped_ram()) {
+            /* No channel to wait for, the pages come from the file */
+            p->running = true;
+            qemu_thread_create(&p->thread, p->name, multifd_recv_file_thread,
+                               p, QEMU_THREAD_JOINABLE);
+            qemu_sem_post(&multifd_recv_state->channels_ready);
+            atomic_inc(&multifd_recv_state->count);
+        }
+    }
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+        int ret;
+
+        ret = multifd_recv_state->ops->recv_setup(p, errp);
+        if (ret) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+bool multifd_recv_all_channels_created(void)
+{
+    int thread_count = migrate_multifd_channels();
+
+    if (!migrate_use_multifd()) {
+        return true;
+    }
+
+    return thread_count == atomic_read(&multifd_recv_state->count);
+}
+
+/*
+ * Try to receive all multifd channels to get ready for the migration.
+ * - Return true and do not set @errp when correctly receving all channels;
+ * - Return false and do not set @errp when correctly receiving the current one;
+ * - Return false and set @errp when failing to receive the current channel.
+ */
+bool multifd_recv_new_channel(QIOChannel *ioc, Error **errp)
+{
+    MultiFDRecvParams *p;
+    Error *local_err = NULL;
+    int id;
 
     id = multifd_recv_initial_packet(ioc, &local_err);
     if (id < 0) {
@@ -1513,6 +2503,79 @@ static void mig_throttle_guest_down(void)
     }
 }
 
+/* Start a new period for the per-vcpu dirty page counts */
+static void mig_throttle_vcpus_sample(RAMState *rs)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        if (cpu->cpu_index < max_cpus) {
+            rs->vcpu_dirty_pages_prev[cpu->cpu_index] = cpu->dirty_pages;
+        }
+    }
+}
+
+/**
+ * mig_throttle_vcpus_down: throttle down the vcpus that dirty memory
+ *
+ * Like mig_throttle_guest_down(), but based on the pages each vcpu
+ * pushed to its KVM dirty ring during the last period.  A vcpu is
+ * throttled when it dirtied more than its share of half the bytes
+ * that were transferred, the same target the global heuristic uses,
+ * or more than the average of all the vcpus, whichever is lower.  The
+ * vcpus that don't write to memory keep running at full speed.
+ *
+ * @rs: current RAM state
+ * @bytes_xfer_period: bytes transferred during the last period
+ */
+static void mig_throttle_vcpus_down(RAMState *rs, uint64_t bytes_xfer_period)
+{
+    MigrationState *s = migrate_get_current();
+    uint64_t pct_initial = s->parameters.cpu_throttle_initial;
+    uint64_t pct_icrement = s->parameters.cpu_throttle_increment;
+    int pct_max = s->parameters.max_cpu_throttle;
+    uint64_t total = 0, threshold;
+    unsigned int nr_vcpus = 0;
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        if (cpu->cpu_index < max_cpus) {
+            total += cpu->dirty_pages -
+                     rs->vcpu_dirty_pages_prev[cpu->cpu_index];
+            nr_vcpus++;
+        }
+    }
+    if (!nr_vcpus) {
+        return;
+    }
+
+    threshold = MIN(total / nr_vcpus,
+                    bytes_xfer_period / 2 / nr_vcpus /
+                    qemu_real_host_page_size);
+
+    CPU_FOREACH(cpu) {
+        uint64_t dirty;
+        int pct;
+
+        if (cpu->cpu_index >= max_cpus) {
+            continue;
+        }
+        dirty = cpu->dirty_pages - rs->vcpu_dirty_pages_prev[cpu->cpu_index];
+        if (!dirty || dirty < threshold) {
+            continue;
+        }
+
+        pct = cpu_throttle_get_vcpu_percentage(cpu);
+        if (!pct) {
+            pct = pct_initial;
+        } else {
+            pct = MIN(pct + pct_icrement, pct_max);
+        }
+        trace_migration_throttle_vcpu(cpu->cpu_index, dirty, pct);
+        cpu_throttle_set_vcpu(cpu, pct);
+    }
+}
+
 /**
  * xbzrle_cache_zero_page: insert a zero page in the XBZRLE cache
  *
@@ -1533,8 +2596,10 @@ static void xbzrle_cache_zero_page(RAMState *rs, ram_addr_t current_addr)
 
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
-    cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
-                 ram_counters.dirty_sync_count);
+    if (cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
+                     ram_counters.dirty_sync_count) > 0) {
+        xbzrle_counters.cache_eviction++;
+    }
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
@@ -1557,17 +2622,21 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
                             ram_addr_t current_addr, RAMBlock *block,
                             ram_addr_t offset, bool last_stage)
 {
-    int encoded_len = 0, bytes_xbzrle;
+    int encoded_len = 0, bytes_xbzrle, ret;
     uint8_t *prev_cached_page;
 
     if (!cache_is_cached(XBZRLE.cache, current_addr,
                          ram_counters.dirty_sync_count)) {
         xbzrle_counters.cache_miss++;
         if (!last_stage) {
-            if (cache_insert(XBZRLE.cache, current_addr, *current_data,
-                             ram_counters.dirty_sync_count) == -1) {
+            ret = cache_insert(XBZRLE.cache, current_addr, *current_data,
+                               ram_counters.dirty_sync_count);
+            if (ret == -1) {
                 return -1;
             } else {
+                if (ret > 0) {
+                    xbzrle_counters.cache_eviction++;
+                }
                 /* update *current_data when the page has been
                    inserted into cache */
                 *current_data = get_cached_data(XBZRLE.cache, current_addr);
@@ -1575,6 +2644,7 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
         }
         return -1;
     }
+    xbzrle_counters.cache_hit++;
 
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
@@ -1677,79 +2747,305 @@ static void migration_bitmap_sync_range(RAMState *rs, RAMBlock *rb,
                                               &rs->num_dirty_pages_period);
 }
 
+/* Dirty bitmap sync threads */
+
+/*
+ * Number of pages in one unit of work.  It is a multiple of
+ * BITS_PER_LONG so that two threads never touch the same word of a
+ * RAMBlock's bmap.
+ */
+#define BITMAP_SYNC_CHUNK_PAGES (BITS_PER_LONG * 256)
+
+struct BitmapSyncChunk {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t length;
+};
+typedef struct BitmapSyncChunk BitmapSyncChunk;
+
+struct BitmapSyncState {
+    /* helper threads, the migration thread is not included */
+    QemuThread *threads;
+    int thread_count;
+    /* protects the fields below, except next_chunk */
+    QemuMutex lock;
+    /* signalled when a new round of work is ready, or on quit */
+    QemuCond work_cond;
+    /* signalled when the last helper thread finishes a round */
+    QemuCond done_cond;
+    BitmapSyncChunk *chunks;
+    unsigned int nr_chunks;
+    unsigned int chunks_alloc;
+    /* next chunk to be processed, claimed with atomic_fetch_inc */
+    unsigned int next_chunk;
+    /* increased every time a new round of work is started */
+    unsigned int round;
+    /* helper threads still working on the current round */
+    int busy;
+    bool quit;
+    /* newly dirtied pages found in this round */
+    uint64_t num_dirty;
+    /* pages dirtied by the guest found in this round */
+    uint64_t real_dirty;
+};
+typedef struct BitmapSyncState BitmapSyncState;
+
+static BitmapSyncState *bitmap_sync;
+
 /**
- * ram_pagesize_summary: calculate all the pagesizes of a VM
+ * bitmap_sync_process_chunks: sync chunks until there are none left
  *
- * Returns a summary bitmap of the page sizes of all RAMBlocks
+ * Can be called concurrently by the migration thread and all the
+ * helper threads; every chunk is processed exactly once.
  *
- * For VMs with just normal pages this is equivalent to the host page
- * size. If it's got some huge pages then it's the OR of all the
- * different page sizes.
+ * @bs: bitmap sync state
+ * @num_dirty: incremented by the number of newly dirtied pages
+ * @real_dirty: incremented by the number of pages dirtied by the guest
  */
-uint64_t ram_pagesize_summary(void)
+static void bitmap_sync_process_chunks(BitmapSyncState *bs,
+                                       uint64_t *num_dirty,
+                                       uint64_t *real_dirty)
 {
-    RAMBlock *block;
-    uint64_t summary = 0;
+    unsigned int i;
 
-    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-        summary |= block->page_size;
-    }
+    while ((i = atomic_fetch_inc(&bs->next_chunk)) < bs->nr_chunks) {
+        BitmapSyncChunk *chunk = &bs->chunks[i];
 
-    return summary;
+        *num_dirty += cpu_physical_memory_sync_dirty_bitmap(chunk->block,
+                                                            chunk->start,
+                                                            chunk->length,
+                                                            real_dirty);
+    }
 }
 
-uint64_t ram_get_total_transferred_pages(void)
+static void *bitmap_sync_thread(void *opaque)
 {
-    return  ram_counters.normal + ram_counters.duplicate +
-                compression_counters.pages + xbzrle_counters.pages;
-}
+    BitmapSyncState *bs = opaque;
+    unsigned int round = 0;
 
-static void migration_update_rates(RAMState *rs, int64_t end_time)
-{
-    uint64_t page_count = rs->target_page_count - rs->target_page_count_prev;
-    double compressed_size;
+    rcu_register_thread();
 
-    /* calculate period counters */
-    ram_counters.dirty_pages_rate = rs->num_dirty_pages_period * 1000
-                / (end_time - rs->time_last_bitmap_sync);
+    qemu_mutex_lock(&bs->lock);
+    while (true) {
+        uint64_t num_dirty = 0, real_dirty = 0;
 
-    if (!page_count) {
-        return;
-    }
+        while (!bs->quit && bs->round == round) {
+            qemu_cond_wait(&bs->work_cond, &bs->lock);
+        }
+        if (bs->quit) {
+            break;
+        }
+        round = bs->round;
+        qemu_mutex_unlock(&bs->lock);
 
-    if (migrate_use_xbzrle()) {
-        xbzrle_counters.cache_miss_rate = (double)(xbzrle_counters.cache_miss -
-            rs->xbzrle_cache_miss_prev) / page_count;
-        rs->xbzrle_cache_miss_prev = xbzrle_counters.cache_miss;
+        bitmap_sync_process_chunks(bs, &num_dirty, &real_dirty);
+
+        qemu_mutex_lock(&bs->lock);
+        bs->num_dirty += num_dirty;
+        bs->real_dirty += real_dirty;
+        if (--bs->busy == 0) {
+            qemu_cond_signal(&bs->done_cond);
+        }
     }
+    qemu_mutex_unlock(&bs->lock);
 
-    if (migrate_use_compression()) {
-        compression_counters.busy_rate = (double)(compression_counters.busy -
-            rs->compress_thread_busy_prev) / page_count;
-        rs->compress_thread_busy_prev = compression_counters.busy;
+    rcu_unregister_thread();
 
-        compressed_size = compression_counters.compressed_size -
-                          rs->compressed_size_prev;
-        if (compressed_size) {
-            double uncompressed_size = (compression_counters.pages -
-                                    rs->compress_pages_prev) * TARGET_PAGE_SIZE;
+    return NULL;
+}
 
-            /* Compression-Ratio = Uncompressed-size / Compressed-size */
-            compression_counters.compression_rate =
-                                        uncompressed_size / compressed_size;
+static void bitmap_sync_threads_cleanup(void)
+{
+    BitmapSyncState *bs = bitmap_sync;
+    int i;
 
-            rs->compress_pages_prev = compression_counters.pages;
-            rs->compressed_size_prev = compression_counters.compressed_size;
-        }
+    if (!bs) {
+        return;
+    }
+
+    qemu_mutex_lock(&bs->lock);
+    bs->quit = true;
+    qemu_cond_broadcast(&bs->work_cond);
+    qemu_mutex_unlock(&bs->lock);
+
+    for (i = 0; i < bs->thread_count; i++) {
+        qemu_thread_join(bs->threads + i);
     }
+    qemu_mutex_destroy(&bs->lock);
+    qemu_cond_destroy(&bs->work_cond);
+    qemu_cond_destroy(&bs->done_cond);
+    g_free(bs->chunks);
+    g_free(bs->threads);
+    g_free(bs);
+    bitmap_sync = NULL;
 }
 
-static void migration_bitmap_sync(RAMState *rs)
+static void bitmap_sync_threads_setup(void)
 {
-    RAMBlock *block;
+    BitmapSyncState *bs;
+    int i;
+
+    if (migrate_bitmap_sync_threads() <= 1) {
+        return;
+    }
+
+    bs = g_new0(BitmapSyncState, 1);
+    bs->thread_count = migrate_bitmap_sync_threads() - 1;
+    bs->threads = g_new0(QemuThread, bs->thread_count);
+    qemu_mutex_init(&bs->lock);
+    qemu_cond_init(&bs->work_cond);
+    qemu_cond_init(&bs->done_cond);
+    for (i = 0; i < bs->thread_count; i++) {
+        qemu_thread_create(bs->threads + i, "bitmap-sync",
+                           bitmap_sync_thread, bs, QEMU_THREAD_JOINABLE);
+    }
+    bitmap_sync = bs;
+}
+
+/**
+ * bitmap_sync_add_block: split a RAMBlock into chunks of work
+ *
+ * @bs: bitmap sync state
+ * @block: RAMBlock to be synchronized
+ */
+static void bitmap_sync_add_block(BitmapSyncState *bs, RAMBlock *block)
+{
+    ram_addr_t chunk_size = (ram_addr_t)BITMAP_SYNC_CHUNK_PAGES <<
+                            TARGET_PAGE_BITS;
+    ram_addr_t start;
+
+    for (start = 0; start < block->used_length; start += chunk_size) {
+        BitmapSyncChunk *chunk;
+
+        if (bs->nr_chunks == bs->chunks_alloc) {
+            bs->chunks_alloc = MAX(bs->chunks_alloc * 2, 64);
+            bs->chunks = g_renew(BitmapSyncChunk, bs->chunks,
+                                 bs->chunks_alloc);
+        }
+        chunk = &bs->chunks[bs->nr_chunks++];
+        chunk->block = block;
+        chunk->start = start;
+        chunk->length = MIN(chunk_size, block->used_length - start);
+    }
+}
+
+/**
+ * migration_bitmap_sync_threaded: sync all RAMBlocks with helper threads
+ *
+ * The dirty log of every RAMBlock is cut in chunks that are merged into
+ * the migration bitmap by the helper threads and the migration thread
+ * together.  Must be called with the bitmap_mutex and the RCU read lock
+ * held, so that the RAMBlocks cannot go away under the helpers.
+ *
+ * @rs: current RAM state
+ */
+static void migration_bitmap_sync_threaded(RAMState *rs)
+{
+    BitmapSyncState *bs = bitmap_sync;
+    uint64_t num_dirty = 0, real_dirty = 0;
+    RAMBlock *block;
+
+    bs->nr_chunks = 0;
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        bitmap_sync_add_block(bs, block);
+    }
+
+    qemu_mutex_lock(&bs->lock);
+    atomic_set(&bs->next_chunk, 0);
+    bs->num_dirty = 0;
+    bs->real_dirty = 0;
+    bs->busy = bs->thread_count;
+    bs->round++;
+    qemu_cond_broadcast(&bs->work_cond);
+    qemu_mutex_unlock(&bs->lock);
+
+    bitmap_sync_process_chunks(bs, &num_dirty, &real_dirty);
+
+    qemu_mutex_lock(&bs->lock);
+    while (bs->busy) {
+        qemu_cond_wait(&bs->done_cond, &bs->lock);
+    }
+    rs->migration_dirty_pages += num_dirty + bs->num_dirty;
+    rs->num_dirty_pages_period += real_dirty + bs->real_dirty;
+    qemu_mutex_unlock(&bs->lock);
+}
+
+/**
+ * ram_pagesize_summary: calculate all the pagesizes of a VM
+ *
+ * Returns a summary bitmap of the page sizes of all RAMBlocks
+ *
+ * For VMs with just normal pages this is equivalent to the host page
+ * size. If it's got some huge pages then it's the OR of all the
+ * different page sizes.
+ */
+uint64_t ram_pagesize_summary(void)
+{
+    RAMBlock *block;
+    uint64_t summary = 0;
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        summary |= block->page_size;
+    }
+
+    return summary;
+}
+
+uint64_t ram_get_total_transferred_pages(void)
+{
+    return  ram_counters.normal + ram_counters.duplicate +
+                compression_counters.pages + xbzrle_counters.pages;
+}
+
+static void migration_update_rates(RAMState *rs, int64_t end_time)
+{
+    uint64_t page_count = rs->target_page_count - rs->target_page_count_prev;
+    double compressed_size;
+
+    /* calculate period counters */
+    ram_counters.dirty_pages_rate = rs->num_dirty_pages_period * 1000
+                / (end_time - rs->time_last_bitmap_sync);
+
+    if (!page_count) {
+        return;
+    }
+
+    if (migrate_use_xbzrle()) {
+        xbzrle_counters.cache_miss_rate = (double)(xbzrle_counters.cache_miss -
+            rs->xbzrle_cache_miss_prev) / page_count;
+        rs->xbzrle_cache_miss_prev = xbzrle_counters.cache_miss;
+    }
+
+    if (migrate_use_compression()) {
+        compression_counters.busy_rate = (double)(compression_counters.busy -
+            rs->compress_thread_busy_prev) / page_count;
+        rs->compress_thread_busy_prev = compression_counters.busy;
+
+        compressed_size = compression_counters.compressed_size -
+                          rs->compressed_size_prev;
+        if (compressed_size) {
+            double uncompressed_size = (compression_counters.pages -
+                                    rs->compress_pages_prev) * TARGET_PAGE_SIZE;
+
+            /* Compression-Ratio = Uncompressed-size / Compressed-size */
+            compression_counters.compression_rate =
+                                        uncompressed_size / compressed_size;
+
+            rs->compress_pages_prev = compression_counters.pages;
+            rs->compressed_size_prev = compression_counters.compressed_size;
+        }
+    }
+}
+
+static void migration_bitmap_sync(RAMState *rs)
+{
+    RAMBlock *block;
     int64_t end_time;
+    int64_t start_us, bql_time;
     uint64_t bytes_xfer_now;
 
+    /* All callers hold the BQL for the whole sync */
+    start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     ram_counters.dirty_sync_count++;
 
     if (!rs->time_last_bitmap_sync) {
@@ -1761,8 +3057,12 @@ static void migration_bitmap_sync(RAMState *rs)
 
     qemu_mutex_lock(&rs->bitmap_mutex);
     rcu_read_lock();
-    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-        migration_bitmap_sync_range(rs, block, block->used_length);
+    if (bitmap_sync) {
+        migration_bitmap_sync_threaded(rs);
+    } else {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            migration_bitmap_sync_range(rs, block, block->used_length);
+        }
     }
     ram_counters.remaining = ram_bytes_remaining();
     rcu_read_unlock();
@@ -1791,10 +3091,19 @@ static void migration_bitmap_sync(RAMState *rs)
                 (++rs->dirty_rate_high_cnt >= 2)) {
                     trace_migration_throttle();
                     rs->dirty_rate_high_cnt = 0;
-                    mig_throttle_guest_down();
+                    if (migrate_vcpu_throttle()) {
+                        mig_throttle_vcpus_down(rs, bytes_xfer_now -
+                                                    rs->bytes_xfer_prev);
+                    } else {
+                        mig_throttle_guest_down();
+                    }
             }
         }
 
+        if (migrate_vcpu_throttle()) {
+            mig_throttle_vcpus_sample(rs);
+        }
+
         migration_update_rates(rs, end_time);
 
         rs->target_page_count_prev = rs->target_page_count;
@@ -1807,6 +3116,11 @@ static void migration_bitmap_sync(RAMState *rs)
     if (migrate_use_events()) {
         qapi_event_send_migration_pass(ram_counters.dirty_sync_count);
     }
+
+    bql_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_us;
+    ram_counters.dirty_sync_bql_time = bql_time;
+    ram_counters.dirty_sync_bql_time_max =
+        MAX(ram_counters.dirty_sync_bql_time_max, bql_time);
 }
 
 static void migration_bitmap_sync_precopy(RAMState *rs)
@@ -1974,6 +3288,14 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
     p = block->host + offset;
     trace_ram_save_page(block->idstr, (uint64_t)offset, p);
 
+    /*
+     * With write tracking the page is unprotected as soon as it is saved,
+     * so it must be copied before the guest can change it.
+     */
+    if (rs->uffdio_fd >= 0) {
+        send_async = false;
+    }
+
     XBZRLE_cache_lock();
     if (!rs->ram_bulk_stage && !migration_in_postcopy() &&
         migrate_use_xbzrle()) {
@@ -2006,6 +3328,247 @@ static int ram_save_multifd_page(RAMState *rs, RAMBlock *block,
     return 1;
 }
 
+/* Size of the mapped-ram bitmap of @block in the file, in bytes */
+static uint64_t mapped_ram_bitmap_size(RAMBlock *block)
+{
+    /* Padded to 8 bytes, so that 32 and 64 bit hosts agree, see below */
+    return ROUND_UP(DIV_ROUND_UP(block->used_length >> TARGET_PAGE_BITS, 8),
+                    8);
+}
+
+/**
+ * mapped_ram_flush: write the pending run of pages to the file
+ *
+ * Returns 0 for success or a negative errno value
+ *
+ * @rs: current RAM state
+ */
+static int mapped_ram_flush(RAMState *rs)
+{
+    RAMBlock *block = rs->mapped_block;
+    struct iovec iov;
+    int ret;
+
+    if (!block) {
+        return 0;
+    }
+
+    iov.iov_base = block->host + rs->mapped_start;
+    iov.iov_len = rs->mapped_len;
+    ret = qemu_pwritev(rs->f, &iov, 1, block->pages_offset + rs->mapped_start);
+    rs->mapped_block = NULL;
+    if (ret < 0) {
+        error_report("Failed to write pages of %s at " RAM_ADDR_FMT ": %s",
+                     block->idstr, rs->mapped_start, strerror(-ret));
+        return ret;
+    }
+    /* Keep the bandwidth computation of the stream right */
+    qemu_update_position(rs->f, iov.iov_len);
+    return 0;
+}
+
+/**
+ * save_mapped_page: save a page in its slot of the mapped-ram file
+ *
+ * Zero pages aren't written, they are just left out of the bitmap of
+ * the file.  Contiguous pages are gathered and written at once, straight
+ * from guest memory, by the main thread or by the multifd channels.
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * @rs: current RAM state
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ */
+static int save_mapped_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
+{
+    unsigned long page = offset >> TARGET_PAGE_BITS;
+    int ret;
+
+    if (is_zero_range(block->host + offset, TARGET_PAGE_SIZE)) {
+        clear_bit(page, block->file_bmap);
+        ram_counters.duplicate++;
+        return 1;
+    }
+    set_bit(page, block->file_bmap);
+
+    if (migrate_use_multifd()) {
+        return ram_save_multifd_page(rs, block, offset);
+    }
+
+    if (rs->mapped_block == block &&
+        rs->mapped_start + rs->mapped_len == offset &&
+        rs->mapped_len < MAPPED_RAM_BATCH) {
+        rs->mapped_len += TARGET_PAGE_SIZE;
+    } else {
+        ret = mapped_ram_flush(rs);
+        if (ret < 0) {
+            return ret;
+        }
+        rs->mapped_block = block;
+        rs->mapped_start = offset;
+        rs->mapped_len = TARGET_PAGE_SIZE;
+    }
+    ram_counters.transferred += TARGET_PAGE_SIZE;
+    ram_counters.normal++;
+    return 1;
+}
+
+/**
+ * mapped_ram_save_header: lay out the file region of a RAMBlock
+ *
+ * Writes the mapped-ram header of @block to the stream and moves the
+ * stream past the region of the block.
+ *
+ * @f: QEMUFile where to send the data
+ * @block: block we are laying out
+ */
+static void mapped_ram_save_header(QEMUFile *f, RAMBlock *block)
+{
+    /* version, page size and the two offsets */
+    const uint64_t header_size = 4 + 3 * 8;
+    int64_t pos = qemu_file_get_offset(f);
+
+    if (pos < 0) {
+        qemu_file_set_error(f, pos);
+        return;
+    }
+
+    block->bitmap_offset = pos + header_size;
+    block->pages_offset = ROUND_UP(block->bitmap_offset +
+                                   mapped_ram_bitmap_size(block),
+                                   MAPPED_RAM_ALIGN);
+    /* Sized to the bitmap in the file, that pads it to 64 bits */
+    block->file_bmap = bitmap_new(mapped_ram_bitmap_size(block) * 8);
+
+    qemu_put_be32(f, MAPPED_RAM_VERSION);
+    qemu_put_be64(f, TARGET_PAGE_SIZE);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+    trace_ram_mapped_ram_header(block->idstr, block->bitmap_offset,
+                                block->pages_offset);
+
+    qemu_file_set_offset(f, block->pages_offset + block->used_length);
+}
+
+/**
+ * mapped_ram_save_bitmaps: write the bitmaps of the mapped-ram file
+ *
+ * Called once every page is in the file, the pages whose bit is clear are
+ * zero.
+ *
+ * Returns 0 for success or a negative errno value
+ *
+ * @f: QEMUFile where to send the data
+ */
+static int mapped_ram_save_bitmaps(QEMUFile *f)
+{
+    RAMBlock *block;
+    int ret = 0;
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        uint64_t size = mapped_ram_bitmap_size(block);
+        unsigned long *le_bitmap = bitmap_new(size * 8);
+        struct iovec iov = {
+            .iov_base = le_bitmap,
+            .iov_len = size,
+        };
+
+        bitmap_to_le(le_bitmap, block->file_bmap, size * 8);
+        ret = qemu_pwritev(f, &iov, 1, block->bitmap_offset);
+        g_free(le_bitmap);
+        if (ret < 0) {
+            error_report("Failed to write the page bitmap of %s: %s",
+                         block->idstr, strerror(-ret));
+            break;
+        }
+    }
+    rcu_read_unlock();
+    return ret;
+}
+
+/**
+ * mapped_ram_load_block: read the pages of a RAMBlock from the file
+ *
+ * Reads the mapped-ram header of @block from the stream, then the pages
+ * present in the file, and moves the stream past the region of the block.
+ * With multifd the pages are read by the channels, see
+ * multifd_recv_file_sync().
+ *
+ * Returns 0 for success or a negative errno value
+ *
+ * @f: QEMUFile of the migration stream
+ * @block: block we are loading
+ */
+static int mapped_ram_load_block(QEMUFile *f, RAMBlock *block)
+{
+    unsigned long nbits = block->used_length >> TARGET_PAGE_BITS;
+    uint32_t version = qemu_get_be32(f);
+    uint64_t page_size = qemu_get_be64(f);
+    uint64_t bitmap_offset = qemu_get_be64(f);
+    uint64_t pages_offset = qemu_get_be64(f);
+    uint64_t size = mapped_ram_bitmap_size(block);
+    unsigned long *le_bitmap, *bitmap;
+    unsigned long run_start, run_end;
+    struct iovec iov;
+    int ret;
+
+    if (version != MAPPED_RAM_VERSION) {
+        error_report("Unsupported mapped-ram version %u for %s", version,
+                     block->idstr);
+        return -EINVAL;
+    }
+    if (page_size != TARGET_PAGE_SIZE) {
+        error_report("Mismatched mapped-ram page size %" PRIu64
+                     " for %s", page_size, block->idstr);
+        return -EINVAL;
+    }
+    trace_ram_mapped_ram_header(block->idstr, bitmap_offset, pages_offset);
+
+    le_bitmap = bitmap_new(size * 8);
+    bitmap = bitmap_new(size * 8);
+    iov.iov_base = le_bitmap;
+    iov.iov_len = size;
+    ret = qemu_preadv(f, &iov, 1, bitmap_offset);
+    if (ret < 0) {
+        error_report("Failed to read the page bitmap of %s: %s",
+                     block->idstr, strerror(-ret));
+        goto out;
+    }
+    bitmap_from_le(bitmap, le_bitmap, size * 8);
+
+    block->pages_offset = pages_offset;
+    for (run_start = find_first_bit(bitmap, nbits); run_start < nbits;
+         run_start = find_next_bit(bitmap, nbits, run_end)) {
+        ram_addr_t offset = run_start << TARGET_PAGE_BITS;
+
+        run_end = find_next_zero_bit(bitmap, nbits, run_start);
+        if (migrate_use_multifd()) {
+            multifd_recv_file_queue(f, block, offset,
+                                    (run_end - run_start) << TARGET_PAGE_BITS);
+            continue;
+        }
+
+        iov.iov_base = block->host + offset;
+        iov.iov_len = (run_end - run_start) << TARGET_PAGE_BITS;
+        ret = qemu_preadv(f, &iov, 1, pages_offset + offset);
+        if (ret < 0) {
+            error_report("Failed to read pages of %s at " RAM_ADDR_FMT
+                         ": %s", block->idstr, offset, strerror(-ret));
+            goto out;
+        }
+    }
+
+    qemu_file_set_offset(f, pages_offset + block->used_length);
+    ret = qemu_file_get_error(f);
+
+out:
+    g_free(le_bitmap);
+    g_free(bitmap);
+    return ret;
+}
+
 static bool do_compress_ram_page(QEMUFile *f, z_stream *stream, RAMBlock *block,
                                  ram_addr_t offset, uint8_t *source_buf)
 {
@@ -2118,74 +3681,452 @@ retry:
         }
     }
 
-    /*
-     * wait for the free thread if the user specifies 'compress-wait-thread',
-     * otherwise we will post the page out in the main thread as normal page.
-     */
-    if (pages < 0 && wait) {
-        qemu_cond_wait(&comp_done_cond, &comp_done_lock);
-        goto retry;
+    /*
+     * wait for the free thread if the user specifies 'compress-wait-thread',
+     * otherwise we will post the page out in the main thread as normal page.
+     */
+    if (pages < 0 && wait) {
+        qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+        goto retry;
+    }
+    qemu_mutex_unlock(&comp_done_lock);
+
+    return pages;
+}
+
+/**
+ * find_dirty_block: find the next dirty page and update any state
+ * associated with the search process.
+ *
+ * Returns true if a page is found
+ *
+ * @rs: current RAM state
+ * @pss: data about the state of the current dirty page scan
+ * @again: set to false if the search has scanned the whole of RAM
+ */
+static bool find_dirty_block(RAMState *rs, PageSearchStatus *pss, bool *again)
+{
+    pss->page = migration_bitmap_find_dirty(rs, pss->block, pss->page);
+    if (pss->complete_round && pss->block == rs->last_seen_block &&
+        pss->page >= rs->last_page) {
+        /*
+         * We've been once around the RAM and haven't found anything.
+         * Give up.
+         */
+        *again = false;
+        return false;
+    }
+    if ((pss->page << TARGET_PAGE_BITS) >= pss->block->used_length) {
+        /* Didn't find anything in this RAM Block */
+        pss->page = 0;
+        pss->block = QLIST_NEXT_RCU(pss->block, next);
+        if (!pss->block) {
+            /*
+             * If memory migration starts over, we will meet a dirtied page
+             * which may still exists in compression threads's ring, so we
+             * should flush the compressed data to make sure the new page
+             * is not overwritten by the old one in the destination.
+             *
+             * Also If xbzrle is on, stop using the data compression at this
+             * point. In theory, xbzrle can do better than compression.
+             */
+            flush_compressed_data(rs);
+
+            /* Hit the end of the list */
+            pss->block = QLIST_FIRST_RCU(&ram_list.blocks);
+            /* Flag that we've looped */
+            pss->complete_round = true;
+            rs->ram_bulk_stage = false;
+        }
+        /* Didn't find anything this time, but try again on the new block */
+        *again = true;
+        return false;
+    } else {
+        /* Can go around again, but... */
+        *again = true;
+        /* We've found something so probably don't need to */
+        return true;
+    }
+}
+
+/*
+ * Background snapshot
+ *
+ * The guest RAM is write protected with userfaultfd once the device state
+ * is saved, then each page is unprotected as soon as it has been copied
+ * to the stream.  A vCPU writing to a page that was not saved yet blocks
+ * in the kernel until the migration thread saves that page out of order,
+ * see poll_fault_page().
+ */
+
+/* Largest run of saved pages unprotected with a single ioctl */
+#define WT_RELEASE_MAX (2 * MiB)
+
+#ifdef CONFIG_LINUX
+
+/**
+ * ram_wt_release_flush: drop the write protection of the pending run of
+ * saved pages, waking the vCPUs that fault on them
+ *
+ * Returns 0 on success or negative on error
+ *
+ * @rs: current RAM state
+ */
+static int ram_wt_release_flush(RAMState *rs)
+{
+    RAMBlock *block = rs->wp_release_block;
+    int ret;
+
+    if (!rs->wp_release_len) {
+        return 0;
+    }
+
+    ret = uffd_change_protection(rs->uffdio_fd,
+                                 block->host + rs->wp_release_start,
+                                 rs->wp_release_len, false, false);
+    rs->wp_release_len = 0;
+    if (ret) {
+        error_report("%s: failed to unprotect %s/0x" RAM_ADDR_FMT ": %s",
+                     __func__, block->idstr, rs->wp_release_start,
+                     strerror(-ret));
+    }
+    return ret;
+}
+
+/**
+ * ram_wt_release: queue a saved host page for unprotection
+ *
+ * Contiguous pages are unprotected together, which saves most of the
+ * ioctls during the linear scan of RAM.
+ *
+ * Returns 0 on success or negative on error
+ *
+ * @rs: current RAM state
+ * @block: block of the page
+ * @offset: offset of the host page inside the block
+ * @flush: unprotect it now, e.g. because a vCPU waits for it
+ */
+static int ram_wt_release(RAMState *rs, RAMBlock *block, ram_addr_t offset,
+                          bool flush)
+{
+    int ret = 0;
+
+    if (rs->wp_release_len && rs->wp_release_block == block &&
+        rs->wp_release_start + rs->wp_release_len == offset &&
+        rs->wp_release_len < WT_RELEASE_MAX) {
+        rs->wp_release_len += block->page_size;
+    } else {
+        ret = ram_wt_release_flush(rs);
+        rs->wp_release_block = block;
+        rs->wp_release_start = offset;
+        rs->wp_release_len = block->page_size;
+    }
+
+    if (flush && !ret) {
+        ret = ram_wt_release_flush(rs);
+    }
+    return ret;
+}
+
+/**
+ * poll_fault_page: get a page a vCPU is blocked on
+ *
+ * Faults on pages that were saved but not unprotected yet are resolved
+ * here; only the pages that still have to be saved are returned.
+ *
+ * Returns the block of the page, or NULL if no vCPU waits for a page
+ *
+ * @rs: current RAM state
+ * @offset: set to the offset of the host page inside the block
+ */
+static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
+{
+    struct uffd_msg uffd_msg;
+    RAMBlock *block;
+    unsigned long page, end;
+    void *host;
+
+    if (rs->uffdio_fd < 0) {
+        return NULL;
+    }
+
+    while (uffd_read_events(rs->uffdio_fd, &uffd_msg, 1) == 1) {
+        if (uffd_msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+
+        host = (void *)(uintptr_t)uffd_msg.arg.pagefault.address;
+        block = qemu_ram_block_from_host(host, false, offset);
+        assert(block && (block->flags & RAM_UF_WRITEPROTECT));
+        *offset = QEMU_ALIGN_DOWN(*offset, block->page_size);
+
+        page = *offset >> TARGET_PAGE_BITS;
+        end = page + (block->page_size >> TARGET_PAGE_BITS);
+        trace_ram_write_tracking_fault(block->idstr, (uint64_t)*offset);
+        if (find_next_bit(block->bmap, end, page) < end) {
+            return block;
+        }
+
+        /* Already saved, it only waits in the pending run */
+        ram_wt_release_flush(rs);
+        uffd_change_protection(rs->uffdio_fd, block->host + *offset,
+                               block->page_size, false, false);
+    }
+
+    return NULL;
+}
+
+/**
+ * ram_write_tracking_available: check if the host kernel supports
+ * userfaultfd write protection
+ */
+bool ram_write_tracking_available(void)
+{
+    uint64_t uffd_features;
+
+    if (uffd_query_features(&uffd_features, NULL)) {
+        return false;
+    }
+    return !!(uffd_features & UFFD_FEATURE_PAGEFAULT_FLAG_WP);
+}
+
+/**
+ * ram_write_tracking_compatible: check if all the guest RAM can be write
+ * protected with userfaultfd
+ *
+ * The kernel only supports it for some kinds of memory, e.g. not for
+ * shared memory or hugetlbfs on older kernels.
+ */
+bool ram_write_tracking_compatible(void)
+{
+    const uint64_t uffd_ioctls_mask = BIT(_UFFDIO_WRITEPROTECT);
+    uint64_t uffd_ioctls;
+    RAMBlock *block;
+    bool ret = false;
+    int uffd_fd;
+
+    uffd_fd = uffd_create_fd(UFFD_FEATURE_PAGEFAULT_FLAG_WP, false, NULL);
+    if (uffd_fd < 0) {
+        return false;
+    }
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        /* Nothing writes to read-only regions */
+        if (block->mr->readonly || block->mr->rom_device) {
+            continue;
+        }
+        if (uffd_register_memory(uffd_fd, block->host, block->used_length,
+                                 UFFDIO_REGISTER_MODE_WP, &uffd_ioctls,
+                                 NULL)) {
+            goto out;
+        }
+        if ((uffd_ioctls & uffd_ioctls_mask) != uffd_ioctls_mask) {
+            goto out;
+        }
+    }
+    ret = true;
+
+out:
+    rcu_read_unlock();
+    /* Closing the fd unregisters everything */
+    close(uffd_fd);
+    return ret;
+}
+
+/**
+ * ram_write_tracking_prepare: populate the guest RAM
+ *
+ * Write protection only applies to the pages that are mapped, so map the
+ * ones the guest never touched before protecting them.  Reading them is
+ * enough and only maps the zero page.  Called before the VM is stopped,
+ * pages mapped by the guest in the meantime are mapped anyway.
+ */
+void ram_write_tracking_prepare(void)
+{
+    RAMBlock *block;
+    ram_addr_t offset;
+    char *p;
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if (block->mr->readonly || block->mr->rom_device) {
+            continue;
+        }
+        for (offset = 0; offset < block->used_length;
+             offset += block->page_size) {
+            p = (char *)block->host + offset;
+            (void)atomic_read(p);
+        }
+    }
+    rcu_read_unlock();
+}
+
+/**
+ * ram_write_tracking_start: write protect the guest RAM
+ *
+ * Called with the VM stopped, right after its device state was saved.
+ *
+ * Returns 0 on success or -1 on error
+ */
+int ram_write_tracking_start(void)
+{
+    RAMState *rs = ram_state;
+    Error *local_err = NULL;
+    RAMBlock *block;
+    int uffd_fd, ret;
+
+    uffd_fd = uffd_create_fd(UFFD_FEATURE_PAGEFAULT_FLAG_WP, true,
+                             &local_err);
+    if (uffd_fd < 0) {
+        error_report_err(local_err);
+        return -1;
+    }
+    rs->uffdio_fd = uffd_fd;
+    rs->wp_release_len = 0;
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if (block->mr->readonly || block->mr->rom_device) {
+            continue;
+        }
+        if (uffd_register_memory(uffd_fd, block->host, block->used_length,
+                                 UFFDIO_REGISTER_MODE_WP, NULL,
+                                 &local_err)) {
+            error_report_err(local_err);
+            goto fail;
+        }
+        /* The block must not go away while its pages fault to us */
+        memory_region_ref(block->mr);
+        block->flags |= RAM_UF_WRITEPROTECT;
+
+        ret = uffd_change_protection(uffd_fd, block->host, block->used_length,
+                                     true, false);
+        if (ret) {
+            error_report("%s: failed to write protect %s: %s", __func__,
+                         block->idstr, strerror(-ret));
+            goto fail;
+        }
+        trace_ram_write_tracking_ramblock_start(block->idstr,
+                                                block->page_size,
+                                                block->host,
+                                                block->used_length);
+    }
+    rcu_read_unlock();
+
+    return 0;
+
+fail:
+    rcu_read_unlock();
+    ram_write_tracking_stop();
+    return -1;
+}
+
+/**
+ * ram_write_tracking_stop: unprotect the guest RAM and stop tracking it
+ */
+void ram_write_tracking_stop(void)
+{
+    RAMState *rs = ram_state;
+    RAMBlock *block;
+
+    if (!rs || rs->uffdio_fd < 0) {
+        return;
+    }
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if (!(block->flags & RAM_UF_WRITEPROTECT)) {
+            continue;
+        }
+        uffd_change_protection(rs->uffdio_fd, block->host, block->used_length,
+                               false, false);
+        uffd_unregister_memory(rs->uffdio_fd, block->host, block->used_length,
+                               NULL);
+        trace_ram_write_tracking_ramblock_stop(block->idstr,
+                                               block->page_size,
+                                               block->host,
+                                               block->used_length);
+        block->flags &= ~RAM_UF_WRITEPROTECT;
+        memory_region_unref(block->mr);
     }
-    qemu_mutex_unlock(&comp_done_lock);
+    rcu_read_unlock();
 
-    return pages;
+    close(rs->uffdio_fd);
+    rs->uffdio_fd = -1;
+    rs->wp_release_len = 0;
 }
 
 /**
- * find_dirty_block: find the next dirty page and update any state
- * associated with the search process.
+ * ram_write_tracking_wait: wait for a vCPU to fault on a protected page
  *
- * Returns true if a page is found
+ * Returns true if a vCPU waits for a page to be saved
  *
- * @rs: current RAM state
- * @pss: data about the state of the current dirty page scan
- * @again: set to false if the search has scanned the whole of RAM
+ * @timeout_ms: how long to wait, 0 to only check
  */
-static bool find_dirty_block(RAMState *rs, PageSearchStatus *pss, bool *again)
+bool ram_write_tracking_wait(int timeout_ms)
 {
-    pss->page = migration_bitmap_find_dirty(rs, pss->block, pss->page);
-    if (pss->complete_round && pss->block == rs->last_seen_block &&
-        pss->page >= rs->last_page) {
-        /*
-         * We've been once around the RAM and haven't found anything.
-         * Give up.
-         */
-        *again = false;
-        return false;
-    }
-    if ((pss->page << TARGET_PAGE_BITS) >= pss->block->used_length) {
-        /* Didn't find anything in this RAM Block */
-        pss->page = 0;
-        pss->block = QLIST_NEXT_RCU(pss->block, next);
-        if (!pss->block) {
-            /*
-             * If memory migration starts over, we will meet a dirtied page
-             * which may still exists in compression threads's ring, so we
-             * should flush the compressed data to make sure the new page
-             * is not overwritten by the old one in the destination.
-             *
-             * Also If xbzrle is on, stop using the data compression at this
-             * point. In theory, xbzrle can do better than compression.
-             */
-            flush_compressed_data(rs);
+    RAMState *rs = ram_state;
+    GPollFD pfd;
 
-            /* Hit the end of the list */
-            pss->block = QLIST_FIRST_RCU(&ram_list.blocks);
-            /* Flag that we've looped */
-            pss->complete_round = true;
-            rs->ram_bulk_stage = false;
-        }
-        /* Didn't find anything this time, but try again on the new block */
-        *again = true;
+    if (!rs || rs->uffdio_fd < 0) {
         return false;
-    } else {
-        /* Can go around again, but... */
-        *again = true;
-        /* We've found something so probably don't need to */
-        return true;
     }
+
+    pfd.fd = rs->uffdio_fd;
+    pfd.events = G_IO_IN;
+    pfd.revents = 0;
+    return qemu_poll_ns(&pfd, 1, (int64_t)MAX(timeout_ms, 0) * SCALE_MS) > 0;
+}
+
+#else
+
+static int ram_wt_release_flush(RAMState *rs)
+{
+    return 0;
+}
+
+static int ram_wt_release(RAMState *rs, RAMBlock *block, ram_addr_t offset,
+                          bool flush)
+{
+    return 0;
+}
+
+static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
+{
+    return NULL;
+}
+
+bool ram_write_tracking_available(void)
+{
+    return false;
+}
+
+bool ram_write_tracking_compatible(void)
+{
+    return false;
+}
+
+void ram_write_tracking_prepare(void)
+{
+}
+
+int ram_write_tracking_start(void)
+{
+    return -1;
+}
+
+void ram_write_tracking_stop(void)
+{
+}
+
+bool ram_write_tracking_wait(int timeout_ms)
+{
+    return false;
 }
 
+#endif /* CONFIG_LINUX */
+
 /**
  * unqueue_page: gets a page of the queue
  *
@@ -2195,19 +4136,23 @@ static bool find_dirty_block(RAMState *rs, PageSearchStatus *pss, bool *again)
  *
  * @rs: current RAM state
  * @offset: used to return the offset within the RAMBlock
+ * @urgent: set if the page comes from a fault, not from a prefetch
  */
-static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset)
+static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset, bool *urgent)
 {
+    RAMSrcPageRequestQueue *queue;
     RAMBlock *block = NULL;
 
-    if (QSIMPLEQ_EMPTY_ATOMIC(&rs->src_page_requests)) {
+    if (QSIMPLEQ_EMPTY_ATOMIC(&rs->src_page_requests) &&
+        QSIMPLEQ_EMPTY_ATOMIC(&rs->src_prefetch_requests)) {
         return NULL;
     }
 
     qemu_mutex_lock(&rs->src_page_req_mutex);
-    if (!QSIMPLEQ_EMPTY(&rs->src_page_requests)) {
-        struct RAMSrcPageRequest *entry =
-                                QSIMPLEQ_FIRST(&rs->src_page_requests);
+    *urgent = !QSIMPLEQ_EMPTY(&rs->src_page_requests);
+    queue = *urgent ? &rs->src_page_requests : &rs->src_prefetch_requests;
+    if (!QSIMPLEQ_EMPTY(queue)) {
+        struct RAMSrcPageRequest *entry = QSIMPLEQ_FIRST(queue);
         block = entry->rb;
         *offset = entry->offset;
 
@@ -2216,9 +4161,11 @@ static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset)
             entry->offset += TARGET_PAGE_SIZE;
         } else {
             memory_region_unref(block->mr);
-            QSIMPLEQ_REMOVE_HEAD(&rs->src_page_requests, next_req);
+            QSIMPLEQ_REMOVE_HEAD(queue, next_req);
             g_free(entry);
-            migration_consume_urgent_request();
+            if (*urgent) {
+                migration_consume_urgent_request();
+            }
         }
     }
     qemu_mutex_unlock(&rs->src_page_req_mutex);
@@ -2240,10 +4187,10 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
 {
     RAMBlock  *block;
     ram_addr_t offset;
-    bool dirty;
+    bool dirty, urgent;
 
     do {
-        block = unqueue_page(rs, &offset);
+        block = unqueue_page(rs, &offset, &urgent);
         /*
          * We're sending this page, and since it's postcopy nothing else
          * will dirty it, and we must make sure it doesn't get sent again
@@ -2265,6 +4212,12 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
 
     } while (block && !dirty);
 
+    if (!block) {
+        /* A vCPU may be blocked on a write protected page */
+        block = poll_fault_page(rs, &offset);
+        urgent = true;
+    }
+
     if (block) {
         /*
          * As soon as we start servicing pages out of order, then we have
@@ -2281,6 +4234,7 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
          */
         pss->block = block;
         pss->page = offset >> TARGET_PAGE_BITS;
+        pss->urgent = urgent;
     }
 
     return !!block;
@@ -2306,13 +4260,22 @@ static void migration_page_queue_free(RAMState *rs)
         QSIMPLEQ_REMOVE_HEAD(&rs->src_page_requests, next_req);
         g_free(mspr);
     }
+    QSIMPLEQ_FOREACH_SAFE(mspr, &rs->src_prefetch_requests, next_req,
+                          next_mspr) {
+        memory_region_unref(mspr->rb->mr);
+        QSIMPLEQ_REMOVE_HEAD(&rs->src_prefetch_requests, next_req);
+        g_free(mspr);
+    }
     rcu_read_unlock();
 }
 
 /**
  * ram_save_queue_pages: queue the page for transmission
  *
- * A request from postcopy destination for example.
+ * A request from postcopy destination for example.  Only the first host
+ * page of the range is urgent, the rest is the destination's prefetch
+ * window and is queued separately, behind the urgent pages of later
+ * requests.
  *
  * Returns zero on success or negative on error
  *
@@ -2362,12 +4325,24 @@ int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len)
         g_malloc0(sizeof(struct RAMSrcPageRequest));
     new_entry->rb = ramblock;
     new_entry->offset = start;
-    new_entry->len = len;
+    new_entry->len = MIN(len, qemu_ram_pagesize(ramblock));
 
     memory_region_ref(ramblock->mr);
     qemu_mutex_lock(&rs->src_page_req_mutex);
     QSIMPLEQ_INSERT_TAIL(&rs->src_page_requests, new_entry, next_req);
     migration_make_urgent_request();
+    if (len > new_entry->len) {
+        struct RAMSrcPageRequest *prefetch =
+            g_malloc0(sizeof(struct RAMSrcPageRequest));
+
+        prefetch->rb = ramblock;
+        prefetch->offset = start + new_entry->len;
+        prefetch->len = len - new_entry->len;
+        memory_region_ref(ramblock->mr);
+        QSIMPLEQ_INSERT_TAIL(&rs->src_prefetch_requests, prefetch, next_req);
+        trace_ram_save_queue_prefetch(ramblock->idstr, prefetch->offset,
+                                      prefetch->len);
+    }
     qemu_mutex_unlock(&rs->src_page_req_mutex);
     rcu_read_unlock();
 
@@ -2396,6 +4371,50 @@ static bool save_page_use_compression(RAMState *rs)
     return false;
 }
 
+/*
+ * Whether the host page at @pss goes through the multifd channels.
+ *
+ * In postcopy the pages requested by the destination go through the
+ * main channel.  The destination places whole host pages, so the
+ * channels only get the host pages that fit in a packet and that are
+ * sent entirely, see multifd_recv_place_pages().
+ */
+static bool save_page_use_multifd(RAMState *rs, PageSearchStatus *pss)
+{
+    RAMBlock *block = pss->block;
+    unsigned long count = qemu_ram_pagesize(block) >> TARGET_PAGE_BITS;
+    unsigned long end = pss->page + count;
+
+    if (!migrate_use_multifd() || save_page_use_compression(rs)) {
+        return false;
+    }
+    if (!migration_in_postcopy()) {
+        return true;
+    }
+    if (pss->urgent || pss->page & (count - 1) ||
+        count > multifd_send_state->page_count) {
+        return false;
+    }
+    return find_next_zero_bit(block->bmap, end, pss->page) >= end;
+}
+
+/*
+ * Whether the migration thread looks for zero pages, otherwise the
+ * multifd channels do it, or nobody does.
+ */
+static bool save_page_use_zero_detection(RAMState *rs, PageSearchStatus *pss)
+{
+    switch (migrate_zero_page_detection()) {
+    case ZERO_PAGE_DETECTION_NONE:
+        return false;
+    case ZERO_PAGE_DETECTION_MULTIFD:
+        return !pss->multifd;
+    default:
+        /* In postcopy a host page goes through a single channel */
+        return !pss->multifd || !migration_in_postcopy();
+    }
+}
+
 /*
  * try to compress the page before posting it out, return true if the page
  * has been properly handled by compression, otherwise needs other
@@ -2450,29 +4469,35 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return res;
     }
 
+    if (migrate_mapped_ram()) {
+        return save_mapped_page(rs, block, offset);
+    }
+
     if (save_compress_page(rs, block, offset)) {
         return 1;
     }
 
-    res = save_zero_page(rs, block, offset);
-    if (res > 0) {
-        /* Must let xbzrle know, otherwise a previous (now 0'd) cached
-         * page would be stale
-         */
-        if (!save_page_use_compression(rs)) {
-            XBZRLE_cache_lock();
-            xbzrle_cache_zero_page(rs, block->offset + offset);
-            XBZRLE_cache_unlock();
+    if (save_page_use_zero_detection(rs, pss)) {
+        res = save_zero_page(rs, block, offset);
+        if (res > 0) {
+            /* Must let xbzrle know, otherwise a previous (now 0'd) cached
+             * page would be stale
+             */
+            if (!save_page_use_compression(rs)) {
+                XBZRLE_cache_lock();
+                xbzrle_cache_zero_page(rs, block->offset + offset);
+                XBZRLE_cache_unlock();
+            }
+            ram_release_pages(block->idstr, offset, res);
+            return res;
         }
-        ram_release_pages(block->idstr, offset, res);
-        return res;
     }
 
     /*
      * do not use multifd for compression as the first page in the new
      * block should be posted out before sending the compressed page
      */
-    if (!save_page_use_compression(rs) && migrate_use_multifd()) {
+    if (pss->multifd) {
         return ram_save_multifd_page(rs, block, offset);
     }
 
@@ -2503,12 +4528,19 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
     int tmppages, pages = 0;
     size_t pagesize_bits =
         qemu_ram_pagesize(pss->block) >> TARGET_PAGE_BITS;
+    unsigned long start_page = pss->page;
+    bool saved = false;
 
     if (ramblock_is_ignored(pss->block)) {
         error_report("block %s should not be migrated !", pss->block->idstr);
         return 0;
     }
 
+    pss->multifd = save_page_use_multifd(rs, pss);
+    if (pss->multifd && migration_in_postcopy()) {
+        multifd_queue_reserve(pss->block, pagesize_bits);
+    }
+
     do {
         /* Check the pages is dirty and if it is send it */
         if (!migration_bitmap_clear_dirty(rs, pss->block, pss->page)) {
@@ -2522,6 +4554,7 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
         }
 
         pages += tmppages;
+        saved = true;
         if (pss->block->unsentmap) {
             clear_bit(pss->page, pss->block->unsentmap);
         }
@@ -2532,9 +4565,89 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
 
     /* The offset we leave with is the last one we looked at */
     pss->page--;
+
+    if (saved && rs->uffdio_fd >= 0) {
+        unsigned long first = QEMU_ALIGN_DOWN(start_page, pagesize_bits);
+        unsigned long end = first + pagesize_bits;
+        int ret;
+
+        /* Only unprotect the host page once all of it is saved */
+        if (find_next_bit(pss->block->bmap, end, first) >= end) {
+            ret = ram_wt_release(rs, pss->block, first << TARGET_PAGE_BITS,
+                                 pss->urgent);
+            if (ret) {
+                return ret;
+            }
+        }
+    }
     return pages;
 }
 
+/*
+ * postcopy_preempt_file: the channel for the pages requested by the
+ * destination, or NULL if they go through the main channel.  After an
+ * error on the preempt channel, e.g. once postcopy recovered from a
+ * network failure, the main channel is used again.
+ */
+static QEMUFile *postcopy_preempt_file(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (!migrate_postcopy_preempt() || !migration_in_postcopy() ||
+        !s->postcopy_qemufile_src ||
+        qemu_file_get_error(s->postcopy_qemufile_src)) {
+        return NULL;
+    }
+    return s->postcopy_qemufile_src;
+}
+
+/**
+ * ram_save_host_page_preempt: save a requested host page through the
+ * postcopy preempt channel
+ *
+ * The page is followed by RAM_SAVE_FLAG_EOS and flushed at once, so that
+ * the destination loads it right away; an empty burst (RAM_SAVE_FLAG_EOS
+ * alone) closes the channel, see ram_postcopy_preempt_finish().
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ * @last_stage: if we are at the completion stage
+ * @f: the postcopy preempt channel
+ */
+static int ram_save_host_page_preempt(RAMState *rs, PageSearchStatus *pss,
+                                      bool last_stage, QEMUFile *f)
+{
+    QEMUFile *main_file = rs->f;
+    RAMBlock *main_last_sent_block = rs->last_sent_block;
+    int64_t start = qemu_ftell_fast(f);
+    int pages, ret;
+
+    rs->f = f;
+    rs->last_sent_block = rs->preempt_last_sent_block;
+    pages = ram_save_host_page(rs, pss, last_stage);
+    rs->preempt_last_sent_block = rs->last_sent_block;
+    rs->last_sent_block = main_last_sent_block;
+    rs->f = main_file;
+
+    if (qemu_ftell_fast(f) != start) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        ram_counters.transferred += 8;
+        qemu_fflush(f);
+    }
+    trace_ram_save_host_page_preempt(pss->block->idstr,
+                                     (uint64_t)pss->page << TARGET_PAGE_BITS,
+                                     pages);
+
+    /*
+     * The pages may be lost; fail the main channel too so that postcopy
+     * pauses, and recovery resends them from the destination's bitmap.
+     */
+    ret = qemu_file_get_error(f);
+    return ret ? ret : pages;
+}
+
 /**
  * ram_find_and_save_block: finds a dirty page and sends it to f
  *
@@ -2570,7 +4683,10 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
     }
 
     do {
+        QEMUFile *preempt_file;
+
         again = true;
+        pss.urgent = false;
         found = get_queued_page(rs, &pss);
 
         if (!found) {
@@ -2578,7 +4694,11 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
             found = find_dirty_block(rs, &pss, &again);
         }
 
-        if (found) {
+        preempt_file = pss.urgent ? postcopy_preempt_file() : NULL;
+        if (found && preempt_file) {
+            pages = ram_save_host_page_preempt(rs, &pss, last_stage,
+                                               preempt_file);
+        } else if (found) {
             pages = ram_save_host_page(rs, &pss, last_stage);
         }
     } while (!pages && again);
@@ -2643,6 +4763,7 @@ static void ram_state_cleanup(RAMState **rsp)
         migration_page_queue_free(*rsp);
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
+        g_free((*rsp)->vcpu_dirty_pages_prev);
         g_free(*rsp);
         *rsp = NULL;
     }
@@ -2672,17 +4793,24 @@ static void ram_save_cleanup(void *opaque)
     /* caller have hold iothread lock or is in a bh, so there is
      * no writing race against the migration bitmap
      */
-    memory_global_dirty_log_stop();
+    if (migrate_background_snapshot()) {
+        ram_write_tracking_stop();
+    } else {
+        memory_global_dirty_log_stop();
+    }
 
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
         g_free(block->bmap);
         block->bmap = NULL;
         g_free(block->unsentmap);
         block->unsentmap = NULL;
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
     }
 
     xbzrle_cleanup();
     compress_threads_save_cleanup();
+    bitmap_sync_threads_cleanup();
     ram_state_cleanup(rsp);
 }
 
@@ -2690,6 +4818,7 @@ static void ram_state_reset(RAMState *rs)
 {
     rs->last_seen_block = NULL;
     rs->last_sent_block = NULL;
+    rs->preempt_last_sent_block = NULL;
     rs->last_page = 0;
     rs->last_version = ram_list.version;
     rs->ram_bulk_stage = true;
@@ -3171,6 +5300,8 @@ static int ram_state_init(RAMState **rsp)
     qemu_mutex_init(&(*rsp)->bitmap_mutex);
     qemu_mutex_init(&(*rsp)->src_page_req_mutex);
     QSIMPLEQ_INIT(&(*rsp)->src_page_requests);
+    QSIMPLEQ_INIT(&(*rsp)->src_prefetch_requests);
+    (*rsp)->uffdio_fd = -1;
 
     /*
      * This must match with the initial values of dirty bitmap.
@@ -3180,6 +5311,14 @@ static int ram_state_init(RAMState **rsp)
     (*rsp)->migration_dirty_pages = 0;
     ram_state_reset(*rsp);
 
+    if (migrate_vcpu_throttle()) {
+        (*rsp)->vcpu_dirty_pages_prev = g_new0(uint64_t, max_cpus);
+        mig_throttle_vcpus_sample(*rsp);
+    }
+
+    ram_counters.dirty_sync_bql_time = 0;
+    ram_counters.dirty_sync_bql_time_max = 0;
+
     return 0;
 }
 
@@ -3212,14 +5351,29 @@ static void ram_list_init_bitmaps(void)
 
 static void ram_init_bitmaps(RAMState *rs)
 {
+    RAMBlock *block;
+
     /* For memory_global_dirty_log_start below.  */
     qemu_mutex_lock_iothread();
     qemu_mutex_lock_ramlist();
     rcu_read_lock();
 
     ram_list_init_bitmaps();
-    memory_global_dirty_log_start();
-    migration_bitmap_sync_precopy(rs);
+    if (migrate_background_snapshot()) {
+        /*
+         * Writes are tracked with userfaultfd instead of the dirty log,
+         * and each page is sent exactly once.
+         */
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+
+            bitmap_set(block->bmap, 0, pages);
+            rs->migration_dirty_pages += pages;
+        }
+    } else {
+        memory_global_dirty_log_start();
+        migration_bitmap_sync_precopy(rs);
+    }
 
     rcu_read_unlock();
     qemu_mutex_unlock_ramlist();
@@ -3344,14 +5498,22 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     RAMState **rsp = opaque;
     RAMBlock *block;
 
+    if (migrate_mapped_ram() && !qemu_file_is_seekable(f)) {
+        error_report("mapped-ram needs a seekable migration stream, "
+                     "e.g. a file: URI");
+        return -1;
+    }
+
     if (compress_threads_save_setup()) {
         return -1;
     }
+    bitmap_sync_threads_setup();
 
     /* migration has already setup the bitmap, reuse it. */
     if (!migration_in_colo_state()) {
         if (ram_init_all(rsp) != 0) {
             compress_threads_save_cleanup();
+            bitmap_sync_threads_cleanup();
             return -1;
         }
     }
@@ -3372,6 +5534,20 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
             qemu_put_be64(f, block->mr->addr);
             qemu_put_byte(f, ramblock_is_ignored(block) ? 1 : 0);
         }
+        if (migrate_mapped_ram() && !ramblock_is_ignored(block)) {
+            mapped_ram_save_header(f, block);
+        }
+        if (migrate_local_ram()) {
+            qemu_put_byte(f, ramblock_is_local(block));
+            if (ramblock_is_local(block) &&
+                qemu_file_send_fd(f, block->fd)) {
+                error_report("local-ram: failed to pass the file of RAM "
+                             "block %s, it needs a unix socket",
+                             block->idstr);
+                rcu_read_unlock();
+                return -1;
+            }
+        }
     }
 
     rcu_read_unlock();
@@ -3423,7 +5599,8 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     i = 0;
     while ((ret = qemu_file_rate_limit(f)) == 0 ||
-            !QSIMPLEQ_EMPTY(&rs->src_page_requests)) {
+            !QSIMPLEQ_EMPTY(&rs->src_page_requests) ||
+            ram_write_tracking_wait(0)) {
         int pages;
 
         if (qemu_file_get_error(f)) {
@@ -3458,6 +5635,18 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         }
         i++;
     }
+    if (rs->uffdio_fd >= 0) {
+        ret = ram_wt_release_flush(rs);
+        if (ret) {
+            qemu_file_set_error(f, ret);
+        }
+    }
+    if (migrate_mapped_ram()) {
+        ret = mapped_ram_flush(rs);
+        if (ret) {
+            qemu_file_set_error(f, ret);
+        }
+    }
     rcu_read_unlock();
 
     /*
@@ -3490,6 +5679,20 @@ out:
  * @f: QEMUFile where to send the data
  * @opaque: RAMState pointer
  */
+/*
+ * Every page has been sent, tell the destination that nothing more comes
+ * through the postcopy preempt channel
+ */
+static void ram_postcopy_preempt_finish(void)
+{
+    QEMUFile *f = postcopy_preempt_file();
+
+    if (f) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        qemu_fflush(f);
+    }
+}
+
 static int ram_save_complete(QEMUFile *f, void *opaque)
 {
     RAMState **temp = opaque;
@@ -3522,14 +5725,25 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     }
 
     flush_compressed_data(rs);
+    if (!ret && migrate_mapped_ram()) {
+        ret = mapped_ram_flush(rs);
+    }
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
     rcu_read_unlock();
 
     multifd_send_sync_main();
+    if (!ret && migrate_mapped_ram()) {
+        /* Only once every page is in the file */
+        ret = mapped_ram_save_bitmaps(f);
+    }
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
     qemu_fflush(f);
 
+    if (!ret && migration_in_postcopy()) {
+        ram_postcopy_preempt_finish();
+    }
+
     return ret;
 }
 
@@ -3605,14 +5819,18 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
  *
  * @f: QEMUFile where to read the data from
  * @flags: Page flags (mostly to see if it's a continuation of previous block)
+ * @channel: the RamChannel @f carries, each one has its own previous block
  */
-static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
+static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags,
+                                              int channel)
 {
-    static RAMBlock *block = NULL;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    RAMBlock *block;
     char id[256];
     uint8_t len;
 
     if (flags & RAM_SAVE_FLAG_CONTINUE) {
+        block = mis->last_recv_block[channel];
         if (!block) {
             error_report("Ack, bad migration stream!");
             return NULL;
@@ -3625,6 +5843,7 @@ static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
     id[len] = 0;
 
     block = qemu_ram_block_by_name(id);
+    mis->last_recv_block[channel] = block;
     if (!block) {
         error_report("Can't find block %s", id);
         return NULL;
@@ -4021,19 +6240,21 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
  *
  * Returns 0 for success or -errno in case of error
  *
- * Called in postcopy mode by ram_load().
+ * Called in postcopy mode by ram_load(), and for the postcopy preempt
+ * channel by ram_load_postcopy_preempt().
  * rcu_read_lock is taken prior to this being called.
  *
  * @f: QEMUFile where to send the data
+ * @channel: the RamChannel @f carries
  */
-static int ram_load_postcopy(QEMUFile *f)
+static int ram_load_postcopy(QEMUFile *f, int channel)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
     bool matches_target_page_size = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
     /* Temporary page that is later 'placed' */
-    void *postcopy_host_page = postcopy_get_tmp_page(mis);
+    void *postcopy_host_page = postcopy_get_tmp_page(mis, channel);
     void *last_host = NULL;
     bool all_zero = false;
 
@@ -4062,7 +6283,7 @@ static int ram_load_postcopy(QEMUFile *f)
         trace_ram_load_postcopy_loop((uint64_t)addr, flags);
         place_needed = false;
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE)) {
-            block = ram_block_from_stream(f, flags);
+            block = ram_block_from_stream(f, flags, channel);
 
             host = host_from_ram_block_offset(block, addr);
             if (!host) {
@@ -4136,7 +6357,9 @@ static int ram_load_postcopy(QEMUFile *f)
             break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
-            multifd_recv_sync_main();
+            if (channel == RAM_CHANNEL_PRECOPY) {
+                multifd_recv_sync_main();
+            }
             break;
         default:
             error_report("Unknown combination of migration flags: %#x"
@@ -4167,6 +6390,43 @@ static int ram_load_postcopy(QEMUFile *f)
     return ret;
 }
 
+/**
+ * ram_load_postcopy_preempt: load the pages of the postcopy preempt
+ * channel
+ *
+ * Returns 0 once the source closed the channel, or -errno on error
+ *
+ * The source sends each requested host page as a burst ending with
+ * RAM_SAVE_FLAG_EOS, and an empty burst at the end.  The RCU read lock is
+ * only held while loading a burst, not while waiting for the next one.
+ *
+ * @f: the postcopy preempt channel
+ */
+int ram_load_postcopy_preempt(QEMUFile *f)
+{
+    int ret = 0;
+
+    while (!ret) {
+        uint8_t *buf;
+
+        if (qemu_peek_buffer(f, &buf, sizeof(uint64_t), 0) !=
+            sizeof(uint64_t)) {
+            ret = qemu_file_get_error(f) ?: -EIO;
+            break;
+        }
+        if (ldq_be_p(buf) == RAM_SAVE_FLAG_EOS) {
+            qemu_file_skip(f, sizeof(uint64_t));
+            break;
+        }
+
+        rcu_read_lock();
+        ret = ram_load_postcopy(f, RAM_CHANNEL_POSTCOPY);
+        rcu_read_unlock();
+    }
+
+    return ret;
+}
+
 static bool postcopy_is_advised(void)
 {
     PostcopyState ps = postcopy_state_get();
@@ -4219,6 +6479,48 @@ static void colo_flush_ram_cache(void)
     trace_colo_flush_ram_cache_end();
 }
 
+/**
+ * ram_load_local_block: take over the file of a RAMBlock with local-ram
+ *
+ * The source passes the file of each of its local RAMBlocks, which
+ * replaces the one of @block, so the pages are neither sent nor copied.
+ *
+ * Returns 0 for success or a negative errno value
+ *
+ * @f: QEMUFile of the migration stream
+ * @block: block we are loading
+ */
+static int ram_load_local_block(QEMUFile *f, RAMBlock *block)
+{
+    Error *local_err = NULL;
+    bool local = qemu_get_byte(f);
+    int fd;
+
+    if (local != ramblock_is_local(block)) {
+        error_report("local-ram: RAM block %s is backed by shared memory "
+                     "on the %s only", block->idstr,
+                     local ? "source" : "destination");
+        return -EINVAL;
+    }
+    if (!local) {
+        return 0;
+    }
+
+    fd = qemu_file_recv_fd(f);
+    if (fd < 0) {
+        error_report("local-ram: no file received for RAM block %s: %s",
+                     block->idstr, strerror(-fd));
+        return fd;
+    }
+    if (qemu_ram_remap_fd(block, fd, &local_err)) {
+        error_report_err(local_err);
+        close(fd);
+        return -EINVAL;
+    }
+    trace_ram_load_local_block(block->idstr, fd);
+    return 0;
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     int flags = 0, ret = 0, invalid_flags = 0;
@@ -4249,7 +6551,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     rcu_read_lock();
 
     if (postcopy_running) {
-        ret = ram_load_postcopy(f);
+        ret = ram_load_postcopy(f, RAM_CHANNEL_PRECOPY);
     }
 
     while (!postcopy_running && !ret && !(flags & RAM_SAVE_FLAG_EOS)) {
@@ -4272,7 +6574,8 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+            RAMBlock *block = ram_block_from_stream(f, flags,
+                                                    RAM_CHANNEL_PRECOPY);
 
             /*
              * After going into COLO, we should load the Page into colo_cache.
@@ -4352,8 +6655,15 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                             ret = -EINVAL;
                         }
                     }
+                    if (!ret && migrate_local_ram()) {
+                        ret = ram_load_local_block(f, block);
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
+                    if (!ret && migrate_mapped_ram() &&
+                        !ramblock_is_ignored(block)) {
+                        ret = mapped_ram_load_block(f, block);
+                    }
                 } else {
                     error_report("Unknown ramblock \"%s\", cannot "
                                  "accept migration", id);
@@ -4362,6 +6672,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
                 total_ram_bytes -= length;
             }
+            if (!ret && migrate_mapped_ram() && migrate_use_multifd()) {
+                ret = multifd_recv_file_sync();
+            }
             break;
 
         case RAM_SAVE_FLAG_ZERO:
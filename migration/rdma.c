@@ -393,6 +393,14 @@ typedef struct RDMAContext {
     /* the RDMAContext for return path */
     struct RDMAContext *return_path;
     bool is_return_path;
+
+    /*
+     * Connection of a multifd channel.  On the destination, it shares
+     * the CM channel and the listen id with the main connection.
+     */
+    bool is_multifd_channel;
+    /* number of multifd channels accepted so far (destination) */
+    int multifd_accepted;
 } RDMAContext;
 
 #define TYPE_QIO_CHANNEL_RDMA "qio-channel-rdma"
@@ -1515,6 +1523,12 @@ static int qemu_rdma_wait_comp_channel(RDMAContext *rdma)
          * But we need to be able to handle 'cancel' or an error
          * without hanging forever.
          */
+        /*
+         * The multifd channels of the destination share the CM channel
+         * with the main connection, whose events belong to the main loop.
+         */
+        int nfds = rdma->is_multifd_channel && rdma->listen_id ? 1 : 2;
+
         while (!rdma->error_state  && !rdma->received_error) {
             GPollFD pfds[2];
             pfds[0].fd = rdma->comp_channel->fd;
@@ -1526,7 +1540,7 @@ static int qemu_rdma_wait_comp_channel(RDMAContext *rdma)
             pfds[1].revents = 0;
 
             /* 0.1s timeout, should be fine for a 'cancel' */
-            switch (qemu_poll_ns(pfds, 2, 100 * 1000 * 1000)) {
+            switch (qemu_poll_ns(pfds, nfds, 100 * 1000 * 1000)) {
             case 2:
             case 1: /* fd active */
                 if (pfds[0].revents) {
@@ -2329,7 +2343,7 @@ static void qemu_rdma_cleanup(RDMAContext *rdma)
         rdma->connected = false;
     }
 
-    if (rdma->channel) {
+    if (rdma->channel && !rdma->is_multifd_channel) {
         qemu_set_fd_handler(rdma->channel->fd, NULL, NULL, NULL);
     }
     g_free(rdma->dest_blocks);
@@ -2372,13 +2386,13 @@ static void qemu_rdma_cleanup(RDMAContext *rdma)
 
     /* the destination side, listen_id and channel is shared */
     if (rdma->listen_id) {
-        if (!rdma->is_return_path) {
+        if (!rdma->is_return_path && !rdma->is_multifd_channel) {
             rdma_destroy_id(rdma->listen_id);
         }
         rdma->listen_id = NULL;
 
         if (rdma->channel) {
-            if (!rdma->is_return_path) {
+            if (!rdma->is_return_path && !rdma->is_multifd_channel) {
                 rdma_destroy_event_channel(rdma->channel);
             }
             rdma->channel = NULL;
@@ -2668,6 +2682,7 @@ static ssize_t qio_channel_rdma_writev(QIOChannel *ioc,
                                        size_t niov,
                                        int *fds,
                                        size_t nfds,
+                                       int flags,
                                        Error **errp)
 {
     QIOChannelRDMA *rioc = QIO_CHANNEL_RDMA(ioc);
@@ -3061,7 +3076,7 @@ qio_channel_rdma_shutdown(QIOChannel *ioc,
     rcu_read_lock();
 
     rdmain = atomic_rcu_read(&rioc->rdmain);
-    rdmaout = atomic_rcu_read(&rioc->rdmain);
+    rdmaout = atomic_rcu_read(&rioc->rdmaout);
 
     switch (how) {
     case QIO_CHANNEL_SHUTDOWN_READ:
@@ -3141,7 +3156,9 @@ static size_t qemu_rdma_save_page(QEMUFile *f, void *opaque,
 
     CHECK_ERROR_STATE();
 
-    if (migrate_get_current()->state == MIGRATION_STATUS_POSTCOPY_ACTIVE) {
+    /* With multifd, the pages are written by the multifd channels */
+    if (migrate_get_current()->state == MIGRATION_STATUS_POSTCOPY_ACTIVE ||
+        migrate_use_multifd()) {
         rcu_read_unlock();
         return RAM_SAVE_CONTROL_NOT_SUPP;
     }
@@ -3236,12 +3253,15 @@ err:
 }
 
 static void rdma_accept_incoming_migration(void *opaque);
+static void rdma_accept_incoming_multifd(void *opaque);
 
 static void rdma_cm_poll_handler(void *opaque)
 {
     RDMAContext *rdma = opaque;
     int ret;
     struct rdma_cm_event *cm_event;
+    enum rdma_cm_event_type event;
+    struct rdma_cm_id *id;
     MigrationIncomingState *mis = migration_incoming_get_current();
 
     ret = rdma_get_cm_event(rdma->channel, &cm_event);
@@ -3249,11 +3269,22 @@ static void rdma_cm_poll_handler(void *opaque)
         error_report("get_cm_event failed %d", errno);
         return;
     }
+    event = cm_event->event;
+    id = cm_event->id;
     rdma_ack_cm_event(cm_event);
 
-    if (cm_event->event == RDMA_CM_EVENT_DISCONNECTED ||
-        cm_event->event == RDMA_CM_EVENT_DEVICE_REMOVAL) {
-        error_report("receive cm event, cm event is %d", cm_event->event);
+    /*
+     * The multifd channels notice their own disconnection through
+     * their completion queue, don't fail the main connection for it.
+     */
+    if (id != rdma->cm_id &&
+        !(rdma->return_path && id == rdma->return_path->cm_id)) {
+        return;
+    }
+
+    if (event == RDMA_CM_EVENT_DISCONNECTED ||
+        event == RDMA_CM_EVENT_DEVICE_REMOVAL) {
+        error_report("receive cm event, cm event is %d", event);
         rdma->error_state = -EPIPE;
         if (rdma->return_path) {
             rdma->return_path->error_state = -EPIPE;
@@ -3365,7 +3396,11 @@ static int qemu_rdma_accept(RDMAContext *rdma)
         qemu_set_fd_handler(rdma->channel->fd, rdma_accept_incoming_migration,
                             NULL,
                             (void *)(intptr_t)rdma->return_path);
-    } else {
+    } else if (migrate_use_multifd() && !rdma->is_multifd_channel) {
+        /* Then the connection requests of the multifd channels */
+        qemu_set_fd_handler(rdma->channel->fd, rdma_accept_incoming_multifd,
+                            NULL, rdma);
+    } else if (!rdma->is_multifd_channel) {
         qemu_set_fd_handler(rdma->channel->fd, rdma_cm_poll_handler,
                             NULL, rdma);
     }
@@ -3415,6 +3450,74 @@ static int dest_ram_sort_func(const void *a, const void *b)
     return (a_index < b_index) ? -1 : (a_index != b_index);
 }
 
+/*
+ * Answer a RAM_BLOCKS_REQUEST: put the local RAM Block list in the order
+ * of the source, pin it if asked to, and send the descriptions of the
+ * blocks (address and rkey) back to the source.
+ */
+static int qemu_rdma_send_dest_blocks(RDMAContext *rdma)
+{
+    RDMAControlHeader blocks = { .type = RDMA_CONTROL_RAM_BLOCKS_RESULT,
+                                 .repeat = 1 };
+    RDMALocalBlocks *local = &rdma->local_ram_blocks;
+    int i, ret;
+
+    /*
+     * Sort our local RAM Block list so it's the same as the source,
+     * we can do this since we've filled in a src_index in the list
+     * as we received the RAMBlock list earlier.
+     */
+    qsort(local->block, local->nb_blocks, sizeof(RDMALocalBlock),
+          dest_ram_sort_func);
+    for (i = 0; i < local->nb_blocks; i++) {
+        local->block[i].index = i;
+    }
+
+    if (rdma->pin_all) {
+        ret = qemu_rdma_reg_whole_ram_blocks(rdma);
+        if (ret) {
+            error_report("rdma migration: error dest "
+                            "registering ram blocks");
+            return ret;
+        }
+    }
+
+    /*
+     * Dest uses this to prepare to transmit the RAMBlock descriptions
+     * to the source VM after connection setup.
+     * Both sides use the "remote" structure to communicate and update
+     * their "local" descriptions with what was sent.
+     */
+    for (i = 0; i < local->nb_blocks; i++) {
+        rdma->dest_blocks[i].remote_host_addr =
+            (uintptr_t)(local->block[i].local_host_addr);
+
+        if (rdma->pin_all) {
+            rdma->dest_blocks[i].remote_rkey = local->block[i].mr->rkey;
+        }
+
+        rdma->dest_blocks[i].offset = local->block[i].offset;
+        rdma->dest_blocks[i].length = local->block[i].length;
+
+        dest_block_to_network(&rdma->dest_blocks[i]);
+        trace_qemu_rdma_registration_handle_ram_blocks_loop(
+            local->block[i].block_name,
+            local->block[i].offset,
+            local->block[i].length,
+            local->block[i].local_host_addr,
+            local->block[i].src_index);
+    }
+
+    blocks.len = local->nb_blocks * sizeof(RDMADestBlock);
+
+    ret = qemu_rdma_post_send_control(rdma, (uint8_t *) rdma->dest_blocks,
+                                      &blocks);
+    if (ret < 0) {
+        error_report("rdma migration: error sending remote info");
+    }
+    return ret;
+}
+
 /*
  * During each iteration of the migration, we listen for instructions
  * by the source VM to perform dynamic page registrations before they
@@ -3434,11 +3537,8 @@ static int qemu_rdma_registration_handle(QEMUFile *f, void *opaque)
                                .type = RDMA_CONTROL_UNREGISTER_FINISHED,
                                .repeat = 0,
                              };
-    RDMAControlHeader blocks = { .type = RDMA_CONTROL_RAM_BLOCKS_RESULT,
-                                 .repeat = 1 };
     QIOChannelRDMA *rioc = QIO_CHANNEL_RDMA(opaque);
     RDMAContext *rdma;
-    RDMALocalBlocks *local;
     RDMAControlHeader head;
     RDMARegister *reg, *registers;
     RDMACompress *comp;
@@ -3449,7 +3549,6 @@ static int qemu_rdma_registration_handle(QEMUFile *f, void *opaque)
     int ret = 0;
     int idx = 0;
     int count = 0;
-    int i = 0;
 
     rcu_read_lock();
     rdma = atomic_rcu_read(&rioc->rdmain);
@@ -3461,7 +3560,6 @@ static int qemu_rdma_registration_handle(QEMUFile *f, void *opaque)
 
     CHECK_ERROR_STATE();
 
-    local = &rdma->local_ram_blocks;
     do {
         trace_qemu_rdma_registration_handle_wait();
 
@@ -3508,61 +3606,8 @@ static int qemu_rdma_registration_handle(QEMUFile *f, void *opaque)
         case RDMA_CONTROL_RAM_BLOCKS_REQUEST:
             trace_qemu_rdma_registration_handle_ram_blocks();
 
-            /* Sort our local RAM Block list so it's the same as the source,
-             * we can do this since we've filled in a src_index in the list
-             * as we received the RAMBlock list earlier.
-             */
-            qsort(rdma->local_ram_blocks.block,
-                  rdma->local_ram_blocks.nb_blocks,
-                  sizeof(RDMALocalBlock), dest_ram_sort_func);
-            for (i = 0; i < local->nb_blocks; i++) {
-                local->block[i].index = i;
-            }
-
-            if (rdma->pin_all) {
-                ret = qemu_rdma_reg_whole_ram_blocks(rdma);
-                if (ret) {
-                    error_report("rdma migration: error dest "
-                                    "registering ram blocks");
-                    goto out;
-                }
-            }
-
-            /*
-             * Dest uses this to prepare to transmit the RAMBlock descriptions
-             * to the source VM after connection setup.
-             * Both sides use the "remote" structure to communicate and update
-             * their "local" descriptions with what was sent.
-             */
-            for (i = 0; i < local->nb_blocks; i++) {
-                rdma->dest_blocks[i].remote_host_addr =
-                    (uintptr_t)(local->block[i].local_host_addr);
-
-                if (rdma->pin_all) {
-                    rdma->dest_blocks[i].remote_rkey = local->block[i].mr->rkey;
-                }
-
-                rdma->dest_blocks[i].offset = local->block[i].offset;
-                rdma->dest_blocks[i].length = local->block[i].length;
-
-                dest_block_to_network(&rdma->dest_blocks[i]);
-                trace_qemu_rdma_registration_handle_ram_blocks_loop(
-                    local->block[i].block_name,
-                    local->block[i].offset,
-                    local->block[i].length,
-                    local->block[i].local_host_addr,
-                    local->block[i].src_index);
-            }
-
-            blocks.len = rdma->local_ram_blocks.nb_blocks
-                                                * sizeof(RDMADestBlock);
-
-
-            ret = qemu_rdma_post_send_control(rdma,
-                                        (uint8_t *) rdma->dest_blocks, &blocks);
-
+            ret = qemu_rdma_send_dest_blocks(rdma);
             if (ret < 0) {
-                error_report("rdma migration: error sending remote info");
                 goto out;
             }
 
@@ -3793,6 +3838,58 @@ static int qemu_rdma_registration_start(QEMUFile *f, void *opaque,
  * Inform dest that dynamic registrations are done for now.
  * First, flush writes, if any.
  */
+/*
+ * Propagate the RAMBlock descriptions sent by the destination in
+ * response to a RAM_BLOCKS_REQUEST to our local copy.
+ */
+static int qemu_rdma_recv_dest_blocks(RDMAContext *rdma,
+                                      RDMAControlHeader *resp,
+                                      int reg_result_idx, Error **errp)
+{
+    RDMALocalBlocks *local = &rdma->local_ram_blocks;
+    int i, nb_dest_blocks = resp->len / sizeof(RDMADestBlock);
+
+    /*
+     * The protocol uses two different sets of rkeys (mutually exclusive):
+     * 1. One key to represent the virtual address of the entire ram block.
+     *    (dynamic chunk registration disabled - pin everything with one rkey.)
+     * 2. One to represent individual chunks within a ram block.
+     *    (dynamic chunk registration enabled - pin individual chunks.)
+     *
+     * Once the capability is successfully negotiated, the destination transmits
+     * the keys to use (or sends them later) including the virtual addresses
+     * and then propagates the remote ram block descriptions to his local copy.
+     */
+
+    if (local->nb_blocks != nb_dest_blocks) {
+        ERROR(errp, "ram blocks mismatch (Number of blocks %d vs %d) "
+                    "Your QEMU command line parameters are probably "
+                    "not identical on both the source and destination.",
+                    local->nb_blocks, nb_dest_blocks);
+        return -EINVAL;
+    }
+
+    qemu_rdma_move_header(rdma, reg_result_idx, resp);
+    memcpy(rdma->dest_blocks,
+        rdma->wr_data[reg_result_idx].control_curr, resp->len);
+    for (i = 0; i < nb_dest_blocks; i++) {
+        network_to_dest_block(&rdma->dest_blocks[i]);
+
+        /* We require that the blocks are in the same order */
+        if (rdma->dest_blocks[i].length != local->block[i].length) {
+            ERROR(errp, "Block %s/%d has a different length %" PRIu64
+                        "vs %" PRIu64, local->block[i].block_name, i,
+                        local->block[i].length,
+                        rdma->dest_blocks[i].length);
+            return -EINVAL;
+        }
+        local->block[i].remote_host_addr =
+                rdma->dest_blocks[i].remote_host_addr;
+        local->block[i].remote_rkey = rdma->dest_blocks[i].remote_rkey;
+    }
+    return 0;
+}
+
 static int qemu_rdma_registration_stop(QEMUFile *f, void *opaque,
                                        uint64_t flags, void *data)
 {
@@ -3825,8 +3922,7 @@ static int qemu_rdma_registration_stop(QEMUFile *f, void *opaque,
 
     if (flags == RAM_CONTROL_SETUP) {
         RDMAControlHeader resp = {.type = RDMA_CONTROL_RAM_BLOCKS_RESULT };
-        RDMALocalBlocks *local = &rdma->local_ram_blocks;
-        int reg_result_idx, i, nb_dest_blocks;
+        int reg_result_idx;
 
         head.type = RDMA_CONTROL_RAM_BLOCKS_REQUEST;
         trace_qemu_rdma_registration_stop_ram();
@@ -3848,49 +3944,11 @@ static int qemu_rdma_registration_stop(QEMUFile *f, void *opaque,
             return ret;
         }
 
-        nb_dest_blocks = resp.len / sizeof(RDMADestBlock);
-
-        /*
-         * The protocol uses two different sets of rkeys (mutually exclusive):
-         * 1. One key to represent the virtual address of the entire ram block.
-         *    (dynamic chunk registration disabled - pin everything with one rkey.)
-         * 2. One to represent individual chunks within a ram block.
-         *    (dynamic chunk registration enabled - pin individual chunks.)
-         *
-         * Once the capability is successfully negotiated, the destination transmits
-         * the keys to use (or sends them later) including the virtual addresses
-         * and then propagates the remote ram block descriptions to his local copy.
-         */
-
-        if (local->nb_blocks != nb_dest_blocks) {
-            ERROR(errp, "ram blocks mismatch (Number of blocks %d vs %d) "
-                        "Your QEMU command line parameters are probably "
-                        "not identical on both the source and destination.",
-                        local->nb_blocks, nb_dest_blocks);
-            rdma->error_state = -EINVAL;
+        ret = qemu_rdma_recv_dest_blocks(rdma, &resp, reg_result_idx, errp);
+        if (ret < 0) {
+            rdma->error_state = ret;
             rcu_read_unlock();
-            return -EINVAL;
-        }
-
-        qemu_rdma_move_header(rdma, reg_result_idx, &resp);
-        memcpy(rdma->dest_blocks,
-            rdma->wr_data[reg_result_idx].control_curr, resp.len);
-        for (i = 0; i < nb_dest_blocks; i++) {
-            network_to_dest_block(&rdma->dest_blocks[i]);
-
-            /* We require that the blocks are in the same order */
-            if (rdma->dest_blocks[i].length != local->block[i].length) {
-                ERROR(errp, "Block %s/%d has a different length %" PRIu64
-                            "vs %" PRIu64, local->block[i].block_name, i,
-                            local->block[i].length,
-                            rdma->dest_blocks[i].length);
-                rdma->error_state = -EINVAL;
-                rcu_read_unlock();
-                return -EINVAL;
-            }
-            local->block[i].remote_host_addr =
-                    rdma->dest_blocks[i].remote_host_addr;
-            local->block[i].remote_rkey = rdma->dest_blocks[i].remote_rkey;
+            return ret;
         }
     }
 
@@ -3991,6 +4049,299 @@ static QEMUFile *qemu_fopen_rdma(RDMAContext *rdma, const char *mode)
     return rioc->file;
 }
 
+/*
+ * Multifd over RDMA.
+ *
+ * Each multifd channel has its own connection (and queue pair) to the
+ * destination.  The multifd packets are sent with SEND messages through
+ * the regular channel interface, while the pages are written straight
+ * into the destination RAM with RDMA WRITEs.  Both sides pin all of the
+ * RAM of each channel connection when it is set up, so the registration
+ * is reused by every iteration.  The writes of a packet complete on the
+ * queue pair before the SEND of the next packet, so the pages are in
+ * place by the time the destination sees the next SYNC.
+ */
+
+/* Number of page writes posted at once */
+#define RDMA_MULTIFD_WRITE_BATCH 64
+
+static struct {
+    char *host_port;
+} outgoing_args;
+
+static bool multifd_incoming;
+
+static bool rdma_multifd_check(Error **errp)
+{
+    if (migrate_multifd_compression() != MULTIFD_COMPRESSION_NONE) {
+        error_setg(errp, "RDMA multifd channels don't support compression");
+        return false;
+    }
+    if (migrate_postcopy()) {
+        error_setg(errp, "RDMA multifd channels don't support postcopy");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Source side of the RAMBlock exchange of a multifd channel.  The
+ * request carries the names of our RAMBlocks, as the channel can be set
+ * up before the main connection has sent the block list.
+ */
+static int qemu_rdma_multifd_recv_dest_blocks(RDMAContext *rdma,
+                                              Error **errp)
+{
+    RDMALocalBlocks *local = &rdma->local_ram_blocks;
+    RDMAControlHeader head = { .type = RDMA_CONTROL_RAM_BLOCKS_REQUEST,
+                               .repeat = 1 };
+    RDMAControlHeader resp = { .type = RDMA_CONTROL_RAM_BLOCKS_RESULT };
+    GString *names = g_string_new(NULL);
+    int i, reg_result_idx, ret;
+
+    for (i = 0; i < local->nb_blocks; i++) {
+        g_string_append_len(names, local->block[i].block_name,
+                            strlen(local->block[i].block_name) + 1);
+    }
+    head.len = names->len;
+
+    ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *)names->str, &resp,
+                                  &reg_result_idx,
+                                  qemu_rdma_reg_whole_ram_blocks);
+    g_string_free(names, true);
+    if (ret < 0) {
+        ERROR(errp, "receiving remote info!");
+        return ret;
+    }
+
+    return qemu_rdma_recv_dest_blocks(rdma, &resp, reg_result_idx, errp);
+}
+
+/* Destination side of the RAMBlock exchange of a multifd channel */
+static int qemu_rdma_multifd_send_dest_blocks(RDMAContext *rdma)
+{
+    RDMALocalBlocks *local = &rdma->local_ram_blocks;
+    RDMAControlHeader head;
+    unsigned int src_index = 0;
+    const char *name, *end;
+    int i, ret;
+
+    ret = qemu_rdma_exchange_recv(rdma, &head,
+                                  RDMA_CONTROL_RAM_BLOCKS_REQUEST);
+    if (ret < 0) {
+        return ret;
+    }
+
+    name = (const char *)rdma->wr_data[RDMA_WRID_READY].control_curr;
+    end = name + head.len;
+    while (name < end) {
+        size_t len = strnlen(name, end - name);
+
+        if (name + len == end) {
+            error_report("rdma: malformed RAMBlock list");
+            return -EINVAL;
+        }
+        for (i = 0; i < local->nb_blocks; i++) {
+            if (!strcmp(local->block[i].block_name, name)) {
+                local->block[i].src_index = src_index++;
+                break;
+            }
+        }
+        if (i == local->nb_blocks) {
+            error_report("RAMBlock '%s' not found on destination", name);
+            return -ENOENT;
+        }
+        name += len + 1;
+    }
+
+    return qemu_rdma_send_dest_blocks(rdma);
+}
+
+bool rdma_multifd_outgoing(void)
+{
+    return outgoing_args.host_port != NULL;
+}
+
+bool rdma_multifd_incoming(void)
+{
+    return multifd_incoming;
+}
+
+QIOChannel *rdma_send_channel_create(Error **errp)
+{
+    RDMAContext *rdma;
+    QIOChannelRDMA *rioc;
+
+    if (!outgoing_args.host_port) {
+        error_setg(errp, "RDMA migration is not in progress");
+        return NULL;
+    }
+
+    rdma = qemu_rdma_data_init(outgoing_args.host_port, errp);
+    if (!rdma) {
+        return NULL;
+    }
+    rdma->is_multifd_channel = true;
+
+    if (qemu_rdma_source_init(rdma, true, errp) ||
+        qemu_rdma_connect(rdma, errp)) {
+        g_free(rdma);
+        return NULL;
+    }
+
+    if (!rdma->pin_all) {
+        ERROR(errp, "multifd channels need the destination to pin all memory");
+        goto err;
+    }
+
+    if (qemu_rdma_multifd_recv_dest_blocks(rdma, errp) < 0) {
+        goto err;
+    }
+
+    trace_rdma_send_channel_create(rdma->local_ram_blocks.nb_blocks);
+    rioc = QIO_CHANNEL_RDMA(object_new(TYPE_QIO_CHANNEL_RDMA));
+    rioc->rdmaout = rdma;
+    return QIO_CHANNEL(rioc);
+
+err:
+    qemu_rdma_cleanup(rdma);
+    g_free(rdma);
+    return NULL;
+}
+
+void rdma_send_channel_destroy(QIOChannel *send)
+{
+    /* Remove channel */
+    if (send) {
+        object_unref(OBJECT(send));
+    }
+    g_free(outgoing_args.host_port);
+    outgoing_args.host_port = NULL;
+}
+
+int rdma_send_channel_write_pages(QIOChannel *ioc, RAMBlock *rb,
+                                  const struct iovec *iov, unsigned int niov,
+                                  Error **errp)
+{
+    QIOChannelRDMA *rioc = QIO_CHANNEL_RDMA(ioc);
+    struct ibv_sge sge[RDMA_MULTIFD_WRITE_BATCH];
+    struct ibv_send_wr wr[RDMA_MULTIFD_WRITE_BATCH], *bad_wr;
+    RDMALocalBlock *block;
+    RDMAContext *rdma;
+    unsigned int i, j, n;
+    int ret = 0;
+
+    rcu_read_lock();
+    rdma = atomic_rcu_read(&rioc->rdmaout);
+    if (!rdma || rdma->error_state) {
+        error_setg(errp, "RDMA multifd channel is in an error state");
+        ret = -EIO;
+        goto out;
+    }
+
+    block = g_hash_table_lookup(rdma->blockmap,
+                                (void *)(uintptr_t)qemu_ram_get_offset(rb));
+    if (!block) {
+        error_setg(errp, "RDMA: RAMBlock %s is not registered",
+                   qemu_ram_get_idstr(rb));
+        ret = -EINVAL;
+        goto out;
+    }
+
+    for (i = 0; i < niov; i += n) {
+        n = MIN(niov - i, RDMA_MULTIFD_WRITE_BATCH);
+
+        for (j = 0; j < n; j++) {
+            uint8_t *addr = iov[i + j].iov_base;
+
+            sge[j].addr = (uintptr_t)addr;
+            sge[j].length = iov[i + j].iov_len;
+            sge[j].lkey = block->mr->lkey;
+
+            wr[j] = (struct ibv_send_wr) {
+                .wr_id = qemu_rdma_make_wrid(RDMA_WRID_RDMA_WRITE,
+                                             block->index, 0),
+                .next = j + 1 < n ? &wr[j + 1] : NULL,
+                .sg_list = &sge[j],
+                .num_sge = 1,
+                .opcode = IBV_WR_RDMA_WRITE,
+                /* Only wait for the last write of the batch */
+                .send_flags = j + 1 < n ? 0 : IBV_SEND_SIGNALED,
+                .wr.rdma.remote_addr = block->remote_host_addr +
+                                       (addr - block->local_host_addr),
+                .wr.rdma.rkey = block->remote_rkey,
+            };
+        }
+
+        ret = ibv_post_send(rdma->qp, wr, &bad_wr);
+        if (ret) {
+            error_setg_errno(errp, ret, "RDMA: failed to post page writes");
+            ret = -ret;
+            break;
+        }
+
+        ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE, NULL);
+        if (ret < 0) {
+            error_setg(errp, "RDMA: page writes failed (%d)", ret);
+            break;
+        }
+        rdma->total_writes += n;
+    }
+
+    if (ret < 0) {
+        rdma->error_state = ret;
+    }
+out:
+    rcu_read_unlock();
+    return ret;
+}
+
+static void rdma_accept_incoming_multifd(void *opaque)
+{
+    RDMAContext *rdma = opaque;
+    RDMAContext *chan = g_new0(RDMAContext, 1);
+    QIOChannelRDMA *rioc;
+    Error *local_err = NULL;
+    int ret;
+
+    chan->current_index = -1;
+    chan->current_chunk = -1;
+    chan->is_multifd_channel = true;
+    /* the CM channel and the listen id are shared */
+    chan->channel = rdma->channel;
+    chan->listen_id = rdma->listen_id;
+
+    if (++rdma->multifd_accepted == migrate_multifd_channels()) {
+        /* That was the last one, watch the main connection again */
+        qemu_set_fd_handler(rdma->channel->fd, rdma_cm_poll_handler,
+                            NULL, rdma);
+    }
+
+    trace_rdma_accept_incoming_multifd(rdma->multifd_accepted);
+    ret = qemu_rdma_accept(chan);
+    if (ret) {
+        error_report("RDMA multifd channel initialization failed!");
+        g_free(chan);
+        return;
+    }
+
+    ret = qemu_rdma_multifd_send_dest_blocks(chan);
+    if (ret < 0) {
+        error_report("RDMA multifd channel RAMBlock exchange failed");
+        qemu_rdma_cleanup(chan);
+        g_free(chan);
+        return;
+    }
+
+    rioc = QIO_CHANNEL_RDMA(object_new(TYPE_QIO_CHANNEL_RDMA));
+    rioc->rdmain = chan;
+    migration_ioc_process_incoming(QIO_CHANNEL(rioc), &local_err);
+    object_unref(OBJECT(rioc));
+    if (local_err) {
+        error_report_err(local_err);
+    }
+}
+
 static void rdma_accept_incoming_migration(void *opaque)
 {
     RDMAContext *rdma = opaque;
@@ -4030,6 +4381,11 @@ void rdma_start_incoming_migration(const char *host_port, Error **errp)
     Error *local_err = NULL;
 
     trace_rdma_start_incoming_migration();
+    if (migrate_use_multifd() && !rdma_multifd_check(errp)) {
+        return;
+    }
+    multifd_incoming = migrate_use_multifd();
+
     rdma = qemu_rdma_data_init(host_port, &local_err);
 
     if (rdma == NULL) {
@@ -4077,10 +4433,15 @@ void rdma_start_outgoing_migration(void *opaque,
                             const char *host_port, Error **errp)
 {
     MigrationState *s = opaque;
-    RDMAContext *rdma = qemu_rdma_data_init(host_port, errp);
+    RDMAContext *rdma = NULL;
     RDMAContext *rdma_return_path = NULL;
     int ret = 0;
 
+    if (migrate_use_multifd() && !rdma_multifd_check(errp)) {
+        return;
+    }
+
+    rdma = qemu_rdma_data_init(host_port, errp);
     if (rdma == NULL) {
         goto err;
     }
@@ -4127,6 +4488,11 @@ void rdma_start_outgoing_migration(void *opaque,
 
     trace_rdma_start_outgoing_migration_after_rdma_connect();
 
+    /* The multifd channels connect to the same address */
+    g_free(outgoing_args.host_port);
+    outgoing_args.host_port = migrate_use_multifd() ? g_strdup(host_port)
+                                                    : NULL;
+
     s->to_dst_file = qemu_fopen_rdma(rdma, "wb");
     migrate_fd_connect(s, NULL);
     return;
@@ -17,9 +17,57 @@
 #ifndef QEMU_MIGRATION_RDMA_H
 #define QEMU_MIGRATION_RDMA_H
 
+#include "exec/cpu-common.h"
+#include "io/channel.h"
+#include "qapi/error.h"
+
 void rdma_start_outgoing_migration(void *opaque, const char *host_port,
                                    Error **errp);
 
 void rdma_start_incoming_migration(const char *host_port, Error **errp);
 
+/*
+ * Multifd channels over RDMA.  The channels carry the multifd packets,
+ * and the pages are written into the destination RAM with
+ * rdma_send_channel_write_pages().
+ */
+#ifdef CONFIG_RDMA
+bool rdma_multifd_outgoing(void);
+bool rdma_multifd_incoming(void);
+QIOChannel *rdma_send_channel_create(Error **errp);
+void rdma_send_channel_destroy(QIOChannel *send);
+int rdma_send_channel_write_pages(QIOChannel *ioc, RAMBlock *rb,
+                                  const struct iovec *iov, unsigned int niov,
+                                  Error **errp);
+#else
+static inline bool rdma_multifd_outgoing(void)
+{
+    return false;
+}
+
+static inline bool rdma_multifd_incoming(void)
+{
+    return false;
+}
+
+static inline QIOChannel *rdma_send_channel_create(Error **errp)
+{
+    error_setg(errp, "RDMA support is disabled");
+    return NULL;
+}
+
+static inline void rdma_send_channel_destroy(QIOChannel *send)
+{
+}
+
+static inline int rdma_send_channel_write_pages(QIOChannel *ioc, RAMBlock *rb,
+                                                const struct iovec *iov,
+                                                unsigned int niov,
+                                                Error **errp)
+{
+    error_setg(errp, "RDMA support is disabled");
+    return -1;
+}
+#endif
+
 #endif
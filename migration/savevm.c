@@ -58,6 +58,7 @@
 #include "qjson.h"
 #include "migration/colo.h"
 #include "qemu/bitmap.h"
+#include "qemu/rcu.h"
 #include "net/announce.h"
 
 const unsigned int postcopy_ram_discard_version = 0;
@@ -242,6 +243,10 @@ typedef struct SaveStateEntry {
     void *opaque;
     CompatEntry *compat;
     int is_ram;
+    /* the state can be saved and loaded by a vmstate thread */
+    bool parallel;
+    /* ns spent saving the state at the last completion, -1 if not saved */
+    int64_t save_time;
 } SaveStateEntry;
 
 typedef struct SaveState {
@@ -695,6 +700,7 @@ int register_savevm_live(DeviceState *dev,
     se->ops = ops;
     se->opaque = opaque;
     se->vmsd = NULL;
+    se->save_time = -1;
     /* if this is a live_savem then set is_ram */
     if (ops->save_setup != NULL) {
         se->is_ram = 1;
@@ -773,6 +779,8 @@ int vmstate_register_with_alias_id(DeviceState *dev, int instance_id,
     se->opaque = opaque;
     se->vmsd = vmsd;
     se->alias_id = alias_id;
+    se->parallel = vmstate_is_parallel(vmsd);
+    se->save_time = -1;
 
     if (dev) {
         char *id = qdev_get_dev_path(dev);
@@ -851,12 +859,234 @@ static void vmstate_save_old_style(QEMUFile *f, SaveStateEntry *se, QJSON *vmdes
 
 static int vmstate_save(QEMUFile *f, SaveStateEntry *se, QJSON *vmdesc)
 {
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int ret = 0;
+
     trace_vmstate_save(se->idstr, se->vmsd ? se->vmsd->name : "(old)");
     if (!se->vmsd) {
         vmstate_save_old_style(f, se, vmdesc);
-        return 0;
+    } else {
+        ret = vmstate_save_state(f, se->vmsd, se->opaque, vmdesc);
     }
-    return vmstate_save_state(f, se->vmsd, se->opaque, vmdesc);
+    se->save_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+    return ret;
+}
+
+/*
+ * vmstate threads save and load the state of the devices that support
+ * it (see vmstate_is_parallel()) at the end of the migration, each one
+ * in its own buffer.  The buffers go through the stream in the order of
+ * the devices, as QEMU_VM_SECTION_BUFFERED sections.
+ *
+ * Only consecutive parallel devices are handled concurrently: the other
+ * devices, and anything else in the stream, wait until the pending jobs
+ * are done.  The migration thread counts as one of the threads, as it
+ * runs the queued jobs while it waits.
+ */
+typedef struct VMStateJob {
+    SaveStateEntry *se;
+    /* the state of the device */
+    QIOChannelBuffer *bioc;
+    /* save: the file writing to @bioc and the fields description */
+    QEMUFile *f;
+    QJSON *vmdesc;
+    int ret;
+    bool done;
+    QSIMPLEQ_ENTRY(VMStateJob) next;
+    QSIMPLEQ_ENTRY(VMStateJob) pending_next;
+} VMStateJob;
+
+typedef struct VMStateThreads {
+    bool save;
+    int nr_threads;
+    QemuThread *threads;
+    /* jobs queued by the migration thread, in order, and not waited yet */
+    QSIMPLEQ_HEAD(, VMStateJob) pending;
+    /* this mutex protects the following parameters */
+    QemuMutex mutex;
+    /* signalled when a job is queued or done, or the threads must quit */
+    QemuCond cond;
+    /* jobs that no thread picked yet */
+    QSIMPLEQ_HEAD(, VMStateJob) queue;
+    bool quit;
+} VMStateThreads;
+
+static void vmstate_job_run(VMStateJob *job, bool save)
+{
+    QEMUFile *f;
+
+    if (save) {
+        job->ret = vmstate_save(job->f, job->se, job->vmdesc);
+        qemu_fflush(job->f);
+        if (!job->ret) {
+            job->ret = qemu_file_get_error(job->f);
+        }
+        return;
+    }
+
+    f = qemu_fopen_channel_input(QIO_CHANNEL(job->bioc));
+    job->ret = vmstate_load(f, job->se);
+    qemu_fclose(f);
+}
+
+static VMStateJob *vmstate_job_new(SaveStateEntry *se, QIOChannelBuffer *bioc)
+{
+    VMStateJob *job = g_new0(VMStateJob, 1);
+
+    job->se = se;
+    if (bioc) {
+        job->bioc = bioc;
+    } else {
+        job->bioc = qio_channel_buffer_new(4096);
+        qio_channel_set_name(QIO_CHANNEL(job->bioc), "migration-vmstate");
+        job->f = qemu_fopen_channel_output(QIO_CHANNEL(job->bioc));
+        job->vmdesc = qjson_new();
+    }
+    return job;
+}
+
+static void vmstate_job_free(VMStateJob *job)
+{
+    if (job->f) {
+        qemu_fclose(job->f);
+    }
+    if (job->vmdesc) {
+        qjson_destroy(job->vmdesc);
+    }
+    object_unref(OBJECT(job->bioc));
+    g_free(job);
+}
+
+static void *vmstate_thread(void *opaque)
+{
+    VMStateThreads *t = opaque;
+    VMStateJob *job;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock(&t->mutex);
+    while (true) {
+        job = QSIMPLEQ_FIRST(&t->queue);
+        if (!job) {
+            if (t->quit) {
+                break;
+            }
+            qemu_cond_wait(&t->cond, &t->mutex);
+            continue;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&t->queue, next);
+        qemu_mutex_unlock(&t->mutex);
+
+        vmstate_job_run(job, t->save);
+
+        qemu_mutex_lock(&t->mutex);
+        job->done = true;
+        qemu_cond_broadcast(&t->cond);
+    }
+    qemu_mutex_unlock(&t->mutex);
+
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+/*
+ * Returns the vmstate threads, or NULL if the migration thread handles
+ * the devices itself
+ */
+static VMStateThreads *vmstate_threads_new(bool save)
+{
+    VMStateThreads *t;
+    int i;
+
+    if (migrate_vmstate_threads() <= 1) {
+        return NULL;
+    }
+
+    t = g_new0(VMStateThreads, 1);
+    t->save = save;
+    t->nr_threads = migrate_vmstate_threads() - 1;
+    t->threads = g_new0(QemuThread, t->nr_threads);
+    QSIMPLEQ_INIT(&t->pending);
+    QSIMPLEQ_INIT(&t->queue);
+    qemu_mutex_init(&t->mutex);
+    qemu_cond_init(&t->cond);
+    for (i = 0; i < t->nr_threads; i++) {
+        qemu_thread_create(&t->threads[i], save ? "vmstate-save" :
+                           "vmstate-load", vmstate_thread, t,
+                           QEMU_THREAD_JOINABLE);
+    }
+    trace_vmstate_threads_new(save, t->nr_threads);
+    return t;
+}
+
+/* All the jobs must have been waited for */
+static void vmstate_threads_destroy(VMStateThreads *t)
+{
+    int i;
+
+    if (!t) {
+        return;
+    }
+
+    assert(QSIMPLEQ_EMPTY(&t->pending));
+    qemu_mutex_lock(&t->mutex);
+    t->quit = true;
+    qemu_cond_broadcast(&t->cond);
+    qemu_mutex_unlock(&t->mutex);
+    for (i = 0; i < t->nr_threads; i++) {
+        qemu_thread_join(&t->threads[i]);
+    }
+    qemu_cond_destroy(&t->cond);
+    qemu_mutex_destroy(&t->mutex);
+    g_free(t->threads);
+    g_free(t);
+}
+
+static void vmstate_threads_queue(VMStateThreads *t, VMStateJob *job)
+{
+    QSIMPLEQ_INSERT_TAIL(&t->pending, job, pending_next);
+
+    qemu_mutex_lock(&t->mutex);
+    QSIMPLEQ_INSERT_TAIL(&t->queue, job, next);
+    qemu_cond_broadcast(&t->cond);
+    qemu_mutex_unlock(&t->mutex);
+}
+
+/*
+ * Returns the next pending job once it is done, NULL if there are no
+ * pending jobs.  The caller frees the job.
+ */
+static VMStateJob *vmstate_threads_next(VMStateThreads *t)
+{
+    VMStateJob *job, *other;
+
+    if (!t || QSIMPLEQ_EMPTY(&t->pending)) {
+        return NULL;
+    }
+    job = QSIMPLEQ_FIRST(&t->pending);
+    QSIMPLEQ_REMOVE_HEAD(&t->pending, pending_next);
+
+    qemu_mutex_lock(&t->mutex);
+    while (!job->done) {
+        other = QSIMPLEQ_FIRST(&t->queue);
+        if (!other) {
+            qemu_cond_wait(&t->cond, &t->mutex);
+            continue;
+        }
+        /* Help instead of waiting */
+        QSIMPLEQ_REMOVE_HEAD(&t->queue, next);
+        qemu_mutex_unlock(&t->mutex);
+
+        vmstate_job_run(other, t->save);
+
+        qemu_mutex_lock(&t->mutex);
+        other->done = true;
+        qemu_cond_broadcast(&t->cond);
+    }
+    qemu_mutex_unlock(&t->mutex);
+
+    return job;
 }
 
 /*
@@ -869,6 +1099,7 @@ static void save_section_header(QEMUFile *f, SaveStateEntry *se,
     qemu_put_be32(f, se->section_id);
 
     if (section_type == QEMU_VM_SECTION_FULL ||
+        section_type == QEMU_VM_SECTION_BUFFERED ||
         section_type == QEMU_VM_SECTION_START) {
         /* ID string */
         size_t len = strlen(se->idstr);
@@ -1246,29 +1477,16 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
     qemu_fflush(f);
 }
 
-int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
-                                       bool inactivate_disks)
+static
+int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
 {
-    QJSON *vmdesc;
-    int vmdesc_len;
     SaveStateEntry *se;
     int ret;
-    bool in_postcopy = migration_in_postcopy();
-    Error *local_err = NULL;
-
-    if (precopy_notify(PRECOPY_NOTIFY_COMPLETE, &local_err)) {
-        error_report_err(local_err);
-    }
-
-    trace_savevm_state_complete_precopy();
-
-    cpu_synchronize_all_states();
 
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
         if (!se->ops ||
             (in_postcopy && se->ops->has_postcopy &&
              se->ops->has_postcopy(se->opaque)) ||
-            (in_postcopy && !iterable_only) ||
             !se->ops->save_live_complete_precopy) {
             continue;
         }
@@ -1291,10 +1509,75 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
         }
     }
 
-    if (iterable_only) {
-        return 0;
+    return 0;
+}
+
+/*
+ * Write the sections of the devices saved by the vmstate threads so far
+ *
+ * Returns 0 on success, negative on error
+ */
+static int qemu_savevm_state_flush_buffered(VMStateThreads *t, QEMUFile *f,
+                                            QJSON *vmdesc)
+{
+    VMStateJob *job;
+    int ret = 0;
+
+    while ((job = vmstate_threads_next(t))) {
+        SaveStateEntry *se = job->se;
+
+        if (!ret) {
+            ret = job->ret;
+        }
+        if (!ret) {
+            trace_savevm_section_start(se->idstr, se->section_id);
+
+            json_start_object(vmdesc, NULL);
+            json_prop_str(vmdesc, "name", se->idstr);
+            json_prop_int(vmdesc, "instance_id", se->instance_id);
+            json_append_members(vmdesc, job->vmdesc);
+
+            save_section_header(f, se, QEMU_VM_SECTION_BUFFERED);
+            qemu_put_be32(f, job->bioc->usage);
+            qemu_put_buffer(f, job->bioc->data, job->bioc->usage);
+            trace_savevm_section_end(se->idstr, se->section_id, 0);
+            save_section_footer(f, se);
+
+            json_end_object(vmdesc);
+        }
+        vmstate_job_free(job);
     }
+    return ret;
+}
 
+/**
+ * qemu_savevm_state_complete_precopy_non_iterable: save the device state
+ *
+ * Saves the state of all the devices without an iterative save handler,
+ * followed by the end of stream marker and the vmstate description.
+ * The CPU state must already be synchronized.
+ *
+ * Returns 0 on success, negative on error
+ *
+ * @f: the stream the state is written to
+ * @in_postcopy: the RAM is still being sent by postcopy
+ * @inactivate_disks: inactivate the block devices before the end marker
+ */
+int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
+                                                    bool in_postcopy,
+                                                    bool inactivate_disks)
+{
+    VMStateThreads *threads;
+    QJSON *vmdesc;
+    int vmdesc_len;
+    SaveStateEntry *se;
+    int ret;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        se->save_time = -1;
+    }
+
+    threads = vmstate_threads_new(true);
     vmdesc = qjson_new();
     json_prop_int(vmdesc, "page_size", qemu_target_page_size());
     json_start_array(vmdesc, "devices");
@@ -1308,6 +1591,15 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
             continue;
         }
 
+        if (threads && se->parallel) {
+            vmstate_threads_queue(threads, vmstate_job_new(se, NULL));
+            continue;
+        }
+        ret = qemu_savevm_state_flush_buffered(threads, f, vmdesc);
+        if (ret) {
+            goto out;
+        }
+
         trace_savevm_section_start(se->idstr, se->section_id);
 
         json_start_object(vmdesc, NULL);
@@ -1317,14 +1609,19 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
         save_section_header(f, se, QEMU_VM_SECTION_FULL);
         ret = vmstate_save(f, se, vmdesc);
         if (ret) {
-            qemu_file_set_error(f, ret);
-            return ret;
+            goto out;
         }
         trace_savevm_section_end(se->idstr, se->section_id, 0);
         save_section_footer(f, se);
 
         json_end_object(vmdesc);
     }
+    ret = qemu_savevm_state_flush_buffered(threads, f, vmdesc);
+    if (ret) {
+        goto out;
+    }
+    vmstate_threads_destroy(threads);
+    threads = NULL;
 
     if (inactivate_disks) {
         /* Inactivate before sending QEMU_VM_EOF so that the
@@ -1333,8 +1630,7 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
         if (ret) {
             error_report("%s: bdrv_inactivate_all() failed (%d)",
                          __func__, ret);
-            qemu_file_set_error(f, ret);
-            return ret;
+            goto out;
         }
     }
     if (!in_postcopy) {
@@ -1351,8 +1647,100 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
         qemu_put_be32(f, vmdesc_len);
         qemu_put_buffer(f, (uint8_t *)qjson_get_str(vmdesc), vmdesc_len);
     }
+    ret = 0;
+
+out:
+    if (ret) {
+        qemu_file_set_error(f, ret);
+        /* Wait for the devices that are still being saved */
+        qemu_savevm_state_flush_buffered(threads, f, vmdesc);
+    }
+    vmstate_threads_destroy(threads);
     qjson_destroy(vmdesc);
 
+    return ret;
+}
+
+/*
+ * Returns the expected time to save the device state in microseconds,
+ * from the last time each device was saved.  The parallel devices are
+ * assumed to spread evenly over the vmstate threads.
+ */
+int64_t qemu_savevm_vmstate_cost(void)
+{
+    int threads = migrate_vmstate_threads();
+    int64_t serial = 0, parallel = 0;
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (se->save_time < 0) {
+            continue;
+        }
+        if (se->parallel && threads > 1) {
+            parallel += se->save_time;
+        } else {
+            serial += se->save_time;
+        }
+    }
+    return (serial + parallel / threads) / SCALE_US;
+}
+
+/*
+ * Returns the time each device took to save its state at the last
+ * completion
+ */
+VMStateTimeList *qemu_savevm_vmstate_times(void)
+{
+    VMStateTimeList *head = NULL, **tail = &head;
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        VMStateTimeList *entry;
+
+        if (se->save_time < 0) {
+            continue;
+        }
+        entry = g_new0(VMStateTimeList, 1);
+        entry->value = g_new0(VMStateTime, 1);
+        entry->value->id = g_strdup(se->idstr);
+        entry->value->instance_id = se->instance_id;
+        entry->value->time = se->save_time / SCALE_US;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
+
+int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
+                                       bool inactivate_disks)
+{
+    int ret;
+    Error *local_err = NULL;
+    bool in_postcopy = migration_in_postcopy();
+
+    if (precopy_notify(PRECOPY_NOTIFY_COMPLETE, &local_err)) {
+        error_report_err(local_err);
+    }
+
+    trace_savevm_state_complete_precopy();
+
+    cpu_synchronize_all_states();
+
+    if (!in_postcopy || iterable_only) {
+        ret = qemu_savevm_state_complete_precopy_iterable(f, in_postcopy);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    if (!iterable_only) {
+        ret = qemu_savevm_state_complete_precopy_non_iterable(f, in_postcopy,
+                                                              inactivate_disks);
+        if (ret) {
+            return ret;
+        }
+    }
+
     qemu_fflush(f);
     return 0;
 }
@@ -1741,6 +2129,10 @@ static void *postcopy_ram_listen_thread(void *opaque)
     if (load_res < 0) {
         error_report("%s: loadvm failed: %d", __func__, load_res);
         qemu_file_set_error(f, load_res);
+        if (mis->postcopy_qemufile_dst) {
+            /* Don't wait for the source to close it in the cleanup */
+            qemu_file_shutdown(mis->postcopy_qemufile_dst);
+        }
         migrate_set_state(&mis->state, MIGRATION_STATUS_POSTCOPY_ACTIVE,
                                        MIGRATION_STATUS_FAILED);
     } else {
@@ -2157,8 +2549,16 @@ static bool check_section_footer(QEMUFile *f, SaveStateEntry *se)
     return true;
 }
 
-static int
-qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
+/*
+ * Read the header of a QEMU_VM_SECTION_START/FULL/BUFFERED section and
+ * look up the device it is for
+ *
+ * Returns 0 on success, negative on error
+ *
+ * @f: the stream
+ * @sep: set to the device
+ */
+static int qemu_loadvm_section_header(QEMUFile *f, SaveStateEntry **sep)
 {
     uint32_t instance_id, version_id, section_id;
     SaveStateEntry *se;
@@ -2209,10 +2609,25 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
         return -EINVAL;
     }
 
+    *sep = se;
+    return 0;
+}
+
+static int
+qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
+{
+    SaveStateEntry *se;
+    int ret;
+
+    ret = qemu_loadvm_section_header(f, &se);
+    if (ret < 0) {
+        return ret;
+    }
+
     ret = vmstate_load(f, se);
     if (ret < 0) {
         error_report("error while loading state for instance 0x%x of"
-                     " device '%s'", instance_id, idstr);
+                     " device '%s'", se->instance_id, se->idstr);
         return ret;
     }
     if (!check_section_footer(f, se)) {
@@ -2222,6 +2637,86 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
     return 0;
 }
 
+/* Returns the first error of the devices loaded by the vmstate threads */
+static int qemu_loadvm_flush_buffered(VMStateThreads *t)
+{
+    VMStateJob *job;
+    int ret = 0;
+
+    while ((job = vmstate_threads_next(t))) {
+        if (job->ret < 0 && !ret) {
+            error_report("error while loading state for instance 0x%x of"
+                         " device '%s'", job->se->instance_id,
+                         job->se->idstr);
+            ret = job->ret;
+        }
+        vmstate_job_free(job);
+    }
+    return ret;
+}
+
+/*
+ * A QEMU_VM_SECTION_BUFFERED section carries the length of the state,
+ * so that a vmstate thread can load it while the stream goes on.
+ *
+ * @threads: the vmstate threads, created on the first section
+ */
+static int
+qemu_loadvm_section_buffered(QEMUFile *f, VMStateThreads **threads)
+{
+    QIOChannelBuffer *bioc;
+    SaveStateEntry *se;
+    VMStateJob *job;
+    uint32_t length;
+    int ret;
+
+    ret = qemu_loadvm_section_header(f, &se);
+    if (ret < 0) {
+        return ret;
+    }
+
+    length = qemu_get_be32(f);
+    trace_qemu_loadvm_state_section_buffered(se->idstr, length);
+    bioc = qio_channel_buffer_new(length);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "migration-vmstate");
+    ret = qemu_get_buffer(f, bioc->data, length);
+    if (ret != length) {
+        object_unref(OBJECT(bioc));
+        error_report("Failed to read the state of device '%s'", se->idstr);
+        ret = qemu_file_get_error(f);
+        return ret ? ret : -EINVAL;
+    }
+    bioc->usage = length;
+    if (!check_section_footer(f, se)) {
+        object_unref(OBJECT(bioc));
+        return -EINVAL;
+    }
+
+    job = vmstate_job_new(se, bioc);
+    if (!*threads) {
+        *threads = vmstate_threads_new(false);
+    }
+    /* Otherwise, load it in order like a QEMU_VM_SECTION_FULL */
+    if (*threads && se->parallel) {
+        vmstate_threads_queue(*threads, job);
+        return 0;
+    }
+
+    ret = qemu_loadvm_flush_buffered(*threads);
+    if (ret < 0) {
+        vmstate_job_free(job);
+        return ret;
+    }
+    vmstate_job_run(job, false);
+    ret = job->ret;
+    if (ret < 0) {
+        error_report("error while loading state for instance 0x%x of"
+                     " device '%s'", se->instance_id, se->idstr);
+    }
+    vmstate_job_free(job);
+    return ret;
+}
+
 static int
 qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis)
 {
@@ -2377,6 +2872,7 @@ static bool postcopy_pause_incoming(MigrationIncomingState *mis)
 
 int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis)
 {
+    VMStateThreads *threads = NULL;
     uint8_t section_type;
     int ret = 0;
 
@@ -2390,7 +2886,20 @@ retry:
         }
 
         trace_qemu_loadvm_state_section(section_type);
+        if (section_type != QEMU_VM_SECTION_BUFFERED) {
+            /* Everything else sees the devices loaded so far */
+            ret = qemu_loadvm_flush_buffered(threads);
+            if (ret < 0) {
+                goto out;
+            }
+        }
         switch (section_type) {
+        case QEMU_VM_SECTION_BUFFERED:
+            ret = qemu_loadvm_section_buffered(f, &threads);
+            if (ret < 0) {
+                goto out;
+            }
+            break;
         case QEMU_VM_SECTION_START:
         case QEMU_VM_SECTION_FULL:
             ret = qemu_loadvm_section_start_full(f, mis);
@@ -2423,6 +2932,14 @@ retry:
     }
 
 out:
+    if (!ret) {
+        ret = qemu_loadvm_flush_buffered(threads);
+    } else {
+        qemu_loadvm_flush_buffered(threads);
+    }
+    vmstate_threads_destroy(threads);
+    threads = NULL;
+
     if (ret < 0) {
         qemu_file_set_error(f, ret);
 
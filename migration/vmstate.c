@@ -314,6 +314,87 @@ bool vmstate_save_needed(const VMStateDescription *vmsd, void *opaque)
     return true;
 }
 
+/* Types that only copy between the stream and the field */
+static const VMStateInfo *const vmstate_plain_info[] = {
+    &vmstate_info_bool,
+    &vmstate_info_int8,
+    &vmstate_info_int16,
+    &vmstate_info_int32,
+    &vmstate_info_int64,
+    &vmstate_info_uint8_equal,
+    &vmstate_info_uint16_equal,
+    &vmstate_info_int32_equal,
+    &vmstate_info_uint32_equal,
+    &vmstate_info_uint64_equal,
+    &vmstate_info_int32_le,
+    &vmstate_info_uint8,
+    &vmstate_info_uint16,
+    &vmstate_info_uint32,
+    &vmstate_info_uint64,
+    &vmstate_info_nullptr,
+    &vmstate_info_float64,
+    &vmstate_info_cpudouble,
+    &vmstate_info_buffer,
+    &vmstate_info_unused_buffer,
+    &vmstate_info_bitmap,
+};
+
+static bool vmstate_info_is_plain(const VMStateInfo *info)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(vmstate_plain_info); i++) {
+        if (info == vmstate_plain_info[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * vmstate_is_parallel: whether a vmstate thread can save and load @vmsd
+ *
+ * That is the case when the description is marked as parallel, or
+ * when neither it nor its fields and subsections have hooks or types
+ * with side effects, so that loading only writes to the device.
+ * The needed and field_exists callbacks count as hooks: they are
+ * free to look at anything, not just the device.
+ *
+ * @vmsd: the description of the device
+ */
+bool vmstate_is_parallel(const VMStateDescription *vmsd)
+{
+    const VMStateField *field;
+    const VMStateDescription **sub;
+
+    if (vmsd->parallel) {
+        return true;
+    }
+    if (vmsd->unmigratable || vmsd->load_state_old ||
+        vmsd->pre_load || vmsd->post_load ||
+        vmsd->pre_save || vmsd->post_save || vmsd->needed) {
+        return false;
+    }
+
+    for (field = vmsd->fields; field && field->name; field++) {
+        if (field->field_exists) {
+            return false;
+        }
+        if (field->flags & (VMS_STRUCT | VMS_VSTRUCT)) {
+            if (!vmstate_is_parallel(field->vmsd)) {
+                return false;
+            }
+        } else if (!vmstate_info_is_plain(field->info)) {
+            return false;
+        }
+    }
+    for (sub = vmsd->subsections; sub && *sub; sub++) {
+        if (!vmstate_is_parallel(*sub)) {
+            return false;
+        }
+    }
+    return true;
+}
 
 int vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, QJSON *vmdesc_id)
@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "xbzrle.h"
 
 /*
@@ -24,8 +25,8 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
+                                    int slen, uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
@@ -126,6 +127,328 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512BW_OPT) || \
+    (defined(__aarch64__) && !defined(HOST_WORDS_BIGENDIAN))
+#define XBZRLE_ACCEL
+
+/*
+ * The accelerated encoders first build a bitmap with one bit per byte,
+ * set where the old and new page are equal, and then walk the runs of
+ * set and clear bits.  The vector code only has to fill the bitmap; the
+ * run walking and the output format are shared with every ISA.
+ */
+
+/* Bytes covered by one bitmap, runs carry over from one block to the next */
+#define XBZRLE_BLOCK_SIZE 4096
+
+/*
+ * Fill @map for the first @len bytes of @old_buf and @new_buf.  @len is
+ * a multiple of 64, bit N of map[i] stands for byte i * 64 + N.
+ */
+typedef void XBZRLECompareFunc(const uint8_t *old_buf, const uint8_t *new_buf,
+                               int len, uint64_t *map);
+
+/*
+ * As in util/bufferiszero.c the regions are ordered by increasing ISA.
+ * There is no SSE2 variant, the scalar encoder is as fast on hosts
+ * without AVX2.
+ */
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static void xbzrle_compare_avx2(const uint8_t *old_buf,
+                                const uint8_t *new_buf,
+                                int len, uint64_t *map)
+{
+    int i;
+
+    for (i = 0; i < len; i += 64) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(old_buf + i + 32));
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)(new_buf + i + 32));
+        uint32_t lo = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a0, b0));
+        uint32_t hi = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a1, b1));
+
+        *map++ = ((uint64_t)hi << 32) | lo;
+    }
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#ifdef CONFIG_AVX512BW_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512bw")
+#include <immintrin.h>
+
+static void xbzrle_compare_avx512bw(const uint8_t *old_buf,
+                                    const uint8_t *new_buf,
+                                    int len, uint64_t *map)
+{
+    int i;
+
+    for (i = 0; i < len; i += 64) {
+        __m512i a = _mm512_loadu_si512(old_buf + i);
+        __m512i b = _mm512_loadu_si512(new_buf + i);
+
+        *map++ = _mm512_cmpeq_epi8_mask(a, b);
+    }
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512BW_OPT */
+
+#ifdef __aarch64__
+#include <arm_neon.h>
+
+static void xbzrle_compare_neon(const uint8_t *old_buf,
+                                const uint8_t *new_buf,
+                                int len, uint64_t *map)
+{
+    static const uint8_t weights[16] = {
+        1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+    };
+    uint8x16_t w = vld1q_u8(weights);
+    int i;
+
+    for (i = 0; i < len; i += 64) {
+        uint8x16_t t0, t1, t2, t3;
+
+        t0 = vandq_u8(vceqq_u8(vld1q_u8(old_buf + i),
+                               vld1q_u8(new_buf + i)), w);
+        t1 = vandq_u8(vceqq_u8(vld1q_u8(old_buf + i + 16),
+                               vld1q_u8(new_buf + i + 16)), w);
+        t2 = vandq_u8(vceqq_u8(vld1q_u8(old_buf + i + 32),
+                               vld1q_u8(new_buf + i + 32)), w);
+        t3 = vandq_u8(vceqq_u8(vld1q_u8(old_buf + i + 48),
+                               vld1q_u8(new_buf + i + 48)), w);
+
+        /* Three rounds of pairwise adds fold every 8 bytes into one.  */
+        t0 = vpaddq_u8(t0, t1);
+        t2 = vpaddq_u8(t2, t3);
+        t0 = vpaddq_u8(t0, t2);
+        t0 = vpaddq_u8(t0, t0);
+
+        *map++ = vgetq_lane_u64(vreinterpretq_u64_u8(t0), 0);
+    }
+}
+#endif /* __aarch64__ */
+
+/*
+ * Note that for xbzrle_test_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#ifdef __aarch64__
+#define CACHE_NEON       1
+#define INIT_CACHE       CACHE_NEON
+#define INIT_COMPARE     xbzrle_compare_neon
+#define INIT_ENCODE      xbzrle_encode_buffer_bitmap
+#else
+#define CACHE_AVX512BW   1
+#define CACHE_AVX2       2
+#define XBZRLE_CPUID
+#define INIT_CACHE       0
+#define INIT_COMPARE     NULL
+#define INIT_ENCODE      xbzrle_encode_buffer_int
+#endif
+
+static int xbzrle_encode_buffer_bitmap(uint8_t *old_buf, uint8_t *new_buf,
+                                       int slen, uint8_t *dst, int dlen);
+
+static unsigned cpuid_cache = INIT_CACHE;
+static XBZRLECompareFunc *xbzrle_compare_accel = INIT_COMPARE;
+static int (*xbzrle_encode_accel)(uint8_t *, uint8_t *, int,
+                                  uint8_t *, int) = INIT_ENCODE;
+
+/*
+ * Return the index of the first byte at or after @pos and before @end
+ * whose bit in @map is @set, or @end if there is none.
+ */
+static inline int xbzrle_find_bit(const uint64_t *map, int pos, int end,
+                                  bool set)
+{
+    while (pos < end) {
+        uint64_t word = set ? map[pos / 64] : ~map[pos / 64];
+
+        word &= ~0ULL << (pos % 64);
+        if (word) {
+            return MIN(QEMU_ALIGN_DOWN(pos, 64) + ctz64(word), end);
+        }
+        pos = QEMU_ALIGN_DOWN(pos, 64) + 64;
+    }
+    return end;
+}
+
+static void xbzrle_compare(const uint8_t *old_buf, const uint8_t *new_buf,
+                           int len, uint64_t *map)
+{
+    int i = QEMU_ALIGN_DOWN(len, 64);
+
+    xbzrle_compare_accel(old_buf, new_buf, i, map);
+    if (i < len) {
+        uint64_t bits = 0;
+        int j;
+
+        for (j = i; j < len; j++) {
+            bits |= (uint64_t)(old_buf[j] == new_buf[j]) << (j - i);
+        }
+        map[i / 64] = bits;
+    }
+}
+
+/*
+ * Produces the same output, and fails in the same cases, as
+ * xbzrle_encode_buffer_int().  The overflow checks that the scalar code
+ * does when a run starts are done when it ends, which is equivalent as
+ * @d does not move in between.
+ */
+static int xbzrle_encode_buffer_bitmap(uint8_t *old_buf, uint8_t *new_buf,
+                                       int slen, uint8_t *dst, int dlen)
+{
+    uint64_t map[XBZRLE_BLOCK_SIZE / 64];
+    bool zrun = true;
+    int run_start = 0, run_len;
+    int d = 0, base, len, i;
+
+    for (base = 0; base < slen; base += XBZRLE_BLOCK_SIZE) {
+        len = MIN(slen - base, XBZRLE_BLOCK_SIZE);
+        xbzrle_compare(old_buf + base, new_buf + base, len, map);
+
+        /* zruns end at the first clear bit, nzruns at the first set one */
+        for (i = xbzrle_find_bit(map, 0, len, !zrun); i < len;
+             i = xbzrle_find_bit(map, i, len, !zrun)) {
+            run_len = base + i - run_start;
+
+            /* overflow */
+            if (d + 2 > dlen) {
+                return -1;
+            }
+            d += uleb128_encode_small(dst + d, run_len);
+            if (!zrun) {
+                /* overflow */
+                if (d + run_len > dlen) {
+                    return -1;
+                }
+                memcpy(dst + d, new_buf + run_start, run_len);
+                d += run_len;
+            }
+            run_start = base + i;
+            zrun = !zrun;
+        }
+    }
+
+    /* overflow */
+    if (d + 2 > dlen) {
+        return -1;
+    }
+
+    if (zrun) {
+        /* buffer unchanged, otherwise skip last zero run */
+        return run_start ? d : 0;
+    }
+
+    run_len = slen - run_start;
+    d += uleb128_encode_small(dst + d, run_len);
+    /* overflow */
+    if (d + run_len > dlen) {
+        return -1;
+    }
+    memcpy(dst + d, new_buf + run_start, run_len);
+    d += run_len;
+
+    return d;
+}
+
+static void init_accel(unsigned cache)
+{
+    XBZRLECompareFunc *fn = NULL;
+
+#ifdef __aarch64__
+    if (cache & CACHE_NEON) {
+        fn = xbzrle_compare_neon;
+    }
+#else
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        fn = xbzrle_compare_avx2;
+    }
+#endif
+#ifdef CONFIG_AVX512BW_OPT
+    if (cache & CACHE_AVX512BW) {
+        fn = xbzrle_compare_avx512bw;
+    }
+#endif
+#endif
+    xbzrle_compare_accel = fn;
+    xbzrle_encode_accel = fn ? xbzrle_encode_buffer_bitmap
+                             : xbzrle_encode_buffer_int;
+}
+
+#ifdef XBZRLE_CPUID
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+#ifdef CONFIG_AVX2_OPT
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+#endif
+#ifdef CONFIG_AVX512BW_OPT
+            /* ... and that the OS saves the opmask and upper ZMM state.  */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512BW)) {
+                cache |= CACHE_AVX512BW;
+            }
+#endif
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* XBZRLE_CPUID */
+
+bool xbzrle_test_next_accel(void)
+{
+    /*
+     * If no bits set, we just tested xbzrle_encode_buffer_int, and there
+     * are no more acceleration options to test.
+     */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+#else
+#define xbzrle_encode_accel xbzrle_encode_buffer_int
+bool xbzrle_test_next_accel(void)
+{
+    return false;
+}
+#endif /* XBZRLE_ACCEL */
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_accel(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
@@ -488,6 +488,7 @@ class MigrationDump(object):
     QEMU_VM_SUBSECTION    = 0x05
     QEMU_VM_VMDESCRIPTION = 0x06
     QEMU_VM_CONFIGURATION = 0x07
+    QEMU_VM_SECTION_BUFFERED = 0x09
     QEMU_VM_SECTION_FOOTER= 0x7e
 
     def __init__(self, filename):
@@ -531,11 +532,16 @@ class MigrationDump(object):
             elif section_type == self.QEMU_VM_CONFIGURATION:
                 section = ConfigurationSection(file)
                 section.read()
-            elif section_type == self.QEMU_VM_SECTION_START or section_type == self.QEMU_VM_SECTION_FULL:
+            elif section_type in (self.QEMU_VM_SECTION_START,
+                                  self.QEMU_VM_SECTION_FULL,
+                                  self.QEMU_VM_SECTION_BUFFERED):
                 section_id = file.read32()
                 name = file.readstr()
                 instance_id = file.read32()
                 version_id = file.read32()
+                if section_type == self.QEMU_VM_SECTION_BUFFERED:
+                    # Length of the state, which follows as usual
+                    file.read32()
                 section_key = (name, instance_id)
                 classdesc = self.section_classes[section_key]
                 section = classdesc[0](file, version_id, classdesc[1], section_key)
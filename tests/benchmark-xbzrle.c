@@ -0,0 +1,95 @@
+/*
+ * XBZRLE encoder speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "../migration/xbzrle.h"
+
+#define PAGE_SIZE 4096
+/* Small enough to stay in the cache, so that the encoder is measured */
+#define NR_PAGES 16
+
+typedef struct {
+    const char *name;
+    /* one changed byte every @stride bytes, 0 for unchanged pages */
+    int stride;
+    /* length of each changed run */
+    int run;
+} XBZRLEPattern;
+
+static const XBZRLEPattern patterns[] = {
+    { "unchanged", 0, 0 },
+    { "sparse", 512, 1 },
+    { "sparse-runs", 512, 16 },
+    { "medium", 64, 1 },
+    { "dense", 8, 1 },
+    { "dense-runs", 32, 16 },
+};
+
+static double xbzrle_encode_speed(const XBZRLEPattern *pat)
+{
+    uint8_t *old_buf = g_malloc(PAGE_SIZE * NR_PAGES);
+    uint8_t *new_buf = g_malloc(PAGE_SIZE * NR_PAGES);
+    uint8_t *dst = g_malloc(PAGE_SIZE);
+    double total = 0.0;
+    int i, j;
+
+    for (i = 0; i < PAGE_SIZE * NR_PAGES; i++) {
+        old_buf[i] = g_test_rand_int();
+    }
+    memcpy(new_buf, old_buf, PAGE_SIZE * NR_PAGES);
+    for (i = 0; pat->stride && i < PAGE_SIZE * NR_PAGES; i += pat->stride) {
+        for (j = 0; j < pat->run; j++) {
+            new_buf[i + j] ^= 0x5a;
+        }
+    }
+
+    g_test_timer_start();
+    do {
+        for (i = 0; i < NR_PAGES; i++) {
+            g_assert(xbzrle_encode_buffer(old_buf + i * PAGE_SIZE,
+                                          new_buf + i * PAGE_SIZE,
+                                          PAGE_SIZE, dst, PAGE_SIZE) >= 0);
+        }
+        total += PAGE_SIZE * NR_PAGES;
+    } while (g_test_timer_elapsed() < 1.0);
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(dst);
+
+    return total / MiB;
+}
+
+static void test_xbzrle_encode_speed(void)
+{
+    int level = 0;
+    double total;
+    size_t i;
+
+    /*
+     * Selecting the next encoder cannot be undone, so each level runs
+     * all the patterns.  The last level is the generic C encoder.
+     */
+    do {
+        for (i = 0; i < ARRAY_SIZE(patterns); i++) {
+            total = xbzrle_encode_speed(&patterns[i]);
+            g_print("xbzrle encode %s, accel level %d: ",
+                    patterns[i].name, level);
+            g_print("%.2f MB in %.2f secs: ", total, g_test_timer_last());
+            g_print("%.2f MB/sec\n", total / g_test_timer_last());
+        }
+        level++;
+    } while (xbzrle_test_next_accel());
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/xbzrle/encode-speed", test_xbzrle_encode_speed);
+
+    return g_test_run();
+}
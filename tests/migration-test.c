@@ -442,6 +442,25 @@ static void migrate_set_parameter(QTestState *who, const char *parameter,
     migrate_check_parameter(who, parameter, value);
 }
 
+static void migrate_set_parameter_str(QTestState *who, const char *parameter,
+                                      const char *value)
+{
+    QDict *rsp;
+    const char *result;
+
+    rsp = qtest_qmp(who,
+                    "{ 'execute': 'migrate-set-parameters',"
+                    "'arguments': { %s: %s } }",
+                    parameter, value);
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+
+    rsp = wait_command(who, "{ 'execute': 'query-migrate-parameters' }");
+    result = qdict_get_str(rsp, parameter);
+    g_assert_cmpstr(result, ==, value);
+    qobject_unref(rsp);
+}
+
 static void migrate_pause(QTestState *who)
 {
     QDict *rsp;
@@ -676,6 +695,7 @@ static void test_migrate_end(QTestState *from, QTestState *to, bool test_dest)
 
     cleanup("bootsect");
     cleanup("migsocket");
+    cleanup("migfile");
     cleanup("src_serial");
     cleanup("dest_serial");
 }
@@ -729,12 +749,15 @@ static void test_deprecated(void)
 
 static int migrate_postcopy_prepare(QTestState **from_ptr,
                                      QTestState **to_ptr,
-                                     bool hide_error)
+                                     bool hide_error, bool multifd,
+                                     bool preempt)
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
     QTestState *from, *to;
 
-    if (test_migrate_start(&from, &to, uri, hide_error, false)) {
+    /* The multifd capability must be set before listening */
+    if (test_migrate_start(&from, &to, multifd ? "defer" : uri,
+                           hide_error, false)) {
         return -1;
     }
 
@@ -742,6 +765,24 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
     migrate_set_capability(to, "postcopy-ram", true);
     migrate_set_capability(to, "postcopy-blocktime", true);
 
+    if (preempt) {
+        migrate_set_capability(from, "postcopy-preempt", true);
+        migrate_set_capability(to, "postcopy-preempt", true);
+    }
+
+    if (multifd) {
+        QDict *rsp;
+
+        migrate_set_parameter(from, "multifd-channels", 4);
+        migrate_set_parameter(to, "multifd-channels", 4);
+        migrate_set_capability(from, "multifd", true);
+        migrate_set_capability(to, "multifd", true);
+
+        rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                               "  'arguments': { 'uri': %s }}", uri);
+        qobject_unref(rsp);
+    }
+
     /* We want to pick a speed slow enough that the test completes
      * quickly, but that it doesn't complete precopy even on a slow
      * machine, so also set the downtime.
@@ -781,19 +822,56 @@ static void test_postcopy(void)
 {
     QTestState *from, *to;
 
-    if (migrate_postcopy_prepare(&from, &to, false)) {
+    if (migrate_postcopy_prepare(&from, &to, false, false, false)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
+/* The multifd channels keep sending the background pages in postcopy */
+static void test_postcopy_multifd(void)
+{
+    QTestState *from, *to;
+
+    if (migrate_postcopy_prepare(&from, &to, false, true, false)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
+/* Faulted pages go through the preempt channel */
+static void test_postcopy_preempt(void)
+{
+    QTestState *from, *to;
+
+    if (migrate_postcopy_prepare(&from, &to, false, false, true)) {
         return;
     }
     migrate_postcopy_start(from, to);
     migrate_postcopy_complete(from, to);
 }
 
+/* Each page request also pulls in the following 64K on the main channel */
+static void test_postcopy_preempt_prefetch(void)
+{
+    QTestState *from, *to;
+
+    if (migrate_postcopy_prepare(&from, &to, false, false, true)) {
+        return;
+    }
+    migrate_set_parameter(to, "postcopy-prefetch-size", 65536);
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
 static void test_postcopy_recovery(void)
 {
     QTestState *from, *to;
     char *uri;
 
-    if (migrate_postcopy_prepare(&from, &to, true)) {
+    if (migrate_postcopy_prepare(&from, &to, true, false, false)) {
         return;
     }
 
@@ -912,6 +990,72 @@ static void test_precopy_unix(void)
     g_free(uri);
 }
 
+/*
+ * Save and load the devices with vmstate threads.  On x86 the devices
+ * without hooks (port92, acpi_build...) go as buffered sections between
+ * the others, whose state must still land in order.
+ */
+static void test_precopy_vmstate_threads(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    const char *arch = qtest_get_arch();
+    bool x86 = g_str_equal(arch, "i386") || g_str_equal(arch, "x86_64");
+    uint8_t port92 = 0;
+    QTestState *from, *to;
+    int i;
+
+    if (test_migrate_start(&from, &to, uri, false, false)) {
+        return;
+    }
+
+    migrate_set_parameter(from, "vmstate-threads", 4);
+    migrate_set_parameter(to, "vmstate-threads", 4);
+
+    /* 1 ms should make it not converge*/
+    migrate_set_parameter(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter(from, "max-bandwidth", 1000000000);
+
+    if (x86) {
+        /* The CMOS NVRAM belongs to the RTC, which has hooks */
+        for (i = 0; i < 8; i++) {
+            qtest_outb(from, 0x70, 0x38 + i);
+            qtest_outb(from, 0x71, 0xa0 + i);
+        }
+        port92 = qtest_inb(from, 0x92);
+    }
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    /* 300 ms should converge */
+    migrate_set_parameter(from, "downtime-limit", 300);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    if (x86) {
+        for (i = 0; i < 8; i++) {
+            qtest_outb(to, 0x70, 0x38 + i);
+            g_assert_cmphex(qtest_inb(to, 0x71), ==, 0xa0 + i);
+        }
+        g_assert_cmphex(qtest_inb(to, 0x92), ==, port92);
+    }
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
 #if 0
 /* Currently upset on aarch64 TCG */
 static void test_ignore_shared(void)
@@ -950,6 +1094,39 @@ static void test_ignore_shared(void)
 }
 #endif
 
+static void test_local_ram(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    QTestState *from, *to;
+
+    if (test_migrate_start(&from, &to, uri, false, true)) {
+        return;
+    }
+
+    migrate_set_capability(from, "local-ram", true);
+    migrate_set_capability(to, "local-ram", true);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate(from, uri, "{}");
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    /* The guest RAM was passed, not copied */
+    g_assert_cmpint(read_ram_property_int(from, "transferred"), <, 1024 * 1024);
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
 static void test_xbzrle(const char *uri)
 {
     QTestState *from, *to;
@@ -1044,6 +1221,226 @@ static void test_precopy_tcp(void)
     g_free(uri);
 }
 
+static void test_multifd_tcp(const char *method, const char *zero_page)
+{
+    char *uri;
+    int64_t duplicate;
+    QDict *rsp;
+    QTestState *from, *to;
+
+    if (test_migrate_start(&from, &to, "defer", false, false)) {
+        return;
+    }
+
+    /*
+     * We want to pick a speed slow enough that the test completes
+     * quickly, but that it doesn't complete precopy even on a slow
+     * machine, so also set the downtime.
+     */
+    /* 1 ms should make it not converge*/
+    migrate_set_parameter(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter(from, "max-bandwidth", 1000000000);
+
+    migrate_set_parameter(from, "multifd-channels", 16);
+    migrate_set_parameter(to, "multifd-channels", 16);
+
+    migrate_set_parameter_str(from, "multifd-compression", method);
+    migrate_set_parameter_str(to, "multifd-compression", method);
+
+    migrate_set_parameter_str(from, "zero-page-detection", zero_page);
+
+    migrate_set_capability(from, "multifd", true);
+    migrate_set_capability(to, "multifd", true);
+
+    /* Start incoming migration from the 1st socket */
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': 'tcp:127.0.0.1:0' }}");
+    qobject_unref(rsp);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    uri = migrate_get_socket_address(to, "socket-address");
+
+    migrate(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    /* 300ms it should converge */
+    migrate_set_parameter(from, "downtime-limit", 300);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    /*
+     * The memory above the area the guest writes to is never touched.
+     * The pages the guest wrapped back to zero go as zero pages too,
+     * check_guests_ram() catches them if they are not cleared.
+     */
+    duplicate = read_ram_property_int(from, "duplicate");
+    if (g_str_equal(zero_page, "none")) {
+        g_assert_cmpint(duplicate, ==, 0);
+    } else {
+        g_assert_cmpint(duplicate, >, 0);
+    }
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
+static void test_multifd_tcp_none(void)
+{
+    test_multifd_tcp("none", "multifd");
+}
+
+static void test_multifd_tcp_zlib(void)
+{
+    test_multifd_tcp("zlib", "multifd");
+}
+
+#ifdef CONFIG_ZSTD
+static void test_multifd_tcp_zstd(void)
+{
+    test_multifd_tcp("zstd", "multifd");
+}
+#endif
+
+static void test_multifd_tcp_zero_page_legacy(void)
+{
+    test_multifd_tcp("none", "legacy");
+}
+
+static void test_multifd_tcp_no_zero_page(void)
+{
+    test_multifd_tcp("none", "none");
+}
+
+static void test_mapped_ram_file(bool multifd)
+{
+    char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+    QDict *rsp;
+    QTestState *from, *to;
+
+    if (test_migrate_start(&from, &to, "defer", false, false)) {
+        return;
+    }
+
+    /* 1GB/s */
+    migrate_set_parameter(from, "max-bandwidth", 1000000000);
+
+    if (multifd) {
+        migrate_set_parameter(from, "multifd-channels", 4);
+        migrate_set_parameter(to, "multifd-channels", 4);
+        migrate_set_capability(from, "multifd", true);
+        migrate_set_capability(to, "multifd", true);
+    }
+    migrate_set_capability(from, "mapped-ram", true);
+    migrate_set_capability(to, "mapped-ram", true);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    /* The whole file is written before the destination reads it */
+    migrate(from, uri, "{}");
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    wait_for_migration_complete(from);
+
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s }}", uri);
+    qobject_unref(rsp);
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
+static void test_mapped_ram_file_plain(void)
+{
+    test_mapped_ram_file(false);
+}
+
+static void test_mapped_ram_file_multifd(void)
+{
+    test_mapped_ram_file(true);
+}
+
+/*
+ * Take a background snapshot to a file while the guest keeps dirtying
+ * its memory, then load it on the destination.
+ */
+static void test_background_snapshot(void)
+{
+    char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+    unsigned char src_byte_a, src_byte_b;
+    QDict *rsp;
+    QTestState *from, *to;
+
+    if (test_migrate_start(&from, &to, "defer", false, false)) {
+        return;
+    }
+
+    rsp = qtest_qmp(from, "{ 'execute': 'migrate-set-capabilities',"
+                          "'arguments': { 'capabilities': [ {"
+                          "'capability': 'background-snapshot',"
+                          "'state': true } ] } }");
+    if (!qdict_haskey(rsp, "return")) {
+        g_test_message("Skipping test: userfaultfd write protection "
+                       "not available");
+        qobject_unref(rsp);
+        qtest_quit(from);
+        qtest_quit(to);
+        cleanup("bootsect");
+        g_free(uri);
+        return;
+    }
+    qobject_unref(rsp);
+
+    /* Slow enough that the guest writes to pages not saved yet */
+    migrate_set_parameter(from, "max-bandwidth", 100000000);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate(from, uri, "{}");
+
+    qtest_memread(from, start_address, &src_byte_a, 1);
+    wait_for_migration_complete(from);
+
+    /* The source never stops for longer than the device state save */
+    rsp = wait_command(from, "{ 'execute': 'query-status' }");
+    g_assert(qdict_get_bool(rsp, "running"));
+    qobject_unref(rsp);
+
+    do {
+        qtest_memread(from, start_address, &src_byte_b, 1);
+        usleep(1000 * 10);
+    } while (src_byte_a == src_byte_b);
+
+    /* The snapshot must hold the memory as it was at a single point */
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s }}", uri);
+    qobject_unref(rsp);
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
 static void test_migrate_fd_proto(void)
 {
     QTestState *from, *to;
@@ -1176,13 +1573,34 @@ int main(int argc, char **argv)
 
     qtest_add_func("/migration/postcopy/unix", test_postcopy);
     qtest_add_func("/migration/postcopy/recovery", test_postcopy_recovery);
+    qtest_add_func("/migration/postcopy/multifd", test_postcopy_multifd);
+    qtest_add_func("/migration/postcopy/preempt", test_postcopy_preempt);
+    qtest_add_func("/migration/postcopy/preempt/prefetch",
+                   test_postcopy_preempt_prefetch);
     qtest_add_func("/migration/deprecated", test_deprecated);
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix", test_precopy_unix);
     qtest_add_func("/migration/precopy/tcp", test_precopy_tcp);
+    qtest_add_func("/migration/precopy/unix/vmstate-threads",
+                   test_precopy_vmstate_threads);
     /* qtest_add_func("/migration/ignore_shared", test_ignore_shared); */
+    qtest_add_func("/migration/local-ram/unix", test_local_ram);
     qtest_add_func("/migration/xbzrle/unix", test_xbzrle_unix);
     qtest_add_func("/migration/fd_proto", test_migrate_fd_proto);
+    qtest_add_func("/migration/background-snapshot/file",
+                   test_background_snapshot);
+    qtest_add_func("/migration/mapped-ram/file", test_mapped_ram_file_plain);
+    qtest_add_func("/migration/mapped-ram/file/multifd",
+                   test_mapped_ram_file_multifd);
+    qtest_add_func("/migration/multifd/tcp/none", test_multifd_tcp_none);
+    qtest_add_func("/migration/multifd/tcp/zlib", test_multifd_tcp_zlib);
+    qtest_add_func("/migration/multifd/tcp/zero-page/legacy",
+                   test_multifd_tcp_zero_page_legacy);
+    qtest_add_func("/migration/multifd/tcp/zero-page/none",
+                   test_multifd_tcp_no_zero_page);
+#ifdef CONFIG_ZSTD
+    qtest_add_func("/migration/multifd/tcp/zstd", test_multifd_tcp_zstd);
+#endif
 
     ret = g_test_run();
 
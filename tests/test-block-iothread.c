@@ -71,6 +71,15 @@ static BlockDriver bdrv_test = {
     .bdrv_co_block_status   = bdrv_test_co_block_status,
 };
 
+static BlockDriver bdrv_test_mq = {
+    .format_name            = "test-mq",
+    .instance_size          = 1,
+    .supports_multiqueue    = true,
+
+    .bdrv_co_preadv         = bdrv_test_co_prwv,
+    .bdrv_co_pwritev        = bdrv_test_co_prwv,
+};
+
 static void test_sync_op_pread(BdrvChild *c)
 {
     uint8_t buf[512];
@@ -726,6 +735,126 @@ static void test_attach_preserve_blk_ctx(void)
     blk_unref(blk);
 }
 
+typedef struct QueueContextRequest {
+    BlockBackend *blk;
+    QEMUIOVector qiov;
+    AioContext *completion_ctx;
+    bool done;
+} QueueContextRequest;
+
+static void queue_context_read_cb(void *opaque, int ret)
+{
+    QueueContextRequest *req = opaque;
+
+    g_assert_cmpint(ret, ==, 0);
+    req->completion_ctx = qemu_get_current_aio_context();
+    atomic_mb_set(&req->done, true);
+}
+
+static void queue_context_read_bh(void *opaque)
+{
+    QueueContextRequest *req = opaque;
+
+    blk_aio_preadv(req->blk, 0, &req->qiov, 0, queue_context_read_cb, req);
+}
+
+static void test_attach_queue_context(void)
+{
+    IOThread *iothread = iothread_new();
+    AioContext *ctx = iothread_get_aio_context(iothread);
+    AioContext *main_ctx = qemu_get_aio_context();
+    BlockBackend *blk;
+    BlockDriverState *bs, *filter, *other;
+    QueueContextRequest req;
+    Error *local_err = NULL;
+    uint8_t buf[512];
+    QDict *options;
+
+    blk = blk_new(main_ctx, BLK_PERM_ALL, BLK_PERM_ALL);
+    bs = bdrv_new_open_driver(&bdrv_test, "base", BDRV_O_RDWR, &error_abort);
+    bs->total_sectors = 65536 / BDRV_SECTOR_SIZE;
+    blk_insert_bs(blk, bs, &error_abort);
+
+    /* bdrv_test can only be used from one AioContext */
+    g_assert_cmpint(blk_attach_queue_context(blk, ctx, &local_err), ==,
+                    -ENOTSUP);
+    error_free_or_abort(&local_err);
+    g_assert(!blk_has_queue_contexts(blk));
+
+    blk_remove_bs(blk);
+    bdrv_unref(bs);
+
+    bs = bdrv_new_open_driver(&bdrv_test_mq, "base-mq", BDRV_O_RDWR,
+                              &error_abort);
+    bs->total_sectors = 65536 / BDRV_SECTOR_SIZE;
+
+    options = qdict_new();
+    qdict_put_str(options, "driver", "raw");
+    qdict_put_str(options, "file", "base-mq");
+    filter = bdrv_open(NULL, NULL, options, BDRV_O_RDWR, &error_abort);
+    blk_insert_bs(blk, filter, &error_abort);
+
+    /* The whole subtree gets the queue context */
+    blk_attach_queue_context(blk, ctx, &error_abort);
+    g_assert(blk_has_queue_contexts(blk));
+    g_assert(bdrv_is_queue_context(filter, ctx));
+    g_assert(bdrv_is_queue_context(bs, ctx));
+    g_assert(bdrv_op_is_blocked(filter, BLOCK_OP_TYPE_BACKUP_SOURCE, NULL));
+    g_assert(bdrv_op_is_blocked(bs, BLOCK_OP_TYPE_MIRROR_SOURCE, NULL));
+
+    /* Neither the child nor the root node can be replaced */
+    other = bdrv_new_open_driver(&bdrv_test_mq, "other-mq", BDRV_O_RDWR,
+                                 &error_abort);
+    other->total_sectors = 65536 / BDRV_SECTOR_SIZE;
+
+    bdrv_replace_node(bs, other, &local_err);
+    error_free_or_abort(&local_err);
+    g_assert(filter->file->bs == bs);
+
+    bdrv_replace_node(filter, other, &local_err);
+    error_free_or_abort(&local_err);
+    g_assert(blk_bs(blk) == filter);
+
+    /* Draining stops new requests from the queue context */
+    g_assert(!aio_external_disabled(ctx));
+    bdrv_drained_begin(filter);
+    g_assert(aio_external_disabled(ctx));
+    bdrv_drained_end(filter);
+    g_assert(!aio_external_disabled(ctx));
+
+    /* Requests from the iothread are processed and complete there */
+    req = (QueueContextRequest) { .blk = blk };
+    qemu_iovec_init_buf(&req.qiov, buf, sizeof(buf));
+    aio_bh_schedule_oneshot(ctx, queue_context_read_bh, &req);
+    AIO_WAIT_WHILE(main_ctx, !atomic_mb_read(&req.done));
+    g_assert(req.completion_ctx == ctx);
+
+    blk_detach_queue_context(blk, ctx);
+    g_assert(!blk_has_queue_contexts(blk));
+    g_assert(!bdrv_is_queue_context(filter, ctx));
+    g_assert(!bdrv_is_queue_context(bs, ctx));
+    g_assert(!bdrv_op_is_blocked(filter, BLOCK_OP_TYPE_BACKUP_SOURCE, NULL));
+    g_assert(!bdrv_op_is_blocked(bs, BLOCK_OP_TYPE_MIRROR_SOURCE, NULL));
+    g_assert(!aio_external_disabled(ctx));
+
+    /* Once detached the child can be replaced, and the next attach uses it */
+    bdrv_replace_node(bs, other, &error_abort);
+    g_assert(filter->file->bs == other);
+
+    blk_attach_queue_context(blk, ctx, &error_abort);
+    g_assert(bdrv_is_queue_context(other, ctx));
+    g_assert(!bdrv_is_queue_context(bs, ctx));
+
+    blk_detach_queue_context(blk, ctx);
+    g_assert(!bdrv_is_queue_context(filter, ctx));
+    g_assert(!bdrv_is_queue_context(other, ctx));
+
+    blk_unref(blk);
+    bdrv_unref(filter);
+    bdrv_unref(other);
+    bdrv_unref(bs);
+}
+
 int main(int argc, char **argv)
 {
     int i;
@@ -743,6 +872,7 @@ int main(int argc, char **argv)
     g_test_add_func("/attach/blockjob", test_attach_blockjob);
     g_test_add_func("/attach/second_node", test_attach_second_node);
     g_test_add_func("/attach/preserve_blk_ctx", test_attach_preserve_blk_ctx);
+    g_test_add_func("/attach/queue_context", test_attach_queue_context);
     g_test_add_func("/propagate/basic", test_propagate_basic);
     g_test_add_func("/propagate/diamond", test_propagate_diamond);
     g_test_add_func("/propagate/mirror", test_propagate_mirror);
@@ -91,6 +91,45 @@ static void test_io_channel_fd(void)
     object_unref(OBJECT(ioc));
 }
 
+static void test_io_channel_file_positional(void)
+{
+    QIOChannel *ioc;
+    char buf[8] = { 0 };
+    struct iovec iov[2] = {
+        { .iov_base = (char *)"abcd", .iov_len = 4 },
+        { .iov_base = (char *)"efgh", .iov_len = 4 },
+    };
+
+    unlink(TEST_FILE);
+    ioc = QIO_CHANNEL(qio_channel_file_new_path(
+                          TEST_FILE,
+                          O_RDWR | O_CREAT | O_TRUNC | O_BINARY, TEST_MASK,
+                          &error_abort));
+    g_assert(qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE));
+
+    /* Writing past the end leaves a hole and doesn't move the position */
+    g_assert_cmpint(qio_channel_pwritev(ioc, iov, 2, 4096, &error_abort),
+                    ==, 8);
+    g_assert_cmpint(qio_channel_io_seek(ioc, 0, SEEK_CUR, &error_abort),
+                    ==, 0);
+    g_assert_cmpint(qio_channel_pwritev(ioc, &iov[1], 1, 0, &error_abort),
+                    ==, 4);
+
+    iov[0].iov_base = buf;
+    iov[0].iov_len = 6;
+    g_assert_cmpint(qio_channel_preadv(ioc, iov, 1, 4098, &error_abort),
+                    ==, 6);
+    g_assert(memcmp(buf, "cdefgh", 6) == 0);
+    iov[0].iov_len = 4;
+    g_assert_cmpint(qio_channel_preadv(ioc, iov, 1, 0, &error_abort), ==, 4);
+    g_assert(memcmp(buf, "efgh", 4) == 0);
+    g_assert_cmpint(qio_channel_preadv(ioc, iov, 1, 8192, &error_abort),
+                    ==, 0);
+
+    unlink(TEST_FILE);
+    object_unref(OBJECT(ioc));
+}
+
 
 #ifndef _WIN32
 static void test_io_channel_pipe(bool async)
@@ -137,6 +176,8 @@ int main(int argc, char **argv)
     g_test_add_func("/io/channel/file", test_io_channel_file);
     g_test_add_func("/io/channel/file/rdwr", test_io_channel_file_rdwr);
     g_test_add_func("/io/channel/file/fd", test_io_channel_fd);
+    g_test_add_func("/io/channel/file/positional",
+                    test_io_channel_file_positional);
 #ifndef _WIN32
     g_test_add_func("/io/channel/pipe/sync", test_io_channel_pipe_sync);
     g_test_add_func("/io/channel/pipe/async", test_io_channel_pipe_async);
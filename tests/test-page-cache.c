@@ -0,0 +1,171 @@
+/*
+ * XBZRLE page cache unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "../migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+#define CACHE_PAGES 64
+/* pages that map to the same set in a cache of CACHE_PAGES */
+#define SAME_SET(i) ((uint64_t)(i) * CACHE_PAGES * PAGE_SIZE)
+
+static void fill_page(uint8_t *page, uint64_t addr)
+{
+    memset(page, addr / PAGE_SIZE, PAGE_SIZE);
+}
+
+static void check_page(PageCache *cache, uint64_t addr)
+{
+    uint8_t page[PAGE_SIZE];
+
+    fill_page(page, addr);
+    g_assert(get_cached_data(cache, addr));
+    g_assert(memcmp(get_cached_data(cache, addr), page, PAGE_SIZE) == 0);
+}
+
+static void test_init(void)
+{
+    Error *err = NULL;
+    PageCache *cache;
+
+    cache = cache_init(PAGE_SIZE - 1, PAGE_SIZE, &err);
+    g_assert(!cache);
+    error_free_or_abort(&err);
+
+    cache = cache_init(3 * PAGE_SIZE, PAGE_SIZE, &err);
+    g_assert(!cache);
+    error_free_or_abort(&err);
+
+    /* smaller than one set */
+    cache = cache_init(2 * PAGE_SIZE, PAGE_SIZE, &error_abort);
+    g_assert(cache);
+    cache_fini(cache);
+}
+
+static void test_insert(void)
+{
+    PageCache *cache = cache_init(CACHE_PAGES * PAGE_SIZE, PAGE_SIZE,
+                                  &error_abort);
+    uint8_t page[PAGE_SIZE];
+    uint64_t addr;
+
+    for (addr = 0; addr < CACHE_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(!cache_is_cached(cache, addr, 1));
+        fill_page(page, addr);
+        g_assert_cmpint(cache_insert(cache, addr, page, 1), ==, 0);
+    }
+
+    for (addr = 0; addr < CACHE_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(cache_is_cached(cache, addr, 1));
+        check_page(cache, addr);
+    }
+    g_assert(!get_cached_data(cache, CACHE_PAGES * PAGE_SIZE));
+
+    /* updating a page in place doesn't evict anything */
+    fill_page(page, 0);
+    g_assert_cmpint(cache_insert(cache, 0, page, 1), ==, 0);
+
+    cache_fini(cache);
+}
+
+static void test_associativity(void)
+{
+    PageCache *cache = cache_init(CACHE_PAGES * PAGE_SIZE, PAGE_SIZE,
+                                  &error_abort);
+    uint8_t page[PAGE_SIZE];
+    int i;
+
+    /* a direct mapped cache would keep only one of these */
+    for (i = 0; i < 8; i++) {
+        fill_page(page, SAME_SET(i));
+        g_assert_cmpint(cache_insert(cache, SAME_SET(i), page, 1), ==, 0);
+    }
+    for (i = 0; i < 8; i++) {
+        g_assert(cache_is_cached(cache, SAME_SET(i), 1));
+        check_page(cache, SAME_SET(i));
+    }
+
+    /* the set is full of pages used in this generation */
+    fill_page(page, SAME_SET(8));
+    g_assert_cmpint(cache_insert(cache, SAME_SET(8), page, 2), ==, -1);
+    g_assert(!cache_is_cached(cache, SAME_SET(8), 2));
+
+    /*
+     * Two generations later, the pages used in the last generation are
+     * kept and the least recently used of the oldest ones goes.
+     */
+    for (i = 4; i < 8; i++) {
+        g_assert(cache_is_cached(cache, SAME_SET(i), 2));
+    }
+    g_assert(cache_is_cached(cache, SAME_SET(1), 1));
+    g_assert(cache_is_cached(cache, SAME_SET(0), 1));
+    g_assert_cmpint(cache_insert(cache, SAME_SET(8), page, 3), ==, 1);
+    g_assert(!get_cached_data(cache, SAME_SET(2)));
+    check_page(cache, SAME_SET(8));
+    for (i = 0; i < 8; i++) {
+        if (i != 2) {
+            check_page(cache, SAME_SET(i));
+        }
+    }
+
+    cache_fini(cache);
+}
+
+static void test_resize(gconstpointer opaque)
+{
+    int64_t new_pages = (uintptr_t)opaque;
+    PageCache *cache = cache_init(CACHE_PAGES * PAGE_SIZE, PAGE_SIZE,
+                                  &error_abort);
+    Error *err = NULL;
+    uint8_t page[PAGE_SIZE];
+    uint64_t addr;
+    int kept = 0;
+
+    for (addr = 0; addr < CACHE_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        fill_page(page, addr);
+        g_assert_cmpint(cache_insert(cache, addr, page, 1), ==, 0);
+    }
+
+    g_assert(cache_resize(cache, 3 * PAGE_SIZE, &err) == -1);
+    error_free_or_abort(&err);
+    g_assert(cache_resize(cache, new_pages * PAGE_SIZE, &error_abort) == 0);
+
+    /* pages are moved when used, and as a side effect of every access */
+    for (addr = 0; addr < CACHE_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        if (cache_is_cached(cache, addr, 2)) {
+            check_page(cache, addr);
+            kept++;
+        }
+    }
+    g_assert_cmpint(kept, ==, MIN(new_pages, CACHE_PAGES));
+
+    /* a second resize while the first one is still being moved */
+    g_assert(cache_resize(cache, new_pages * PAGE_SIZE / 2,
+                          &error_abort) == 0);
+    g_assert(cache_resize(cache, new_pages * PAGE_SIZE, &error_abort) == 0);
+    for (addr = 0; addr < 2 * new_pages * PAGE_SIZE; addr += PAGE_SIZE) {
+        fill_page(page, addr);
+        g_assert(cache_insert(cache, addr, page,
+                              5 + addr / PAGE_SIZE * 2) >= 0);
+    }
+
+    cache_fini(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page_cache/init", test_init);
+    g_test_add_func("/page_cache/insert", test_insert);
+    g_test_add_func("/page_cache/associativity", test_associativity);
+    g_test_add_data_func("/page_cache/resize/grow",
+                         (void *)(uintptr_t)(CACHE_PAGES * 4), test_resize);
+    g_test_add_data_func("/page_cache/resize/shrink",
+                         (void *)(uintptr_t)(CACHE_PAGES / 4), test_resize);
+
+    return g_test_run();
+}
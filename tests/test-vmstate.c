@@ -902,6 +902,67 @@ static void test_tmp_struct(void)
     g_assert_cmpint(obj.f, ==, 8); /* From the child->parent */
 }
 
+static const VMStateDescription vmstate_tmp_child_parallel = {
+    .name = "test/tmp_child_parallel",
+    .pre_save = tmp_child_pre_save,
+    .post_load = tmp_child_post_load,
+    .parallel = true,
+    .fields = (VMStateField[]) {
+        VMSTATE_INT64(diff, TmpTestStruct),
+        VMSTATE_STRUCT_POINTER(parent, TmpTestStruct,
+                               vmstate_tmp_back_to_parent, TestStruct),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static bool test_sub_needed(void *opaque)
+{
+    TestStruct *t = (TestStruct *)opaque;
+    return !t->skip_c_e;
+}
+
+static const VMStateDescription vmstate_sub_needed = {
+    .name = "test/sub_needed",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = test_sub_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(c, TestStruct),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_with_sub_needed = {
+    .name = "test/with_sub_needed",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(a, TestStruct),
+        VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription*[]) {
+        &vmstate_sub_needed,
+        NULL
+    }
+};
+
+static void test_is_parallel(void)
+{
+    /* Plain fields, also through a struct */
+    g_assert(vmstate_is_parallel(&vmstate_simple_primitive));
+    g_assert(vmstate_is_parallel(&vmstate_versioned));
+    g_assert(vmstate_is_parallel(&vmstate_tmp_back_to_parent));
+    /* Hooks, or types with side effects */
+    g_assert(!vmstate_is_parallel(&vmstate_tmp_child));
+    g_assert(!vmstate_is_parallel(&vmstate_with_tmp));
+    g_assert(!vmstate_is_parallel(&vmstate_q));
+    /* field_exists and needed callbacks */
+    g_assert(!vmstate_is_parallel(&vmstate_skipping));
+    g_assert(!vmstate_is_parallel(&vmstate_with_sub_needed));
+    /* Hooks that were declared safe */
+    g_assert(vmstate_is_parallel(&vmstate_tmp_child_parallel));
+}
+
 int main(int argc, char **argv)
 {
     temp_fd = mkstemp(temp_file);
@@ -933,6 +994,7 @@ int main(int argc, char **argv)
     g_test_add_func("/vmstate/qtailq/save/saveq", test_save_q);
     g_test_add_func("/vmstate/qtailq/load/loadq", test_load_q);
     g_test_add_func("/vmstate/tmp_struct", test_tmp_struct);
+    g_test_add_func("/vmstate/is_parallel", test_is_parallel);
     g_test_run();
 
     close(temp_fd);
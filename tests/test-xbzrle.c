@@ -174,6 +174,81 @@ static void test_encode_decode(void)
     }
 }
 
+static void encode_decode_pattern(uint8_t *old_buf, uint8_t *new_buf,
+                                  int slen, uint8_t *ref, int ref_len)
+{
+    uint8_t *compressed = g_malloc(slen);
+    uint8_t *test = g_malloc(slen);
+    int dlen;
+
+    /* Every encoder must produce exactly the output of the generic one */
+    dlen = xbzrle_encode_buffer(old_buf, new_buf, slen, compressed, slen);
+    g_assert_cmpint(dlen, ==, ref_len);
+    if (dlen > 0) {
+        g_assert(memcmp(compressed, ref, dlen) == 0);
+
+        memcpy(test, old_buf, slen);
+        g_assert_cmpint(xbzrle_decode_buffer(compressed, dlen, test, slen),
+                        >, 0);
+        g_assert(memcmp(test, new_buf, slen) == 0);
+    }
+
+    g_free(compressed);
+    g_free(test);
+}
+
+#define ACCEL_PATTERNS 64
+
+static void test_encode_accel(void)
+{
+    uint8_t *old_buf[ACCEL_PATTERNS], *new_buf[ACCEL_PATTERNS];
+    uint8_t *ref[ACCEL_PATTERNS];
+    int slen[ACCEL_PATTERNS], ref_len[ACCEL_PATTERNS];
+    bool first = true;
+    int i, j;
+
+    for (i = 0; i < ACCEL_PATTERNS; i++) {
+        /* cover lengths that are not a multiple of the vector size too */
+        slen[i] = i % 4 ? PAGE_SIZE
+                        : g_test_rand_int_range(1, PAGE_SIZE / 8) * 8;
+        old_buf[i] = g_malloc(slen[i]);
+        new_buf[i] = g_malloc(slen[i]);
+        ref[i] = g_malloc(slen[i]);
+        for (j = 0; j < slen[i]; j++) {
+            old_buf[i][j] = g_test_rand_int();
+        }
+        memcpy(new_buf[i], old_buf[i], slen[i]);
+
+        /* sparse, dense and unchanged pages, with runs across 64 bytes */
+        for (j = 0; j < slen[i]; j++) {
+            if ((i % 3 == 0 && g_test_rand_int_range(0, 300) == 0) ||
+                (i % 3 == 1 && g_test_rand_int_range(0, 2)) ||
+                (i % 3 == 2 && i % 5 && (j / 67) % 3 == 0)) {
+                new_buf[i][j] ^= g_test_rand_int_range(1, 256);
+            }
+        }
+    }
+
+    /* The last encoder tested is the generic one */
+    do {
+        for (i = 0; i < ACCEL_PATTERNS; i++) {
+            if (first) {
+                ref_len[i] = xbzrle_encode_buffer(old_buf[i], new_buf[i],
+                                                  slen[i], ref[i], slen[i]);
+            }
+            encode_decode_pattern(old_buf[i], new_buf[i], slen[i],
+                                  ref[i], ref_len[i]);
+        }
+        first = false;
+    } while (xbzrle_test_next_accel());
+
+    for (i = 0; i < ACCEL_PATTERNS; i++) {
+        g_free(old_buf[i]);
+        g_free(new_buf[i]);
+        g_free(ref[i]);
+    }
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +261,8 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    /* Switches to the generic encoder, so it has to come last */
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
 
     return g_test_run();
 }
@@ -81,7 +81,7 @@ static void *worker_thread(void *opaque)
     pool->pending_threads--;
     do_spawn_thread(pool);
 
-    while (!pool->stopping) {
+    while (!pool->stopping && pool->cur_threads <= pool->max_threads) {
         ThreadPoolElement *req;
         int ret;
 
@@ -321,6 +321,19 @@ ThreadPool *thread_pool_new(AioContext *ctx)
     return pool;
 }
 
+/*
+ * Change the maximum number of worker threads.  Threads above the new
+ * maximum exit once they are done with their current request.
+ */
+void thread_pool_set_max_threads(ThreadPool *pool, int max_threads)
+{
+    assert(max_threads > 0);
+
+    qemu_mutex_lock(&pool->lock);
+    pool->max_threads = max_threads;
+    qemu_mutex_unlock(&pool->lock);
+}
+
 void thread_pool_free(ThreadPool *pool)
 {
     if (!pool) {
@@ -0,0 +1,155 @@
+/*
+ * Linux userfaultfd helpers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/userfaultfd.h"
+#include "trace.h"
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+
+static int uffd_open(int flags, Error **errp)
+{
+#ifdef __NR_userfaultfd
+    int uffd = syscall(__NR_userfaultfd, flags);
+
+    if (uffd < 0) {
+        error_setg_errno(errp, errno, "userfaultfd not available");
+    }
+    return uffd;
+#else
+    error_setg(errp, "userfaultfd not supported by the build host");
+    return -1;
+#endif
+}
+
+int uffd_query_features(uint64_t *features, Error **errp)
+{
+    struct uffdio_api api_struct = { 0 };
+    int uffd, ret = -1;
+
+    uffd = uffd_open(O_CLOEXEC, errp);
+    if (uffd < 0) {
+        return -1;
+    }
+
+    api_struct.api = UFFD_API;
+    if (ioctl(uffd, UFFDIO_API, &api_struct)) {
+        error_setg_errno(errp, errno, "UFFDIO_API failed");
+        goto out;
+    }
+    *features = api_struct.features;
+    ret = 0;
+
+out:
+    close(uffd);
+    return ret;
+}
+
+int uffd_create_fd(uint64_t features, bool non_blocking, Error **errp)
+{
+    struct uffdio_api api_struct = { 0 };
+    int flags = O_CLOEXEC | (non_blocking ? O_NONBLOCK : 0);
+    int uffd;
+
+    uffd = uffd_open(flags, errp);
+    if (uffd < 0) {
+        return -1;
+    }
+
+    /* The kernel expects UFFDIO_API before any other ioctl */
+    api_struct.api = UFFD_API;
+    api_struct.features = features;
+    if (ioctl(uffd, UFFDIO_API, &api_struct)) {
+        error_setg_errno(errp, errno, "UFFDIO_API failed");
+        goto fail;
+    }
+    if ((api_struct.features & features) != features) {
+        error_setg(errp, "Missing userfault features: 0x%" PRIx64,
+                   features & ~api_struct.features);
+        goto fail;
+    }
+
+    trace_uffd_create_fd(uffd, features);
+    return uffd;
+
+fail:
+    close(uffd);
+    return -1;
+}
+
+int uffd_register_memory(int uffd, void *addr, uint64_t length,
+                         uint64_t mode, uint64_t *ioctls, Error **errp)
+{
+    struct uffdio_register reg_struct;
+
+    reg_struct.range.start = (uintptr_t)addr;
+    reg_struct.range.len = length;
+    reg_struct.mode = mode;
+
+    if (ioctl(uffd, UFFDIO_REGISTER, &reg_struct)) {
+        error_setg_errno(errp, errno, "userfault register of %p+%" PRIx64
+                         " failed", addr, length);
+        return -1;
+    }
+    if (ioctls) {
+        *ioctls = reg_struct.ioctls;
+    }
+
+    trace_uffd_register_memory(uffd, addr, length, mode);
+    return 0;
+}
+
+int uffd_unregister_memory(int uffd, void *addr, uint64_t length,
+                           Error **errp)
+{
+    struct uffdio_range range_struct;
+
+    range_struct.start = (uintptr_t)addr;
+    range_struct.len = length;
+
+    if (ioctl(uffd, UFFDIO_UNREGISTER, &range_struct)) {
+        error_setg_errno(errp, errno, "userfault unregister of %p+%" PRIx64
+                         " failed", addr, length);
+        return -1;
+    }
+
+    trace_uffd_unregister_memory(uffd, addr, length);
+    return 0;
+}
+
+int uffd_change_protection(int uffd, void *addr, uint64_t length,
+                           bool wp, bool dont_wake)
+{
+    struct uffdio_writeprotect wp_struct;
+
+    wp_struct.range.start = (uintptr_t)addr;
+    wp_struct.range.len = length;
+    wp_struct.mode = (wp ? UFFDIO_WRITEPROTECT_MODE_WP : 0) |
+                     (dont_wake ? UFFDIO_WRITEPROTECT_MODE_DONTWAKE : 0);
+
+    trace_uffd_change_protection(uffd, addr, length, wp);
+    if (ioctl(uffd, UFFDIO_WRITEPROTECT, &wp_struct)) {
+        return -errno;
+    }
+    return 0;
+}
+
+int uffd_read_events(int uffd, struct uffd_msg *msgs, int count)
+{
+    ssize_t res;
+
+    do {
+        res = read(uffd, msgs, count * sizeof(struct uffd_msg));
+    } while (res < 0 && errno == EINTR);
+
+    if (res < 0) {
+        return errno == EAGAIN ? 0 : -errno;
+    }
+    /* The kernel only returns whole messages */
+    return res / sizeof(struct uffd_msg);
+}